@@ -1,6 +1,7 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include "cpuapi.h"
 #include "instruction.h"
 #include "util.h"
 #include <stdint.h>
@@ -111,6 +112,9 @@
 
 #define STATE_CODE16 0x0001
 #define STATE_ADDR16 0x0002
+// 32-bit code with DS, ES and SS all at base zero, so the decoder can pick handlers that don't add the segment base (see
+// cpu_seg_update_flat). 0x0004 is used by the decoder for prefixes.
+#define STATE_FLAT 0x0008
 
 #define IS_USER_MODE() cpu->cpl == 3
 
@@ -356,6 +360,26 @@ struct cpu {
     uint32_t smc_has_code_length;
     uint32_t* smc_has_code;
 
+    // One bit per page of RAM, set when the page has been written to since the last savestate.
+    // When dirty_tracking is set, clean pages are mapped with the write tag so that the first write goes through access.c
+    uint32_t* dirty_pages;
+    int dirty_tracking;
+
+    // Set when pages of RAM that the guest fills with zeros can be given back to the host (see cpu_free_zeroed_page)
+    int free_zeroed_pages;
+
+    // Index of this processor, which is also its initial APIC ID. The bootstrap processor is zero.
+    int id;
+    // Set on application processors between INIT and STARTUP. They don't run at all until then.
+    int wait_for_sipi;
+    // Whether the machine has a local APIC for this processor. Set on reset.
+    int apic_connected;
+
+    // Device memory that the TLB may map directly (see cpu_set_direct_mmio)
+    uint32_t direct_mmio_base, direct_mmio_size;
+    void* direct_mmio_host;
+    uint32_t* direct_mmio_dirty;
+
     uint32_t tlb_entry_count;
     uint32_t tlb_entry_indexes[MAX_TLB_ENTRIES];
 
@@ -371,7 +395,10 @@ struct cpu {
     struct decoded_instruction trace_cache[TRACE_CACHE_SIZE];
     struct trace_info trace_info[TRACE_INFO_ENTRIES];
 };
-extern struct cpu *cpu;
+extern MACHINE_LOCAL struct cpu *cpu;
+// All processors of the machine. "cpu" points to the one that is running.
+extern MACHINE_LOCAL struct cpu *cpus[MAX_CPUS];
+extern MACHINE_LOCAL int cpu_count;
 
 #define MEM32(e) *(uint32_t*)(cpu->mem + e)
 #define MEM16(e) *(uint16_t*)(cpu->mem + e)
@@ -382,6 +409,8 @@ uint32_t cpulib_ptr_to_phys(void*);
 // Converts pointer to a physical address
 #define PTR_TO_PHYS(ptr) (uint32_t)(uintptr_t)((void*)ptr - cpu->mem)
 #endif
+// Same as above, but also handles pointers into direct-mapped device memory. Used by the slow paths in access.c
+#define TLB_PTR_TO_PHYS(ptr) ((uintptr_t)((void*)(ptr) - cpu->direct_mmio_host) < cpu->direct_mmio_size ? cpu->direct_mmio_base + (uint32_t)((void*)(ptr) - cpu->direct_mmio_host) : PTR_TO_PHYS(ptr))
 
 // Based on the linear address, the TLB tag for this entry, and the shift for the current mode
 #define TLB_ENTRY_INVALID8(addr, tag, shift) (tag >> shift & 1)
@@ -549,6 +578,7 @@ int cpu_access_verify(uint32_t addr, uint32_t end, int shift);
 // seg.c
 void cpu_seg_load_virtual(int id, uint16_t sel);
 void cpu_seg_load_real(int id, uint16_t sel);
+void cpu_seg_update_flat(void);
 int cpu_seg_load_protected(int id, uint16_t sel, struct seg_desc* info);
 int cpu_seg_load_descriptor2(int table, uint32_t selector, struct seg_desc* seg, int exception, int code);
 int cpu_seg_load_descriptor(uint32_t selector, struct seg_desc* seg, int exception, int code);
@@ -569,13 +599,78 @@ int cpu_smc_page_has_code(uint32_t phys);
 int cpu_smc_has_code(uint32_t phys);
 void cpu_smc_invalidate(uint32_t lin, uint32_t phys);
 void cpu_smc_invalidate_page(uint32_t phys);
+void cpu_smc_invalidate_pages(uint32_t* pages);
 void cpu_smc_set_code(uint32_t phys);
 
+// access.c
+uint32_t cpu_mmio_read(uint32_t addr, int size);
+void cpu_mmio_write(uint32_t addr, uint32_t data, int size);
+
+// cpu.c
+int cpu_dirty_page(uint32_t phys);
+int cpu_dirty_mark(uint32_t phys);
+int cpu_free_zeroed_page(uint32_t lin);
+void cpu_for_each(void (*fn)(void));
+void cpu_select(int id);
+int cpu_run_processor(int cycles);
+int cpu_ap_runnable(int id);
+void cpu_reset_processor(void);
+
+// When more than one processor has something to do, none of them runs more than this many cycles at a time before it
+// looks at what the others are doing. This is how far apart their clocks can get.
+#define CPU_QUANTUM 1000
+
+// smp.c
+// Work that an application processor running on its own thread hands to the machine's thread, which owns the devices
+enum {
+    SMP_NONE,
+    SMP_INB,
+    SMP_INW,
+    SMP_IND,
+    SMP_OUTB,
+    SMP_OUTW,
+    SMP_OUTD,
+    SMP_MMIO_READ,
+    SMP_MMIO_WRITE,
+    SMP_INTERRUPT,
+    SMP_FPU_IRQ,
+    SMP_GET_TSC_DEADLINE,
+    SMP_SET_TSC_DEADLINE,
+    SMP_PROTECT_PAGE,
+    SMP_SMC_SET_CODE,
+    SMP_SMC_INVALIDATE,
+    SMP_LOCK_BUS,
+    SMP_UNLOCK_BUS
+};
+#ifdef CPU_USE_THREADS
+// Set on the threads of the application processors, NULL on the machine's thread
+extern MACHINE_LOCAL struct cpu_thread* cpu_thread;
+#define CPU_ON_AP_THREAD() (cpu_thread != NULL)
+#else
+#define CPU_ON_AP_THREAD() 0
+#endif
+int cpu_smp_start(void);
+int cpu_smp_active(void);
+int cpu_smp_run(int cycles);
+int cpu_smp_busy(void);
+uint64_t cpu_smp_request(int request, uint32_t a, uint32_t b, uint32_t c);
+void cpu_smp_quiesce(void);
+void cpu_smp_resume(void);
+void cpu_smp_stop(void);
+void cpu_smp_restart(void);
+void cpu_smp_wake(void);
+void cpu_smp_break(void);
+void cpu_smp_send_init(int id);
+void cpu_smp_send_startup(int id, int vector);
+void cpu_smp_lock_bus(void);
+void cpu_smp_unlock_bus(void);
+
 // mmu.c
 void cpu_mmu_tlb_flush(void);
 void cpu_mmu_tlb_flush_nonglobal(void);
 int cpu_mmu_translate(uint32_t lin, int shift);
 void cpu_mmu_tlb_invalidate(uint32_t lin);
+void cpu_mmu_tlb_protect_ram(uint32_t phys);
 
 // trace.c
 struct trace_info* cpu_trace_get_entry(uint32_t phys);
@@ -604,6 +699,9 @@ int cpu_prot_set_cr(int cr, uint32_t v);
 void cpu_prot_set_dr(int cr, uint32_t v);
 void cpu_prot_update_cpl(void);
 
+// ops/misc.c
+int cpu_get_cpuid_limit_winnt(void);
+
 // ops/ctrlflow.c
 void cpu_exception(int vec, int code);
 int cpu_interrupt(int vector, int code, int type, int eip_to_push);
@@ -7,6 +7,11 @@ int fpu_op_register(uint32_t opcode, uint32_t flags);
 int fpu_op_memory(uint32_t opcode, uint32_t flags, uint32_t linaddr);
 int fpu_fwait(void);
 void fpu_init(void);
+void fpu_state_processor(char* name);
+void fpu_switch(int from, int to);
+struct fpu* fpu_get_saved(int id);
+void fpu_load(struct fpu* saved);
+void fpu_store(struct fpu* saved);
 
 int fpu_fxsave(uint32_t linaddr);
 int fpu_fxrstor(uint32_t linaddr);
@@ -60,7 +65,7 @@ struct fpu {
     float_status_t status;
 #endif
 };
-extern struct fpu fpu;
+extern MACHINE_LOCAL struct fpu fpu;
 #endif
 
 #ifdef LIBCPU
@@ -43,6 +43,10 @@ typedef __insn_t* (*insn_handler_t)(__insn_t*);
 #define I_SET_OP(i, j) i |= (j) << I_OP_SHIFT
 #define I_SET_SEG_BASE(i, j) i |= (j) << I_SEG_SHIFT
 
+// A read-modify-write of memory that has to be atomic with respect to the other processors: a LOCK prefix, or an XCHG
+// with memory. Only set when the machine has more than one processor.
+#define I_LOCK (1 << 29)
+
 // Represents one decoded CPU instruction. Takes up 16 bytes on 32-bit, 20 bytes (padded out to 24 bytes) on 64-bit
 struct decoded_instruction {
     // Various flags holding x86 instruction operands like effective address, length, and source/dest
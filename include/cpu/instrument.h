@@ -1,7 +1,9 @@
 #ifndef INSTRUMENT_H
 #define INSTRUMENT_H
 
+#include "platform.h"
 #include <stdint.h>
+#include <stdio.h>
 
 // Called when a region of ROM has its permissions changed from readonly to read/write or vice versa.  
 void cpu_instrument_memory_permissions_changed(uint32_t addr, int access_bits);
@@ -53,4 +55,35 @@ void cpu_instrument_tlb_full(void);
 // This is because this result is not exactly specified in the Intel documentation, so it's a potential source of non-determinism.
 void cpu_instrument_approximate_sse(int dest, int dwords);
 
+// Built-in counters. Unlike the hooks above, these are always compiled in since incrementing them costs next to nothing.
+// Port I/O and MMIO are counted per port and per region by io.c.
+struct instrument_counters {
+    uint64_t traces_decoded, trace_hits, trace_flushes;
+    uint64_t tlb_misses, tlb_flushes, page_walks;
+    uint64_t smc_invalidations, pages_freed;
+    uint64_t irqs;
+    uint64_t disk_bytes_read, disk_bytes_written;
+    uint64_t snapshot_restores;
+};
+extern MACHINE_LOCAL struct instrument_counters instrument_counters;
+#define INSTRUMENT_COUNT(name) instrument_counters.name++
+#define INSTRUMENT_COUNT_N(name, n) instrument_counters.name += (n)
+
+// Sets up the counter dumps: every "interval" seconds (if nonzero), and whenever SIGUSR2 is received. Dumps are appended to
+// "path" as one JSON object per line, or written to stderr if path is NULL.
+void instrument_counters_init(char* path, int interval);
+// Called from the main loop. Writes a dump if one is due.
+void instrument_counters_poll(void);
+void instrument_counters_dump(void);
+// Writes the counters as comma separated JSON fields, minus the values in "since" if it is not NULL
+void instrument_counters_write(FILE* f, struct instrument_counters* since);
+
+// Sampling profiler. cpu_run takes a sample every "interval" instructions, following up to "depth" saved frame pointers.
+// The report is written to report_path at exit and with every counter dump, and the collapsed stacks to stacks_path if
+// it is not NULL.
+extern MACHINE_LOCAL uint64_t cpu_profiler_next_sample;
+void cpu_profiler_init(int interval, int depth, char* report_path, char* stacks_path);
+void cpu_profiler_sample(void);
+void cpu_profiler_report(void);
+
 #endif
\ No newline at end of file
@@ -260,6 +260,13 @@ OPTYPE op_mov_r32r32(struct decoded_instruction* i);
 OPTYPE op_mov_r32e32(struct decoded_instruction* i);
 OPTYPE op_mov_e32r32(struct decoded_instruction* i);
 OPTYPE op_mov_e32i32(struct decoded_instruction* i);
+OPTYPE op_mov_r8e8_flat(struct decoded_instruction* i);
+OPTYPE op_mov_e8r8_flat(struct decoded_instruction* i);
+OPTYPE op_mov_r16e16_flat(struct decoded_instruction* i);
+OPTYPE op_mov_e16r16_flat(struct decoded_instruction* i);
+OPTYPE op_mov_r32e32_flat(struct decoded_instruction* i);
+OPTYPE op_mov_e32r32_flat(struct decoded_instruction* i);
+OPTYPE op_mov_e32i32_flat(struct decoded_instruction* i);
 
 OPTYPE op_mov_s16r16(struct decoded_instruction* i);
 OPTYPE op_mov_s16e16(struct decoded_instruction* i);
@@ -338,6 +345,10 @@ OPTYPE op_xlat32(struct decoded_instruction* i);
 
 OPTYPE op_bswap_r16(struct decoded_instruction* i);
 OPTYPE op_bswap_r32(struct decoded_instruction* i);
+OPTYPE op_movbe_r16e16(struct decoded_instruction* i);
+OPTYPE op_movbe_r32e32(struct decoded_instruction* i);
+OPTYPE op_movbe_e16r16(struct decoded_instruction* i);
+OPTYPE op_movbe_e32r32(struct decoded_instruction* i);
 
 // BCD
 OPTYPE op_daa(struct decoded_instruction* i);
@@ -471,6 +482,8 @@ OPTYPE op_sse_10_17(struct decoded_instruction* i);
 OPTYPE op_sse_28_2F(struct decoded_instruction* i);
 OPTYPE op_sse_38(struct decoded_instruction* i);
 OPTYPE op_sse_6638(struct decoded_instruction* i);
+OPTYPE op_sse_3A(struct decoded_instruction* i);
+OPTYPE op_sse_663A(struct decoded_instruction* i);
 OPTYPE op_sse_50_57(struct decoded_instruction* i);
 OPTYPE op_sse_58_5F(struct decoded_instruction* i);
 OPTYPE op_sse_60_67(struct decoded_instruction* i);
@@ -24,6 +24,8 @@ enum {
     // 0F 12
     MOVHLPS_XGqXEq,
     MOVLPS_XGqXEq,
+    MOVSLDUP_XGoXEo,
+    MOVDDUP_XGoXEq,
 
     // 0F 13
     //MOVLPS_XEqXGq, // This appears to do exactly the same thing as MOVSD_XEqXGq
@@ -287,7 +289,10 @@ enum {
     MOVDQ2Q_MGqXEo,
     // 0F D7
     PMOVMSKB_GdMEq,
-    PMOVMSKB_GdXEo
+    PMOVMSKB_GdXEo,
+    // 0F D0
+    ADDSUBPD_XGoXEo,
+    ADDSUBPS_XGoXEo
 };
 
 enum {
@@ -428,6 +433,8 @@ int execute_0F10_17(struct decoded_instruction* i);
 int execute_0F28_2F(struct decoded_instruction* i);
 int execute_0F38(struct decoded_instruction* i);
 int execute_660F38(struct decoded_instruction* i);
+int execute_0F3A(struct decoded_instruction* i);
+int execute_660F3A(struct decoded_instruction* i);
 int execute_0F50_57(struct decoded_instruction* i);
 int execute_0F58_5F(struct decoded_instruction* i);
 int execute_0F60_67(struct decoded_instruction* i);
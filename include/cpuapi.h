@@ -31,9 +31,24 @@ struct cpu_config
     struct cpuid_level_info features[FEATURE_SIZE_MAX];
 };
 
+// Most processors that a machine can have
+#define MAX_CPUS 8
+
 int cpu_init(void);
 void cpu_reset(void);
 int cpu_init_mem(int size);
+// Adds application processors to the machine, up to "count" processors in total. Must be called after cpu_init_mem.
+// They wait in reset until the bootstrap processor starts them with INIT and STARTUP IPIs (see cpu_send_init). If
+// "threads" is non-zero and the platform has them, each of them runs on a host thread of its own. Otherwise, they take
+// turns with the bootstrap processor on the caller's thread, which is slower but reproducible.
+int cpu_init_smp(int count, int threads);
+int cpu_get_count(void);
+// INIT and STARTUP inter-processor interrupts for application processor "id". INIT resets it and makes it wait for a
+// STARTUP IPI, which starts it in real mode at vector * 4096.
+void cpu_send_init(int id);
+void cpu_send_startup(int id, int vector);
+// Give pages of RAM that the guest clears back to the host. Only has an effect if RAM was allocated with mmap.
+void cpu_set_free_zeroed_pages(int enabled);
 int cpu_add_rom(int addr, int size, void *data);
 int cpu_set_cpuid(struct cpu_config *cfg);
 
@@ -41,6 +56,8 @@ int cpu_set_cpuid(struct cpu_config *cfg);
 int cpu_in_hlt(void);
 void cpu_add_cycles(itick_t);
 uint64_t cpu_get_cycles(void);
+// Current value of the time-stamp counter, as seen by the guest
+uint64_t cpu_get_tsc(void);
 
 // Read the number of instructions executed. Useful for printing IPS values.
 uint64_t cpu_get_real_cycles(void);
@@ -64,6 +81,8 @@ void cpu_cancel_execution_cycle(int reason);
 // Raise the INTR line to the CPU
 void cpu_raise_intr_line(void);
 void cpu_lower_intr_line(void);
+// Raise the INTR line of processor "id", which doesn't have to be the one that is running
+void cpu_raise_intr_line_of(int id);
 // Checks if the INTR line is high and IF is set
 int cpu_interrupt_pending(void);
 
@@ -92,6 +111,12 @@ void cpu_debug(void);
 
 // mmu.c
 uint32_t cpu_read_phys(uint32_t addr);
+// Lets the TLB map device memory (such as a linear framebuffer) straight to "host". Reads never reach the MMIO handlers,
+// and neither do writes to pages whose bit is set in "dirty". The first write to a clean page goes through the MMIO write
+// handler, which is expected to set the bit. Pass host = NULL to remove the mapping.
+void cpu_set_direct_mmio(uint32_t base, uint32_t size, void* host, uint32_t* dirty);
+// Call after clearing bits in the dirty bitmap so that the next write to those pages is seen again
+void cpu_protect_direct_mmio(void);
 
 #define MEM_RDONLY 1
 
@@ -15,6 +15,7 @@ void vga_init(struct pc_settings* pc);
 void ide_init(struct pc_settings* pc);
 void fdc_init(struct pc_settings* pc);
 void acpi_init(struct pc_settings* pc);
+void hpet_init(struct pc_settings* pc);
 void ne2000_init(struct ne2000_settings* conf);
 
 // XXX:
@@ -43,6 +44,7 @@ int pit_next(itick_t now);
 int apic_next(itick_t now);
 int floppy_next(itick_t now);
 int acpi_next(itick_t now);
+int hpet_next(itick_t now);
 
 void dma_raise_dreq(int);
 // DMA handlers
@@ -77,6 +79,7 @@ void pci_copy_default_configuration(void* confptr, void* area, int size);
 void ioapic_init(struct pc_settings* pc);
 void apic_init(struct pc_settings* pc);
 int apic_is_enabled(void);
+void apic_select(int id);
 
 // Handled by the PIC
 void ioapic_lower_irq(int);
@@ -84,6 +87,11 @@ void ioapic_raise_irq(int);
 void ioapic_remote_eoi(int irq);
 int apic_has_interrupt(void);
 int apic_get_interrupt(void);
-void apic_receive_bus_message(int vector, int type, int trigger_mode);
+// "destination" is an APIC ID, or a set of processors if "logical" is set
+void apic_receive_bus_message(int vector, int type, int trigger_mode, uint32_t destination, int logical);
+
+// IA32_TSC_DEADLINE MSR
+void apic_set_tsc_deadline(uint64_t deadline);
+uint64_t apic_get_tsc_deadline(void);
 
 #endif
\ No newline at end of file
@@ -1,8 +1,31 @@
 #ifndef DISPLAY_H
 #define DISPLAY_H
 
-void display_init(void);
-void display_update(int scanline_start, int scanlines);
+#include <stdint.h>
+
+struct display_settings {
+    // Draw one frame out of every "frameskip." If zero, the screen is never drawn.
+    int frameskip;
+
+    // The following are only used by the headless display
+    // Print the hash of the screen every time it changes
+    int print_hash;
+    // Exit as soon as the screen hash equals wait_hash, or with an error after wait_frames frames if it never does
+    int wait_enabled, wait_frames;
+    uint64_t wait_hash;
+    // Write the screen to "<screenshot_path>-<frame>.ppm" every "screenshot_interval" frames
+    char* screenshot_path;
+    int screenshot_interval;
+};
+
+// A region of the framebuffer returned by display_get_pixels, in pixels
+struct display_rect {
+    int x, y, width, height;
+};
+
+void display_init(struct display_settings* settings);
+// Presents the given regions of the framebuffer. Everything outside of them is unchanged since the last update.
+void display_update(struct display_rect* rects, int count);
 void display_set_resolution(int width, int height);
 void* display_get_pixels(void);
 void display_handle_events(void);
@@ -2,6 +2,7 @@
 #define IO_H
 
 #include <stdint.h>
+#include <stdio.h>
 typedef uint32_t (*io_read)(uint32_t port);
 typedef void (*io_write)(uint32_t port, uint32_t data);
 typedef void (*io_reset)(void);
@@ -28,6 +29,9 @@ void io_handle_mmio_write(uint32_t addr, uint32_t data, int size);
 uint32_t io_handle_mmio_read(uint32_t addr, int size);
 int io_addr_mmio_read(uint32_t addr);
 
+// Writes the per-port and per-region access counts as JSON array members
+void io_dump_counters(FILE* f);
+
 void io_init(void);
 
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "drive.h"
 #include "cpuapi.h" // for struct cpu_config
+#include "display.h" // for struct display_settings
 #include <stdint.h>
 
 struct loaded_file {
@@ -55,6 +56,8 @@ struct pc_settings {
     struct loaded_file bios, vgabios;
 
     unsigned int cpu_type;
+    // Number of processors, up to MAX_CPUS. More than one requires the APIC.
+    int cpus;
 
     int
         // Setting pci_enabled to zero will disable direct memory disk accesses. Otherwise, the system will function identically to that of one without PCI support.
@@ -66,7 +69,13 @@ struct pc_settings {
         // Settting vbe_enabled to zero will disable the Bochs VBE extensions (it will not disable the VBE functions in the BIOS, although the BIOS won't be able to enable VBE)
         vbe_enabled,
         // Setting pci_vga_enabled to zero will disable PCI VGA accleration. Note that in some cases, it will make screen updating slower due to how the Halfix fetch-decode-execute loop is implemented
-        pci_vga_enabled;
+        pci_vga_enabled,
+        // Setting hpet_enabled to zero will remove the High Precision Event Timer. It requires the I/O APIC to be enabled.
+        hpet_enabled,
+        // Setting vga_render_thread to one will draw the screen on a separate thread. Ignored where threads are unavailable.
+        vga_render_thread,
+        // Setting free_pages to one gives pages of RAM that the guest clears back to the host. Ignored where RAM is not allocated with mmap.
+        free_pages;
 
     // Current time according to the CMOS clock
     uint64_t current_time;
@@ -91,6 +100,35 @@ struct pc_settings {
 
     struct virtio_cfg virtio[MAX_VIRTIO_DEVICES];
 
+    struct display_settings display;
+
+    // Performance counters are appended to stats_file (or stderr if NULL) every stats_interval seconds, and on SIGUSR2
+    char* stats_file;
+    int stats_interval;
+
+    // Sampling profiler: one sample every "interval" instructions (0 disables it), following up to "depth" frame pointers
+    struct {
+        int interval, depth;
+        char *report, *stacks;
+    } profiler;
+
+    // Benchmark mode (see benchmark.c): runs until "instructions" guest instructions have been executed (0 for no limit) or
+    // the guest writes to I/O port "port" (-1 for none), after restoring "savestate" if it is set
+    struct {
+        int enabled, port;
+        uint64_t instructions;
+        char *savestate, *report;
+    } benchmark;
+
+    // Guest-driven in-memory snapshots (see pc.c): I/O port that takes and restores them, or -1 for none
+    int snapshot_port;
+
+    // Record/replay log (see replay.c): the inputs from the host are written to "record", or taken from "replay" instead of
+    // the host. At most one of them may be set.
+    struct {
+        char *record, *replay;
+    } replay;
+
     int boot_kernel;
 
     // Kernel loading options
@@ -107,6 +145,10 @@ enum {
 
 int pc_init(struct pc_settings* pc);
 int pc_execute(void);
+// Host time spent in cpu_run, only measured while pc_measure_time is set
+extern MACHINE_LOCAL int pc_measure_time;
+extern MACHINE_LOCAL uint64_t pc_cpu_time_ns;
+int benchmark_run(struct pc_settings* pc);
 uint32_t pc_run(void);
 void pc_set_a20(int state);
 void pc_in_hlt(void);
@@ -13,4 +13,28 @@
 
 #define halloc(x) calloc(x, 1)
 
+// Memory sections of savestates can be mapped straight from the file instead of being read in, and background
+// savestates can be compressed and written by other threads. The VGA can also draw the screen on its own thread, and
+// each application processor can run on one of its own (see cpu/smp.c).
+// Guest RAM is reserved with mmap and only backed by host memory once it is touched.
+#if !defined(_WIN32) && !defined(EMSCRIPTEN) && !defined(PROFAN)
+#define STATE_USE_MMAP
+#define CPU_USE_MMAP
+#define STATE_USE_THREADS
+#define VGA_USE_THREADS
+// The instrumentation callbacks expect to be called on the machine's thread
+#if !defined(INSTRUMENT) && !defined(LIBCPU)
+#define CPU_USE_THREADS
+#endif
+#endif
+
+// Everything that belongs to one emulated machine (CPU, devices, I/O handlers, timers) is declared MACHINE_LOCAL. With
+// threads, that makes it thread-local: whichever thread calls pc_init owns the machine, and a process can run one machine
+// per thread. Read-only tables, like the decoder tables and the softfloat constants, are shared.
+#ifdef STATE_USE_THREADS
+#define MACHINE_LOCAL __thread __attribute__((tls_model("local-exec")))
+#else
+#define MACHINE_LOCAL
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,26 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+// Record and replay of the inputs that come from outside the machine (see replay.c)
+
+#include <stdint.h>
+
+enum {
+    REPLAY_KEY,
+    REPLAY_MOUSE_BUTTONS,
+    REPLAY_MOUSE_MOVE,
+    REPLAY_DRIVE_COMPLETE
+};
+
+// Opens the log for recording or for replaying (at most one of the paths may be set). The CMOS start time is written to
+// the log when recording, and read back from it when replaying.
+int replay_init(char* record_path, char* replay_path, uint64_t* current_time);
+
+// Called where an input event enters the machine. Returns 1 if the event must be dropped: during a replay, only the events
+// from the log are delivered.
+int replay_event(int type, int a, int b, int c, int d);
+
+// Delivers the events that are due from the log. Called by pc_execute, with the CPU stopped, before it runs the CPU.
+void replay_poll(void);
+
+#endif
@@ -6,6 +6,24 @@
 typedef void (*state_handler)(void);
 void state_read_from_file(char* path);
 void state_store_to_file(char* path);
+// Stores only the RAM pages changed since "parent" was saved or restored. Restoring the result needs the whole chain.
+void state_store_incremental_to_file(char* path, char* parent);
+// Takes a snapshot right away, but compresses RAM and VRAM and writes them out on background threads while the emulator
+// keeps running. RAM is protected through state_protect_page until it has been written.
+void state_store_to_file_background(char* path);
+// Blocks until the background savestate, if any, is on disk
+void state_wait_background(void);
+// Must be called before a page of guest RAM is modified for the first time after a savestate
+void state_protect_page(void* page);
+
+// In-memory snapshot, for running the same workload over and over from a known point. Taking it copies all of RAM once.
+// Restoring it copies back only the RAM pages that were written since it was taken or last restored, along with the
+// device state, and keeps the code traces of every other page. Disk contents are not part of it.
+void state_snapshot_take(void);
+// Returns -1 if no snapshot has been taken yet
+int state_snapshot_restore(void);
+// Set while the state handlers are saving or restoring the in-memory snapshot
+int state_is_snapshot(void);
 void state_register(state_handler s);
 
 #define TYPE_DATA 0
@@ -41,6 +59,11 @@ struct bjson_string {
 };
 
 void state_file(int size, char* name, void* ptr);
+// Like state_file, but for guest memory tracked with a dirty bitmap (one bit per 4 KB page). Clears the bitmap, except when
+// restoring the in-memory snapshot: then it is left holding the pages that were restored, and the caller has to clear it.
+void state_file_paged(uint32_t size, char* name, void* ptr, uint32_t* dirty);
+// Like state_file, but stored page aligned in memory.bin so that restoring can map it copy-on-write
+void state_section(uint32_t size, char* name, void* ptr);
 void state_array(int size, int ellen, char* name, void* ptr);
 void state_integer(int size, char* name, void* ptr);
 int state_is_reading(void);
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "platform.h"
 
 #define UNUSED(x) (void)(x)
 
@@ -45,10 +46,11 @@ void afree(void* ptr);
 
 typedef uint64_t itick_t;
 itick_t get_now(void);
-extern uint32_t ticks_per_second;
+extern MACHINE_LOCAL uint32_t ticks_per_second;
 
 // Functions that mess around with timing
 void add_now(itick_t a);
+uint64_t get_host_time_ns(void);
 
 // Quick Malloc API
 void qmalloc_init(void);
@@ -0,0 +1,96 @@
+// Benchmark runner
+// Runs the guest until it has executed a fixed number of instructions, or until it writes to a chosen I/O port, and then
+// writes a JSON report: instructions per second, where the host time went, and how much the performance counters moved.
+// Guest time is derived from the instruction count (see get_now) and the CMOS clock is pinned, so the guest does exactly the
+// same work on every run and the numbers can be compared across commits and hosts. The RAM hash in the report can be used
+// to check that. This doesn't hold with more than one processor, unless the run is recorded or replayed: the application
+// processors run on threads of their own, and how far they get in a given amount of guest time depends on the host.
+// cpu_ns is the time spent in cpu_run, which includes the port and MMIO handlers that guest instructions call. devices_ns
+// is the rest of pc_execute (mostly timers), and display_ns is VGA rendering and the display driver.
+
+#include "cpu/instrument.h"
+#include "cpuapi.h"
+#include "devices.h"
+#include "display.h"
+#include "io.h"
+#include "pc.h"
+#include "state.h"
+#include "util.h"
+#include <stdio.h>
+
+static MACHINE_LOCAL int stop_requested;
+static MACHINE_LOCAL uint32_t stop_value;
+
+static void benchmark_port_write(uint32_t port, uint32_t data)
+{
+    UNUSED(port);
+    stop_requested = 1;
+    stop_value = data;
+    cpu_request_fast_return(EXIT_STATUS_NORMAL);
+}
+
+static uint64_t benchmark_hash_ram(uint32_t size)
+{
+    // 64-bit FNV-1a, a dword at a time
+    uint32_t* ram = cpu_get_ram_ptr();
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (uint32_t i = 0; i < size / 4; i++)
+        hash = (hash ^ ram[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+int benchmark_run(struct pc_settings* pc)
+{
+    if (pc->benchmark.savestate)
+        state_read_from_file(pc->benchmark.savestate);
+    if (pc->benchmark.port >= 0)
+        io_register_write(pc->benchmark.port, 1, benchmark_port_write, benchmark_port_write, benchmark_port_write);
+
+    struct instrument_counters counters = instrument_counters;
+    uint64_t instructions = cpu_get_cycles(), ticks = get_now(), execute_ns = 0, display_ns = 0;
+    char* reason = "budget";
+
+    pc_cpu_time_ns = 0;
+    pc_measure_time = 1;
+    uint64_t begin = get_host_time_ns();
+    while (!pc->benchmark.instructions || cpu_get_cycles() - instructions < pc->benchmark.instructions) {
+        uint64_t now = get_host_time_ns();
+        pc_execute();
+        uint64_t executed = get_host_time_ns();
+        vga_update();
+        display_handle_events();
+        display_ns += get_host_time_ns() - executed;
+        execute_ns += executed - now;
+
+        if (stop_requested) {
+            reason = "port";
+            break;
+        }
+        // HLT with interrupts disabled: nothing will ever happen again
+        if (cpu_get_exit_reason() == EXIT_STATUS_HLT && !cpu_interrupts_masked()) {
+            reason = "halted";
+            break;
+        }
+    }
+    uint64_t wall_ns = get_host_time_ns() - begin;
+    pc_measure_time = 0;
+    instructions = cpu_get_cycles() - instructions;
+    ticks = get_now() - ticks;
+
+    FILE* f = pc->benchmark.report ? fopen(pc->benchmark.report, "w") : stdout;
+    if (!f) {
+        fprintf(stderr, "Unable to write benchmark report to %s\n", pc->benchmark.report);
+        return -1;
+    }
+    fprintf(f, "{\"stop\":\"%s\",\"port_value\":%u,\"instructions\":%llu,\"guest_ticks\":%llu,", reason, stop_value,
+        (unsigned long long)instructions, (unsigned long long)ticks);
+    fprintf(f, "\"wall_ns\":%llu,\"cpu_ns\":%llu,\"devices_ns\":%llu,\"display_ns\":%llu,", (unsigned long long)wall_ns,
+        (unsigned long long)pc_cpu_time_ns, (unsigned long long)(execute_ns - pc_cpu_time_ns), (unsigned long long)display_ns);
+    fprintf(f, "\"mips\":%.3f,\"ram_hash\":\"%016llx\",\"counters\":{", wall_ns ? instructions * 1000.0 / wall_ns : 0.0,
+        (unsigned long long)benchmark_hash_ram(pc->memory_size));
+    instrument_counters_write(f, &counters);
+    fprintf(f, "}}\n");
+    if (f != stdout)
+        fclose(f);
+    return 0;
+}
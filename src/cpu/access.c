@@ -1,6 +1,21 @@
 #include "cpu/cpu.h"
 #include "io.h"
 
+// Device memory belongs to the machine's thread, whichever processor accesses it (see smp.c)
+uint32_t cpu_mmio_read(uint32_t addr, int size)
+{
+    if (CPU_ON_AP_THREAD())
+        return cpu_smp_request(SMP_MMIO_READ, addr, size, 0);
+    return io_handle_mmio_read(addr, size);
+}
+void cpu_mmio_write(uint32_t addr, uint32_t data, int size)
+{
+    if (CPU_ON_AP_THREAD())
+        cpu_smp_request(SMP_MMIO_WRITE, addr, data, size);
+    else
+        io_handle_mmio_write(addr, data, size);
+}
+
 int cpu_access_read8(uint32_t addr, uint32_t tag, int shift)
 {
     // Check for unmapped addresses
@@ -10,10 +25,10 @@ int cpu_access_read8(uint32_t addr, uint32_t tag, int shift)
         tag = cpu->tlb_tags[addr >> 12] >> shift;
     }
     void* host_ptr = cpu->tlb[addr >> 12] + addr;
-    uint32_t phys = PTR_TO_PHYS(host_ptr);
+    uint32_t phys = TLB_PTR_TO_PHYS(host_ptr);
     // Check for MMIO areas
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu->memory_size)) {
-        cpu->read_result = io_handle_mmio_read(phys, 0);
+        cpu->read_result = cpu_mmio_read(phys, 0);
         return 0;
     }
     cpu->read_result = *(uint8_t*)host_ptr;
@@ -39,9 +54,9 @@ int cpu_access_read16(uint32_t addr, uint32_t tag, int shift)
         tag = cpu->tlb_tags[addr >> 12] >> shift;
     }
     void* host_ptr = cpu->tlb[addr >> 12] + addr;
-    uint32_t phys = PTR_TO_PHYS(host_ptr);
+    uint32_t phys = TLB_PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu->memory_size)) {
-        cpu->read_result = io_handle_mmio_read(phys, 1);
+        cpu->read_result = cpu_mmio_read(phys, 1);
         return 0;
     }
     cpu->read_result = *(uint16_t*)host_ptr;
@@ -66,9 +81,9 @@ int cpu_access_read32(uint32_t addr, uint32_t tag, int shift)
         tag = cpu->tlb_tags[addr >> 12] >> shift;
     }
     void* host_ptr = cpu->tlb[addr >> 12] + addr;
-    uint32_t phys = PTR_TO_PHYS(host_ptr);
+    uint32_t phys = TLB_PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu->memory_size)) {
-        cpu->read_result = io_handle_mmio_read(phys, 2);
+        cpu->read_result = cpu_mmio_read(phys, 2);
         return 0;
     }
     cpu->read_result = *(uint32_t*)host_ptr;
@@ -83,16 +98,25 @@ int cpu_access_write8(uint32_t addr, uint32_t data, uint32_t tag, int shift)
         tag = cpu->tlb_tags[addr >> 12] >> shift;
     }
     void* host_ptr = cpu->tlb[addr >> 12] + addr;
-    uint32_t phys = PTR_TO_PHYS(host_ptr);
+    uint32_t phys = TLB_PTR_TO_PHYS(host_ptr);
 
     // Check for MMIO areas
     if ((phys >= 0xA0000 && phys < 0x100000) || (phys >= cpu->memory_size)) {
-        io_handle_mmio_write(phys, data, 0);
+        cpu_mmio_write(phys, data, 0);
+        // The device should have marked the page dirty, so let the TLB map it directly now
+        if ((tag & 1) && phys - cpu->direct_mmio_base < cpu->direct_mmio_size)
+            cpu_mmu_tlb_invalidate(addr);
         return 0;
     }
+    if (cpu_dirty_mark(phys))
+        cpu_mmu_tlb_invalidate(addr);
+    *(uint8_t*)host_ptr = data;
+    // The write comes first so that another processor decoding this code either sees it or has its trace removed here
+    // (see cpu_decode)
+    if (cpu_count > 1)
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
     if (cpu_smc_has_code(phys))
         cpu_smc_invalidate(addr, phys);
-    *(uint8_t*)host_ptr = data;
     return 0;
 }
 int cpu_access_write16(uint32_t addr, uint32_t data, uint32_t tag, int shift)
@@ -110,14 +134,21 @@ int cpu_access_write16(uint32_t addr, uint32_t data, uint32_t tag, int shift)
         tag = cpu->tlb_tags[addr >> 12] >> shift;
     }
     void* host_ptr = cpu->tlb[addr >> 12] + addr;
-    uint32_t phys = PTR_TO_PHYS(host_ptr);
+    uint32_t phys = TLB_PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0x100000) || (phys >= cpu->memory_size)) {
-        io_handle_mmio_write(phys, data, 1);
+        cpu_mmio_write(phys, data, 1);
+        // The device should have marked the page dirty, so let the TLB map it directly now
+        if ((tag & 1) && phys - cpu->direct_mmio_base < cpu->direct_mmio_size)
+            cpu_mmu_tlb_invalidate(addr);
         return 0;
     }
+    if (cpu_dirty_mark(phys))
+        cpu_mmu_tlb_invalidate(addr);
+    *(uint16_t*)host_ptr = data;
+    if (cpu_count > 1)
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
     if (cpu_smc_has_code(phys))
         cpu_smc_invalidate(addr, phys);
-    *(uint16_t*)host_ptr = data;
     return 0;
 }
 int cpu_access_write32(uint32_t addr, uint32_t data, uint32_t tag, int shift)
@@ -136,14 +167,21 @@ int cpu_access_write32(uint32_t addr, uint32_t data, uint32_t tag, int shift)
         tag = cpu->tlb_tags[addr >> 12] >> shift;
     }
     void* host_ptr = cpu->tlb[addr >> 12] + addr;
-    uint32_t phys = PTR_TO_PHYS(host_ptr);
+    uint32_t phys = TLB_PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0x100000) || (phys >= cpu->memory_size)) {
-        io_handle_mmio_write(phys, data, 2);
+        cpu_mmio_write(phys, data, 2);
+        // The device should have marked the page dirty, so let the TLB map it directly now
+        if ((tag & 1) && phys - cpu->direct_mmio_base < cpu->direct_mmio_size)
+            cpu_mmu_tlb_invalidate(addr);
         return 0;
     }
+    if (cpu_dirty_mark(phys))
+        cpu_mmu_tlb_invalidate(addr);
+    *(uint32_t*)host_ptr = data;
+    if (cpu_count > 1)
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
     if (cpu_smc_has_code(phys))
         cpu_smc_invalidate(addr, phys);
-    *(uint32_t*)host_ptr = data;
     return 0;
 }
 
@@ -222,6 +260,6 @@ uint32_t lin2phys(uint32_t addr)
         tag = cpu->tlb_tags[addr >> 12] >> TLB_SYSTEM_READ;
     }
     void* host_ptr = cpu->tlb[addr >> 12] + addr;
-    uint32_t phys = PTR_TO_PHYS(host_ptr);
+    uint32_t phys = TLB_PTR_TO_PHYS(host_ptr);
     return phys;
 }
\ No newline at end of file
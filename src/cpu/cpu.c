@@ -6,19 +6,61 @@
 #include "cpuapi.h"
 #include "platform.h"
 #include "devices.h"
+#include "state.h"
 #include <string.h>
+#ifdef CPU_USE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#endif
 
 #include <profan.h>
 
-struct cpu *cpu;
+MACHINE_LOCAL struct cpu *cpu;
+MACHINE_LOCAL struct cpu *cpus[MAX_CPUS];
+MACHINE_LOCAL int cpu_count = 1;
+
+// Index of the processor that "cpu" points to
+static MACHINE_LOCAL int cpu_current;
+
+// Switches to another processor. Everything that the instruction handlers keep outside of struct cpu goes with it.
+void cpu_select(int id)
+{
+    if (id == cpu_current)
+        return;
+    fpu_switch(cpu_current, id);
+    cpu = cpus[id];
+    cpu_current = id;
+    cpu_update_mxcsr();
+    apic_select(id);
+}
+
+// Calls "fn" once for every processor, with "cpu" pointing to it. For changes to things that all processors share, like
+// RAM and the A20 gate, which each of them caches in its own TLB.
+void cpu_for_each(void (*fn)(void))
+{
+    struct cpu* self = cpu;
+    cpu_smp_quiesce();
+    for (int i = 0; i < cpu_count; i++) {
+        cpu = cpus[i];
+        fn();
+    }
+    cpu = self;
+    cpu_smp_resume();
+}
 
 void cpu_set_a20(int a20_enabled)
 {
-    uint32_t old_a20_mask = cpu->a20_mask;
+    uint32_t old_a20_mask = cpu->a20_mask, a20_mask = -1 ^ (!a20_enabled << 20);
 
-    cpu->a20_mask = -1 ^ (!a20_enabled << 20);
-    if (old_a20_mask != cpu->a20_mask)
-        cpu_mmu_tlb_flush(); // Only clear TLB if A20 gate has changed
+    cpu_smp_quiesce();
+    for (int i = 0; i < cpu_count; i++)
+        cpus[i]->a20_mask = a20_mask;
+    if (old_a20_mask != a20_mask)
+        cpu_for_each(cpu_mmu_tlb_flush); // Only clear TLB if A20 gate has changed
+    cpu_smp_resume();
 
 #ifdef INSTRUMENT
     cpu_instrument_set_a20(a20_enabled);
@@ -27,19 +69,66 @@ void cpu_set_a20(int a20_enabled)
 
 int cpu_init_mem(int size)
 {
+#ifdef CPU_USE_MMAP
+    // Only address space is reserved here. The host hands out zeroed pages as the guest touches them, so a guest costs as
+    // much host memory as it actually uses, not as much as it was configured with.
+    cpu->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (cpu->mem == MAP_FAILED) {
+        CPU_LOG("Unable to reserve %d bytes of RAM\n", size);
+        cpu->mem = NULL;
+        return -1;
+    }
+#else
     cpu->mem = profan_kmalloc(size, 0);
+#endif
     memset(cpu->mem + 0xC0000, -1, 0x40000);
     cpu->memory_size = size;
 
     cpu->smc_has_code_length = (size + 4095) >> 12;
     cpu->smc_has_code = calloc(4, cpu->smc_has_code_length);
 
+    // Everything is dirty until the first savestate is taken
+    cpu->dirty_pages = malloc(((cpu->smc_has_code_length + 31) >> 5) * 4);
+    memset(cpu->dirty_pages, -1, ((cpu->smc_has_code_length + 31) >> 5) * 4);
+
 // It's possible that instrumentation callbacks will need a physical pointer to RAM
 #ifdef INSTRUMENT
     cpu_instrument_init_mem();
 #endif
     return 0;
 }
+
+void cpu_set_free_zeroed_pages(int enabled)
+{
+#ifdef CPU_USE_MMAP
+    // Pages are discarded one guest page at a time
+    for (int i = 0; i < cpu_count; i++)
+        cpus[i]->free_zeroed_pages = enabled && sysconf(_SC_PAGESIZE) == 4096;
+#else
+    UNUSED(enabled);
+#endif
+}
+
+// Called when the guest is about to fill the page at "lin" with zeros. If the page is plain RAM that can be written to
+// directly, it is given back to the host instead, and the next access sees a fresh zeroed page. Returns 1 if this was done,
+// in which case the caller must skip the writes.
+int cpu_free_zeroed_page(uint32_t lin)
+{
+#ifdef CPU_USE_MMAP
+    // A write tag means the page is not RAM, contains code, or still has to be marked dirty
+    if (!cpu->free_zeroed_pages || (cpu->tlb_tags[lin >> 12] >> cpu->tlb_shift_write & 1))
+        return 0;
+    uint8_t* host = cpu->tlb[lin >> 12] + lin;
+    if ((uintptr_t)(host - cpu->mem8) >= cpu->memory_size || madvise(host, 4096, MADV_DONTNEED))
+        return 0;
+    INSTRUMENT_COUNT(pages_freed);
+    return 1;
+#else
+    UNUSED(lin);
+    return 0;
+#endif
+}
+
 int cpu_interrupts_masked(void)
 {
     return cpu->eflags & EFLAGS_IF;
@@ -50,8 +139,40 @@ itick_t cpu_get_cycles(void)
     return cpu->cycles + (cpu->cycle_offset - cpu->cycles_to_run);
 }
 
+int cpu_dirty_page(uint32_t phys)
+{
+    phys >>= 12;
+    if (phys >= cpu->smc_has_code_length)
+        return 1;
+    return cpu->dirty_pages[phys >> 5] & (1 << (phys & 31));
+}
+
+// Marks a page of RAM as modified. Returns non-zero if the page was clean and write-protected in the TLB, in which case
+// the caller should invalidate its TLB entry so that subsequent writes take the fast path again.
+int cpu_dirty_mark(uint32_t phys)
+{
+    phys >>= 12;
+    if (phys >= cpu->smc_has_code_length)
+        return 0;
+    uint32_t mask = 1 << (phys & 31);
+    if (cpu->dirty_pages[phys >> 5] & mask)
+        return 0;
+    // A savestate may still be reading the old contents. Other processors may be marking pages next to this one.
+    if (CPU_ON_AP_THREAD())
+        cpu_smp_request(SMP_PROTECT_PAGE, phys << 12, 0, 0);
+    else
+        state_protect_page(cpu->mem + (phys << 12));
+    __atomic_fetch_or(&cpu->dirty_pages[phys >> 5], mask, __ATOMIC_SEQ_CST);
+    return cpu->dirty_tracking;
+}
+
+uint64_t cpu_get_tsc(void)
+{
+    return cpu_get_cycles() - cpu->tsc_fudge;
+}
+
 // Execute main CPU interpreter
-int cpu_run(int cycles)
+int cpu_run_processor(int cycles)
 {
     // Reset state
     cpu->cycle_offset = cycles;
@@ -66,8 +187,9 @@ int cpu_run(int cycles)
         if (cpu->intr_line_state) {
             // Check for validity
             if (cpu->eflags & EFLAGS_IF && !cpu->interrupts_blocked) {
-                int interrupt_id = pic_get_interrupt();
+                int interrupt_id = CPU_ON_AP_THREAD() ? cpu_smp_request(SMP_INTERRUPT, 0, 0, 0) : pic_get_interrupt();
                 cpu_interrupt(interrupt_id, 0, INTERRUPT_TYPE_HARDWARE, VIRT_EIP());
+                INSTRUMENT_COUNT(irqs);
 #ifdef INSTRUMENT
                 cpu_instrument_hardware_interrupt(interrupt_id);
 #endif
@@ -90,12 +212,23 @@ int cpu_run(int cycles)
             cpu->interrupts_blocked = 0;
         }
 
+        // Stop the run at the next profiler sample. The rest is put in refill_counter, like interrupt_guard does.
+        uint64_t until_sample = cpu_profiler_next_sample - cpu_get_cycles();
+        if (until_sample < (uint64_t)cpu->cycles_to_run) {
+            cpu->refill_counter += cpu->cycles_to_run - until_sample;
+            cpu->cycles_to_run = until_sample;
+            cpu->cycle_offset = until_sample;
+        }
+
         // Reset state as needed
         cpu_execute();
 
         // Move cycles forward
         cpu->cycles += cpu_get_cycles() - cpu->cycles;
 
+        if (cpu->cycles >= cpu_profiler_next_sample)
+            cpu_profiler_sample();
+
         cpu->cycles_to_run = cpu->refill_counter;
         cpu->refill_counter = 0;
         cpu->cycle_offset = cpu->cycles_to_run;
@@ -114,6 +247,64 @@ int cpu_run(int cycles)
     return cycles_run;
 }
 
+// Whether application processor "id" has something to do: it isn't halted, or it is and an interrupt will wake it up
+int cpu_ap_runnable(int id)
+{
+    struct cpu* ap = cpus[id];
+    if (ap->wait_for_sipi)
+        return 0;
+    return ap->exit_reason != EXIT_STATUS_HLT || (ap->intr_line_state && ap->eflags & EFLAGS_IF);
+}
+
+// Runs all processors for "cycles" cycles. Normally, the application processors run on host threads of their own (see
+// smp.c). When a run has to be reproducible, or the platform has no threads, they take turns with the BSP on this thread
+// instead, and run for as long as the BSP did in each turn. Either way, the clock of the machine (get_now) follows the
+// BSP.
+int cpu_run(int cycles)
+{
+    if (cpu_count == 1)
+        return cpu_run_processor(cycles);
+    if (cpu_smp_active())
+        return cpu_smp_run(cycles);
+
+    int total = 0;
+    while (total < cycles) {
+        int slice = cycles - total, ap_runnable = 0;
+        for (int i = 1; i < cpu_count; i++)
+            ap_runnable |= cpu_ap_runnable(i);
+        if (ap_runnable && slice > CPU_QUANTUM)
+            slice = CPU_QUANTUM;
+
+        int cycles_run = cpu_run_processor(slice), most = cycles_run;
+        // A halted BSP doesn't stop the others. They get the whole turn, and the BSP's clock catches up with them afterwards.
+        int halted = cpu->exit_reason == EXIT_STATUS_HLT, budget = halted ? slice : cycles_run;
+        // Whether a processor stopped early because a device or another processor needs attention
+        int interrupted = !halted && cycles_run < slice;
+        uint64_t start = cpu_get_cycles() - cycles_run;
+        for (int i = 1; i < cpu_count; i++) {
+            if (!budget || !cpu_ap_runnable(i))
+                continue;
+            cpu_select(i);
+            // Processors that were halted skip the time they slept, like the BSP does
+            if (cpu->cycles < start)
+                cpu->cycles = start;
+            int ap_cycles_run = cpu_run_processor(budget);
+            if (ap_cycles_run < budget && cpu->exit_reason != EXIT_STATUS_HLT)
+                interrupted = 1;
+            if (ap_cycles_run > most)
+                most = ap_cycles_run;
+        }
+        cpu_select(0);
+        if (halted)
+            cpu->cycles += most - cycles_run;
+        total += most;
+
+        if (interrupted || !most)
+            break;
+    }
+    return total;
+}
+
 void cpu_raise_intr_line(void)
 {
     cpu->intr_line_state = 1;
@@ -121,6 +312,15 @@ void cpu_raise_intr_line(void)
     cpu_instrument_set_intr_line(1, 0);
 #endif
 }
+void cpu_raise_intr_line_of(int id)
+{
+    if (id == cpu_current)
+        cpu_raise_intr_line();
+    else {
+        cpus[id]->intr_line_state = 1;
+        cpu_smp_wake(); // It may be parked in HLT
+    }
+}
 void cpu_lower_intr_line(void)
 {
     cpu->intr_line_state = 0;
@@ -141,6 +341,7 @@ void cpu_cancel_execution_cycle(int reason)
     cpu->cycles_to_run = 1;
     cpu->cycle_offset = 1;
     cpu->refill_counter = 0;
+    cpu_smp_break();
 }
 
 void* cpu_get_ram_ptr(void)
@@ -158,14 +359,21 @@ int cpu_add_rom(int addr, int size, void* data)
 
 int cpu_get_exit_reason(void)
 {
+    // The machine is only idle once every processor is
+    if (cpu->exit_reason == EXIT_STATUS_HLT) {
+        if (cpu_smp_active())
+            return cpu_smp_busy() ? EXIT_STATUS_NORMAL : EXIT_STATUS_HLT;
+        for (int i = 1; i < cpu_count; i++)
+            if (cpu_ap_runnable(i))
+                return EXIT_STATUS_NORMAL;
+    }
     return cpu->exit_reason;
 }
 
 // Tells the CPU to stop execution after it's been running a little bit. Does nothing in this case.
 void cpu_set_break(void) {}
 
-// Resets CPU
-void cpu_reset(void)
+void cpu_reset_processor(void)
 {
     for (int i = 0; i < 8; i++) {
         // Clear general purpose registers
@@ -200,32 +408,95 @@ void cpu_reset(void)
 
     cpu->page_attribute_tables = 0x0007040600070406LL;
 
-    // Reset APIC MSR, if APIC is enabled
-    if (apic_is_enabled())
-        cpu->apic_base = 0xFEE00900; // We are BSP
+    // Reset APIC MSR, if APIC is enabled. The APIC belongs to the machine's thread, so it's asked here, once.
+    cpu->apic_connected = apic_is_enabled();
+    if (cpu->apic_connected)
+        cpu->apic_base = cpu->id ? 0xFEE00800 : 0xFEE00900; // Bit 8 is set on the BSP
     else
         cpu->apic_base = 0;
 
     cpu->mxcsr = 0x1F80;
     cpu_update_mxcsr();
 
-    // Reset TLB
-    memset(cpu->tlb, 0, sizeof(void*) * (1 << 20));
-    memset(cpu->tlb_tags, 0xFF, 1 << 20);
-    memset(cpu->tlb_attrs, 0xFF, 1 << 20);
+    // The application processors don't run until the BSP starts them
+    if (cpu->id) {
+        cpu->wait_for_sipi = 1;
+        cpu->intr_line_state = 0;
+        cpu->exit_reason = EXIT_STATUS_NORMAL;
+    }
+
+    // Reset TLB. Every entry that was filled in is on the list, so there's no need to touch all 1M of them.
     cpu_mmu_tlb_flush();
 }
 
+// Resets CPU
+void cpu_reset(void)
+{
+    int self = cpu_current;
+    // Application processors on threads of their own are reset once they have stopped
+    int count = cpu_smp_active() ? 1 : cpu_count;
+    for (int i = 0; i < count; i++) {
+        cpu_select(i);
+        cpu_reset_processor();
+    }
+    cpu_select(self);
+    for (int i = count; i < cpu_count; i++)
+        cpu_smp_send_init(i);
+    // An application processor that triggered the reset mustn't run any further
+    if (self != 0)
+        cpu_request_fast_return(EXIT_STATUS_NORMAL);
+}
+
+void cpu_send_init(int id)
+{
+    if (id <= 0 || id >= cpu_count)
+        return;
+    if (cpu_smp_active()) {
+        cpu_smp_send_init(id);
+        return;
+    }
+    int self = cpu_current;
+    cpu_select(id);
+    cpu_reset_processor();
+    cpu_select(self);
+    if (id == self)
+        cpu_request_fast_return(EXIT_STATUS_NORMAL);
+}
+
+void cpu_send_startup(int id, int vector)
+{
+    // STARTUP IPIs are ignored unless the processor has just received an INIT
+    if (id <= 0 || id >= cpu_count)
+        return;
+    if (cpu_smp_active()) {
+        cpu_smp_send_startup(id, vector);
+        return;
+    }
+    if (!cpus[id]->wait_for_sipi)
+        return;
+    int self = cpu_current;
+    cpu_select(id);
+    cpu_load_csip_real(vector << 8, 0);
+    cpu->wait_for_sipi = 0;
+    cpu_select(self);
+}
+
+int cpu_get_count(void)
+{
+    return cpu_count;
+}
+
 int cpu_apic_connected(void)
 {
-    return apic_is_enabled() && (cpu->apic_base & 0x100);
+    return cpu->apic_connected && (cpu->apic_base & 0x100);
 }
 
-static void cpu_state(void)
+static void cpu_state_processor(char* name)
 {
 #ifndef LIBCPU
+    int trace_cache_usage = cpu->trace_cache_usage;
     // <<< BEGIN AUTOGENERATE "state" >>>
-    struct bjson_object* obj = state_obj("cpu", 44);
+    struct bjson_object* obj = state_obj(name, 44 + 1);
     state_field(obj, 64, "cpu->reg32", &cpu->reg32);
     state_field(obj, 128, "cpu->xmm32", &cpu->xmm32);
     state_field(obj, 4, "cpu->mxcsr", &cpu->mxcsr);
@@ -271,25 +542,78 @@ static void cpu_state(void)
     state_field(obj, 8, "cpu->ia32_efer", &cpu->ia32_efer);
     state_field(obj, 12, "cpu->sysenter", &cpu->sysenter);
     // <<< END AUTOGENERATE "state" >>>
-    state_file(cpu->memory_size, "ram", cpu->mem);
+    state_field(obj, 4, "cpu->wait_for_sipi", &cpu->wait_for_sipi);
+    // The in-memory snapshot keeps the trace cache, so the traces decoded since it was taken must not be overwritten
+    if (state_is_reading() && state_is_snapshot())
+        cpu->trace_cache_usage = trace_cache_usage;
+#else
+    UNUSED(name);
+#endif
+}
+
+static void cpu_state(void)
+{
+#ifndef LIBCPU
+    cpu_smp_stop();
+    cpu_state_processor("cpu");
+    // The application processors are saved under their own names, so a savestate has to be restored with as many
+    // processors as it was taken with. The BSP's FPU is saved by fpu.c.
+    for (int i = 1; i < cpu_count; i++) {
+        char name[16];
+        cpu_select(i);
+        sprintf(name, "cpu%d", i);
+        cpu_state_processor(name);
+        sprintf(name, "fpu%d", i);
+        fpu_state_processor(name);
+    }
+    cpu_select(0);
+    state_file_paged(cpu->memory_size, "ram", cpu->mem, cpu->dirty_pages);
+    int snapshot = state_is_reading() && state_is_snapshot();
+    if (snapshot) {
+        // Only the pages that were just restored have changed, so the code traces of all the others are still good
+        cpu_smc_invalidate_pages(cpu->dirty_pages);
+        memset(cpu->dirty_pages, 0, ((cpu->smc_has_code_length + 31) >> 5) * 4);
+    }
 
-    if (state_is_reading()) {
-        cpu_trace_flush(); // Remove all residual code traces
-        cpu_mmu_tlb_flush(); // Remove all stale TLB entries
-        cpu_prot_update_cpl(); // Update cpu->tlb_shift_*
+    // From now on, record which pages are written so that the next snapshot can be incremental.
+    for (int i = 0; i < cpu_count; i++)
+        cpus[i]->dirty_tracking = 1;
+    if (!state_is_reading())
+        cpu_for_each(cpu_mmu_tlb_flush); // Write-protect the pages we just cleaned
+    else {
+#ifdef STATE_USE_MMAP
+        // RAM may now be mapped from the snapshot, and discarding such a page would bring back its old contents
+        for (int i = 0; i < cpu_count && !snapshot; i++)
+            cpus[i]->free_zeroed_pages = 0;
+#endif
+        if (!snapshot)
+            cpu_for_each(cpu_trace_flush); // Remove all residual code traces
+        cpu_for_each(cpu_mmu_tlb_flush); // Remove all stale TLB entries
+        cpu_for_each(cpu_prot_update_cpl); // Update cpu->tlb_shift_*
         cpu_update_mxcsr();
 
         // The following line doesn't work with OS/2, which assumes that the base/limit/access of all segmentation registers are stored in the cache.
         // In many cases, OS/2 loads the base/limit/access into the segment register (updating the cache) and then modifies descriptors in memorys.
         //for(int i=0;i<6;i++) cpu_load_seg_value_mov(i, cpu->seg[i]);
     }
+    cpu_smp_restart();
 #endif
 }
 
+static struct cpu* cpu_alloc(void)
+{
+    struct cpu* c = calloc(1, sizeof(struct cpu));
+    if (!c)
+        return NULL;
+    memset(c->tlb_tags, 0xFF, 1 << 20);
+    memset(c->tlb_attrs, 0xFF, 1 << 20);
+    return c;
+}
+
 // Initializes CPU
 int cpu_init(void)
 {
-    cpu = calloc(1, sizeof(struct cpu));
+    cpu = cpus[0] = cpu_alloc();
     state_register(cpu_state);
     io_register_reset(cpu_reset);
     fpu_init();
@@ -299,6 +623,44 @@ int cpu_init(void)
     return 0;
 }
 
+int cpu_init_smp(int count, int threads)
+{
+    for (int i = cpu_count; i < count; i++) {
+        struct cpu* ap = cpu_alloc();
+        if (!ap) {
+            CPU_LOG("Unable to allocate processor %d\n", i);
+            return -1;
+        }
+        ap->id = i;
+        // RAM and everything that describes it is shared
+        ap->mem = cpu->mem;
+        ap->memory_size = cpu->memory_size;
+        ap->smc_has_code_length = cpu->smc_has_code_length;
+        ap->smc_has_code = cpu->smc_has_code;
+        ap->dirty_pages = cpu->dirty_pages;
+        ap->dirty_tracking = cpu->dirty_tracking;
+        ap->free_zeroed_pages = cpu->free_zeroed_pages;
+        ap->direct_mmio_base = cpu->direct_mmio_base;
+        ap->direct_mmio_size = cpu->direct_mmio_size;
+        ap->direct_mmio_host = cpu->direct_mmio_host;
+        ap->direct_mmio_dirty = cpu->direct_mmio_dirty;
+        ap->a20_mask = cpu->a20_mask;
+        cpus[i] = ap;
+        cpu_count = i + 1;
+
+        cpu_select(i);
+        cpu_reset_processor();
+        cpu_select(0);
+    }
+#ifdef CPU_USE_THREADS
+    if (threads && cpu_count > 1 && !cpu_smp_active())
+        return cpu_smp_start();
+#else
+    UNUSED(threads);
+#endif
+    return 0;
+}
+
 void cpu_init_dma(uint32_t page)
 {
     cpu_smc_invalidate_page(page);
@@ -306,6 +668,9 @@ void cpu_init_dma(uint32_t page)
 
 void cpu_write_mem(uint32_t addr, void* data, uint32_t length)
 {
+    // Entries for pages that become dirty here stay write-protected until the next TLB flush, which is harmless.
+    for (uint32_t page = addr & ~0xFFF; page < addr + length; page += 4096)
+        cpu_dirty_mark(page);
     if (length <= 4) {
         switch (length) {
         case 1:
@@ -340,6 +705,6 @@ void cpu_debug(void)
     printf("ESP: %08x EBP: %08x ESI: %08x EDI: %08x\n", cpu->reg32[ESP], cpu->reg32[EBP], cpu->reg32[ESI], cpu->reg32[EDI]);
     printf("EFLAGS: %08x\n", cpu_get_eflags());
     printf("CS:EIP: %04x:%08x (lin: %08x) Physical EIP: %08x\n", cpu->seg[CS], VIRT_EIP(), LIN_EIP(), cpu->phys_eip);
-    printf("Translation mode: %d-bit\n", cpu->state_hash ? 16 : 32);
+    printf("Translation mode: %d-bit\n", cpu->state_hash & STATE_CODE16 ? 16 : 32);
     printf("Physical RAM base: %p Cycles to run: %d Cycles executed: %d\n", cpu->mem, cpu->cycles_to_run, (uint32_t)cpu_get_cycles());
 }
@@ -3,6 +3,7 @@
 #include "cpu/cpu.h"
 #include "cpu/opcodes.h"
 #include "cpu/simd.h"
+#include <string.h>
 
 #ifdef LIBCPU
 void* get_phys_ram_ptr(uint32_t addr, int write);
@@ -13,10 +14,10 @@ void* get_phys_ram_ptr(uint32_t addr, int write);
 // ============================================================================
 // Important state variable used by the emulator
 // ============================================================================
-static uint8_t* rawp; // Physical pointer used by decoder
-static uint8_t prefetch[16];
-static int state_hash;
-static int seg_prefix[2] = { DS, SS };
+static MACHINE_LOCAL uint8_t* rawp; // Physical pointer used by decoder
+static MACHINE_LOCAL uint8_t prefetch[16];
+static MACHINE_LOCAL int state_hash;
+static MACHINE_LOCAL int seg_prefix[2] = { DS, SS };
 #define rb() *rawp++
 #define rbs() (int8_t) * rawp++
 static inline uint32_t rw(void)
@@ -160,6 +161,11 @@ done:
     //OPCODE_TOO_LONG();
 
     opcode_info = tbl[opcode]; // Note: no risk of overflow since rawp is 8-bits in width, and thus opcode will always be < 256
+    if (tbl == optable0F && (opcode == 0x38 || opcode == 0x3A)) {
+        // Three byte opcodes: 0F 38 xx /r, and 0F 3A xx /r ib
+        OPCODE_TOO_LONG();
+        opcode_info = opcode == 0x3A ? opcode_modrm | opcode_imm8 : opcode_modrm;
+    }
     switch (opcode_info & 15) {
     case opcode_singlebyte:
         break;
@@ -254,6 +260,13 @@ done:
 typedef int (*decode_handler_t)(struct decoded_instruction*);
 #define SIZEOP(a16, a32) state_hash& STATE_CODE16 ? a16 : a32
 #define REGOP(mem, reg) modrm < 0xC0 ? mem : reg
+// Picks the handler for flat segments if the memory operand described by "flags" can use it (see STATE_FLAT)
+#define FLATOP(flags, flat, normal) (flat_operand(flags) ? flat : normal)
+static inline int flat_operand(int flags)
+{
+    int seg = I_SEG_BASE(flags);
+    return state_hash & STATE_FLAT && !(flags >> I_ADDR16_SHIFT & 1) && (seg == DS || seg == ES || seg == SS);
+}
 
 #define R8(i) ((i)&3) << 2 | (i) >> 2
 #define R16(i) (i) << 1
@@ -507,7 +520,7 @@ enum {
     SSE_PREFIX_F3
 };
 
-static int sse_prefix = 0;
+static MACHINE_LOCAL int sse_prefix = 0;
 static int decode_prefix(struct decoded_instruction* i)
 {
     uint8_t prefix = rawp[-1];
@@ -598,6 +611,9 @@ done:
             //CPU_LOG("LOCK opcode=%02x valid=%d\n", prefix, valid);
             if (!valid)
                 goto error;
+            // Only matters when there's another processor to be atomic with respect to
+            if (cpu_count > 1)
+                i->flags |= I_LOCK;
         }
 
         // Reset all state
@@ -1117,9 +1133,11 @@ static int decode_86(struct decoded_instruction* i)
 {
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 1);
-    if (modrm < 0xC0)
+    if (modrm < 0xC0) {
         i->handler = op_xchg_r8e8;
-    else
+        if (cpu_count > 1)
+            i->flags |= I_LOCK; // XCHG with memory is locked even without the prefix
+    } else
         i->handler = op_xchg_r8r8;
     return 0;
 }
@@ -1127,9 +1145,11 @@ static int decode_87(struct decoded_instruction* i)
 {
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
-    if (modrm < 0xC0)
+    if (modrm < 0xC0) {
         i->handler = SIZEOP(op_xchg_r16e16, op_xchg_r32e32);
-    else
+        if (cpu_count > 1)
+            i->flags |= I_LOCK;
+    } else
         i->handler = SIZEOP(op_xchg_r16r16, op_xchg_r32r32);
     return 0;
 }
@@ -1139,7 +1159,7 @@ static int decode_88(struct decoded_instruction* i)
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 1);
     if (modrm < 0xC0)
-        i->handler = op_mov_e8r8;
+        i->handler = FLATOP(i->flags, op_mov_e8r8_flat, op_mov_e8r8);
     else
         i->handler = op_mov_r8r8;
     return 0;
@@ -1148,7 +1168,10 @@ static int decode_89(struct decoded_instruction* i)
 {
     uint8_t modrm = rb();
     i->flags = parse_modrm(i, modrm, 0);
-    i->handler = REGOP(SIZEOP(op_mov_e16r16, op_mov_e32r32), SIZEOP(op_mov_r16r16, op_mov_r32r32));
+    if (modrm < 0xC0)
+        i->handler = FLATOP(i->flags, SIZEOP(op_mov_e16r16_flat, op_mov_e32r32_flat), SIZEOP(op_mov_e16r16, op_mov_e32r32));
+    else
+        i->handler = SIZEOP(op_mov_r16r16, op_mov_r32r32);
     return 0;
 }
 static int decode_8A(struct decoded_instruction* i)
@@ -1156,7 +1179,7 @@ static int decode_8A(struct decoded_instruction* i)
     uint8_t modrm = rb();
     int flags = parse_modrm(i, modrm, 1);
     if (modrm < 0xC0)
-        i->handler = op_mov_r8e8;
+        i->handler = FLATOP(flags, op_mov_r8e8_flat, op_mov_r8e8);
     else {
         flags = swap_rm_reg(flags);
         i->handler = op_mov_r8r8;
@@ -1169,7 +1192,7 @@ static int decode_8B(struct decoded_instruction* i)
     uint8_t modrm = rb();
     int flags = parse_modrm(i, modrm, 0);
     if (modrm < 0xC0)
-        i->handler = SIZEOP(op_mov_r16e16, op_mov_r32e32);
+        i->handler = FLATOP(flags, SIZEOP(op_mov_r16e16_flat, op_mov_r32e32_flat), SIZEOP(op_mov_r16e16, op_mov_r32e32));
     else {
         flags = swap_rm_reg(flags);
         i->handler = SIZEOP(op_mov_r16r16, op_mov_r32r32);
@@ -1569,7 +1592,7 @@ static int decode_C7(struct decoded_instruction* i)
     if (modrm >= 0xC0)
         i->handler = SIZEOP(op_mov_r16i16, op_mov_r32i32);
     else
-        i->handler = SIZEOP(op_mov_e16i16, op_mov_e32i32);
+        i->handler = SIZEOP(op_mov_e16i16, FLATOP(i->flags, op_mov_e32i32_flat, op_mov_e32i32));
     i->imm32 = rv();
     return 0;
 }
@@ -2205,8 +2228,8 @@ static const int decode_sse10_17_tbl[8 * 4] = {
 
     MOVHLPS_XGqXEq, // 0F 12 (note: can be changed to MOVLPS)
     MOVLPS_XGqXEq, // 66 0F 12
-    MOVHLPS_XGqXEq, // F2 0F 12 - TODO: SSE3
-    MOVHLPS_XGqXEq, // F3 0F 12 - TODO: SSE3
+    MOVDDUP_XGoXEq, // F2 0F 12
+    MOVSLDUP_XGoXEo, // F3 0F 12
 
     // Technically MOVLPS, but it has the same functionality as MOVSD.
     MOVSD_XEqXGq, // 0F 13
@@ -2407,7 +2430,26 @@ static int decode_0F38(struct decoded_instruction* i)
     i->imm8 = rb();
 
     uint8_t modrm = rb();
+    if ((i->imm8 & 0xFE) == 0xF0) {
+        // MOVBE: memory operands only. F2 0F 38 F0/F1 is CRC32, which we don't support.
+        i->flags = parse_modrm(i, modrm, 0);
+        if (modrm >= 0xC0 || sse_prefix == SSE_PREFIX_F2 || sse_prefix == SSE_PREFIX_F3) {
+            i->handler = op_ud_exception;
+            return 1;
+        }
+        if (i->imm8 & 1)
+            i->handler = SIZEOP(op_movbe_e16r16, op_movbe_e32r32);
+        else
+            i->handler = SIZEOP(op_movbe_r16e16, op_movbe_r32e32);
+        return 0;
+    }
     int flags = parse_modrm(i, modrm, 6);
+    // None of the SSSE3 and SSE4.1 instructions take an F2 or F3 prefix
+    if (sse_prefix == SSE_PREFIX_F2 || sse_prefix == SSE_PREFIX_F3) {
+        i->flags = flags;
+        i->handler = op_ud_exception;
+        return 1;
+    }
     if(sse_prefix == SSE_PREFIX_66) i->handler = op_sse_6638;
     else i->handler = op_sse_38;
     I_SET_OP(flags, modrm >= 0xC0);
@@ -2415,6 +2457,28 @@ static int decode_0F38(struct decoded_instruction* i)
     return 0;
 }
 
+static int decode_0F3A(struct decoded_instruction* i)
+{
+    // Opcode ordering:
+    //  [prefixes] 0F 3A <minor opcode> <modr/m> [sib] [disp] <imm8>
+    // Like the other SSE opcodes with immediates, imm16 holds the minor opcode in the low byte and the immediate in the
+    // high byte.
+    int op = rb();
+    uint8_t modrm = rb();
+    int flags = parse_modrm(i, modrm, 6);
+    i->imm16 = op | rb() << 8;
+    if (sse_prefix == SSE_PREFIX_F2 || sse_prefix == SSE_PREFIX_F3) {
+        i->flags = flags;
+        i->handler = op_ud_exception;
+        return 1;
+    }
+    if(sse_prefix == SSE_PREFIX_66) i->handler = op_sse_663A;
+    else i->handler = op_sse_3A;
+    I_SET_OP(flags, modrm >= 0xC0);
+    i->flags = flags;
+    return 0;
+}
+
 static int decode_sysenter_sysexit(struct decoded_instruction* i) // 0F34, 0F35
 {
     i->flags = 0;
@@ -3236,10 +3300,38 @@ static int decode_sseD0_D7(struct decoded_instruction* i){
     i->handler = op_sse_D0_D7;
     I_SET_OP(flags, modrm >= 0xC0);
     i->flags = flags;
+    if (opcode == 0) {
+        // 0F D0: ADDSUBPD and ADDSUBPS (SSE3)
+        if (sse_prefix == SSE_PREFIX_66)
+            i->imm8 = ADDSUBPD_XGoXEo;
+        else if (sse_prefix == SSE_PREFIX_F2)
+            i->imm8 = ADDSUBPS_XGoXEo;
+        else {
+            i->handler = op_ud_exception;
+            return 1;
+        }
+        return 0;
+    }
     opcode--;
     i->imm8 = decode_sseD0_D7_tbl[opcode << 2 | sse_prefix];
     return 0;
 }
+static int decode_0FF0(struct decoded_instruction* i)
+{
+    // F2 0F F0: LDDQU, which is the same as MOVDQU as far as we're concerned
+    if (sse_prefix != SSE_PREFIX_F2)
+        return decode_invalid0F(i);
+    uint8_t modrm = rb();
+    int flags = parse_modrm(i, modrm, 6);
+    if (modrm >= 0xC0) {
+        i->handler = op_ud_exception;
+        return 1;
+    }
+    i->handler = op_sse_68_6F;
+    i->flags = flags;
+    i->imm8 = MOVDQU_XGoXEo;
+    return 0;
+}
 static const int decode_sseD8_DF_tbl[8 * 2] = {
     // 0F D8
     PSUBUSB_MGqMEq,
@@ -3442,6 +3534,17 @@ int cpu_decode(struct trace_info* info, struct decoded_instruction* i)
     state_hash = cpu->state_hash;
     rawp = get_phys_ram_ptr(cpu->phys_eip, 0);
     uint8_t* rawp_base = rawp;
+    // Another processor may write to the code while it is decoded here, before set_smc tells it to remove the trace. What
+    // was there at the start is compared with what is there once set_smc has been called, and a trace that has changed in
+    // the meantime isn't kept.
+    uint8_t code[MAX_TRACE_SIZE * 15];
+    int code_length = 0;
+    if (cpu_count > 1) {
+        code_length = 0x1000 - (cpu->phys_eip & 0xFFF);
+        if (code_length > (int)sizeof(code))
+            code_length = sizeof(code);
+        memcpy(code, rawp_base, code_length);
+    }
     uintptr_t high_mark = (uintptr_t)(get_phys_ram_ptr ((cpu->phys_eip & ~0xFFF) + 0xFF0, 0));
     void* original = i;
     //if(cpu->phys_eip == 0x1102b8) __asm__("int3");
@@ -3468,6 +3571,10 @@ int cpu_decode(struct trace_info* info, struct decoded_instruction* i)
                     info->flags = length;
                     info->ptr = original;
                     set_smc(length, LIN_EIP());
+                    if (code_length && memcmp(code, rawp_base, length)) {
+                        info->phys = -1;
+                        return 0;
+                    }
                     }
                     return instructions_translated & instructions_mask;
                 }
@@ -3523,6 +3630,10 @@ int cpu_decode(struct trace_info* info, struct decoded_instruction* i)
                 info->flags = length;
                 info->ptr = original;
                 set_smc(length, LIN_EIP());
+                if (code_length && memcmp(code, rawp_base, length)) {
+                    info->phys = -1;
+                    return 0;
+                }
             }
             return instructions_translated & instructions_mask;
         }
@@ -3853,7 +3964,7 @@ static const decode_handler_t table0F[256] = {
     /* 0F 37 */ decode_invalid0F,
     /* 0F 38 */ decode_0F38,
     /* 0F 39 */ decode_invalid0F,
-    /* 0F 3A */ decode_invalid0F,
+    /* 0F 3A */ decode_0F3A,
     /* 0F 3B */ decode_invalid0F,
     /* 0F 3C */ decode_invalid0F,
     /* 0F 3D */ decode_invalid0F,
@@ -4035,7 +4146,7 @@ static const decode_handler_t table0F[256] = {
     /* 0F ED */ decode_sseE8_EF,
     /* 0F EE */ decode_sseE8_EF,
     /* 0F EF */ decode_sseE8_EF,
-    /* 0F F0 */ decode_invalid0F,
+    /* 0F F0 */ decode_0FF0,
     /* 0F F1 */ decode_sseF1_F7,
     /* 0F F2 */ decode_sseF1_F7,
     /* 0F F3 */ decode_sseF1_F7,
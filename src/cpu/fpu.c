@@ -41,6 +41,13 @@ FADD:
 #include "cpu/cpu.h"
 #include "cpu/instrument.h"
 #include "devices.h"
+#include <float.h>
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0 && !defined(__FAST_MATH__)
+// Host doubles are rounded like doubles, so they can be used for some operations (see fpu_add)
+#define FPU_FAST_PATH
+#include <math.h>
+#include <string.h>
+#endif
 #define EXCEPTION_HANDLER return 1
 
 #define FLOATX80
@@ -120,7 +127,7 @@ static const floatx80* Constants[8] = {
     &Constant_1, &Constant_L2T, &Constant_L2E, &Constant_PI, &Constant_LG2, &Constant_LN2, &Zero, &IndefiniteNaN
 };
 
-struct fpu fpu;
+MACHINE_LOCAL struct fpu fpu;
 
 // FLDCW
 static void fpu_set_control_word(uint16_t control_word)
@@ -165,11 +172,12 @@ static void fpu_set_control_word(uint16_t control_word)
     fpu.status.denormals_are_zeros = 0;
 }
 
-static void fpu_state(void)
+// Also used by cpu_state for the application processors, under their own names
+void fpu_state_processor(char* name)
 {
 #ifndef LIBCPU
     // <<< BEGIN AUTOGENERATE "state" >>>
-    struct bjson_object* obj = state_obj("fpu", 9 + 16);
+    struct bjson_object* obj = state_obj(name, 9 + 16);
     state_field(obj, 4, "fpu.ftop", &fpu.ftop);
     state_field(obj, 2, "fpu.control_word", &fpu.control_word);
     state_field(obj, 2, "fpu.status_word", &fpu.status_word);
@@ -180,17 +188,45 @@ static void fpu_state(void)
     state_field(obj, 2, "fpu.fpu_opcode", &fpu.fpu_opcode);
     state_field(obj, 2, "fpu.fpu_data_seg", &fpu.fpu_data_seg);
     // <<< END AUTOGENERATE "state" >>>
-    char name[32];
+    char field[32];
     for (int i = 0; i < 8; i++) {
-        sprintf(name, "fpu.st[%d].mantissa", i);
-        state_field(obj, 8, name, &fpu.st[i].fraction);
-        sprintf(name, "fpu.st[%d].exponent", i);
-        state_field(obj, 2, name, &fpu.st[i].exp);
+        sprintf(field, "fpu.st[%d].mantissa", i);
+        state_field(obj, 8, field, &fpu.st[i].fraction);
+        sprintf(field, "fpu.st[%d].exponent", i);
+        state_field(obj, 2, field, &fpu.st[i].exp);
     }
     if (state_is_reading())
         fpu_set_control_word(fpu.control_word);
+#else
+    UNUSED(name);
 #endif
 }
+static void fpu_state(void)
+{
+    fpu_state_processor("fpu");
+}
+
+// x87 state of the processors that aren't running. cpu_select swaps it with "fpu".
+static MACHINE_LOCAL struct fpu saved_fpu[MAX_CPUS];
+void fpu_switch(int from, int to)
+{
+    saved_fpu[from] = fpu;
+    fpu = saved_fpu[to];
+}
+// An application processor on a thread of its own works on that thread's copy of "fpu", and only keeps its x87 state in
+// saved_fpu while it is parked (see fpu_load and fpu_store)
+struct fpu* fpu_get_saved(int id)
+{
+    return &saved_fpu[id];
+}
+void fpu_load(struct fpu* saved)
+{
+    fpu = *saved;
+}
+void fpu_store(struct fpu* saved)
+{
+    *saved = fpu;
+}
 
 static uint16_t fpu_get_status_word(void)
 {
@@ -305,7 +341,7 @@ static void fpu_stack_fault(void)
     //return 0;
 }
 
-static uint32_t partial_sw, bits_to_clear;
+static MACHINE_LOCAL uint32_t partial_sw, bits_to_clear;
 
 static void fpu_commit_sw(void)
 {
@@ -533,6 +569,127 @@ static int fpu_read_f80(uint32_t linaddr, floatx80* data)
     return 0;
 }
 
+// Host floating point fast path for FADD, FSUB, FMUL, FDIV and FSQRT
+// Lots of software sets the precision control to 53 bits. With round to nearest, the result is then the exact result
+// rounded to a double, which is exactly what the host computes -- as long as the operands are doubles and neither the host
+// nor the x87 can overflow or underflow. The operands are limited to exponents of +/- 400, so that cannot happen, and the
+// exact rounding error is computed as well so that #P and C1 can be set the same way as SoftFloat does.
+// Only used if the compiler evaluates doubles as doubles (i.e. not on the x87 itself).
+#ifdef FPU_FAST_PATH
+#define FAST_PATH_EXPONENT_LIMIT 400
+
+static inline int fpu_fast_path_ok(floatx80 a)
+{
+    int exponent = (a.exp & 0x7FFF) - 0x3FFF;
+    return (a.fraction >> 63) && !(a.fraction & 0x7FF) && exponent >= -FAST_PATH_EXPONENT_LIMIT && exponent <= FAST_PATH_EXPONENT_LIMIT;
+}
+static inline int fpu_fast_path_ok2(floatx80 a, floatx80 b)
+{
+    // Round to nearest with 53-bit precision, and nothing raised by the operand conversion
+    return (fpu.control_word & 0xF00) == FPU_PRECISION_53 << FPU_PRECISION_SHIFT && !fpu.status.float_exception_flags && fpu_fast_path_ok(a) && fpu_fast_path_ok(b);
+}
+
+static inline double fpu_to_double(floatx80 a)
+{
+    uint64_t bits = (uint64_t)(a.exp >> 15) << 63 | (uint64_t)((a.exp & 0x7FFF) - 0x3FFF + 1023) << 52 | (a.fraction << 1 >> 12);
+    double result;
+    memcpy(&result, &bits, 8);
+    return result;
+}
+
+// "error" is the exact result minus "result", or at least something with the same sign
+static inline floatx80 fpu_from_double(double result, double error)
+{
+    uint64_t bits;
+    floatx80 f;
+    memcpy(&bits, &result, 8);
+    f.exp = bits >> 63 << 15;
+    if (bits << 1) {
+        f.exp |= (bits >> 52 & 0x7FF) - 1023 + 0x3FFF;
+        f.fraction = bits << 11 | 0x8000000000000000ULL;
+    } else
+        f.fraction = 0;
+
+    if (error != 0) {
+        fpu.status.float_exception_flags |= float_flag_inexact;
+        if ((error < 0) != (result < 0))
+            fpu.status.float_exception_flags |= RAISE_SW_C1; // Rounded up
+    }
+    return f;
+}
+
+// Returns a * b, and the exact difference between that and the real product in *error
+static inline double fpu_two_product(double a, double b, double* error)
+{
+    double product = a * b;
+#ifdef FP_FAST_FMA
+    *error = fma(a, b, -product);
+#else
+    // Dekker's algorithm
+    double a_split = a * 134217729.0, b_split = b * 134217729.0;
+    double a_hi = a_split - (a_split - a), a_lo = a - a_hi, b_hi = b_split - (b_split - b), b_lo = b - b_hi;
+    *error = ((a_hi * b_hi - product) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo;
+#endif
+    return product;
+}
+
+static inline floatx80 fpu_fast_add(double a, double b)
+{
+    double sum = a + b, b_virtual = sum - a;
+    return fpu_from_double(sum, (a - (sum - b_virtual)) + (b - b_virtual));
+}
+#endif
+
+static floatx80 fpu_add(floatx80 a, floatx80 b)
+{
+#ifdef FPU_FAST_PATH
+    if (fpu_fast_path_ok2(a, b))
+        return fpu_fast_add(fpu_to_double(a), fpu_to_double(b));
+#endif
+    return floatx80_add(a, b, &fpu.status);
+}
+static floatx80 fpu_sub(floatx80 a, floatx80 b)
+{
+#ifdef FPU_FAST_PATH
+    if (fpu_fast_path_ok2(a, b))
+        return fpu_fast_add(fpu_to_double(a), -fpu_to_double(b));
+#endif
+    return floatx80_sub(a, b, &fpu.status);
+}
+static floatx80 fpu_mul(floatx80 a, floatx80 b)
+{
+#ifdef FPU_FAST_PATH
+    if (fpu_fast_path_ok2(a, b)) {
+        double error, product = fpu_two_product(fpu_to_double(a), fpu_to_double(b), &error);
+        return fpu_from_double(product, error);
+    }
+#endif
+    return floatx80_mul(a, b, &fpu.status);
+}
+static floatx80 fpu_div(floatx80 a, floatx80 b)
+{
+#ifdef FPU_FAST_PATH
+    if (fpu_fast_path_ok2(a, b)) {
+        // The remainder a - q * b is always a double, and the error of q has the sign of remainder / b
+        double x = fpu_to_double(a), y = fpu_to_double(b), q = x / y, error, product = fpu_two_product(q, y, &error);
+        double remainder = (x - product) - error;
+        return fpu_from_double(q, y < 0 ? -remainder : remainder);
+    }
+#endif
+    return floatx80_div(a, b, &fpu.status);
+}
+static floatx80 fpu_sqrt(floatx80 a)
+{
+#ifdef FPU_FAST_PATH
+    if (!(a.exp >> 15) && fpu_fast_path_ok2(a, a)) {
+        // Same as above: a - root * root is a double, and has the same sign as the error
+        double x = fpu_to_double(a), root = sqrt(x), error, product = fpu_two_product(root, root, &error);
+        return fpu_from_double(root, (x - product) - error);
+    }
+#endif
+    return floatx80_sqrt(a, &fpu.status);
+}
+
 // Actual FPU operations
 static int fpu_fcom(floatx80 op1, floatx80 op2, int unordered)
 {
@@ -753,22 +910,22 @@ int fpu_reg_op(struct decoded_instruction* i, uint32_t flags)
 
         switch (smaller_opcode & 7) {
         case 0: // FADD - Floating point add
-            dst = floatx80_add(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
+            dst = fpu_add(fpu_get_st(0), fpu_get_st(st_index));
             break;
         case 1: // FMUL - Floating point multiply
-            dst = floatx80_mul(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
+            dst = fpu_mul(fpu_get_st(0), fpu_get_st(st_index));
             break;
         case 4: // FSUB - Floating point subtract
-            dst = floatx80_sub(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
+            dst = fpu_sub(fpu_get_st(0), fpu_get_st(st_index));
             break;
         case 5: // FSUBR - Floating point subtract reverse
-            dst = floatx80_sub(fpu_get_st(st_index), fpu_get_st(0), &fpu.status);
+            dst = fpu_sub(fpu_get_st(st_index), fpu_get_st(0));
             break;
         case 6: // FDIV - Floating point divide
-            dst = floatx80_div(fpu_get_st(0), fpu_get_st(st_index), &fpu.status);
+            dst = fpu_div(fpu_get_st(0), fpu_get_st(st_index));
             break;
         case 7: // FDIVR - Floating point divide reverse
-            dst = floatx80_div(fpu_get_st(st_index), fpu_get_st(0), &fpu.status);
+            dst = fpu_div(fpu_get_st(st_index), fpu_get_st(0));
             break;
         }
         if (!fpu_check_exceptions()) {
@@ -1025,7 +1182,7 @@ int fpu_reg_op(struct decoded_instruction* i, uint32_t flags)
             }
             return 0;
         case 2: // FSQRT - Compute sqrt(ST0)
-            dest = floatx80_sqrt(fpu_get_st(0), &fpu.status);
+            dest = fpu_sqrt(fpu_get_st(0));
             break;
         case 3: { // FSINCOS - Compute sin(ST0) and sin(ST1)
             // TODO: What if exceptions are masked?
@@ -1377,10 +1534,10 @@ int fpu_mem_op(struct decoded_instruction* i, uint32_t virtaddr, uint32_t seg)
         floatx80 st0 = fpu_get_st(0);
         switch (op) {
         case 0: // FADD - Floating point add
-            st0 = floatx80_add(st0, temp80, &fpu.status);
+            st0 = fpu_add(st0, temp80);
             break;
         case 1: // FMUL - Floating point multiply
-            st0 = floatx80_mul(st0, temp80, &fpu.status);
+            st0 = fpu_mul(st0, temp80);
             break;
         case 2: // FCOM - Floating point compare
         case 3: // FCOMP - Floating point compare and pop
@@ -1390,16 +1547,16 @@ int fpu_mem_op(struct decoded_instruction* i, uint32_t virtaddr, uint32_t seg)
             }
             return 0;
         case 4: // FSUB - Floating point subtract
-            st0 = floatx80_sub(st0, temp80, &fpu.status);
+            st0 = fpu_sub(st0, temp80);
             break;
         case 5: // FSUBR - Floating point subtract with reversed operands
-            st0 = floatx80_sub(temp80, st0, &fpu.status);
+            st0 = fpu_sub(temp80, st0);
             break;
         case 6: // FDIV - Floating point divide
-            st0 = floatx80_div(st0, temp80, &fpu.status);
+            st0 = fpu_div(st0, temp80);
             break;
         case 7: // FDIVR - Floating point divide with reversed operands
-            st0 = floatx80_div(temp80, st0, &fpu.status);
+            st0 = fpu_div(temp80, st0);
             break;
         default: // FLD
             if (!fpu_check_exceptions())
@@ -1804,8 +1961,12 @@ int fpu_fwait(void)
             EXCEPTION_MF();
         else {
             // yucky, but works. OS/2 uses this method
-            pic_lower_irq(13);
-            pic_raise_irq(13);
+            if (CPU_ON_AP_THREAD())
+                cpu_smp_request(SMP_FPU_IRQ, 0, 0, 0);
+            else {
+                pic_lower_irq(13);
+                pic_raise_irq(13);
+            }
             //ABORT();
         }
     }
@@ -0,0 +1,96 @@
+// Built-in performance counters
+// The counters themselves are incremented all over the emulator with INSTRUMENT_COUNT. This file writes them out.
+
+#include "cpu/instrument.h"
+#include "cpuapi.h"
+#include "io.h"
+#include "util.h"
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+
+MACHINE_LOCAL struct instrument_counters instrument_counters;
+
+static MACHINE_LOCAL char* dump_path;
+static MACHINE_LOCAL int dump_interval, dumps;
+static MACHINE_LOCAL time_t last_dump;
+
+#ifdef SIGUSR2
+// The signal goes to the whole process, so every machine compares the count against the last one it has seen
+static volatile sig_atomic_t dump_requests;
+static MACHINE_LOCAL sig_atomic_t dump_requests_seen;
+static void instrument_counters_signal(int sig)
+{
+    UNUSED(sig);
+    dump_requests++;
+}
+#endif
+
+void instrument_counters_write(FILE* f, struct instrument_counters* since)
+{
+    static const struct instrument_counters zero;
+    const struct instrument_counters *c = &instrument_counters, *base = since ? since : &zero;
+#define FIELD(name, sep) fprintf(f, "\"" #name "\":%llu" sep, (unsigned long long)(c->name - base->name))
+    FIELD(traces_decoded, ",");
+    FIELD(trace_hits, ",");
+    FIELD(trace_flushes, ",");
+    FIELD(tlb_misses, ",");
+    FIELD(tlb_flushes, ",");
+    FIELD(page_walks, ",");
+    FIELD(smc_invalidations, ",");
+    FIELD(pages_freed, ",");
+    FIELD(irqs, ",");
+    FIELD(disk_bytes_read, ",");
+    FIELD(disk_bytes_written, ",");
+    FIELD(snapshot_restores, "");
+#undef FIELD
+}
+
+void instrument_counters_dump(void)
+{
+    FILE* f = dump_path ? fopen(dump_path, "a") : stderr;
+    if (!f) {
+        fprintf(stderr, "Unable to open counters file %s\n", dump_path);
+        return;
+    }
+    fprintf(f, "{\"dump\":%d,\"time\":%lld,\"instructions\":%llu,", dumps++, (long long)time(NULL), (unsigned long long)cpu_get_cycles());
+    instrument_counters_write(f, NULL);
+    fprintf(f, ",");
+    io_dump_counters(f);
+    fprintf(f, "}\n");
+    if (f != stderr)
+        fclose(f);
+    else
+        fflush(f);
+
+    cpu_profiler_report();
+}
+
+void instrument_counters_poll(void)
+{
+    int dump = 0;
+#ifdef SIGUSR2
+    dump = dump_requests != dump_requests_seen;
+    dump_requests_seen = dump_requests;
+#endif
+    if (dump_interval) {
+        time_t now = time(NULL);
+        if (now - last_dump >= dump_interval) {
+            last_dump = now;
+            dump = 1;
+        }
+    }
+    if (dump)
+        instrument_counters_dump();
+}
+
+void instrument_counters_init(char* path, int interval)
+{
+    dump_path = path;
+    dump_interval = interval;
+    last_dump = time(NULL);
+#ifdef SIGUSR2
+    dump_requests_seen = dump_requests;
+    signal(SIGUSR2, instrument_counters_signal);
+#endif
+}
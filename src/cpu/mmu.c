@@ -15,6 +15,7 @@ void* get_lin_ram_ptr(uint32_t addr, int flags, int* fault);
 
 void cpu_mmu_tlb_flush(void)
 {
+    INSTRUMENT_COUNT(tlb_flushes);
     for (unsigned int i = 0; i < cpu->tlb_entry_count; i++) {
         uint32_t entry = cpu->tlb_entry_indexes[i];
         if (entry == (uint32_t)-1)
@@ -28,6 +29,7 @@ void cpu_mmu_tlb_flush(void)
 }
 void cpu_mmu_tlb_flush_nonglobal(void)
 {
+    INSTRUMENT_COUNT(tlb_flushes);
     for (unsigned int i = 0; i < cpu->tlb_entry_count; i++) {
         uint32_t entry = cpu->tlb_entry_indexes[i];
         if (entry == (uint32_t)-1)
@@ -61,11 +63,23 @@ static void cpu_set_tlb_entry(uint32_t lin, uint32_t phys, void* ptr, int user,
         tag_write = 1;
     }
 
+    // Direct-mapped device memory can be read in place. Writes are trapped until the device has seen one on the page.
+    uint32_t direct_offset = phys - cpu->direct_mmio_base;
+    if (direct_offset < cpu->direct_mmio_size) {
+        ptr = cpu->direct_mmio_host + direct_offset;
+        tag = 0;
+        tag_write = !(cpu->direct_mmio_dirty[direct_offset >> 17] >> (direct_offset >> 12 & 31) & 1);
+    }
+
     if (cpu_smc_page_has_code(phys)) {
         // Make sure that the flag is set.
         tag_write = 1;
     }
 
+    // Catch the first write to a clean page so that it can be included in the next incremental savestate
+    if (cpu->dirty_tracking && !cpu_dirty_page(phys))
+        tag_write = 1;
+
     if (cpu->tlb_entry_count >= MAX_TLB_ENTRIES) { // Flush TLB
         cpu_mmu_tlb_flush();
 #ifdef INSTRUMENT
@@ -87,19 +101,63 @@ static void cpu_set_tlb_entry(uint32_t lin, uint32_t phys, void* ptr, int user,
     cpu->tlb_tags[entry] = system_read | system_write | user_read | user_write;
 }
 
+void cpu_set_direct_mmio(uint32_t base, uint32_t size, void* host, uint32_t* dirty)
+{
+    // Every processor sees the same device memory
+    for (int i = 0; i < cpu_count; i++) {
+        cpus[i]->direct_mmio_base = base;
+        cpus[i]->direct_mmio_size = host ? size : 0;
+        cpus[i]->direct_mmio_host = host;
+        cpus[i]->direct_mmio_dirty = dirty;
+    }
+    cpu_for_each(cpu_mmu_tlb_flush);
+}
+
+static void cpu_mmu_protect_direct_mmio(void)
+{
+    // Walk the live TLB entries instead of flushing them so that reads stay fast
+    for (unsigned int i = 0; i < cpu->tlb_entry_count; i++) {
+        uint32_t entry = cpu->tlb_entry_indexes[i];
+        if (entry == (uint32_t)-1)
+            continue;
+        uint32_t offset = (uintptr_t)(cpu->tlb[entry] + (entry << 12)) - (uintptr_t)cpu->direct_mmio_host;
+        if (offset < cpu->direct_mmio_size && !(cpu->direct_mmio_dirty[offset >> 17] >> (offset >> 12 & 31) & 1))
+            cpu->tlb_tags[entry] |= (1 << TLB_SYSTEM_WRITE) | (1 << TLB_USER_WRITE);
+    }
+}
+void cpu_protect_direct_mmio(void)
+{
+    cpu_for_each(cpu_mmu_protect_direct_mmio);
+}
+
+// Write-protects every entry that maps the page of RAM at "phys", under whatever linear address
+void cpu_mmu_tlb_protect_ram(uint32_t phys)
+{
+    void* host = cpu->mem + (phys & ~0xFFF);
+    for (unsigned int i = 0; i < cpu->tlb_entry_count; i++) {
+        uint32_t entry = cpu->tlb_entry_indexes[i];
+        if (entry != (uint32_t)-1 && cpu->tlb[entry] + (entry << 12) == host)
+            cpu->tlb_tags[entry] |= (1 << TLB_SYSTEM_WRITE) | (1 << TLB_USER_WRITE);
+    }
+}
+
 uint32_t cpu_read_phys(uint32_t addr)
 {
     if (addr >= cpu->memory_size || (addr >= 0xA0000 && addr < 0xC0000))
-        return io_handle_mmio_read(addr, 2);
+        return cpu_mmio_read(addr, 2);
     else
         return MEM32(addr);
 }
+// Only used to set the accessed and dirty bits of paging entries. Another processor may be changing the entry at the same
+// time, so only those bits are ORed into RAM, like the locked update of the processor does.
 static void cpu_write_phys(uint32_t addr, uint32_t data)
 {
     if (addr >= cpu->memory_size || (addr >= 0xA0000 && addr < 0xC0000))
-        io_handle_mmio_write(addr, data, 2);
-    else
-        MEM32(addr) = data;
+        cpu_mmio_write(addr, data, 2);
+    else {
+        cpu_dirty_mark(addr);
+        __atomic_fetch_or(&MEM32(addr), data & 0x60, __ATOMIC_SEQ_CST);
+    }
 }
 
 // Checks reserved fields for error. disable for speed.
@@ -108,6 +166,7 @@ static void cpu_write_phys(uint32_t addr, uint32_t data)
 // Converts linear to physical address.
 int cpu_mmu_translate(uint32_t lin, int shift)
 {
+    INSTRUMENT_COUNT(tlb_misses);
 #ifdef LIBCPU
     int fault;
     void* ptr = get_lin_ram_ptr(lin & ~0xFFF, shift, &fault);
@@ -126,6 +185,7 @@ int cpu_mmu_translate(uint32_t lin, int shift)
         cpu_set_tlb_entry(lin & ~0xFFF, lin & ~0xFFF, NULL, 1, 1, 0, 0);
         return 0; // No page faults at all!
     } else {
+        INSTRUMENT_COUNT(page_walks);
         int execute = shift & 8;
         shift &= 7;
         // Determine whether we are reading or writing
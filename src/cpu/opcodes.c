@@ -6,6 +6,7 @@
 #include "cpu/simd.h"
 #include "cpuapi.h"
 #include "devices.h"
+#include <string.h>
 
 #define EXCEPTION_HANDLER EXCEP()
 
@@ -45,6 +46,15 @@
         return cpu_get_trace(); \
     } while (0)
 #define STOP2() return i
+// For segment loads: the rest of the trace was decoded for the old STATE_FLAT, so end it if that has changed
+#define NEXT_SEG(flags, old_state_hash)                        \
+    do {                                                       \
+        if ((cpu->state_hash ^ old_state_hash) & STATE_FLAT) { \
+            cpu->phys_eip += flags & 15;                        \
+            STOP();                                            \
+        }                                                      \
+        NEXT(flags);                                           \
+    } while (0)
 #define R8(i) cpu->reg8[i]
 #define R16(i) cpu->reg16[i]
 #define R32(i) cpu->reg32[i]
@@ -69,53 +79,126 @@
     cpu_read##sz(linaddr, res, cpu->tlb_shift_read);                 \
     func(I_OP(flags), &R##sz(I_REG(flags)), res);                   \
     NEXT(flags)
-#define arith_rmw(sz, func, ...)                                                   \
-    uint32_t flags = i->flags,                                                     \
-             linaddr = cpu_get_linaddr(flags, i),                                  \
+
+// The state that an instruction handler changes besides its memory operand, so that a LOCK-prefixed instruction can be
+// tried again if another processor changed the operand in the meantime
+struct locked_state {
+    uint32_t reg32[8], eflags, laux, lop1, lop2, lr;
+};
+static inline void locked_save(struct locked_state* s)
+{
+    memcpy(s->reg32, cpu->reg32, sizeof(s->reg32));
+    s->eflags = cpu->eflags;
+    s->laux = cpu->laux;
+    s->lop1 = cpu->lop1;
+    s->lop2 = cpu->lop2;
+    s->lr = cpu->lr;
+}
+static inline void locked_restore(struct locked_state* s)
+{
+    memcpy(cpu->reg32, s->reg32, sizeof(s->reg32));
+    cpu->eflags = s->eflags;
+    cpu->laux = s->laux;
+    cpu->lop1 = s->lop1;
+    cpu->lop2 = s->lop2;
+    cpu->lr = s->lr;
+}
+
+// With more than one processor, LOCK-prefixed instructions (see I_LOCK) work on a copy of the operand and
+// compare-and-swap the result into RAM. "value" is the copy. Operands that the TLB doesn't map for writing are read and
+// written with the bus locked instead.
+#define locked_rmw(sz, ptr, ...)                                                                      \
+    do {                                                                                              \
+        struct locked_state saved_;                                                                   \
+        uint##sz##_t old_ = __atomic_load_n(ptr, __ATOMIC_SEQ_CST), value;                            \
+        locked_save(&saved_);                                                                         \
+        for (;;) {                                                                                    \
+            value = old_;                                                                             \
+            __VA_ARGS__;                                                                              \
+            if (__atomic_compare_exchange_n(ptr, &old_, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) \
+                break;                                                                                \
+            locked_restore(&saved_);                                                                  \
+        }                                                                                             \
+    } while (0)
+#define lock_bus(flags)         \
+    do {                        \
+        if (flags & I_LOCK)     \
+            cpu_smp_lock_bus(); \
+    } while (0)
+#define unlock_bus(flags)         \
+    do {                          \
+        if (flags & I_LOCK)       \
+            cpu_smp_unlock_bus(); \
+    } while (0)
+
+#define arith_rmw(sz, func, ...)                                                    \
+    uint32_t flags = i->flags,                                                      \
+             linaddr = cpu_get_linaddr(flags, i),                                   \
              tlb_shift = cpu->tlb_tags[linaddr >> 12],                              \
              shift = cpu->tlb_shift_write;                                          \
-    uint##sz##_t* ptr;                                                             \
-    if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                        \
-        if (cpu_access_read##sz(linaddr, tlb_shift >> shift, shift))               \
-            EXCEP();                                                               \
+    uint##sz##_t* ptr;                                                              \
+    if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                         \
+        lock_bus(flags);                                                            \
+        if (cpu_access_read##sz(linaddr, tlb_shift >> shift, shift)) {              \
+            unlock_bus(flags);                                                      \
+            EXCEP();                                                                \
+        }                                                                           \
         func(I_OP(flags), (void*)&cpu->read_result, ##__VA_ARGS__);                 \
         cpu_access_write##sz(linaddr, cpu->read_result, tlb_shift >> shift, shift); \
-    } else {                                                                       \
+        unlock_bus(flags);                                                          \
+    } else {                                                                        \
         ptr = cpu->tlb[linaddr >> 12] + linaddr;                                    \
-        func(I_OP(flags), ptr, ##__VA_ARGS__);                                     \
-    }                                                                              \
+        if (flags & I_LOCK)                                                         \
+            locked_rmw(sz, ptr, func(I_OP(flags), &value, ##__VA_ARGS__));          \
+        else                                                                        \
+            func(I_OP(flags), ptr, ##__VA_ARGS__);                                  \
+    }                                                                               \
     NEXT(flags)
-#define arith_rmw2(sz, func, ...)                                                  \
-    uint32_t flags = i->flags,                                                     \
-             linaddr = cpu_get_linaddr(flags, i),                                  \
+#define arith_rmw2(sz, func, ...)                                                   \
+    uint32_t flags = i->flags,                                                      \
+             linaddr = cpu_get_linaddr(flags, i),                                   \
              tlb_shift = cpu->tlb_tags[linaddr >> 12],                              \
              shift = cpu->tlb_shift_write;                                          \
-    uint##sz##_t* ptr;                                                             \
-    if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                        \
-        if (cpu_access_read##sz(linaddr, tlb_shift >> shift, shift))               \
-            EXCEP();                                                               \
+    uint##sz##_t* ptr;                                                              \
+    if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                         \
+        lock_bus(flags);                                                            \
+        if (cpu_access_read##sz(linaddr, tlb_shift >> shift, shift)) {              \
+            unlock_bus(flags);                                                      \
+            EXCEP();                                                                \
+        }                                                                           \
         func((void*)&cpu->read_result, ##__VA_ARGS__);                              \
         cpu_access_write##sz(linaddr, cpu->read_result, tlb_shift >> shift, shift); \
-    } else {                                                                       \
+        unlock_bus(flags);                                                          \
+    } else {                                                                        \
         ptr = cpu->tlb[linaddr >> 12] + linaddr;                                    \
-        func(ptr, ##__VA_ARGS__);                                                  \
-    }                                                                              \
+        if (flags & I_LOCK)                                                         \
+            locked_rmw(sz, ptr, func(&value, ##__VA_ARGS__));                       \
+        else                                                                        \
+            func(ptr, ##__VA_ARGS__);                                               \
+    }                                                                               \
     NEXT(flags)
-#define arith_rmw3(sz, func, offset, ...)                                          \
-    uint32_t flags = i->flags,                                                     \
-             linaddr = cpu_get_linaddr(flags, i) + offset,                         \
+#define arith_rmw3(sz, func, offset, ...)                                           \
+    uint32_t flags = i->flags,                                                      \
+             linaddr = cpu_get_linaddr(flags, i) + offset,                          \
              tlb_shift = cpu->tlb_tags[linaddr >> 12],                              \
              shift = cpu->tlb_shift_write;                                          \
-    uint##sz##_t* ptr;                                                             \
-    if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                        \
-        if (cpu_access_read##sz(linaddr, tlb_shift >> shift, shift))               \
-            EXCEP();                                                               \
+    uint##sz##_t* ptr;                                                              \
+    if (TLB_ENTRY_INVALID##sz(linaddr, tlb_shift, shift)) {                         \
+        lock_bus(flags);                                                            \
+        if (cpu_access_read##sz(linaddr, tlb_shift >> shift, shift)) {              \
+            unlock_bus(flags);                                                      \
+            EXCEP();                                                                \
+        }                                                                           \
         func((void*)&cpu->read_result, ##__VA_ARGS__);                              \
         cpu_access_write##sz(linaddr, cpu->read_result, tlb_shift >> shift, shift); \
-    } else {                                                                       \
+        unlock_bus(flags);                                                          \
+    } else {                                                                        \
         ptr = cpu->tlb[linaddr >> 12] + linaddr;                                    \
-        func(ptr, ##__VA_ARGS__);                                                  \
-    }                                                                              \
+        if (flags & I_LOCK)                                                         \
+            locked_rmw(sz, ptr, func(&value, ##__VA_ARGS__));                       \
+        else                                                                        \
+            func(ptr, ##__VA_ARGS__);                                               \
+    }                                                                               \
     NEXT(flags)
 #define jcc16(cond)                                                  \
     int flags = i->flags;                                            \
@@ -148,7 +231,7 @@ static void interrupt_guard(void)
     }
 }
 
-static union {
+static MACHINE_LOCAL union {
     uint8_t d8;
     uint16_t d16;
     uint32_t d32;
@@ -162,6 +245,13 @@ static inline uint32_t cpu_get_linaddr(uint32_t i, struct decoded_instruction* j
     addr += j->disp32;
     return FAST_BRANCHLESS_MASK(addr, i) + cpu->seg_base[I_SEG_BASE(i)];
 }
+// Only for instructions with a 32-bit address and a DS, ES or SS segment, decoded with STATE_FLAT set
+static inline uint32_t cpu_get_linaddr_flat(uint32_t i, struct decoded_instruction* j)
+{
+    uint32_t addr = cpu->reg32[I_BASE(i)];
+    addr += cpu->reg32[I_INDEX(i)] << (I_SCALE(i));
+    return addr + j->disp32;
+}
 static inline uint32_t cpu_get_virtaddr(uint32_t i, struct decoded_instruction* j)
 {
     uint32_t addr = cpu->reg32[I_BASE(i)];
@@ -750,6 +840,7 @@ OPTYPE op_pop_s16(struct decoded_instruction* i)
 {
     // This instruction must be treated very carefully
     // We cannot use pop16 for this operation
+    uint32_t old_state_hash = cpu->state_hash;
     int flags = i->flags, seg_dest = I_RM(flags);
     uint16_t dest;
     cpu_read16((cpu->reg32[ESP] & cpu->esp_mask) + cpu->seg_base[SS], dest, cpu->tlb_shift_read);
@@ -758,11 +849,12 @@ OPTYPE op_pop_s16(struct decoded_instruction* i)
     cpu->reg32[ESP] = ((cpu->reg32[ESP] + 2) & cpu->esp_mask) | (cpu->reg32[ESP] & ~cpu->esp_mask);
     if (seg_dest == SS)
         interrupt_guard();
-    NEXT(flags);
+    NEXT_SEG(flags, old_state_hash);
 }
 OPTYPE op_pop_s32(struct decoded_instruction* i)
 {
     // Identical to above except ESP is incremented by 4
+    uint32_t old_state_hash = cpu->state_hash;
     int flags = i->flags, seg_dest = I_RM(flags);
     uint16_t dest;
     cpu_read16((cpu->reg32[ESP] & cpu->esp_mask) + cpu->seg_base[SS], dest, cpu->tlb_shift_read);
@@ -771,7 +863,7 @@ OPTYPE op_pop_s32(struct decoded_instruction* i)
     cpu->reg32[ESP] = ((cpu->reg32[ESP] + 4) & cpu->esp_mask) | (cpu->reg32[ESP] & ~cpu->esp_mask);
     if (seg_dest == SS)
         interrupt_guard();
-    NEXT(flags);
+    NEXT_SEG(flags, old_state_hash);
 }
 OPTYPE op_pusha(struct decoded_instruction* i)
 {
@@ -1708,17 +1800,63 @@ OPTYPE op_mov_e32i32(struct decoded_instruction* i)
     NEXT(flags);
 }
 
+// The same as above, for flat segments (see STATE_FLAT)
+OPTYPE op_mov_r8e8_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr_flat(flags, i);
+    cpu_read8(linaddr, R8(I_REG(flags)), cpu->tlb_shift_read);
+    NEXT(flags);
+}
+OPTYPE op_mov_e8r8_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr_flat(flags, i);
+    cpu_write8(linaddr, R8(I_REG(flags)), cpu->tlb_shift_write);
+    NEXT(flags);
+}
+OPTYPE op_mov_r16e16_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr_flat(flags, i);
+    cpu_read16(linaddr, R16(I_REG(flags)), cpu->tlb_shift_read);
+    NEXT(flags);
+}
+OPTYPE op_mov_e16r16_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr_flat(flags, i);
+    cpu_write16(linaddr, R16(I_REG(flags)), cpu->tlb_shift_write);
+    NEXT(flags);
+}
+OPTYPE op_mov_r32e32_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr_flat(flags, i);
+    cpu_read32(linaddr, R32(I_REG(flags)), cpu->tlb_shift_read);
+    NEXT(flags);
+}
+OPTYPE op_mov_e32r32_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr_flat(flags, i);
+    cpu_write32(linaddr, R32(I_REG(flags)), cpu->tlb_shift_write);
+    NEXT(flags);
+}
+OPTYPE op_mov_e32i32_flat(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr_flat(flags, i);
+    cpu_write32(linaddr, i->imm32, cpu->tlb_shift_write);
+    NEXT(flags);
+}
+
 OPTYPE op_mov_s16r16(struct decoded_instruction* i)
 {
+    uint32_t old_state_hash = cpu->state_hash;
     int flags = i->flags, dest = I_REG(flags);
     if (cpu_load_seg_value_mov(dest, R16(I_RM(flags))))
         EXCEP();
     if (dest == SS)
         interrupt_guard();
-    NEXT(flags);
+    NEXT_SEG(flags, old_state_hash);
 }
 OPTYPE op_mov_s16e16(struct decoded_instruction* i)
 {
+    uint32_t old_state_hash = cpu->state_hash;
     uint32_t flags = i->flags, dest = I_REG(flags), linaddr = cpu_get_linaddr(flags, i);
     uint16_t src;
     cpu_read16(linaddr, src, cpu->tlb_shift_read);
@@ -1726,7 +1864,7 @@ OPTYPE op_mov_s16e16(struct decoded_instruction* i)
         EXCEP();
     if (dest == SS)
         interrupt_guard();
-    NEXT(flags);
+    NEXT_SEG(flags, old_state_hash);
 }
 OPTYPE op_mov_e16s16(struct decoded_instruction* i)
 {
@@ -1843,63 +1981,69 @@ OPTYPE op_lea_r32e32(struct decoded_instruction* i)
 
 OPTYPE op_lds_r16e16(struct decoded_instruction* i)
 {
+    uint32_t old_state_hash = cpu->state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 2, data, cpu->tlb_shift_read);
     if (cpu_load_seg_value_mov(DS, data))
         EXCEP();
     cpu_read16(linaddr, data, cpu->tlb_shift_read);
     R16(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, old_state_hash);
 }
 OPTYPE op_lds_r32e32(struct decoded_instruction* i)
 {
+    uint32_t old_state_hash = cpu->state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 4, data, cpu->tlb_shift_read);
     if (cpu_load_seg_value_mov(DS, data))
         EXCEP();
     cpu_read32(linaddr, data, cpu->tlb_shift_read);
     R32(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, old_state_hash);
 }
 OPTYPE op_les_r16e16(struct decoded_instruction* i)
 {
+    uint32_t old_state_hash = cpu->state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 2, data, cpu->tlb_shift_read);
     if (cpu_load_seg_value_mov(ES, data))
         EXCEP();
     cpu_read16(linaddr, data, cpu->tlb_shift_read);
     R16(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, old_state_hash);
 }
 OPTYPE op_les_r32e32(struct decoded_instruction* i)
 {
+    uint32_t old_state_hash = cpu->state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 4, data, cpu->tlb_shift_read);
     if (cpu_load_seg_value_mov(ES, data))
         EXCEP();
     cpu_read32(linaddr, data, cpu->tlb_shift_read);
     R32(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, old_state_hash);
 }
 OPTYPE op_lss_r16e16(struct decoded_instruction* i)
 {
+    uint32_t old_state_hash = cpu->state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 2, data, cpu->tlb_shift_read);
     if (cpu_load_seg_value_mov(SS, data))
         EXCEP();
     cpu_read16(linaddr, data, cpu->tlb_shift_read);
     R16(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, old_state_hash);
 }
 OPTYPE op_lss_r32e32(struct decoded_instruction* i)
 {
+    uint32_t old_state_hash = cpu->state_hash;
     uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), data;
     cpu_read16(linaddr + 4, data, cpu->tlb_shift_read);
     if (cpu_load_seg_value_mov(SS, data))
         EXCEP();
     cpu_read32(linaddr, data, cpu->tlb_shift_read);
     R32(I_REG(flags)) = data;
-    NEXT(flags);
+    NEXT_SEG(flags, old_state_hash);
 }
 OPTYPE op_lfs_r16e16(struct decoded_instruction* i)
 {
@@ -1972,15 +2116,23 @@ OPTYPE op_xchg_r8e8(struct decoded_instruction* i)
     int tlb_info = cpu->tlb_tags[linaddr >> 12];
     uint8_t* ptr;
     if (TLB_ENTRY_INVALID8(linaddr, tlb_info, cpu->tlb_shift_write)) {
-        if (cpu_access_read8(linaddr, tlb_info, cpu->tlb_shift_write))
+        lock_bus(flags);
+        if (cpu_access_read8(linaddr, tlb_info, cpu->tlb_shift_write)) {
+            unlock_bus(flags);
             EXCEP();
+        }
         UNUSED2(cpu_access_write8(linaddr, R8(I_REG(flags)), tlb_info, cpu->tlb_shift_write));
+        unlock_bus(flags);
         R8(I_REG(flags)) = cpu->read_result;
     } else {
         ptr = cpu->tlb[linaddr >> 12] + linaddr;
-        uint8_t tmp = *ptr;
-        *ptr = R8(I_REG(flags));
-        R8(I_REG(flags)) = tmp;
+        if (flags & I_LOCK)
+            R8(I_REG(flags)) = __atomic_exchange_n(ptr, R8(I_REG(flags)), __ATOMIC_SEQ_CST);
+        else {
+            uint8_t tmp = *ptr;
+            *ptr = R8(I_REG(flags));
+            R8(I_REG(flags)) = tmp;
+        }
     }
     NEXT(flags);
 }
@@ -1991,15 +2143,23 @@ OPTYPE op_xchg_r16e16(struct decoded_instruction* i)
     uint16_t* ptr;
     if (TLB_ENTRY_INVALID16(linaddr, tlb_info, cpu->tlb_shift_write)) {
         tlb_info >>= cpu->tlb_shift_write;
-        if (cpu_access_read16(linaddr, tlb_info, cpu->tlb_shift_write))
+        lock_bus(flags);
+        if (cpu_access_read16(linaddr, tlb_info, cpu->tlb_shift_write)) {
+            unlock_bus(flags);
             EXCEP();
+        }
         UNUSED2(cpu_access_write16(linaddr, R16(I_REG(flags)), tlb_info, cpu->tlb_shift_write));
+        unlock_bus(flags);
         R16(I_REG(flags)) = cpu->read_result;
     } else {
         ptr = cpu->tlb[linaddr >> 12] + linaddr;
-        uint16_t tmp = *ptr;
-        *ptr = R16(I_REG(flags));
-        R16(I_REG(flags)) = tmp;
+        if (flags & I_LOCK)
+            R16(I_REG(flags)) = __atomic_exchange_n(ptr, R16(I_REG(flags)), __ATOMIC_SEQ_CST);
+        else {
+            uint16_t tmp = *ptr;
+            *ptr = R16(I_REG(flags));
+            R16(I_REG(flags)) = tmp;
+        }
     }
     NEXT(flags);
 }
@@ -2010,15 +2170,23 @@ OPTYPE op_xchg_r32e32(struct decoded_instruction* i)
     uint32_t* ptr;
     if (TLB_ENTRY_INVALID32(linaddr, tlb_info, cpu->tlb_shift_write)) {
         tlb_info >>= cpu->tlb_shift_write;
-        if (cpu_access_read32(linaddr, tlb_info, cpu->tlb_shift_write))
+        lock_bus(flags);
+        if (cpu_access_read32(linaddr, tlb_info, cpu->tlb_shift_write)) {
+            unlock_bus(flags);
             EXCEP();
+        }
         UNUSED2(cpu_access_write32(linaddr, R32(I_REG(flags)), tlb_info, cpu->tlb_shift_write));
+        unlock_bus(flags);
         R32(I_REG(flags)) = cpu->read_result;
     } else {
         ptr = cpu->tlb[linaddr >> 12] + linaddr;
-        uint32_t tmp = *ptr;
-        *ptr = R32(I_REG(flags));
-        R32(I_REG(flags)) = tmp;
+        if (flags & I_LOCK)
+            R32(I_REG(flags)) = __atomic_exchange_n(ptr, R32(I_REG(flags)), __ATOMIC_SEQ_CST);
+        else {
+            uint32_t tmp = *ptr;
+            *ptr = R32(I_REG(flags));
+            R32(I_REG(flags)) = tmp;
+        }
     }
     NEXT(flags);
 }
@@ -2052,9 +2220,11 @@ OPTYPE op_cmpxchg_e32r32(struct decoded_instruction* i)
 {
     arith_rmw2(32, cpu_cmpxchg32, R32(I_REG(flags)));
 }
-OPTYPE op_cmpxchg8b_e32(struct decoded_instruction* i)
+#undef EXCEPTION_HANDLER
+#define EXCEPTION_HANDLER return 1
+static int cmpxchg8b(uint32_t linaddr)
 {
-    uint32_t flags = i->flags, low64, high64, linaddr = cpu_get_linaddr(flags, i);
+    uint32_t low64, high64;
     cpu_read32(linaddr, low64, cpu->tlb_shift_write);
     cpu_read32(linaddr + 4, high64, cpu->tlb_shift_write);
     if (cpu->reg32[EAX] == low64 && cpu->reg32[EDX] == high64) {
@@ -2066,6 +2236,35 @@ OPTYPE op_cmpxchg8b_e32(struct decoded_instruction* i)
         cpu->reg32[EAX] = low64;
         cpu->reg32[EDX] = high64;
     }
+    return 0;
+}
+#undef EXCEPTION_HANDLER
+#define EXCEPTION_HANDLER EXCEP()
+OPTYPE op_cmpxchg8b_e32(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), tag = cpu->tlb_tags[linaddr >> 12];
+    if (!(flags & I_LOCK)) {
+        if (cmpxchg8b(linaddr))
+            EXCEP();
+    } else if (!(linaddr & 7) && !TLB_ENTRY_INVALID32(linaddr, tag, cpu->tlb_shift_write)) {
+        // Both halves are in the same page, so one compare-and-swap does it
+        uint64_t* ptr = cpu->tlb[linaddr >> 12] + linaddr;
+        uint64_t expected = (uint64_t)cpu->reg32[EDX] << 32 | cpu->reg32[EAX];
+        uint64_t desired = (uint64_t)cpu->reg32[ECX] << 32 | cpu->reg32[EBX];
+        if (__atomic_compare_exchange_n(ptr, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            cpu_set_zf(1);
+        else {
+            cpu_set_zf(0);
+            cpu->reg32[EAX] = expected;
+            cpu->reg32[EDX] = expected >> 32;
+        }
+    } else {
+        cpu_smp_lock_bus();
+        int fault = cmpxchg8b(linaddr);
+        cpu_smp_unlock_bus();
+        if (fault)
+            EXCEP();
+    }
     NEXT(flags);
 }
 
@@ -2460,7 +2659,7 @@ OPTYPE op_wrmsr(struct decoded_instruction* i)
 OPTYPE op_rdtsc(struct decoded_instruction* i)
 {
     if (!(cpu->cr[4] & CR4_TSD) || (cpu->cpl == 0) || !(cpu->cr[0] & CR0_PE)) {
-        uint64_t tsc = cpu_get_cycles() - cpu->tsc_fudge;
+        uint64_t tsc = cpu_get_tsc();
         cpu->reg32[EAX] = tsc;
         cpu->reg32[EDX] = tsc >> 32;
 //cpu->reg32[EAX] = cpu->cycles & 0xFFFFFFFF;
@@ -3050,6 +3249,33 @@ OPTYPE op_bswap_r32(struct decoded_instruction* i)
     R32(I_RM(flags)) = reg;
     NEXT(flags);
 }
+OPTYPE op_movbe_r16e16(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i);
+    uint16_t src;
+    cpu_read16(linaddr, src, cpu->tlb_shift_read);
+    R16(I_REG(flags)) = src << 8 | src >> 8;
+    NEXT(flags);
+}
+OPTYPE op_movbe_r32e32(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), src;
+    cpu_read32(linaddr, src, cpu->tlb_shift_read);
+    R32(I_REG(flags)) = (src & 0xFF) << 24 | (src & 0xFF00) << 8 | (src & 0xFF0000) >> 8 | src >> 24;
+    NEXT(flags);
+}
+OPTYPE op_movbe_e16r16(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), src = R16(I_REG(flags));
+    cpu_write16(linaddr, src << 8 | src >> 8, cpu->tlb_shift_write);
+    NEXT(flags);
+}
+OPTYPE op_movbe_e32r32(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, linaddr = cpu_get_linaddr(flags, i), src = R32(I_REG(flags));
+    cpu_write32(linaddr, (src & 0xFF) << 24 | (src & 0xFF00) << 8 | (src & 0xFF0000) >> 8 | src >> 24, cpu->tlb_shift_write);
+    NEXT(flags);
+}
 
 OPTYPE op_fpu_mem(struct decoded_instruction* i)
 {
@@ -3101,6 +3327,14 @@ OPTYPE op_sse_6638(struct decoded_instruction* i){
     if(execute_660F38(i)) EXCEP();
     NEXT(i->flags);
 }
+OPTYPE op_sse_3A(struct decoded_instruction* i){
+    if(execute_0F3A(i)) EXCEP();
+    NEXT(i->flags);
+}
+OPTYPE op_sse_663A(struct decoded_instruction* i){
+    if(execute_660F3A(i)) EXCEP();
+    NEXT(i->flags);
+}
 OPTYPE op_sse_50_57(struct decoded_instruction* i){
     if(execute_0F50_57(i)) EXCEP();
     NEXT(i->flags);
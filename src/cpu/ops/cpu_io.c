@@ -45,8 +45,14 @@ int cpu_io_check_access(uint32_t port, int size)
     return 0;
 }
 
+// The devices belong to the machine's thread, so an application processor that runs on a thread of its own hands its
+// port accesses over to it (see smp.c)
 void cpu_outb(uint32_t port, uint32_t data)
 {
+    if (CPU_ON_AP_THREAD()) {
+        cpu_smp_request(SMP_OUTB, port, data, 0);
+        return;
+    }
 #ifdef INSTRUMENT
     cpu_instrument_io_write(port, data, 1);
 #endif
@@ -54,6 +60,10 @@ void cpu_outb(uint32_t port, uint32_t data)
 }
 void cpu_outw(uint32_t port, uint32_t data)
 {
+    if (CPU_ON_AP_THREAD()) {
+        cpu_smp_request(SMP_OUTW, port, data, 0);
+        return;
+    }
 #ifdef INSTRUMENT
     cpu_instrument_io_write(port, data, 2);
 #endif
@@ -61,6 +71,10 @@ void cpu_outw(uint32_t port, uint32_t data)
 }
 void cpu_outd(uint32_t port, uint32_t data)
 {
+    if (CPU_ON_AP_THREAD()) {
+        cpu_smp_request(SMP_OUTD, port, data, 0);
+        return;
+    }
 #ifdef INSTRUMENT
     cpu_instrument_io_write(port, data, 4);
 #endif
@@ -69,6 +83,8 @@ void cpu_outd(uint32_t port, uint32_t data)
 
 uint32_t cpu_inb(uint32_t port)
 {
+    if (CPU_ON_AP_THREAD())
+        return cpu_smp_request(SMP_INB, port, 0, 0);
     uint8_t result = io_readb(port);
 #ifdef INSTRUMENT
     cpu_instrument_io_read(port, result, 1);
@@ -77,6 +93,8 @@ uint32_t cpu_inb(uint32_t port)
 }
 uint32_t cpu_inw(uint32_t port)
 {
+    if (CPU_ON_AP_THREAD())
+        return cpu_smp_request(SMP_INW, port, 0, 0);
     uint16_t result = io_readw(port);
 #ifdef INSTRUMENT
     cpu_instrument_io_read(port, result, 2);
@@ -85,6 +103,8 @@ uint32_t cpu_inw(uint32_t port)
 }
 uint32_t cpu_ind(uint32_t port)
 {
+    if (CPU_ON_AP_THREAD())
+        return cpu_smp_request(SMP_IND, port, 0, 0);
     uint32_t result = io_readd(port);
 #ifdef INSTRUMENT
     cpu_instrument_io_read(port, result, 4);
@@ -25,7 +25,7 @@ static const int cpl_to_TLB_write[4] = {
 
 // These are utilities to handle the stack quickly. Note that the values are only used every instruction
 // This is useful because typically these instructions push/pop a lot of information on/off the stack
-struct
+MACHINE_LOCAL struct
 {
     uint32_t esp; // The value of ESP itself
     int esp_aligned; // Is ESP aligned to 2/4-byte boundary?
@@ -365,6 +365,7 @@ static int do_task_switch(int sel, struct seg_desc* info, int type, int eip)
                 cpu->seg_base[i] = 0;
                 cpu->seg_limit[i] = 0;
                 cpu->seg_access[i] = 0;
+                cpu_seg_update_flat();
                 continue;
             }
             if (cpu_seg_load_descriptor(sel, &seg_info, EX_TS, sel_offs))
@@ -646,6 +647,7 @@ int cpu_interrupt(int vector, int error_code, int type, int eip_to_push)
                         cpu->seg_limit[ES] = 0;
                         cpu->seg_base[ES] = 0;
                         cpu->seg_access[ES] = 0;
+                        cpu_seg_update_flat();
                     }
                     push32(old_ss);
                     push32(old_esp);
@@ -680,6 +682,7 @@ int cpu_interrupt(int vector, int error_code, int type, int eip_to_push)
                         cpu->seg_limit[ES] = 0;
                         cpu->seg_base[ES] = 0;
                         cpu->seg_access[ES] = 0;
+                        cpu_seg_update_flat();
                     }
                     push16(old_ss);
                     push16(old_esp);
@@ -758,7 +761,7 @@ int cpu_interrupt(int vector, int error_code, int type, int eip_to_push)
     }
 }
 
-static int current_exception = -1;
+static MACHINE_LOCAL int current_exception = -1;
 void cpu_exception(int vec, int code)
 {
     while (1) {
@@ -1179,6 +1182,7 @@ static void iret_handle_seg(int x)
         cpu->seg_base[x] = 0;
         cpu->seg_limit[x] = 0;
         cpu->seg_valid[x] = 0;
+        cpu_seg_update_flat();
     }
 }
 
@@ -1611,6 +1615,7 @@ int sysenter(void)
     cpu->seg_limit[SS] = -1;
     cpu->seg_access[SS] = ACCESS_S | 0x03 | ACCESS_P | ACCESS_G | ACCESS_B; // 32-bit, r/x data, accessed, present, 4kb granularity, 32-bit
     cpu->esp_mask = -1;
+    cpu_seg_update_flat();
 
     reload_cs_base();
     return 0;
@@ -1638,6 +1643,7 @@ int sysexit(void)
     cpu->seg_limit[SS] = -1;
     cpu->seg_access[SS] = ACCESS_S | 0x03 | ACCESS_P | ACCESS_G | ACCESS_B | ACCESS_DPL_MASK; // 32-bit, r/x data, accessed, present, 4kb granularity, 32-bit, dpl=3
     cpu->esp_mask = -1;
+    cpu_seg_update_flat();
 
     reload_cs_base();
     return 0;
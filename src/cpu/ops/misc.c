@@ -1,6 +1,7 @@
 // Miscellaneous operations
 #include "cpu/cpu.h"
 #include "cpuapi.h"
+#include "devices.h"
 #ifdef INSTRUMENT
 #include "cpu/instrument.h"
 #endif
@@ -17,7 +18,7 @@
 //#define CORE_DUO_SUPPORT
 // Uncomment this to make the CPU pretend it's an Intel Atom N270
 #define ATOM_N270_SUPPORT
-static int winnt_limit_cpuid;
+static MACHINE_LOCAL int winnt_limit_cpuid;
 
 // Sets CPUID information. Currently unimplemented
 int cpu_set_cpuid(struct cpu_config* x)
@@ -25,6 +26,11 @@ int cpu_set_cpuid(struct cpu_config* x)
     winnt_limit_cpuid = x->cpuid_limit_winnt;
     return 0;
 }
+// For the threads of the application processors, which have to be given the same settings (see smp.c)
+int cpu_get_cpuid_limit_winnt(void)
+{
+    return winnt_limit_cpuid;
+}
 
 void cpuid(void)
 {
@@ -49,17 +55,17 @@ void cpuid(void)
     case 1:
 #ifdef P4_SUPPORT
         cpu->reg32[EAX] = 0x00000f12;
-        cpu->reg32[ECX] = 0;
+        cpu->reg32[ECX] = cpu_apic_connected() << 24;
         cpu->reg32[EDX] = 0x1febfbff | cpu_apic_connected() << 9;
         cpu->reg32[EBX] = 0x00010800;
 #elif defined(CORE_DUO_SUPPORT)
         cpu->reg32[EAX] = 0x000006EC;
-        cpu->reg32[ECX] = 0xC189;
+        cpu->reg32[ECX] = 0xC189 | cpu_apic_connected() << 24;
         cpu->reg32[EDX] = 0x9febf9ff | cpu_apic_connected() << 9;
         cpu->reg32[EBX] = 0x00010800;
 #elif defined(ATOM_N270_SUPPORT)
         cpu->reg32[EAX] = 0x000106C2;
-        cpu->reg32[ECX] = 0x40C39D;
+        cpu->reg32[ECX] = 0x48C39D | cpu_apic_connected() << 24; // Bit 19: SSE4.1, Bit 24: TSC-deadline
         cpu->reg32[EDX] = 0xBFEBF9FF | cpu_apic_connected() << 9;
         cpu->reg32[EBX] = 0x00010800;
 #elif defined (I486_SUPPORT)
@@ -69,10 +75,11 @@ void cpuid(void)
         cpu->reg32[EBX] = 0;
 #else
         cpu->reg32[EAX] = 0x000006a0;
-        cpu->reg32[ECX] = 0;
+        cpu->reg32[ECX] = cpu_apic_connected() << 24;
         cpu->reg32[EDX] = 0x1842c1bf | cpu_apic_connected() << 9;
         cpu->reg32[EBX] = 0x00010000;
 #endif
+        cpu->reg32[EBX] |= cpu->id << 24; // Initial APIC ID
         break;
 #ifndef I486_SUPPORT
     case 2:
@@ -303,7 +310,12 @@ int rdmsr(uint32_t index, uint32_t* high, uint32_t* low)
         value = 0x508;
         break;
     case 0x10:
-        value = cpu_get_cycles() - cpu->tsc_fudge;
+        value = cpu_get_tsc();
+        break;
+    case 0x6E0: // IA32_TSC_DEADLINE
+        if (!cpu_apic_connected())
+            EXCEPTION_GP(0);
+        value = CPU_ON_AP_THREAD() ? cpu_smp_request(SMP_GET_TSC_DEADLINE, 0, 0, 0) : apic_get_tsc_deadline();
         break;
     case 0xc0000080:
         value = cpu->ia32_efer;
@@ -361,6 +373,14 @@ int wrmsr(uint32_t index, uint32_t high, uint32_t low)
     case 0x10:
         cpu->tsc_fudge = cpu_get_cycles() - msr_value;
         break;
+    case 0x6E0: // IA32_TSC_DEADLINE
+        if (!cpu_apic_connected())
+            EXCEPTION_GP(0);
+        if (CPU_ON_AP_THREAD())
+            cpu_smp_request(SMP_SET_TSC_DEADLINE, low, high, 0);
+        else
+            apic_set_tsc_deadline(msr_value);
+        break;
     case 0xc0000080: // https://wiki.osdev.org/CPU_Registers_x86-64#IA32_EFER
         cpu->ia32_efer = msr_value;
         break;
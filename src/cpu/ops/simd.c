@@ -10,12 +10,27 @@
 #include <string.h>
 #define EXCEPTION_HANDLER return 1
 
+// If the host has SSE2, most packed operations are done with the same instruction on the host
+#if defined(__SSE2__) && defined(__GNUC__)
+#define HOST_SSE2
+#include <emmintrin.h>
+#endif
+// SSSE3 and SSE4.1 operations also use the host instructions if the emulator is built for a CPU that has them
+#if defined(HOST_SSE2) && defined(__SSSE3__)
+#define HOST_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(HOST_SSE2) && defined(__SSE4_1__)
+#define HOST_SSE41
+#include <smmintrin.h>
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Floating point routines
 ///////////////////////////////////////////////////////////////////////////////
 #include "softfloat/softfloat-compare.h"
 #include "softfloat/softfloat.h"
-static float_status_t status;
+static MACHINE_LOCAL float_status_t status;
 
 // Raise an exception if SSE is not enabled
 int cpu_sse_exception(void)
@@ -87,6 +102,78 @@ int cpu_sse_handle_exceptions(void)
     return 0;
 }
 
+enum {
+    HOST_ADD,
+    HOST_SUB,
+    HOST_MUL,
+    HOST_DIV,
+    HOST_MIN,
+    HOST_MAX,
+    HOST_SQRT // dest = sqrt(src)
+};
+
+#ifdef HOST_SSE2
+// Packed float operations run on the host if the guest MXCSR has the default settings (round to nearest, all exceptions
+// masked, no DAZ or FTZ). The results are then the same as on real hardware, and only the exception flags need to be
+// copied back. Otherwise, SoftFloat is used.
+#define MXCSR_DEFAULT 0x1F80
+static inline int host_sse_usable(void)
+{
+    return (cpu->mxcsr & ~0x3F) == MXCSR_DEFAULT;
+}
+
+// host_ps(dest, src, op) does "op" on dest and src, and returns 0 if SoftFloat has to do it instead. The scalar versions
+// only read 4 (host_ss) or 8 (host_sd) bytes from src. The empty asm statements keep the compiler from moving the operation
+// across the MXCSR accesses.
+#define HOST_SSE_OP(name, type, packed, suffix, load_src, sqrt) \
+    static inline int name(void* dest, void* src, int op)       \
+    {                                                           \
+        if (!host_sse_usable())                                 \
+            return 0;                                           \
+        type a = _mm_loadu_##packed(dest), b = load_src(src);   \
+        unsigned int csr = MXCSR_DEFAULT;                       \
+        __asm__ volatile("ldmxcsr %0" ::"m"(csr));              \
+        __asm__ volatile("" : "+x"(a), "+x"(b));                \
+        switch (op) {                                           \
+        case HOST_ADD:                                          \
+            a = _mm_add_##suffix(a, b);                         \
+            break;                                              \
+        case HOST_SUB:                                          \
+            a = _mm_sub_##suffix(a, b);                         \
+            break;                                              \
+        case HOST_MUL:                                          \
+            a = _mm_mul_##suffix(a, b);                         \
+            break;                                              \
+        case HOST_DIV:                                          \
+            a = _mm_div_##suffix(a, b);                         \
+            break;                                              \
+        case HOST_MIN:                                          \
+            a = _mm_min_##suffix(a, b);                         \
+            break;                                              \
+        case HOST_MAX:                                          \
+            a = _mm_max_##suffix(a, b);                         \
+            break;                                              \
+        case HOST_SQRT:                                         \
+            a = sqrt;                                           \
+            break;                                              \
+        }                                                       \
+        __asm__ volatile("" : "+x"(a));                         \
+        __asm__ volatile("stmxcsr %0" : "=m"(csr));             \
+        cpu->mxcsr |= csr & 0x3F;                               \
+        _mm_storeu_##packed(dest, a);                           \
+        return 1;                                               \
+    }
+HOST_SSE_OP(host_ps, __m128, ps, ps, _mm_loadu_ps, _mm_sqrt_ps(b))
+HOST_SSE_OP(host_ss, __m128, ps, ss, _mm_load_ss, _mm_move_ss(a, _mm_sqrt_ss(b)))
+HOST_SSE_OP(host_pd, __m128d, pd, pd, _mm_loadu_pd, _mm_sqrt_pd(b))
+HOST_SSE_OP(host_sd, __m128d, pd, sd, _mm_load_sd, _mm_sqrt_sd(a, b))
+#else
+#define host_ps(dest, src, op) 0
+#define host_ss(dest, src, op) 0
+#define host_pd(dest, src, op) 0
+#define host_sd(dest, src, op) 0
+#endif
+
 #define MM32(n) fpu.mm[n].reg.r32[0]
 
 #define FAST_BRANCHLESS_MASK(addr, i) (addr & ((i << 12 & 65536) - 1))
@@ -104,13 +191,13 @@ static inline uint32_t cpu_get_linaddr(uint32_t i, struct decoded_instruction* j
 
 // A temporary "data cache" that holds read data/write data to be flushed out to regular RAM.
 // Note that this isn't much of a cache since it only holds 16 bytes and is not preserved across instruction boundaries
-union {
+MACHINE_LOCAL union {
     uint32_t d32;
     uint32_t d64[2];
     uint32_t d128[4];
 } temp;
-static void* result_ptr;
-static int write_back, write_back_dwords, write_back_linaddr;
+static MACHINE_LOCAL void* result_ptr;
+static MACHINE_LOCAL int write_back, write_back_dwords, write_back_linaddr;
 
 // Flush data in temp.d128 back out to memory. This is required if write_back == 1
 static int write_back_handler(void)
@@ -143,10 +230,10 @@ static int get_read_ptr(uint32_t flags, struct decoded_instruction* i, int dword
     }
 
     uint32_t* host_ptr = cpu->tlb[linaddr >> 12] + linaddr;
-    uint32_t phys = PTR_TO_PHYS(host_ptr);
+    uint32_t phys = TLB_PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu->memory_size)) {
         for (int i = 0, j = 0; i < dwords; i++, j += 4)
-            temp.d128[i] = io_handle_mmio_read(phys + j, 2);
+            temp.d128[i] = cpu_mmio_read(phys + j, 2);
         result_ptr = temp.d128;
         write_back_dwords = dwords;
         write_back_linaddr = linaddr;
@@ -175,7 +262,7 @@ static int get_write_ptr(uint32_t flags, struct decoded_instruction* i, int dwor
     }
 
     uint32_t* host_ptr = cpu->tlb[linaddr >> 12] + linaddr;
-    uint32_t phys = PTR_TO_PHYS(host_ptr);
+    uint32_t phys = TLB_PTR_TO_PHYS(host_ptr);
     if ((phys >= 0xA0000 && phys < 0xC0000) || (phys >= cpu->memory_size)) {
         write_back = 1;
         result_ptr = temp.d128;
@@ -183,6 +270,9 @@ static int get_write_ptr(uint32_t flags, struct decoded_instruction* i, int dwor
         write_back_linaddr = linaddr;
         return 0;
     }
+    // Writes through host_ptr bypass access.c, so record the page here
+    if (cpu_dirty_mark(phys))
+        cpu_mmu_tlb_invalidate(linaddr);
     write_back = 0;
     result_ptr = host_ptr;
     return 0;
@@ -258,8 +348,78 @@ static void* get_reg_dest(int x)
     return &cpu->reg32[x];
 }
 
+#ifdef HOST_SSE2
+// Runs a two operand SSE2 instruction on an MMX (8 bytes) or SSE (16 bytes) register, and returns from the function
+#define HOST_SSE2_OP(dest, src, bytes, intrinsic)                                                                       \
+    do {                                                                                                                 \
+        if ((bytes) == 16)                                                                                               \
+            _mm_storeu_si128((__m128i*)(dest), intrinsic(_mm_loadu_si128((__m128i*)(dest)), _mm_loadu_si128((__m128i*)(src)))); \
+        else                                                                                                             \
+            _mm_storel_epi64((__m128i*)(dest), intrinsic(_mm_loadl_epi64((__m128i*)(dest)), _mm_loadl_epi64((__m128i*)(src)))); \
+        return;                                                                                                          \
+    } while (0)
+// Same, but for the pack instructions. The MMX versions need both operands in one register, since the result from dest
+// goes in the low half and the result from src in the high half.
+#define HOST_SSE2_PACK(dest, src, bytes, intrinsic)                                                                     \
+    do {                                                                                                                 \
+        if ((bytes) == 16)                                                                                               \
+            _mm_storeu_si128((__m128i*)(dest), intrinsic(_mm_loadu_si128((__m128i*)(dest)), _mm_loadu_si128((__m128i*)(src)))); \
+        else {                                                                                                           \
+            __m128i both = _mm_unpacklo_epi64(_mm_loadl_epi64((__m128i*)(dest)), _mm_loadl_epi64((__m128i*)(src)));    \
+            _mm_storel_epi64((__m128i*)(dest), intrinsic(both, both));                                                   \
+        }                                                                                                                \
+        return;                                                                                                          \
+    } while (0)
+
+// Same, but for operations with one operand
+#define HOST_SSE2_OP1(dest, src, bytes, intrinsic)                                                   \
+    do {                                                                                             \
+        if ((bytes) == 16)                                                                           \
+            _mm_storeu_si128((__m128i*)(dest), intrinsic(_mm_loadu_si128((__m128i*)(src))));         \
+        else                                                                                         \
+            _mm_storel_epi64((__m128i*)(dest), intrinsic(_mm_loadl_epi64((__m128i*)(src))));         \
+        return;                                                                                      \
+    } while (0)
+
+static inline __m128i host_unpacklo(__m128i a, __m128i b, int copysize)
+{
+    switch (copysize) {
+    case 1:
+        return _mm_unpacklo_epi8(a, b);
+    case 2:
+        return _mm_unpacklo_epi16(a, b);
+    case 4:
+        return _mm_unpacklo_epi32(a, b);
+    default:
+        return _mm_unpacklo_epi64(a, b);
+    }
+}
+#endif
+
 static void punpckh(void* dst, void* src, int size, int copysize)
 {
+#ifdef HOST_SSE2
+    // The MMX versions interleave the upper halves of 8 byte registers
+    if (size == 16) {
+        __m128i a = _mm_loadu_si128(dst), b = _mm_loadu_si128(src);
+        switch (copysize) {
+        case 1:
+            a = _mm_unpackhi_epi8(a, b);
+            break;
+        case 2:
+            a = _mm_unpackhi_epi16(a, b);
+            break;
+        case 4:
+            a = _mm_unpackhi_epi32(a, b);
+            break;
+        default:
+            a = _mm_unpackhi_epi64(a, b);
+            break;
+        }
+        _mm_storeu_si128(dst, a);
+    } else
+        _mm_storel_epi64(dst, host_unpacklo(_mm_srli_epi64(_mm_loadl_epi64(dst), 32), _mm_srli_epi64(_mm_loadl_epi64(src), 32), copysize));
+#else
     // XXX -- make this faster
     // too many xors
     uint8_t *dst8 = dst, *src8 = src, tmp[16];
@@ -273,6 +433,7 @@ static void punpckh(void* dst, void* src, int size, int copysize)
         nidx += copysize;
     }
     memcpy(dst, tmp, size);
+#endif
 }
 static inline uint16_t pack_i32_to_i16(uint32_t x)
 {
@@ -289,7 +450,7 @@ static inline uint16_t pack_i32_to_i16(uint32_t x)
     }
     return x;
 }
-static uint16_t pack_i16_to_u8(int16_t x)
+static inline uint16_t pack_i16_to_u8(int16_t x)
 {
     if (x >= 0xFF)
         return 0xFF;
@@ -313,6 +474,9 @@ static inline uint8_t pack_i16_to_i8(uint16_t x)
 }
 static void packssdw(void* dest, void* src, int dwordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_PACK(dest, src, dwordcount << 2, _mm_packs_epi32);
+#else
     uint16_t res[8];
     uint32_t *dest32 = dest, *src32 = src;
     for (int i = 0; i < dwordcount; i++) {
@@ -320,9 +484,16 @@ static void packssdw(void* dest, void* src, int dwordcount)
         res[i | dwordcount] = pack_i32_to_i16(src32[i]);
     }
     memcpy(dest, res, dwordcount << 2);
+#endif
 }
 static void punpckl(void* dst, void* src, int size, int copysize)
 {
+#ifdef HOST_SSE2
+    if (size == 16)
+        _mm_storeu_si128(dst, host_unpacklo(_mm_loadu_si128(dst), _mm_loadu_si128(src), copysize));
+    else
+        _mm_storel_epi64(dst, host_unpacklo(_mm_loadl_epi64(dst), _mm_loadl_epi64(src), copysize));
+#else
     // XXX -- make this faster
     uint8_t *dst8 = dst, *src8 = src, tmp[16];
     int idx = 0, nidx = 0, xor = copysize - 1;
@@ -337,9 +508,13 @@ static void punpckl(void* dst, void* src, int size, int copysize)
         nidx += copysize;
     }
     memcpy(dst, tmp, size);
+#endif
 }
 static void psubsb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, bytecount, _mm_subs_epi8);
+#else
     for (int i = 0; i < bytecount; i++) {
         uint8_t x = dest[i], y = src[i], res = x - y;
         x = (x >> 7) + 0x7F;
@@ -347,9 +522,13 @@ static void psubsb(uint8_t* dest, uint8_t* src, int bytecount)
             res = x;
         dest[i] = res;
     }
+#endif
 }
 static void psubsw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_subs_epi16);
+#else
     for (int i = 0; i < wordcount; i++) {
         uint16_t x = dest[i], y = src[i], res = x - y;
         //printf("%x - %x = %x\n", x, y, res);
@@ -358,33 +537,53 @@ static void psubsw(uint16_t* dest, uint16_t* src, int wordcount)
             res = x;
         dest[i] = res;
     }
+#endif
 }
 static void pminub(uint8_t* dest, uint8_t* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, bytecount, _mm_min_epu8);
+#else
     for (int i = 0; i < bytecount; i++)
         if (src[i] < dest[i])
             dest[i] = src[i];
+#endif
 }
 static void pmaxub(uint8_t* dest, uint8_t* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, bytecount, _mm_max_epu8);
+#else
     for (int i = 0; i < bytecount; i++)
         if (dest[i] < src[i])
             dest[i] = src[i];
+#endif
 }
 static void pminsw(int16_t* dest, int16_t* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_min_epi16);
+#else
     for (int i = 0; i < wordcount; i++)
         if (src[i] < dest[i])
             dest[i] = src[i];
+#endif
 }
 static void pmaxsw(int16_t* dest, int16_t* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_max_epi16);
+#else
     for (int i = 0; i < wordcount; i++)
         if (src[i] > dest[i])
             dest[i] = src[i];
+#endif
 }
 static void paddsb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, bytecount, _mm_adds_epi8);
+#else
     // https://locklessinc.com/articles/sat_arithmetic/
     for (int i = 0; i < bytecount; i++) {
         uint8_t x = dest[i], y = src[i], res = x + y;
@@ -393,9 +592,13 @@ static void paddsb(uint8_t* dest, uint8_t* src, int bytecount)
             res = x;
         dest[i] = res;
     }
+#endif
 }
 static void paddsw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_adds_epi16);
+#else
     for (int i = 0; i < wordcount; i++) {
         uint16_t x = dest[i], y = src[i], res = x + y;
         x = (x >> 15) + 0x7FFF;
@@ -403,6 +606,7 @@ static void paddsw(uint16_t* dest, uint16_t* src, int wordcount)
             res = x;
         dest[i] = res;
     }
+#endif
 }
 static void pshuf(void* dest, void* src, int imm, int shift)
 {
@@ -431,6 +635,10 @@ static void pshuf(void* dest, void* src, int imm, int shift)
 // Not the same as pshuf
 static void pshufb(void* dest, void* src, int bytes)
 {
+#ifdef HOST_SSSE3
+    if (bytes == 16)
+        HOST_SSE2_OP(dest, src, 16, _mm_shuffle_epi8);
+#endif
     int8_t* src8 = src;
     uint8_t res[16], *dest8 = dest;
     int mask = bytes - 1;
@@ -538,54 +746,81 @@ static void cpu_psrldq(uint64_t* a, int shift, int mask)
 }
 static void pcmpeqb(uint8_t* dest, uint8_t* src, int count)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, count, _mm_cmpeq_epi8);
+#else
     for (int i = 0; i < count; i++)
         if (src[i] == dest[i])
             dest[i] = 0xFF;
         else
             dest[i] = 0;
+#endif
 }
 static void pcmpeqw(uint16_t* dest, uint16_t* src, int count)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, count << 1, _mm_cmpeq_epi16);
+#else
     for (int i = 0; i < count; i++)
         if (src[i] == dest[i])
             dest[i] = 0xFFFF;
         else
             dest[i] = 0;
+#endif
 }
 static void pcmpeqd(uint32_t* dest, uint32_t* src, int count)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, count << 2, _mm_cmpeq_epi32);
+#else
     for (int i = 0; i < count; i++)
         if (src[i] == dest[i])
             dest[i] = 0xFFFFFFFF;
         else
             dest[i] = 0;
+#endif
 }
 static void pcmpgtb(int8_t* dest, int8_t* src, int count)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, count, _mm_cmpgt_epi8);
+#else
     for (int i = 0; i < count; i++)
         if (dest[i] > src[i])
             dest[i] = 0xFF;
         else
             dest[i] = 0;
+#endif
 }
 static void pcmpgtw(int16_t* dest, int16_t* src, int count)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, count << 1, _mm_cmpgt_epi16);
+#else
     for (int i = 0; i < count; i++)
         if (dest[i] > src[i])
             dest[i] = 0xFFFF;
         else
             dest[i] = 0;
+#endif
 }
 static void pcmpgtd(int32_t* dest, int32_t* src, int count)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, count << 2, _mm_cmpgt_epi32);
+#else
     for (int i = 0; i < count; i++)
         if (dest[i] > src[i])
             dest[i] = 0xFFFFFFFF;
         else
             dest[i] = 0;
+#endif
 }
 static void packuswb(void* dest, void* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_PACK(dest, src, wordcount << 1, _mm_packus_epi16);
+#else
     uint8_t res[16];
     uint16_t *dest16 = dest, *src16 = src;
     for (int i = 0; i < wordcount; i++) {
@@ -593,9 +828,13 @@ static void packuswb(void* dest, void* src, int wordcount)
         res[i | wordcount] = pack_i16_to_u8(src16[i]);
     }
     memcpy(dest, res, wordcount << 1);
+#endif
 }
 static void packsswb(void* dest, void* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_PACK(dest, src, wordcount << 1, _mm_packs_epi16);
+#else
     uint8_t res[16];
     uint16_t *dest16 = dest, *src16 = src;
     for (int i = 0; i < wordcount; i++) {
@@ -603,129 +842,194 @@ static void packsswb(void* dest, void* src, int wordcount)
         res[i | wordcount] = pack_i16_to_i8(src16[i]);
     }
     memcpy(dest, res, wordcount << 1);
+#endif
 }
 static void pmullw(uint16_t* dest, uint16_t* src, int wordcount, int shift)
 {
+#ifdef HOST_SSE2
+    if (shift)
+        HOST_SSE2_OP(dest, src, wordcount << 1, _mm_mulhi_epi16);
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_mullo_epi16);
+#else
     for (int i = 0; i < wordcount; i++) {
         uint32_t result = (uint32_t)(int16_t)dest[i] * (uint32_t)(int16_t)src[i];
         dest[i] = result >> shift;
     }
+#endif
 }
 static void pmuluw(void* dest, void* src, int wordcount, int shift)
 {
+#ifdef HOST_SSE2
+    if (shift)
+        HOST_SSE2_OP(dest, src, wordcount << 1, _mm_mulhi_epu16);
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_mullo_epi16);
+#else
     uint16_t *dest16 = dest, *src16 = src;
     for (int i = 0; i < wordcount; i++) {
         uint32_t result = (uint32_t)dest16[i] * (uint32_t)src16[i];
         dest16[i] = result >> shift;
     }
+#endif
 }
 static void pmuludq(void* dest, void* src, int dwordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, dwordcount << 2, _mm_mul_epu32);
+#else
     uint32_t *dest32 = dest, *src32 = src;
     for (int i = 0; i < dwordcount; i += 2) {
         uint64_t result = (uint64_t)dest32[i] * (uint64_t)src32[i];
         dest32[i] = result;
         dest32[i + 1] = result >> 32L;
     }
+#endif
 }
 static int pmovmskb(uint8_t* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    return _mm_movemask_epi8(bytecount == 16 ? _mm_loadu_si128((__m128i*)src) : _mm_loadl_epi64((__m128i*)src));
+#else
     int dest = 0;
     for (int i = 0; i < bytecount; i++) {
         dest |= (src[i] >> 7) << i;
     }
     return dest;
+#endif
 }
 static void psubusb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, bytecount, _mm_subs_epu8);
+#else
     for (int i = 0; i < bytecount; i++) {
         uint8_t result = dest[i] - src[i];
         dest[i] = -(result <= dest[i]) & result;
     }
+#endif
 }
 static void psubusw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_subs_epu16);
+#else
     for (int i = 0; i < wordcount; i++) {
         uint16_t result = dest[i] - src[i];
         dest[i] = -(result <= dest[i]) & result;
     }
+#endif
 }
 static void paddusb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, bytecount, _mm_adds_epu8);
+#else
     for (int i = 0; i < bytecount; i++) {
         uint8_t result = dest[i] + src[i];
         dest[i] = -(result < dest[i]) | result;
     }
+#endif
 }
 static void paddusw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_adds_epu16);
+#else
     for (int i = 0; i < wordcount; i++) {
         uint16_t result = dest[i] + src[i];
         dest[i] = -(result < dest[i]) | result;
     }
+#endif
 }
 static void paddb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, bytecount, _mm_add_epi8);
+#else
     if (dest == src) // Faster alternative
         for (int i = 0; i < bytecount; i++)
             dest[i] <<= 1;
     else
         for (int i = 0; i < bytecount; i++)
             dest[i] += src[i];
+#endif
 }
 static void paddw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_add_epi16);
+#else
     if (dest == src)
         for (int i = 0; i < wordcount; i++)
             dest[i] <<= 1;
     else
         for (int i = 0; i < wordcount; i++)
             dest[i] += src[i];
+#endif
 }
 static void paddd(uint32_t* dest, uint32_t* src, int dwordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, dwordcount << 2, _mm_add_epi32);
+#else
     if (dest == src)
         for (int i = 0; i < dwordcount; i++)
             dest[i] <<= 1;
     else
         for (int i = 0; i < dwordcount; i++)
             dest[i] += src[i];
+#endif
 }
 static void psubb(uint8_t* dest, uint8_t* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, bytecount, _mm_sub_epi8);
+#else
     if (dest == src)
         for (int i = 0; i < bytecount; i++)
-            dest[i] >>= 1;
+            dest[i] = 0;
     else
         for (int i = 0; i < bytecount; i++)
             dest[i] -= src[i];
+#endif
 }
 static void psubw(uint16_t* dest, uint16_t* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_sub_epi16);
+#else
     if (dest == src)
         for (int i = 0; i < wordcount; i++)
-            dest[i] >>= 1;
+            dest[i] = 0;
     else
         for (int i = 0; i < wordcount; i++)
             dest[i] -= src[i];
+#endif
 }
 static void psubd(uint32_t* dest, uint32_t* src, int dwordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, dwordcount << 2, _mm_sub_epi32);
+#else
     if (dest == src)
         for (int i = 0; i < dwordcount; i++)
-            dest[i] >>= 1;
+            dest[i] = 0;
     else
         for (int i = 0; i < dwordcount; i++)
             dest[i] -= src[i];
+#endif
 }
 static void psubq(uint64_t* dest, uint64_t* src, int qwordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, qwordcount << 3, _mm_sub_epi64);
+#else
     if (dest == src)
         for (int i = 0; i < qwordcount; i++)
-            dest[i] >>= 1;
+            dest[i] = 0;
     else
         for (int i = 0; i < qwordcount; i++)
             dest[i] -= src[i];
+#endif
 }
 static uint32_t cmpps(float32 dest, float32 src, int cmp)
 {
@@ -802,18 +1106,29 @@ static void shufpd(void* dest, void* src, int imm)
 }
 static void pavgb(void* dest, void* src, int bytecount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, bytecount, _mm_avg_epu8);
+#else
     uint8_t *dest8 = dest, *src8 = src;
     for (int i = 0; i < bytecount; i++)
-        dest8[i] = (dest8[i] + src8[i]) >> 1;
+        dest8[i] = (dest8[i] + src8[i] + 1) >> 1;
+#endif
 }
 static void pavgw(void* dest, void* src, int wordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_avg_epu16);
+#else
     uint16_t *dest16 = dest, *src16 = src;
     for (int i = 0; i < wordcount; i++)
-        dest16[i] = (dest16[i] + src16[i]) >> 1;
+        dest16[i] = (dest16[i] + src16[i] + 1) >> 1;
+#endif
 }
 static void pmaddwd(void* dest, void* src, int dwordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, dwordcount << 2, _mm_madd_epi16);
+#else
     uint16_t *src16 = src, *dest16 = dest;
     uint32_t res[4];
     int idx = 0;
@@ -823,9 +1138,13 @@ static void pmaddwd(void* dest, void* src, int dwordcount)
         idx += 2;
     }
     memcpy(dest, res, dwordcount << 2);
+#endif
 }
 static void psadbw(void* dest, void* src, int qwordcount)
 {
+#ifdef HOST_SSE2
+    HOST_SSE2_OP(dest, src, qwordcount << 3, _mm_sad_epu8);
+#else
     uint8_t *src8 = src, *dest8 = dest;
     for (int i = 0; i < qwordcount; i++) {
         uint32_t sum = 0, offs = i << 3;
@@ -839,28 +1158,306 @@ static void psadbw(void* dest, void* src, int qwordcount)
         dest8[offs | 0] = sum;
         dest8[offs | 1] = sum >> 8;
     }
+#endif
 }
 
 static void pabsb(void* dest, void* src, int bytecount)
 {
+#ifdef HOST_SSSE3
+    HOST_SSE2_OP1(dest, src, bytecount, _mm_abs_epi8);
+#else
     int8_t* src8 = src;
     uint8_t* dest8 = dest;
     for (int i = 0; i < bytecount; i++)
         dest8[i] = src8[i] < 0 ? -src8[i] : src8[i];
+#endif
 }
 static void pabsw(void* dest, void* src, int wordcount)
 {
+#ifdef HOST_SSSE3
+    HOST_SSE2_OP1(dest, src, wordcount << 1, _mm_abs_epi16);
+#else
     int16_t* src16 = src;
     uint16_t* dest16 = dest;
     for (int i = 0; i < wordcount; i++)
         dest16[i] = src16[i] < 0 ? -src16[i] : src16[i];
+#endif
 }
 static void pabsd(void* dest, void* src, int dwordcount)
 {
+#ifdef HOST_SSSE3
+    HOST_SSE2_OP1(dest, src, dwordcount << 2, _mm_abs_epi32);
+#else
     int32_t* src32 = src;
     uint32_t* dest32 = dest;
     for (int i = 0; i < dwordcount; i++)
         dest32[i] = src32[i] < 0 ? -src32[i] : src32[i];
+#endif
+}
+
+// Horizontal add and subtract: the low half of the result has the sums (or differences) of adjacent pairs in dest, and the
+// high half those of src.
+static void phaddw(void* dest, void* src, int wordcount, int sub, int saturate)
+{
+#ifdef HOST_SSSE3
+    if (wordcount == 8) {
+        __m128i a = _mm_loadu_si128(dest), b = _mm_loadu_si128(src);
+        if (sub)
+            a = saturate ? _mm_hsubs_epi16(a, b) : _mm_hsub_epi16(a, b);
+        else
+            a = saturate ? _mm_hadds_epi16(a, b) : _mm_hadd_epi16(a, b);
+        _mm_storeu_si128(dest, a);
+        return;
+    }
+#endif
+    int16_t *dest16 = dest, *src16 = src;
+    uint16_t res[8];
+    int half = wordcount >> 1;
+    for (int i = 0; i < half; i++) {
+        int a = sub ? dest16[i * 2] - dest16[i * 2 + 1] : dest16[i * 2] + dest16[i * 2 + 1],
+            b = sub ? src16[i * 2] - src16[i * 2 + 1] : src16[i * 2] + src16[i * 2 + 1];
+        res[i] = saturate ? pack_i32_to_i16(a) : a;
+        res[i + half] = saturate ? pack_i32_to_i16(b) : b;
+    }
+    memcpy(dest, res, wordcount << 1);
+}
+static void phaddd(void* dest, void* src, int dwordcount, int sub)
+{
+#ifdef HOST_SSSE3
+    if (dwordcount == 4) {
+        __m128i a = _mm_loadu_si128(dest), b = _mm_loadu_si128(src);
+        _mm_storeu_si128(dest, sub ? _mm_hsub_epi32(a, b) : _mm_hadd_epi32(a, b));
+        return;
+    }
+#endif
+    uint32_t *dest32 = dest, *src32 = src, res[4];
+    int half = dwordcount >> 1;
+    for (int i = 0; i < half; i++) {
+        res[i] = sub ? dest32[i * 2] - dest32[i * 2 + 1] : dest32[i * 2] + dest32[i * 2 + 1];
+        res[i + half] = sub ? src32[i * 2] - src32[i * 2 + 1] : src32[i * 2] + src32[i * 2 + 1];
+    }
+    memcpy(dest, res, dwordcount << 2);
+}
+// Unsigned bytes in dest times signed bytes in src, with adjacent products added together
+static void pmaddubsw(void* dest, void* src, int wordcount)
+{
+#ifdef HOST_SSSE3
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_maddubs_epi16);
+#else
+    uint8_t* dest8 = dest;
+    int8_t* src8 = src;
+    uint16_t* dest16 = dest;
+    for (int i = 0; i < wordcount; i++)
+        dest16[i] = pack_i32_to_i16(dest8[i * 2] * src8[i * 2] + dest8[i * 2 + 1] * src8[i * 2 + 1]);
+#endif
+}
+static void psignb(void* dest, void* src, int bytecount)
+{
+#ifdef HOST_SSSE3
+    HOST_SSE2_OP(dest, src, bytecount, _mm_sign_epi8);
+#else
+    int8_t *dest8 = dest, *src8 = src;
+    for (int i = 0; i < bytecount; i++)
+        dest8[i] = src8[i] < 0 ? -dest8[i] : src8[i] ? dest8[i] : 0;
+#endif
+}
+static void psignw(void* dest, void* src, int wordcount)
+{
+#ifdef HOST_SSSE3
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_sign_epi16);
+#else
+    int16_t *dest16 = dest, *src16 = src;
+    for (int i = 0; i < wordcount; i++)
+        dest16[i] = src16[i] < 0 ? -dest16[i] : src16[i] ? dest16[i] : 0;
+#endif
+}
+static void psignd(void* dest, void* src, int dwordcount)
+{
+#ifdef HOST_SSSE3
+    HOST_SSE2_OP(dest, src, dwordcount << 2, _mm_sign_epi32);
+#else
+    uint32_t *dest32 = dest, *src32 = src;
+    for (int i = 0; i < dwordcount; i++)
+        dest32[i] = (int32_t)src32[i] < 0 ? -dest32[i] : src32[i] ? dest32[i] : 0;
+#endif
+}
+// Multiply, and round the high 17 bits of the product
+static void pmulhrsw(void* dest, void* src, int wordcount)
+{
+#ifdef HOST_SSSE3
+    HOST_SSE2_OP(dest, src, wordcount << 1, _mm_mulhrs_epi16);
+#else
+    int16_t *dest16 = dest, *src16 = src;
+    for (int i = 0; i < wordcount; i++)
+        dest16[i] = ((dest16[i] * src16[i] >> 14) + 1) >> 1;
+#endif
+}
+// Shifts dest:src right by "shift" bytes and keeps the low half
+static void palignr(void* dest, void* src, int bytes, int shift)
+{
+    uint8_t tmp[32], *dest8 = dest;
+    memcpy(tmp, src, bytes);
+    memcpy(tmp + bytes, dest, bytes);
+    for (int i = 0; i < bytes; i++)
+        dest8[i] = i + shift < bytes * 2 ? tmp[i + shift] : 0;
+}
+
+// Copies the elements of src whose sign bit is set in XMM0. size is the element size in bytes.
+static void pblendv(void* dest, void* src, int size)
+{
+#ifdef HOST_SSE41
+    __m128i mask = _mm_loadu_si128((__m128i*)&XMM32(0));
+    switch (size) {
+    case 1:
+        _mm_storeu_si128(dest, _mm_blendv_epi8(_mm_loadu_si128(dest), _mm_loadu_si128(src), mask));
+        break;
+    case 4:
+        _mm_storeu_ps(dest, _mm_blendv_ps(_mm_loadu_ps(dest), _mm_loadu_ps(src), _mm_castsi128_ps(mask)));
+        break;
+    case 8:
+        _mm_storeu_pd(dest, _mm_blendv_pd(_mm_loadu_pd(dest), _mm_loadu_pd(src), _mm_castsi128_pd(mask)));
+        break;
+    }
+#else
+    uint8_t *dest8 = dest, *src8 = src, *mask = (uint8_t*)&XMM32(0);
+    for (int i = 0; i < 16; i++)
+        if (mask[i | (size - 1)] & 0x80)
+            dest8[i] = src8[i];
+#endif
+}
+// Same, but the elements are selected by the bits in imm
+static void pblend(void* dest, void* src, int size, int imm)
+{
+    uint8_t *dest8 = dest, *src8 = src;
+    for (int i = 0; i < 16; i += size)
+        if (imm >> (i / size) & 1)
+            memcpy(dest8 + i, src8 + i, size);
+}
+// PMOVSX and PMOVZX: extends the low elements of src from "from" to "to" bytes each
+static void pmovx(void* dest, void* src, int from, int to, int sign)
+{
+    uint8_t *src8 = src, res[16];
+    for (int i = 0; i < 16 / to; i++) {
+        uint64_t x = 0;
+        memcpy(&x, src8 + i * from, from);
+        if (sign && x >> (from * 8 - 1))
+            x |= (uint64_t)-1 << (from * 8);
+        memcpy(res + i * to, &x, to);
+    }
+    memcpy(dest, res, 16);
+}
+static void pmuldq(void* dest, void* src)
+{
+#ifdef HOST_SSE41
+    HOST_SSE2_OP(dest, src, 16, _mm_mul_epi32);
+#else
+    int32_t *dest32 = dest, *src32 = src;
+    int64_t* dest64 = dest;
+    dest64[0] = (int64_t)dest32[0] * src32[0];
+    dest64[1] = (int64_t)dest32[2] * src32[2];
+#endif
+}
+static void packusdw(void* dest, void* src)
+{
+#ifdef HOST_SSE41
+    HOST_SSE2_OP(dest, src, 16, _mm_packus_epi32);
+#else
+    int32_t *dest32 = dest, *src32 = src;
+    uint16_t res[8];
+    for (int i = 0; i < 4; i++) {
+        res[i] = dest32[i] < 0 ? 0 : dest32[i] > 0xFFFF ? 0xFFFF : dest32[i];
+        res[i + 4] = src32[i] < 0 ? 0 : src32[i] > 0xFFFF ? 0xFFFF : src32[i];
+    }
+    memcpy(dest, res, 16);
+#endif
+}
+// The remaining element-wise SSE4.1 operations only exist for XMM registers
+#ifdef HOST_SSE41
+#define SSE41_OP(name, type, expr, intrinsic)   \
+    static void name(void* dest, void* src)     \
+    {                                           \
+        HOST_SSE2_OP(dest, src, 16, intrinsic); \
+    }
+#else
+#define SSE41_OP(name, type, expr, intrinsic)                \
+    static void name(void* dest, void* src)                  \
+    {                                                        \
+        type *a = dest, *b = src;                            \
+        for (unsigned int i = 0; i < 16 / sizeof(type); i++) \
+            a[i] = expr;                                     \
+    }
+#endif
+SSE41_OP(pminsb, int8_t, a[i] < b[i] ? a[i] : b[i], _mm_min_epi8)
+SSE41_OP(pminsd, int32_t, a[i] < b[i] ? a[i] : b[i], _mm_min_epi32)
+SSE41_OP(pminuw, uint16_t, a[i] < b[i] ? a[i] : b[i], _mm_min_epu16)
+SSE41_OP(pminud, uint32_t, a[i] < b[i] ? a[i] : b[i], _mm_min_epu32)
+SSE41_OP(pmaxsb, int8_t, a[i] > b[i] ? a[i] : b[i], _mm_max_epi8)
+SSE41_OP(pmaxsd, int32_t, a[i] > b[i] ? a[i] : b[i], _mm_max_epi32)
+SSE41_OP(pmaxuw, uint16_t, a[i] > b[i] ? a[i] : b[i], _mm_max_epu16)
+SSE41_OP(pmaxud, uint32_t, a[i] > b[i] ? a[i] : b[i], _mm_max_epu32)
+SSE41_OP(pmulld, uint32_t, a[i] * b[i], _mm_mullo_epi32)
+SSE41_OP(pcmpeqq, uint64_t, -(uint64_t)(a[i] == b[i]), _mm_cmpeq_epi64)
+// Minimum unsigned word in the low word, and its index in the next one
+static void phminposuw(void* dest, void* src)
+{
+    uint16_t *dest16 = dest, *src16 = src, min = src16[0], index = 0;
+    for (int i = 1; i < 8; i++)
+        if (src16[i] < min) {
+            min = src16[i];
+            index = i;
+        }
+    memset(dest, 0, 16);
+    dest16[0] = min;
+    dest16[1] = index;
+}
+// Sums of absolute differences between a group of 4 bytes in src and 8 sliding groups of 4 bytes in dest
+static void mpsadbw(void* dest, void* src, int imm)
+{
+    uint8_t *d = (uint8_t*)dest + (imm >> 2 & 1) * 4, *s = (uint8_t*)src + (imm & 3) * 4;
+    uint16_t res[8];
+    for (int i = 0; i < 8; i++) {
+        res[i] = 0;
+        for (int j = 0; j < 4; j++)
+            res[i] += d[i + j] > s[j] ? d[i + j] - s[j] : s[j] - d[i + j];
+    }
+    memcpy(dest, res, 16);
+}
+// ROUNDPS/PD/SS/SD. If bit 2 of imm is set, the rounding mode comes from MXCSR, otherwise from bits 0-1. Bit 3 suppresses
+// the precision exception.
+static void sse_round(void* dest, void* src, int count, int is64, int imm)
+{
+    int rounding_mode = status.float_rounding_mode;
+    if (!(imm & 4))
+        status.float_rounding_mode = imm & 3;
+    for (int i = 0; i < count; i++) {
+        if (is64)
+            ((float64*)dest)[i] = float64_round_to_int(((float64*)src)[i], &status);
+        else
+            ((float32*)dest)[i] = float32_round_to_int(((float32*)src)[i], &status);
+    }
+    status.float_rounding_mode = rounding_mode;
+    if (imm & 8)
+        status.float_exception_flags &= ~float_flag_inexact;
+}
+// Dot products: the elements selected by the high 4 bits of imm are multiplied and summed, and the sum is written to the
+// elements selected by the low 4 bits.
+static void dpps(uint32_t* dest, uint32_t* src, int imm)
+{
+    float32 tmp[4];
+    for (int i = 0; i < 4; i++)
+        tmp[i] = imm >> (i + 4) & 1 ? float32_mul(dest[i], src[i], &status) : 0;
+    float32 sum = float32_add(float32_add(tmp[0], tmp[1], &status), float32_add(tmp[2], tmp[3], &status), &status);
+    for (int i = 0; i < 4; i++)
+        dest[i] = imm >> i & 1 ? sum : 0;
+}
+static void dppd(uint64_t* dest, uint64_t* src, int imm)
+{
+    float64 tmp[2];
+    for (int i = 0; i < 2; i++)
+        tmp[i] = imm >> (i + 4) & 1 ? float64_mul(dest[i], src[i], &status) : 0;
+    float64 sum = float64_add(tmp[0], tmp[1], &status);
+    for (int i = 0; i < 2; i++)
+        dest[i] = imm >> i & 1 ? sum : 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1010,6 +1607,20 @@ int execute_0F10_17(struct decoded_instruction* i)
         dest32[2] = *(uint32_t*)(result_ptr);
         dest32[3] = *(uint32_t*)(result_ptr + 4);
         break;
+    case MOVSLDUP_XGoXEo:
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        dest32 = get_sse_reg_dest(I_REG(flags));
+        dest32[0] = *(uint32_t*)(result_ptr);
+        dest32[1] = *(uint32_t*)(result_ptr);
+        dest32[2] = *(uint32_t*)(result_ptr + 8);
+        dest32[3] = *(uint32_t*)(result_ptr + 8);
+        break;
+    case MOVDDUP_XGoXEq:
+        EX(get_sse_read_ptr(flags, i, 2, 0));
+        dest32 = get_sse_reg_dest(I_REG(flags));
+        dest32[0] = dest32[2] = *(uint32_t*)(result_ptr);
+        dest32[1] = dest32[3] = *(uint32_t*)(result_ptr + 4);
+        break;
     case MOVSHDUP_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
@@ -1246,6 +1857,8 @@ int execute_0F50_57(struct decoded_instruction* i)
         EX(get_sse_read_ptr(flags, i, 4, 1));
         src32 = result_ptr;
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ps(dest32, result_ptr, HOST_SQRT))
+            break;
         dest32[0] = float32_sqrt(src32[0], &status);
         dest32[1] = float32_sqrt(src32[1], &status);
         dest32[2] = float32_sqrt(src32[2], &status);
@@ -1256,6 +1869,8 @@ int execute_0F50_57(struct decoded_instruction* i)
         EX(get_sse_read_ptr(flags, i, 1, 1));
         src32 = result_ptr;
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ss(dest32, result_ptr, HOST_SQRT))
+            break;
         dest32[0] = float32_sqrt(src32[0], &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
@@ -1263,6 +1878,8 @@ int execute_0F50_57(struct decoded_instruction* i)
         EX(get_sse_read_ptr(flags, i, 4, 1));
         src32 = result_ptr;
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_pd(dest32, result_ptr, HOST_SQRT))
+            break;
         *(uint64_t*)&dest32[0] = float64_sqrt(*(uint64_t*)&src32[0], &status);
         *(uint64_t*)&dest32[2] = float64_sqrt(*(uint64_t*)&src32[2], &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -1271,6 +1888,8 @@ int execute_0F50_57(struct decoded_instruction* i)
         EX(get_sse_read_ptr(flags, i, 2, 0));
         src32 = result_ptr;
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_sd(dest32, result_ptr, HOST_SQRT))
+            break;
         *(uint64_t*)&dest32[0] = float64_sqrt(*(uint64_t*)&src32[0], &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
@@ -1816,7 +2435,7 @@ static uint32_t get_shift(void* x, int bytes)
 int execute_0FD0_D7(struct decoded_instruction* i)
 {
     uint32_t *dest32, *src32, flags = i->flags;
-    switch (i->imm8 & 15) {
+    switch (i->imm8 & 31) {
     case PSRLW_MGqMEq:
         CHECK_MMX;
         EX(get_mmx_read_ptr(flags, i, 2));
@@ -1919,6 +2538,22 @@ int execute_0FD0_D7(struct decoded_instruction* i)
         EX(get_sse_read_ptr(flags, i, 4, 1));
         cpu->reg32[I_REG(flags)] = pmovmskb(result_ptr, 16);
         break;
+    case ADDSUBPD_XGoXEo:
+        CHECK_SSE;
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        dest32 = get_sse_reg_dest(I_REG(flags));
+        *(float64*)(&dest32[0]) = float64_sub(*(float64*)(&dest32[0]), *(float64*)(result_ptr), &status);
+        *(float64*)(&dest32[2]) = float64_add(*(float64*)(&dest32[2]), *(float64*)(result_ptr + 8), &status);
+        return cpu_sse_handle_exceptions();
+    case ADDSUBPS_XGoXEo:
+        CHECK_SSE;
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        dest32 = get_sse_reg_dest(I_REG(flags));
+        dest32[0] = float32_sub(dest32[0], *(float32*)(result_ptr), &status);
+        dest32[1] = float32_add(dest32[1], *(float32*)(result_ptr + 4), &status);
+        dest32[2] = float32_sub(dest32[2], *(float32*)(result_ptr + 8), &status);
+        dest32[3] = float32_add(dest32[3], *(float32*)(result_ptr + 12), &status);
+        return cpu_sse_handle_exceptions();
     }
     return 0;
 }
@@ -2271,6 +2906,8 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case ADDPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 0));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ps(dest32, result_ptr, HOST_ADD))
+            break;
         dest32[0] = float32_add(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_add(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_add(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2280,12 +2917,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case ADDSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 0));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ss(dest32, result_ptr, HOST_ADD))
+            break;
         dest32[0] = float32_add(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case ADDPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_pd(dest64, result_ptr, HOST_ADD))
+            break;
         dest64[0] = float64_add(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_add(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2293,12 +2934,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case ADDSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_sd(dest64, result_ptr, HOST_ADD))
+            break;
         dest64[0] = float64_add(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MULPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 0));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ps(dest32, result_ptr, HOST_MUL))
+            break;
         dest32[0] = float32_mul(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_mul(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_mul(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2308,12 +2953,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MULSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 0));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ss(dest32, result_ptr, HOST_MUL))
+            break;
         dest32[0] = float32_mul(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MULPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_pd(dest64, result_ptr, HOST_MUL))
+            break;
         dest64[0] = float64_mul(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_mul(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2321,6 +2970,8 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MULSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_sd(dest64, result_ptr, HOST_MUL))
+            break;
         dest64[0] = float64_mul(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
@@ -2385,6 +3036,8 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case SUBPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ps(dest32, result_ptr, HOST_SUB))
+            break;
         dest32[0] = float32_sub(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_sub(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_sub(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2394,12 +3047,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case SUBSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ss(dest32, result_ptr, HOST_SUB))
+            break;
         dest32[0] = float32_sub(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case SUBPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_pd(dest64, result_ptr, HOST_SUB))
+            break;
         dest64[0] = float64_sub(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_sub(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2407,12 +3064,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case SUBSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_sd(dest64, result_ptr, HOST_SUB))
+            break;
         dest64[0] = float64_sub(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MINPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ps(dest32, result_ptr, HOST_MIN))
+            break;
         dest32[0] = float32_min(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_min(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_min(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2422,12 +3083,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MINSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ss(dest32, result_ptr, HOST_MIN))
+            break;
         dest32[0] = float32_min(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MINPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_pd(dest64, result_ptr, HOST_MIN))
+            break;
         dest64[0] = float64_min(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_min(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2435,12 +3100,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MINSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_sd(dest64, result_ptr, HOST_MIN))
+            break;
         dest64[0] = float64_min(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case DIVPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ps(dest32, result_ptr, HOST_DIV))
+            break;
         dest32[0] = float32_div(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_div(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_div(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2450,12 +3119,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case DIVSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ss(dest32, result_ptr, HOST_DIV))
+            break;
         dest32[0] = float32_div(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case DIVPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_pd(dest64, result_ptr, HOST_DIV))
+            break;
         dest64[0] = float64_div(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_div(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2463,12 +3136,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case DIVSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_sd(dest64, result_ptr, HOST_DIV))
+            break;
         dest64[0] = float64_div(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MAXPS_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ps(dest32, result_ptr, HOST_MAX))
+            break;
         dest32[0] = float32_max(dest32[0], *(float32*)(result_ptr), &status);
         dest32[1] = float32_max(dest32[1], *(float32*)(result_ptr + 4), &status);
         dest32[2] = float32_max(dest32[2], *(float32*)(result_ptr + 8), &status);
@@ -2478,12 +3155,16 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MAXSS_XGdXEd:
         EX(get_sse_read_ptr(flags, i, 1, 1));
         dest32 = get_sse_reg_dest(I_REG(flags));
+        if (host_ss(dest32, result_ptr, HOST_MAX))
+            break;
         dest32[0] = float32_max(dest32[0], *(float32*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
     case MAXPD_XGoXEo:
         EX(get_sse_read_ptr(flags, i, 4, 1));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_pd(dest64, result_ptr, HOST_MAX))
+            break;
         dest64[0] = float64_max(dest64[0], *(float64*)(result_ptr), &status);
         dest64[1] = float64_max(dest64[1], *(float64*)(result_ptr + 8), &status);
         fp_exception = cpu_sse_handle_exceptions();
@@ -2491,6 +3172,8 @@ int execute_0F58_5F(struct decoded_instruction* i)
     case MAXSD_XGqXEq:
         EX(get_sse_read_ptr(flags, i, 2, 0));
         dest64 = get_sse_reg_dest(I_REG(flags));
+        if (host_sd(dest64, result_ptr, HOST_MAX))
+            break;
         dest64[0] = float64_max(dest64[0], *(float64*)(result_ptr), &status);
         fp_exception = cpu_sse_handle_exceptions();
         break;
@@ -2773,62 +3456,317 @@ int execute_0F7C_7D(struct decoded_instruction* i)
     return cpu_sse_handle_exceptions();
 }
 
-// SSSE3
-int execute_0F38(struct decoded_instruction* i)
+// For the instructions that only read 16 bits from memory into an XMM register
+static int get_sse_read_ptr16(uint32_t flags, struct decoded_instruction* i)
 {
-    uint32_t flags = i->flags;
-    switch (i->imm8) {
-    case 0: // PSHUFB
-        CHECK_MMX;
-        EX(get_mmx_read_ptr(flags, i, 2));
-        pshufb(get_mmx_reg_dest(I_REG(flags)), result_ptr, 8);
+    if (I_OP2(flags)) {
+        result_ptr = &XMM32(I_RM(flags));
+        return 0;
+    }
+    cpu_read16(cpu_get_linaddr(flags, i), temp.d128[0], cpu->tlb_shift_read);
+    result_ptr = temp.d128;
+    return 0;
+}
+
+// SSSE3 operations, shared by the MMX and SSE versions
+static void ssse3_op(int op, void* dest, void* src, int bytes)
+{
+    switch (op) {
+    case 0x00: // PSHUFB
+        pshufb(dest, src, bytes);
+        break;
+    case 0x01: // PHADDW
+        phaddw(dest, src, bytes >> 1, 0, 0);
+        break;
+    case 0x02: // PHADDD
+        phaddd(dest, src, bytes >> 2, 0);
+        break;
+    case 0x03: // PHADDSW
+        phaddw(dest, src, bytes >> 1, 0, 1);
+        break;
+    case 0x04: // PMADDUBSW
+        pmaddubsw(dest, src, bytes >> 1);
+        break;
+    case 0x05: // PHSUBW
+        phaddw(dest, src, bytes >> 1, 1, 0);
+        break;
+    case 0x06: // PHSUBD
+        phaddd(dest, src, bytes >> 2, 1);
+        break;
+    case 0x07: // PHSUBSW
+        phaddw(dest, src, bytes >> 1, 1, 1);
+        break;
+    case 0x08: // PSIGNB
+        psignb(dest, src, bytes);
+        break;
+    case 0x09: // PSIGNW
+        psignw(dest, src, bytes >> 1);
+        break;
+    case 0x0A: // PSIGND
+        psignd(dest, src, bytes >> 2);
+        break;
+    case 0x0B: // PMULHRSW
+        pmulhrsw(dest, src, bytes >> 1);
         break;
     case 0x1C: // PABSB
-        CHECK_MMX;
-        EX(get_mmx_read_ptr(flags, i, 2));
-        pabsb(get_mmx_reg_dest(I_REG(flags)), result_ptr, 8);
+        pabsb(dest, src, bytes);
         break;
     case 0x1D: // PABSW
-        CHECK_MMX;
-        EX(get_mmx_read_ptr(flags, i, 2));
-        pabsw(get_mmx_reg_dest(I_REG(flags)), result_ptr, 4);
+        pabsw(dest, src, bytes >> 1);
         break;
     case 0x1E: // PABSD
+        pabsd(dest, src, bytes >> 2);
+        break;
+    }
+}
+
+// SSSE3
+int execute_0F38(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags;
+    switch (i->imm8) {
+    case 0x00 ... 0x0B:
+    case 0x1C ... 0x1E:
         CHECK_MMX;
         EX(get_mmx_read_ptr(flags, i, 2));
-        pabsd(get_mmx_reg_dest(I_REG(flags)), result_ptr, 2);
+        ssse3_op(i->imm8, get_mmx_reg_dest(I_REG(flags)), result_ptr, 8);
         break;
     default:
-        CPU_FATAL("TODO: implement 0F 38 %02x", i->imm8);
+        EXCEPTION_UD();
     }
     return 0;
 }
-int execute_660F38(struct decoded_instruction* i)
+int execute_0F3A(struct decoded_instruction* i)
 {
     uint32_t flags = i->flags;
-    switch (i->imm8) {
-    case 0: // PSHUFB
-        CHECK_SSE;
-        EX(get_sse_read_ptr(flags, i, 4, 0)); // no unalign excep
-        pshufb(get_sse_reg_dest(I_REG(flags)), result_ptr, 16);
+    if ((i->imm16 & 0xFF) != 0x0F) // PALIGNR is the only one with an MMX version
+        EXCEPTION_UD();
+    CHECK_MMX;
+    EX(get_mmx_read_ptr(flags, i, 2));
+    palignr(get_mmx_reg_dest(I_REG(flags)), result_ptr, 8, i->imm16 >> 8);
+    return 0;
+}
+
+// SSSE3 and SSE4.1
+int execute_660F38(struct decoded_instruction* i)
+{
+    // Source and destination element sizes of PMOVSX and PMOVZX
+    static const uint8_t pmovx_sizes[6][2] = { { 1, 2 }, { 1, 4 }, { 1, 8 }, { 2, 4 }, { 2, 8 }, { 4, 8 } };
+    uint32_t flags = i->flags, *dest32, *src32;
+    int op = i->imm8, zf = 1, cf = 1;
+    CHECK_SSE;
+    switch (op) {
+    case 0x20 ... 0x25:
+    case 0x30 ... 0x35: {
+        int from = pmovx_sizes[op & 7][0], to = pmovx_sizes[op & 7][1], bytes = 16 / to * from;
+        if (bytes == 2) {
+            EX(get_sse_read_ptr16(flags, i));
+        } else
+            EX(get_sse_read_ptr(flags, i, bytes >> 2, 0));
+        pmovx(get_sse_reg_dest(I_REG(flags)), result_ptr, from, to, op < 0x30);
+        return 0;
+    }
+    case 0x2A: // MOVNTDQA
+        if (I_OP2(flags))
+            EXCEPTION_UD();
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        memcpy(get_sse_reg_dest(I_REG(flags)), result_ptr, 16);
+        return 0;
+    case 0x00 ... 0x0B:
+    case 0x10:
+    case 0x14 ... 0x15:
+    case 0x17:
+    case 0x1C ... 0x1E:
+    case 0x28 ... 0x29:
+    case 0x2B:
+    case 0x38 ... 0x41:
         break;
-    case 0x1C: // PABSB
-        CHECK_SSE;
-        EX(get_sse_read_ptr(flags, i, 4, 0)); // no unalign excep
-        pabsb(get_sse_reg_dest(I_REG(flags)), result_ptr, 16);
+    default:
+        EXCEPTION_UD();
+    }
+
+    // Only the variable blends check alignment, like the immediate blends in 66 0F 3A
+    EX(get_sse_read_ptr(flags, i, 4, op == 0x10 || op == 0x14 || op == 0x15));
+    dest32 = get_sse_reg_dest(I_REG(flags));
+    switch (op) {
+    case 0x10: // PBLENDVB
+        pblendv(dest32, result_ptr, 1);
         break;
-    case 0x1D: // PABSW
-        CHECK_SSE;
-        EX(get_sse_read_ptr(flags, i, 4, 0)); // no unalign excep
-        pabsw(get_sse_reg_dest(I_REG(flags)), result_ptr, 8);
+    case 0x14: // BLENDVPS
+        pblendv(dest32, result_ptr, 4);
         break;
-    case 0x1E: // PABSD
-        CHECK_SSE;
+    case 0x15: // BLENDVPD
+        pblendv(dest32, result_ptr, 8);
+        break;
+    case 0x17: // PTEST
+        src32 = result_ptr;
+        for (int j = 0; j < 4; j++) {
+            if (dest32[j] & src32[j])
+                zf = 0;
+            if (~dest32[j] & src32[j])
+                cf = 0;
+        }
+        cpu_set_eflags((zf ? EFLAGS_ZF : 0) | (cf ? EFLAGS_CF : 0) | (cpu->eflags & ~arith_flag_mask));
+        break;
+    case 0x28: // PMULDQ
+        pmuldq(dest32, result_ptr);
+        break;
+    case 0x29: // PCMPEQQ
+        pcmpeqq(dest32, result_ptr);
+        break;
+    case 0x2B: // PACKUSDW
+        packusdw(dest32, result_ptr);
+        break;
+    case 0x38: // PMINSB
+        pminsb(dest32, result_ptr);
+        break;
+    case 0x39: // PMINSD
+        pminsd(dest32, result_ptr);
+        break;
+    case 0x3A: // PMINUW
+        pminuw(dest32, result_ptr);
+        break;
+    case 0x3B: // PMINUD
+        pminud(dest32, result_ptr);
+        break;
+    case 0x3C: // PMAXSB
+        pmaxsb(dest32, result_ptr);
+        break;
+    case 0x3D: // PMAXSD
+        pmaxsd(dest32, result_ptr);
+        break;
+    case 0x3E: // PMAXUW
+        pmaxuw(dest32, result_ptr);
+        break;
+    case 0x3F: // PMAXUD
+        pmaxud(dest32, result_ptr);
+        break;
+    case 0x40: // PMULLD
+        pmulld(dest32, result_ptr);
+        break;
+    case 0x41: // PHMINPOSUW
+        phminposuw(dest32, result_ptr);
+        break;
+    default:
+        ssse3_op(op, dest32, result_ptr, 16);
+        break;
+    }
+    return 0;
+}
+
+// SSE4.1 (and PALIGNR)
+int execute_660F3A(struct decoded_instruction* i)
+{
+    uint32_t flags = i->flags, *dest32, linaddr, value;
+    int imm = i->imm16 >> 8;
+    uint8_t* src8;
+    CHECK_SSE;
+    switch (i->imm16 & 0xFF) {
+    case 0x08: // ROUNDPS
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        sse_round(get_sse_reg_dest(I_REG(flags)), result_ptr, 4, 0, imm);
+        return cpu_sse_handle_exceptions();
+    case 0x09: // ROUNDPD
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        sse_round(get_sse_reg_dest(I_REG(flags)), result_ptr, 2, 1, imm);
+        return cpu_sse_handle_exceptions();
+    case 0x0A: // ROUNDSS
+        EX(get_sse_read_ptr(flags, i, 1, 0));
+        sse_round(get_sse_reg_dest(I_REG(flags)), result_ptr, 1, 0, imm);
+        return cpu_sse_handle_exceptions();
+    case 0x0B: // ROUNDSD
+        EX(get_sse_read_ptr(flags, i, 2, 0));
+        sse_round(get_sse_reg_dest(I_REG(flags)), result_ptr, 1, 1, imm);
+        return cpu_sse_handle_exceptions();
+    case 0x0C: // BLENDPS
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        pblend(get_sse_reg_dest(I_REG(flags)), result_ptr, 4, imm);
+        break;
+    case 0x0D: // BLENDPD
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        pblend(get_sse_reg_dest(I_REG(flags)), result_ptr, 8, imm);
+        break;
+    case 0x0E: // PBLENDW
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        pblend(get_sse_reg_dest(I_REG(flags)), result_ptr, 2, imm);
+        break;
+    case 0x0F: // PALIGNR
         EX(get_sse_read_ptr(flags, i, 4, 0)); // no unalign excep
-        pabsd(get_sse_reg_dest(I_REG(flags)), result_ptr, 4);
+        palignr(get_sse_reg_dest(I_REG(flags)), result_ptr, 16, imm);
+        break;
+    case 0x14: // PEXTRB
+    case 0x15: // PEXTRW
+    case 0x16: // PEXTRD
+    case 0x17: // EXTRACTPS
+        // Registers get the zero-extended value, memory only gets as many bytes as the element has
+        src8 = get_sse_reg_dest(I_REG(flags));
+        switch (i->imm16 & 3) {
+        case 0:
+            value = src8[imm & 15];
+            break;
+        case 1:
+            value = ((uint16_t*)src8)[imm & 7];
+            break;
+        default:
+            value = ((uint32_t*)src8)[imm & 3];
+            break;
+        }
+        if (I_OP2(flags)) {
+            cpu->reg32[I_RM(flags)] = value;
+            break;
+        }
+        linaddr = cpu_get_linaddr(flags, i);
+        switch (i->imm16 & 3) {
+        case 0:
+            cpu_write8(linaddr, value, cpu->tlb_shift_write);
+            break;
+        case 1:
+            cpu_write16(linaddr, value, cpu->tlb_shift_write);
+            break;
+        default:
+            cpu_write32(linaddr, value, cpu->tlb_shift_write);
+            break;
+        }
+        break;
+    case 0x20: // PINSRB
+        if (I_OP2(flags))
+            value = cpu->reg32[I_RM(flags)];
+        else
+            cpu_read8(cpu_get_linaddr(flags, i), value, cpu->tlb_shift_read);
+        src8 = get_sse_reg_dest(I_REG(flags));
+        src8[imm & 15] = value;
+        break;
+    case 0x21: // INSERTPS
+        // The source element is selected by bits 6-7 for registers. Memory operands are always 32 bits.
+        if (I_OP2(flags))
+            value = (&XMM32(I_RM(flags)))[imm >> 6];
+        else
+            cpu_read32(cpu_get_linaddr(flags, i), value, cpu->tlb_shift_read);
+        dest32 = get_sse_reg_dest(I_REG(flags));
+        dest32[imm >> 4 & 3] = value;
+        for (int j = 0; j < 4; j++)
+            if (imm >> j & 1)
+                dest32[j] = 0;
+        break;
+    case 0x22: // PINSRD
+        EX(get_reg_read_ptr(flags, i));
+        dest32 = get_sse_reg_dest(I_REG(flags));
+        dest32[imm & 3] = *(uint32_t*)result_ptr;
+        break;
+    case 0x40: // DPPS
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        dpps(get_sse_reg_dest(I_REG(flags)), result_ptr, imm);
+        return cpu_sse_handle_exceptions();
+    case 0x41: // DPPD
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        dppd(get_sse_reg_dest(I_REG(flags)), result_ptr, imm);
+        return cpu_sse_handle_exceptions();
+    case 0x42: // MPSADBW
+        EX(get_sse_read_ptr(flags, i, 4, 1));
+        mpsadbw(get_sse_reg_dest(I_REG(flags)), result_ptr, imm);
         break;
     default:
-        CPU_FATAL("TODO: implement 660F 38 %02x", i->imm8);
+        EXCEPTION_UD();
     }
     return 0;
-}
\ No newline at end of file
+}
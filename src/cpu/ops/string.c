@@ -241,6 +241,14 @@ int stosd32(int flags)
         return 0;
     }
     for (int i = 0; i < count; i++) {
+        // Clearing whole pages is common enough (page allocators) to give them back to the host instead
+        if (!src && add > 0 && count - i >= 1024 && !((cpu->seg_base[ES] + cpu->reg32[EDI]) & 0xFFF)
+            && cpu_free_zeroed_page(cpu->seg_base[ES] + cpu->reg32[EDI])) {
+            cpu->reg32[EDI] += 4096;
+            cpu->reg32[ECX] -= 1024;
+            i += 1023;
+            continue;
+        }
         cpu_write32(cpu->seg_base[ES] + cpu->reg32[EDI], src, cpu->tlb_shift_write);
         cpu->reg32[EDI] += add;
         cpu->reg32[ECX]--;
@@ -0,0 +1,270 @@
+// Sampling guest profiler
+// Every "interval" instructions, cpu_run records where the guest is: its linear and physical EIP, CPL and address space
+// (CR3). If the code is 32-bit, the chain of saved frame pointers is followed as well to get a call stack. Samples are
+// aggregated in hash tables and written out as a plain text report of the hottest addresses, and optionally as collapsed
+// stacks ("a;b;c count" per line) that flame graph tools understand.
+// No symbols are needed: addresses are reported as they are, and can be looked up against the guest's own binaries.
+
+#include "cpu/cpu.h"
+#include "cpu/instrument.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILER_LOG(x, ...) LOG("PROFILER", x, ##__VA_ARGS__)
+
+// Number of frame pointers followed if the configuration doesn't give a usable one, and the most that can be asked for
+#define PROFILER_DEFAULT_DEPTH 16
+#define PROFILER_MAX_DEPTH 1024
+
+// No samples are taken until this is set to something reasonable by cpu_profiler_init
+MACHINE_LOCAL uint64_t cpu_profiler_next_sample = -1;
+
+struct profiler_sample {
+    uint32_t cr3, lin, phys;
+    int cpl;
+    uint64_t count;
+};
+
+struct profiler_stack {
+    uint32_t hash, depth;
+    uint32_t* frames; // Address space first, then the outermost return address, and the current EIP last
+    uint64_t count;
+};
+
+static MACHINE_LOCAL struct {
+    int interval, depth;
+    char *report_path, *stacks_path;
+
+    uint64_t total, cpl_samples[4];
+    // Open addressing hash tables, always at most half full
+    struct profiler_sample* samples;
+    struct profiler_stack* stacks;
+    unsigned int sample_count, sample_size, stack_count, stack_size;
+
+    uint32_t* frames;
+} profiler;
+
+static uint32_t hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    return x ^ (x >> 16);
+}
+
+static struct profiler_sample* profiler_find_sample(struct profiler_sample* table, unsigned int size, uint32_t cr3, uint32_t lin, int cpl)
+{
+    unsigned int i = hash32(lin ^ hash32(cr3 ^ cpl)) & (size - 1);
+    while (table[i].count && (table[i].lin != lin || table[i].cr3 != cr3 || table[i].cpl != cpl))
+        i = (i + 1) & (size - 1);
+    return &table[i];
+}
+
+static struct profiler_stack* profiler_find_stack(struct profiler_stack* table, unsigned int size, uint32_t hash, uint32_t* frames, uint32_t depth)
+{
+    unsigned int i = hash & (size - 1);
+    while (table[i].count && (table[i].hash != hash || table[i].depth != depth || memcmp(table[i].frames, frames, depth * 4)))
+        i = (i + 1) & (size - 1);
+    return &table[i];
+}
+
+static void profiler_grow_samples(void)
+{
+    unsigned int size = profiler.sample_size ? profiler.sample_size * 2 : 4096;
+    struct profiler_sample* table = calloc(size, sizeof(struct profiler_sample));
+    for (unsigned int i = 0; i < profiler.sample_size; i++) {
+        struct profiler_sample* s = &profiler.samples[i];
+        if (s->count)
+            *profiler_find_sample(table, size, s->cr3, s->lin, s->cpl) = *s;
+    }
+    free(profiler.samples);
+    profiler.samples = table;
+    profiler.sample_size = size;
+}
+
+static void profiler_grow_stacks(void)
+{
+    unsigned int size = profiler.stack_size ? profiler.stack_size * 2 : 4096;
+    struct profiler_stack* table = calloc(size, sizeof(struct profiler_stack));
+    for (unsigned int i = 0; i < profiler.stack_size; i++) {
+        struct profiler_stack* s = &profiler.stacks[i];
+        if (s->count)
+            *profiler_find_stack(table, size, s->hash, s->frames, s->depth) = *s;
+    }
+    free(profiler.stacks);
+    profiler.stacks = table;
+    profiler.stack_size = size;
+}
+
+// Reads a dword from the guest without causing page faults or touching devices. Only works if the page is already in the
+// TLB, which is almost always the case for the stack.
+static int profiler_read32(uint32_t lin, uint32_t* result)
+{
+    if ((lin & 0xFFF) > 0xFFC || cpu->tlb_tags[lin >> 12] >> TLB_SYSTEM_READ & 1)
+        return 0;
+    memcpy(result, cpu->tlb[lin >> 12] + lin, 4);
+    return 1;
+}
+
+// Follows the saved EBP chain: [ebp] holds the caller's EBP, and [ebp+4] the return address
+static int profiler_walk_stack(uint32_t* frames)
+{
+    uint32_t ebp = cpu->reg32[EBP], depth = 0;
+    while (depth < (uint32_t)profiler.depth) {
+        uint32_t next_ebp, ret;
+        if (!ebp || !profiler_read32(ebp + cpu->seg_base[SS], &next_ebp) || !profiler_read32(ebp + 4 + cpu->seg_base[SS], &ret) || !ret)
+            break;
+        frames[depth++] = ret;
+        if (next_ebp <= ebp)
+            break;
+        ebp = next_ebp;
+    }
+    return depth;
+}
+
+void cpu_profiler_sample(void)
+{
+    cpu_profiler_next_sample = cpu_get_cycles() + profiler.interval;
+
+    uint32_t cr3 = cpu->cr[0] & CR0_PG ? cpu->cr[3] : 0, lin = LIN_EIP();
+    int cpl = cpu->cpl & 3;
+    profiler.total++;
+    profiler.cpl_samples[cpl]++;
+
+    if (profiler.sample_count * 2 >= profiler.sample_size)
+        profiler_grow_samples();
+    struct profiler_sample* s = profiler_find_sample(profiler.samples, profiler.sample_size, cr3, lin, cpl);
+    if (!s->count++) {
+        s->cr3 = cr3;
+        s->lin = lin;
+        s->phys = cpu->phys_eip;
+        s->cpl = cpl;
+        profiler.sample_count++;
+    }
+
+    if (!profiler.stacks_path)
+        return;
+
+    // Build the stack root first: address space, outermost caller, ..., current EIP
+    uint32_t* callers = profiler.frames + profiler.depth + 2;
+    int depth = cpu->state_hash & STATE_CODE16 ? 0 : profiler_walk_stack(callers);
+    uint32_t* frames = profiler.frames;
+    frames[0] = cr3;
+    for (int i = 0; i < depth; i++)
+        frames[i + 1] = callers[depth - 1 - i];
+    frames[depth + 1] = lin;
+    depth += 2;
+
+    uint32_t hash = 0;
+    for (int i = 0; i < depth; i++)
+        hash = hash32(hash ^ frames[i]);
+    if (profiler.stack_count * 2 >= profiler.stack_size)
+        profiler_grow_stacks();
+    struct profiler_stack* st = profiler_find_stack(profiler.stacks, profiler.stack_size, hash, frames, depth);
+    if (!st->count++) {
+        st->hash = hash;
+        st->depth = depth;
+        st->frames = malloc(depth * 4);
+        memcpy(st->frames, frames, depth * 4);
+        profiler.stack_count++;
+    }
+}
+
+static int profiler_compare_samples(const void* a, const void* b)
+{
+    uint64_t x = ((const struct profiler_sample*)a)->count, y = ((const struct profiler_sample*)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// How many of the hottest addresses to list in the report
+#define REPORT_ADDRESSES 100
+
+void cpu_profiler_report(void)
+{
+    if (!profiler.interval || !profiler.total)
+        return;
+
+    FILE* f = fopen(profiler.report_path, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to write profile to %s\n", profiler.report_path);
+        return;
+    }
+    double total = profiler.total;
+    fprintf(f, "%llu samples, one every %d instructions\n\n", (unsigned long long)profiler.total, profiler.interval);
+
+    fprintf(f, "By privilege level:\n");
+    for (int i = 0; i < 4; i++)
+        if (profiler.cpl_samples[i])
+            fprintf(f, "  CPL %d  %10llu  %6.2f%%\n", i, (unsigned long long)profiler.cpl_samples[i], profiler.cpl_samples[i] * 100 / total);
+
+    // Compact the table so that it can be sorted. Samples are counted per address space first.
+    struct profiler_sample* sorted = malloc((profiler.sample_count + 1) * sizeof(struct profiler_sample));
+    struct profiler_sample* spaces = calloc(profiler.sample_count + 1, sizeof(struct profiler_sample));
+    unsigned int n = 0, space_count = 0;
+    for (unsigned int i = 0; i < profiler.sample_size; i++) {
+        struct profiler_sample* s = &profiler.samples[i];
+        if (!s->count)
+            continue;
+        sorted[n++] = *s;
+        unsigned int j = 0;
+        while (j < space_count && spaces[j].cr3 != s->cr3)
+            j++;
+        if (j == space_count) {
+            spaces[space_count++].cr3 = s->cr3;
+        }
+        spaces[j].count += s->count;
+    }
+    qsort(sorted, n, sizeof(struct profiler_sample), profiler_compare_samples);
+    qsort(spaces, space_count, sizeof(struct profiler_sample), profiler_compare_samples);
+
+    fprintf(f, "\nBy address space:\n  CR3          samples        %%\n");
+    for (unsigned int i = 0; i < space_count; i++)
+        fprintf(f, "  %08x  %10llu  %6.2f%%\n", spaces[i].cr3, (unsigned long long)spaces[i].count, spaces[i].count * 100 / total);
+
+    fprintf(f, "\nHottest addresses:\n     samples        %%  CPL  CR3       linear    physical\n");
+    for (unsigned int i = 0; i < n && i < REPORT_ADDRESSES; i++)
+        fprintf(f, "  %10llu  %6.2f%%  %d    %08x  %08x  %08x\n", (unsigned long long)sorted[i].count, sorted[i].count * 100 / total,
+            sorted[i].cpl, sorted[i].cr3, sorted[i].lin, sorted[i].phys);
+    free(sorted);
+    free(spaces);
+    fclose(f);
+
+    if (!profiler.stacks_path)
+        return;
+    f = fopen(profiler.stacks_path, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to write stacks to %s\n", profiler.stacks_path);
+        return;
+    }
+    for (unsigned int i = 0; i < profiler.stack_size; i++) {
+        struct profiler_stack* st = &profiler.stacks[i];
+        if (!st->count)
+            continue;
+        fprintf(f, "cr3_%08x", st->frames[0]);
+        for (unsigned int j = 1; j < st->depth; j++)
+            fprintf(f, ";%08x", st->frames[j]);
+        fprintf(f, " %llu\n", (unsigned long long)st->count);
+    }
+    fclose(f);
+}
+
+void cpu_profiler_init(int interval, int depth, char* report_path, char* stacks_path)
+{
+    if (interval <= 0)
+        return;
+    if (depth <= 0 || depth > PROFILER_MAX_DEPTH) {
+        fprintf(stderr, "Profiler stack depth %d is out of range (1 to %d), using %d\n", depth, PROFILER_MAX_DEPTH, PROFILER_DEFAULT_DEPTH);
+        depth = PROFILER_DEFAULT_DEPTH;
+    }
+    profiler.interval = interval;
+    profiler.depth = depth;
+    profiler.report_path = report_path ? report_path : "profile.txt";
+    profiler.stacks_path = stacks_path;
+    profiler.frames = malloc((depth + 2) * 2 * sizeof(uint32_t));
+    cpu_profiler_next_sample = cpu_get_cycles() + interval;
+    PROFILER_LOG("Sampling every %d instructions\n", interval);
+    atexit(cpu_profiler_report);
+}
@@ -24,6 +24,17 @@ static void reload_cs_base(void)
     cpu->eip_phys_bias = virt_eip - cpu->phys_eip;
 }
 
+// Keep STATE_FLAT in cpu->state_hash up to date. Call this whenever the base of DS, ES or SS may have changed, and after
+// cpu->state_hash has been assigned. 16-bit code is left alone: it hardly ever uses 32-bit addresses, and traces are only
+// looked up by physical address, so code that runs both ways would be decoded over and over.
+void cpu_seg_update_flat(void)
+{
+    if ((cpu->seg_base[DS] | cpu->seg_base[ES] | cpu->seg_base[SS]) || cpu->state_hash & STATE_ADDR16)
+        cpu->state_hash &= ~STATE_FLAT;
+    else
+        cpu->state_hash |= STATE_FLAT;
+}
+
 void cpu_load_csip_real(uint16_t cs, uint32_t eip)
 {
     SET_VIRT_EIP(eip);
@@ -60,6 +71,7 @@ void cpu_seg_load_virtual(int id, uint16_t sel)
         cpu->esp_mask = 0xFFFF;
         break;
     }
+    cpu_seg_update_flat();
 }
 void cpu_seg_load_real(int id, uint16_t sel)
 {
@@ -76,6 +88,7 @@ void cpu_seg_load_real(int id, uint16_t sel)
         cpu->esp_mask = 0xFFFF;
         break;
     }
+    cpu_seg_update_flat();
 }
 // Note: May raise exception since there's a physical write to update the dirty bit
 int cpu_seg_load_protected(int id, uint16_t sel, struct seg_desc* info)
@@ -84,12 +97,17 @@ int cpu_seg_load_protected(int id, uint16_t sel, struct seg_desc* info)
     cpu->seg_base[id] = cpu_seg_get_base(info);
     cpu->seg_limit[id] = cpu_seg_get_limit(info);
     cpu->seg_access[id] = DESC_ACCESS(info);
+    cpu_seg_update_flat(); // Before the write below, which may fault
 
-    uint32_t linaddr = cpu_seg_descriptor_address(-1, sel);
-    if (linaddr == RESULT_INVALID)
-        CPU_FATAL("Out of limits in internal function\n");
-    info->raw[1] |= 0x100;
-    cpu_write8(linaddr + 5, info->raw[1] >> 8 & 0xFF, TLB_SYSTEM_WRITE);
+    // Like the processor, only write the accessed bit back if it isn't set yet. Otherwise every interrupt and far transfer
+    // writes to the GDT, and that is an SMC invalidation each time if the table shares a chunk with code.
+    if (!(info->raw[1] & 0x100)) {
+        uint32_t linaddr = cpu_seg_descriptor_address(-1, sel);
+        if (linaddr == RESULT_INVALID)
+            CPU_FATAL("Out of limits in internal function\n");
+        info->raw[1] |= 0x100;
+        cpu_write8(linaddr + 5, info->raw[1] >> 8 & 0xFF, TLB_SYSTEM_WRITE);
+    }
 
     switch (id) {
     case CS:
@@ -97,6 +115,7 @@ int cpu_seg_load_protected(int id, uint16_t sel, struct seg_desc* info)
             cpu->state_hash = 0;
         else
             cpu->state_hash = STATE_ADDR16 | STATE_CODE16;
+        cpu_seg_update_flat();
         cpu->cpl = sel & 3;
         cpu_prot_update_cpl();
         break;
@@ -270,6 +289,7 @@ int cpu_load_seg_value_mov(int seg, uint16_t val)
                 cpu->seg_base[seg] = 0;
                 cpu->seg_limit[seg] = 0;
                 cpu->seg_access[seg] = 0;
+                cpu_seg_update_flat();
             }
             break;
         }
@@ -2,6 +2,7 @@
 // Note that writes to address beyond cpu->memory_size can be ignored because the translation system forbids translation from MMIO pages.
 // Also, this subsystem cannot handle cross 128-byte accesses on its own. All unaligned accesses will be split up in access.c
 #include "cpu/cpu.h"
+#include "cpu/instrument.h"
 int cpu_smc_page_has_code(uint32_t phys)
 {
     phys >>= 12;
@@ -18,12 +19,62 @@ int cpu_smc_has_code(uint32_t phys)
     return cpu->smc_has_code[phys >> 5] & (1 << (phys & 31));
 }
 
+// The other processors may have the page mapped for fast writes, which would bypass cpu_smc_invalidate. They are kept
+// out of their TLBs while those are changed (see cpu_smp_quiesce).
+static void cpu_smc_protect_page(uint32_t page)
+{
+    struct cpu* self = cpu;
+    for (int i = 0; i < cpu_count; i++) {
+        if (cpus[i] == self)
+            continue;
+        cpu = cpus[i];
+        cpu_mmu_tlb_protect_ram(page << 12);
+    }
+    cpu = self;
+}
+
 void cpu_smc_set_code(uint32_t phys)
 {
-    phys >>= 7;
-    if ((phys >> 5) >= cpu->smc_has_code_length)
+    uint32_t chunk = phys >> 7;
+    if ((chunk >> 5) >= cpu->smc_has_code_length)
         return;
-    cpu->smc_has_code[phys >> 5] |= 1 << (phys & 31);
+    if (cpu_count > 1 && !cpu->smc_has_code[chunk >> 5]) {
+        // The first code on the page. Processors on other threads may be writing to it, so only the machine's thread
+        // write-protects it.
+        if (CPU_ON_AP_THREAD()) {
+            cpu_smp_request(SMP_SMC_SET_CODE, phys, 0, 0);
+            return;
+        }
+        cpu_smp_quiesce();
+        cpu_smc_protect_page(chunk >> 5);
+        __atomic_fetch_or(&cpu->smc_has_code[chunk >> 5], 1 << (chunk & 31), __ATOMIC_SEQ_CST);
+        cpu_smp_resume();
+        return;
+    }
+    __atomic_fetch_or(&cpu->smc_has_code[chunk >> 5], 1 << (chunk & 31), __ATOMIC_SEQ_CST);
+}
+
+// All processors run code from the same RAM, but each of them has its own trace cache. Removes the traces that start in
+// the 128-byte chunk at "physbase" from all of them. The caller makes sure that none of the others is running (see
+// cpu_smp_quiesce). Returns 1 if the current processor has one that contains "phys".
+static int cpu_smc_remove_traces(uint32_t physbase, uint32_t phys)
+{
+    struct cpu* self = cpu;
+    struct trace_info* info;
+    int quit = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        cpu = cpus[i];
+        for (int j = 0; j < 128; j++) {
+            if ((info = cpu_trace_get_entry(physbase + j))) {
+                // See if trace intersects given physical EIP and if so, exit
+                if (cpu == self && phys >= info->phys && phys <= (info->phys + TRACE_LENGTH(info->flags)))
+                    quit = 1;
+                info->phys = -1;
+            }
+        }
+    }
+    cpu = self;
+    return quit;
 }
 
 // The maximum trace length is 32 instructions, and instructions are a maximum of 15 bytes long. 32 * 15 = 480, and that rounds up to 512 bytes.
@@ -62,51 +113,66 @@ void cpu_smc_invalidate(uint32_t lin, uint32_t phys)
         if (!(page_info & invmask))
             return;
     }
+    if (CPU_ON_AP_THREAD()) {
+        cpu_smp_request(SMP_SMC_INVALIDATE, lin, phys, 0);
+        return;
+    }
+    INSTRUMENT_COUNT(smc_invalidations);
 
+    // Other processors may have added code to the page in the meantime, so look at it again once they are stopped
+    cpu_smp_quiesce();
+    page_info = cpu->smc_has_code[pageid];
     for (int i = start; i <= end; i++) {
         uint32_t mask = 1 << i;
-        if (page_info & mask) {
-            uint32_t physbase = pagebase + (i << 7);
-            struct trace_info* info;
-            for (int j = 0; j < 128; j++) {
-                if ((info = cpu_trace_get_entry(physbase + j))) {
-                    // See if trace intersects given physical EIP and if so, exit
-                    if (!quit && phys >= info->phys && phys <= (info->phys + TRACE_LENGTH(info->flags)))
-                        quit = 1;
-                    info->phys = -1;
-                }
-            }
-        }
+        if (page_info & mask)
+            quit |= cpu_smc_remove_traces(pagebase + (i << 7), phys);
     }
 
     page_info &= ~invmask;
     cpu->smc_has_code[pageid] = page_info;
+    cpu_smp_resume();
     if (!page_info)
         cpu_mmu_tlb_invalidate(lin); // Retranslate the address so that there's no more code remaining
 
     if (quit)
         INTERNAL_CPU_LOOP_EXIT();
 }
+// Removes the code on every page set in the bitmap "pages" from all processors. Unlike cpu_smc_invalidate_page, it is called
+// from outside of cpu_run, when RAM has been changed behind the processors' backs.
+void cpu_smc_invalidate_pages(uint32_t* pages)
+{
+    cpu_smp_quiesce();
+    for (uint32_t page = 0; page < cpu->smc_has_code_length; page++) {
+        if (!pages[page >> 5]) {
+            page |= 31;
+            continue;
+        }
+        if (!(pages[page >> 5] & (1 << (page & 31))) || !cpu->smc_has_code[page])
+            continue;
+        INSTRUMENT_COUNT(smc_invalidations);
+        for (int i = 0; i < 32; i++) {
+            uint32_t physbase = page << 12 | i << 7;
+            if (cpu->smc_has_code[page] & (1 << i))
+                cpu_smc_remove_traces(physbase, physbase);
+        }
+        cpu->smc_has_code[page] = 0;
+    }
+    cpu_smp_resume();
+}
+
 void cpu_smc_invalidate_page(uint32_t phys){
+    cpu_smp_quiesce();
     uint32_t pageid = phys >> 12,
     page_info = cpu->smc_has_code[pageid], pagebase = phys & ~0xFFF, quit = 1;
+    INSTRUMENT_COUNT(smc_invalidations);
     for (int i = 0; i < 31; i++) {
         uint32_t mask = 1 << i;
-        if (page_info & mask) {
-            uint32_t physbase = pagebase + (i << 7);
-            struct trace_info* info;
-            for (int j = 0; j < 128; j++) {
-                if ((info = cpu_trace_get_entry(physbase + j))) {
-                    // See if trace intersects given physical EIP and if so, exit
-                    if (!quit && phys >= info->phys && phys <= (info->phys + TRACE_LENGTH(info->flags)))
-                        quit = 1;
-                    info->phys = -1;
-                }
-            }
-        }
+        if (page_info & mask)
+            cpu_smc_remove_traces(pagebase + (i << 7), phys);
     }
 
     cpu->smc_has_code[pageid] = page_info;
+    cpu_smp_resume();
     // TODO: invalidate TLB
     if (quit)
         INTERNAL_CPU_LOOP_EXIT();
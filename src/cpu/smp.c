@@ -0,0 +1,616 @@
+// Application processors on host threads of their own
+// Each application processor gets a thread that runs cpu_run_processor in quanta of CPU_QUANTUM cycles. The thread that
+// called pc_init (the machine's thread) keeps running the BSP and remains the only one that touches the devices: port
+// and MMIO accesses, interrupt acknowledgement and everything else that belongs to the machine are handed to it as
+// requests, which it serves between the BSP's quanta (see cpu_smp_run). The processors share RAM directly. LOCK-prefixed
+// instructions and XCHG use host atomics on it (see arith_rmw in opcodes.c), and fall back to locking the bus, which
+// stops all other processors, when the operand isn't plain RAM that the TLB maps for writing.
+//
+// Changes to the TLBs and trace caches of other processors (see smc.c, cpu_for_each and cpu_set_a20) are only made by
+// the machine's thread while the others are stopped at the end of a quantum or waiting for a request. INIT and STARTUP
+// are applied once the processor has stopped, and savestates wait for all of them.
+//
+// An application processor doesn't get more than CPU_QUANTUM cycles ahead of the BSP, whose clock is the machine's (see
+// get_now), and skips forward when it falls further behind than that.
+#include "cpu/cpu.h"
+#include "cpu/fpu.h"
+#include "cpu/ops.h"
+#include "cpuapi.h"
+#include "devices.h"
+#include "io.h"
+#include "platform.h"
+#include "state.h"
+#include <string.h>
+
+#ifdef CPU_USE_THREADS
+#include <pthread.h>
+
+enum {
+    SMP_RUNNING,
+    SMP_REQUEST, // Waiting in cpu_smp_request
+    SMP_PARKED // Waiting at the end of a quantum
+};
+
+struct cpu_smp;
+struct cpu_thread {
+    struct cpu_smp* smp;
+    int id, state;
+    // While it is parked, its x87 state is kept here, where cpu_select expects it
+    struct fpu* fpu;
+    // The clock of the processor, as of its last quantum
+    uint64_t cycles;
+    // Savestates and whatever else can't have it running
+    int stopped;
+    // INIT and STARTUP IPIs that haven't been applied yet. "sipi" is the vector, or -1.
+    int init, sipi;
+    int request;
+    uint32_t args[3];
+    uint64_t result;
+    pthread_t thread;
+    pthread_cond_t cond;
+};
+
+struct cpu_smp {
+    // Protects everything in here, and in the cpu_thread structures
+    pthread_mutex_t lock;
+    // The machine's thread waits on this one. Set "waiting" before doing so.
+    pthread_cond_t cond;
+    int waiting;
+    // Non-zero while the other processors must not run. "bus_owner" is the one that may, if it locked the bus.
+    int quiesced;
+    struct cpu_thread* bus_owner;
+    // The clock of the BSP, and how far the others may run
+    uint64_t clock, limit;
+    int bsp_running;
+    // Set when a device wants cpu_run to return early
+    int brk;
+    int count;
+    struct cpu* cpus[MAX_CPUS];
+    int cpuid_limit_winnt;
+    struct cpu_thread thread[MAX_CPUS];
+};
+
+MACHINE_LOCAL struct cpu_thread* cpu_thread;
+static MACHINE_LOCAL struct cpu_smp* smp;
+
+// Whether processor "t" may start another quantum. Called with the lock held, like everything below.
+static int cpu_smp_may_run(struct cpu_thread* t)
+{
+    return !smp->quiesced && !t->stopped && !t->init && t->sipi < 0 && cpu_ap_runnable(t->id) && smp->cpus[t->id]->cycles < smp->limit;
+}
+
+// Whether processor "t" has something to do, or is doing it
+static int cpu_smp_thread_busy(struct cpu_thread* t)
+{
+    return t->state != SMP_PARKED || t->init || t->sipi >= 0 || cpu_ap_runnable(t->id);
+}
+
+// Ends the run of the current processor after the instruction that it is executing
+static void cpu_smp_end_run(void)
+{
+    cpu->cycles += cpu_get_cycles() - cpu->cycles;
+    cpu->cycles_to_run = 1;
+    cpu->cycle_offset = 1;
+    cpu->refill_counter = 0;
+}
+
+static void cpu_smp_wake_locked(void)
+{
+    int woken = 0;
+    for (int i = 1; i < smp->count; i++) {
+        struct cpu_thread* t = &smp->thread[i];
+        if (t->state == SMP_PARKED && cpu_smp_may_run(t)) {
+            pthread_cond_signal(&t->cond);
+            woken = 1;
+        } else if (t->state == SMP_REQUEST && t->request == SMP_NONE)
+            pthread_cond_signal(&t->cond);
+    }
+    // The BSP may be in the middle of a long run that it started while the others were idle. The ones that have work now
+    // would soon have to wait for its clock, so its quanta have to get shorter.
+    if (woken && smp->bsp_running && cpu == smp->cpus[0])
+        cpu_smp_end_run();
+}
+
+static void cpu_smp_wait(void)
+{
+    smp->waiting = 1;
+    pthread_cond_wait(&smp->cond, &smp->lock);
+    smp->waiting = 0;
+}
+
+// Publishes the BSP's clock, and lets the others run up to a quantum past it
+static void cpu_smp_publish(void)
+{
+    smp->clock = smp->cpus[0]->cycles;
+    smp->limit = smp->clock + CPU_QUANTUM;
+    cpu_smp_wake_locked();
+}
+
+static void cpu_smp_wait_quiesced(void)
+{
+    for (;;) {
+        int running = 0;
+        for (int i = 1; i < smp->count; i++)
+            running |= smp->thread[i].state == SMP_RUNNING && &smp->thread[i] != smp->bus_owner;
+        if (!running)
+            return;
+        cpu_smp_wait();
+    }
+}
+
+static void cpu_smp_reply(struct cpu_thread* t, uint64_t result)
+{
+    t->result = result;
+    t->request = SMP_NONE;
+    pthread_cond_signal(&t->cond);
+}
+
+static uint64_t cpu_smp_handle(struct cpu_thread* t)
+{
+    uint32_t* args = t->args;
+    switch (t->request) {
+    case SMP_INB:
+        return cpu_inb(args[0]);
+    case SMP_INW:
+        return cpu_inw(args[0]);
+    case SMP_IND:
+        return cpu_ind(args[0]);
+    case SMP_OUTB:
+        cpu_outb(args[0], args[1]);
+        break;
+    case SMP_OUTW:
+        cpu_outw(args[0], args[1]);
+        break;
+    case SMP_OUTD:
+        cpu_outd(args[0], args[1]);
+        break;
+    case SMP_MMIO_READ:
+        return io_handle_mmio_read(args[0], args[1]);
+    case SMP_MMIO_WRITE:
+        io_handle_mmio_write(args[0], args[1], args[2]);
+        break;
+    case SMP_INTERRUPT:
+        return pic_get_interrupt();
+    case SMP_FPU_IRQ:
+        pic_lower_irq(13);
+        pic_raise_irq(13);
+        break;
+    case SMP_GET_TSC_DEADLINE:
+        return apic_get_tsc_deadline();
+    case SMP_SET_TSC_DEADLINE:
+        apic_set_tsc_deadline((uint64_t)args[1] << 32 | args[0]);
+        break;
+    case SMP_PROTECT_PAGE:
+        state_protect_page(cpu->mem + args[0]);
+        break;
+    case SMP_SMC_SET_CODE:
+        cpu_smc_set_code(args[0]);
+        break;
+    case SMP_SMC_INVALIDATE:
+        cpu_smc_invalidate(args[0], args[1]);
+        break;
+    default:
+        CPU_FATAL("Unknown request %d from processor %d\n", t->request, t->id);
+    }
+    return 0;
+}
+
+// Carries out the request of processor "t" with "cpu" pointing to it, the way it would have been done if it were running
+// on this thread
+static void cpu_smp_serve(struct cpu_thread* t)
+{
+    if (t->request == SMP_LOCK_BUS) {
+        // Until it unlocks the bus again, nothing but this processor runs, and only its requests are served
+        smp->quiesced++;
+        cpu_smp_wait_quiesced();
+        smp->bus_owner = t;
+        cpu_smp_reply(t, 0);
+        for (;;) {
+            while (t->request == SMP_NONE)
+                cpu_smp_wait();
+            if (t->request == SMP_UNLOCK_BUS)
+                break;
+            cpu_smp_serve(t);
+        }
+        smp->bus_owner = NULL;
+        smp->quiesced--;
+        cpu_smp_reply(t, 0);
+        cpu_smp_wake_locked();
+        return;
+    }
+
+    uint64_t clock = smp->clock;
+    int self = cpu->id;
+    pthread_mutex_unlock(&smp->lock);
+
+    cpu_select(t->id);
+    // The devices see the time of the processor that accesses them, which mustn't be too far behind
+    if (cpu_get_cycles() + CPU_QUANTUM < clock)
+        cpu->cycles += clock - CPU_QUANTUM - cpu_get_cycles();
+    uint64_t result = cpu_smp_handle(t);
+    cpu_select(self);
+
+    pthread_mutex_lock(&smp->lock);
+    cpu_smp_reply(t, result);
+}
+
+// Applies the INIT and STARTUP IPIs that parked processor "t" has received
+static void cpu_smp_apply_ipis(struct cpu_thread* t)
+{
+    int init = t->init, sipi = t->sipi, self = cpu->id;
+    t->init = 0;
+    t->sipi = -1;
+    t->stopped++;
+    pthread_mutex_unlock(&smp->lock);
+
+    cpu_select(t->id);
+    if (init)
+        cpu_reset_processor();
+    // STARTUP IPIs are ignored unless the processor has just received an INIT
+    if (sipi >= 0 && cpu->wait_for_sipi) {
+        cpu_load_csip_real(sipi << 8, 0);
+        cpu->wait_for_sipi = 0;
+    }
+    cpu_select(self);
+
+    pthread_mutex_lock(&smp->lock);
+    t->stopped--;
+    cpu_smp_wake_locked();
+}
+
+static void cpu_smp_serve_pending(void)
+{
+    int again = 1;
+    while (again) {
+        again = 0;
+        for (int i = 1; i < smp->count; i++) {
+            struct cpu_thread* t = &smp->thread[i];
+            if (t->state == SMP_REQUEST && t->request != SMP_NONE) {
+                cpu_smp_serve(t);
+                again = 1;
+            } else if (t->state == SMP_PARKED && (t->init || t->sipi >= 0)) {
+                cpu_smp_apply_ipis(t);
+                again = 1;
+            }
+        }
+    }
+}
+
+static void cpu_smp_park(struct cpu_thread* t)
+{
+    fpu_store(t->fpu);
+    t->state = SMP_PARKED;
+    if (smp->waiting)
+        pthread_cond_signal(&smp->cond);
+    while (!cpu_smp_may_run(t))
+        pthread_cond_wait(&t->cond, &smp->lock);
+    t->state = SMP_RUNNING;
+    fpu_load(t->fpu);
+    cpu_update_mxcsr();
+}
+
+static void* cpu_smp_thread(void* arg)
+{
+    // Everything that the CPU code keeps in MACHINE_LOCAL variables starts out empty on this thread
+    struct cpu_thread* t = arg;
+    struct cpu_config config;
+    smp = t->smp;
+    cpu_thread = t;
+    cpu_count = smp->count;
+    memcpy(cpus, smp->cpus, sizeof(smp->cpus));
+    cpu = cpus[t->id];
+    memset(&config, 0, sizeof(config));
+    config.cpuid_limit_winnt = smp->cpuid_limit_winnt;
+    cpu_set_cpuid(&config);
+    fpu_load(t->fpu);
+    cpu_update_mxcsr();
+
+    pthread_mutex_lock(&smp->lock);
+    for (;;) {
+        t->cycles = cpu->cycles;
+        if (!cpu_smp_may_run(t)) {
+            cpu_smp_park(t);
+            continue;
+        }
+        // A processor that was halted, or whose thread didn't get to run, skips the time it missed
+        if (cpu->cycles + CPU_QUANTUM < smp->clock)
+            cpu->cycles = smp->clock - CPU_QUANTUM;
+        uint64_t slice = smp->limit - cpu->cycles;
+        pthread_mutex_unlock(&smp->lock);
+        cpu_run_processor(slice < CPU_QUANTUM ? slice : CPU_QUANTUM);
+        pthread_mutex_lock(&smp->lock);
+    }
+    return NULL;
+}
+
+// Starts a thread for every application processor. Called by cpu_init_smp once they have all been reset.
+int cpu_smp_start(void)
+{
+    struct cpu_smp* s = calloc(1, sizeof(struct cpu_smp));
+    if (!s)
+        return -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->count = cpu_count;
+    memcpy(s->cpus, cpus, sizeof(s->cpus));
+    s->clock = cpus[0]->cycles;
+    s->limit = s->clock + CPU_QUANTUM;
+    s->cpuid_limit_winnt = cpu_get_cpuid_limit_winnt();
+    for (int i = 1; i < cpu_count; i++) {
+        struct cpu_thread* t = &s->thread[i];
+        t->smp = s;
+        t->id = i;
+        t->fpu = fpu_get_saved(i);
+        t->sipi = -1;
+        pthread_cond_init(&t->cond, NULL);
+        if (pthread_create(&t->thread, NULL, cpu_smp_thread, t) != 0) {
+            CPU_LOG("Unable to create a thread for processor %d\n", i);
+            return -1;
+        }
+    }
+    smp = s;
+    return 0;
+}
+
+int cpu_smp_active(void)
+{
+    return smp != NULL;
+}
+
+// Runs the BSP for "cycles" cycles while the others run on their own threads, and serves their requests in between
+int cpu_smp_run(int cycles)
+{
+    int total = 0;
+    smp->brk = 0;
+    pthread_mutex_lock(&smp->lock);
+    while (total < cycles && !smp->brk) {
+        cpu_smp_serve_pending();
+        int slice = cycles - total, busy = 0;
+        for (int i = 1; i < smp->count; i++)
+            busy |= cpu_smp_thread_busy(&smp->thread[i]);
+        if (busy && slice > CPU_QUANTUM)
+            slice = CPU_QUANTUM;
+
+        smp->bsp_running = 1;
+        pthread_mutex_unlock(&smp->lock);
+        int cycles_run = cpu_run_processor(slice);
+        pthread_mutex_lock(&smp->lock);
+        smp->bsp_running = 0;
+        cpu_smp_publish();
+
+        if (cpu->exit_reason != EXIT_STATUS_HLT) {
+            total += cycles_run;
+            // A device or another processor needs attention
+            if (cycles_run < slice)
+                break;
+        } else {
+            // A halted BSP doesn't stop the others. They get the rest of the slice, and the BSP's clock catches up with
+            // them afterwards.
+            uint64_t start = cpu->cycles, target = start + (slice - cycles_run), most = start;
+            smp->limit = target;
+            cpu_smp_wake_locked();
+            while (!smp->brk) {
+                cpu_smp_serve_pending();
+                if (cpu->intr_line_state && cpu->eflags & EFLAGS_IF)
+                    break;
+                busy = 0;
+                for (int i = 1; i < smp->count; i++) {
+                    struct cpu_thread* t = &smp->thread[i];
+                    busy |= t->state != SMP_PARKED || cpu_smp_may_run(t) || t->init || t->sipi >= 0;
+                }
+                if (!busy)
+                    break;
+                cpu_smp_wait();
+            }
+            for (int i = 1; i < smp->count; i++)
+                if (smp->thread[i].cycles > most)
+                    most = smp->thread[i].cycles;
+            if (most > target)
+                most = target;
+            cpu->cycles = most;
+            cycles_run += most - start;
+            cpu_smp_publish();
+
+            // Nothing left to do until a device interrupts
+            if (!cycles_run && !(cpu->intr_line_state && cpu->eflags & EFLAGS_IF)) {
+                busy = 0;
+                for (int i = 1; i < smp->count; i++)
+                    busy |= cpu_smp_thread_busy(&smp->thread[i]);
+                if (!busy)
+                    break;
+            }
+            total += cycles_run;
+        }
+    }
+    pthread_mutex_unlock(&smp->lock);
+    return total;
+}
+
+// Whether any application processor has work to do. The machine isn't idle until none of them has.
+int cpu_smp_busy(void)
+{
+    int busy = 0;
+    pthread_mutex_lock(&smp->lock);
+    for (int i = 1; i < smp->count; i++)
+        busy |= cpu_smp_thread_busy(&smp->thread[i]);
+    pthread_mutex_unlock(&smp->lock);
+    return busy;
+}
+
+// Called on the thread of an application processor. Has the machine's thread do "request" for it, and waits for the
+// result.
+uint64_t cpu_smp_request(int request, uint32_t a, uint32_t b, uint32_t c)
+{
+    struct cpu_thread* t = cpu_thread;
+    pthread_mutex_lock(&smp->lock);
+    t->request = request;
+    t->args[0] = a;
+    t->args[1] = b;
+    t->args[2] = c;
+    t->state = SMP_REQUEST;
+    if (smp->waiting)
+        pthread_cond_signal(&smp->cond);
+    // Don't go on while the others are stopped, unless it's for us
+    while (t->request != SMP_NONE || (smp->quiesced && smp->bus_owner != t))
+        pthread_cond_wait(&t->cond, &smp->lock);
+    t->state = SMP_RUNNING;
+    uint64_t result = t->result;
+    pthread_mutex_unlock(&smp->lock);
+    return result;
+}
+
+// Waits until no application processor is running, and keeps them from starting again until cpu_smp_resume. Called on
+// the machine's thread before it changes something that they cache, like their TLBs. Calls can be nested.
+void cpu_smp_quiesce(void)
+{
+    if (!smp)
+        return;
+    pthread_mutex_lock(&smp->lock);
+    smp->quiesced++;
+    cpu_smp_wait_quiesced();
+    pthread_mutex_unlock(&smp->lock);
+}
+void cpu_smp_resume(void)
+{
+    if (!smp)
+        return;
+    pthread_mutex_lock(&smp->lock);
+    if (!--smp->quiesced)
+        cpu_smp_wake_locked();
+    pthread_mutex_unlock(&smp->lock);
+}
+
+// Waits until every application processor is parked at the end of a quantum, and keeps them there until
+// cpu_smp_restart. Their registers can be read and written in the meantime. Must not be called while a request is served.
+void cpu_smp_stop(void)
+{
+    if (!smp)
+        return;
+    pthread_mutex_lock(&smp->lock);
+    for (int i = 1; i < smp->count; i++)
+        smp->thread[i].stopped++;
+    for (;;) {
+        cpu_smp_serve_pending();
+        int parked = 1;
+        for (int i = 1; i < smp->count; i++)
+            parked &= smp->thread[i].state == SMP_PARKED;
+        if (parked)
+            break;
+        cpu_smp_wait();
+    }
+    pthread_mutex_unlock(&smp->lock);
+}
+void cpu_smp_restart(void)
+{
+    if (!smp)
+        return;
+    pthread_mutex_lock(&smp->lock);
+    for (int i = 1; i < smp->count; i++)
+        smp->thread[i].stopped--;
+    // The BSP's clock may have been changed by a savestate
+    cpu_smp_publish();
+    pthread_mutex_unlock(&smp->lock);
+}
+
+// Lets parked processors that have something to do again run, for instance after an interrupt was raised for them
+void cpu_smp_wake(void)
+{
+    if (!smp)
+        return;
+    pthread_mutex_lock(&smp->lock);
+    cpu_smp_wake_locked();
+    pthread_mutex_unlock(&smp->lock);
+}
+
+// Makes cpu_smp_run return once the BSP's run has ended
+void cpu_smp_break(void)
+{
+    if (smp && !cpu_thread)
+        smp->brk = 1;
+}
+
+// INIT and STARTUP IPIs are applied by the machine's thread once the processor has parked (see cpu_smp_serve_pending).
+// Devices may send them while a request of any processor is being served, even the target's own.
+void cpu_smp_send_init(int id)
+{
+    pthread_mutex_lock(&smp->lock);
+    smp->thread[id].init = 1;
+    smp->thread[id].sipi = -1;
+    if (cpu == smp->cpus[id] || (smp->bsp_running && cpu == smp->cpus[0]))
+        cpu_smp_end_run();
+    if (smp->waiting)
+        pthread_cond_signal(&smp->cond);
+    pthread_mutex_unlock(&smp->lock);
+}
+void cpu_smp_send_startup(int id, int vector)
+{
+    pthread_mutex_lock(&smp->lock);
+    smp->thread[id].sipi = vector;
+    if (cpu == smp->cpus[id] || (smp->bsp_running && cpu == smp->cpus[0]))
+        cpu_smp_end_run();
+    if (smp->waiting)
+        pthread_cond_signal(&smp->cond);
+    pthread_mutex_unlock(&smp->lock);
+}
+
+// Around LOCK-prefixed instructions and XCHG that can't use host atomics, because the operand isn't in RAM that the TLB
+// maps for writing. Nothing else runs in the meantime.
+void cpu_smp_lock_bus(void)
+{
+    if (cpu_thread)
+        cpu_smp_request(SMP_LOCK_BUS, 0, 0, 0);
+    else
+        cpu_smp_quiesce();
+}
+void cpu_smp_unlock_bus(void)
+{
+    if (cpu_thread)
+        cpu_smp_request(SMP_UNLOCK_BUS, 0, 0, 0);
+    else
+        cpu_smp_resume();
+}
+#else
+// Without threads, the processors take turns on the machine's thread (see cpu_run), and none of this is needed
+int cpu_smp_start(void)
+{
+    return -1;
+}
+int cpu_smp_active(void)
+{
+    return 0;
+}
+int cpu_smp_run(int cycles)
+{
+    UNUSED(cycles);
+    return 0;
+}
+int cpu_smp_busy(void)
+{
+    return 0;
+}
+uint64_t cpu_smp_request(int request, uint32_t a, uint32_t b, uint32_t c)
+{
+    UNUSED(request);
+    UNUSED(a);
+    UNUSED(b);
+    UNUSED(c);
+    return 0;
+}
+void cpu_smp_quiesce(void) {}
+void cpu_smp_resume(void) {}
+void cpu_smp_stop(void) {}
+void cpu_smp_restart(void) {}
+void cpu_smp_wake(void) {}
+void cpu_smp_break(void) {}
+void cpu_smp_send_init(int id)
+{
+    UNUSED(id);
+}
+void cpu_smp_send_startup(int id, int vector)
+{
+    UNUSED(id);
+    UNUSED(vector);
+}
+void cpu_smp_lock_bus(void) {}
+void cpu_smp_unlock_bus(void) {}
+#endif
@@ -1,4 +1,5 @@
 #include "cpu/cpu.h"
+#include "cpu/instrument.h"
 #include "cpu/opcodes.h"
 #include <string.h>
 
@@ -14,6 +15,7 @@ void cpu_trace_flush(void)
 {
     memset(cpu->trace_info, 0, sizeof(struct trace_info) * TRACE_INFO_ENTRIES);
     cpu->trace_cache_usage = 0;
+    INSTRUMENT_COUNT(trace_flushes);
 }
 
 struct trace_info* cpu_trace_get_entry(uint32_t phys)
@@ -45,6 +47,7 @@ struct decoded_instruction* cpu_get_trace(void)
         if(trace->ptr == NULL) {
             CPU_FATAL("TRACE is NULL (internal CPU bug 1)\n");
         }
+        INSTRUMENT_COUNT(trace_hits);
         return trace->ptr;
     }
 
@@ -57,6 +60,7 @@ struct decoded_instruction* cpu_get_trace(void)
     // Translate the instructions, as needed
     struct decoded_instruction* i = &cpu->trace_cache[cpu->trace_cache_usage];
     cpu->trace_cache_usage += cpu_decode(trace, i);
+    INSTRUMENT_COUNT(traces_decoded);
     if(i == NULL) {
         CPU_FATAL("TRACE is NULL from decode (internal CPU bug) 0\n");
     }
@@ -0,0 +1,180 @@
+// Display driver for running without a screen, e.g. in batch jobs and benchmarks. Build with "make HEADLESS=1"
+// The screen is kept in memory only. Optionally, a hash of it is computed every frame so that scripts can wait for a
+// certain screen to appear, and frames can be written to disk as PPM images.
+#ifdef HEADLESS
+
+#include "display.h"
+#include "platform.h"
+#include "util.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define DISPLAY_LOG(x, ...) LOG("DISPLAY", x, ##__VA_ARGS__)
+
+static MACHINE_LOCAL struct display_settings* settings;
+
+static MACHINE_LOCAL uint32_t* pixels;
+static MACHINE_LOCAL int w, h;
+
+// Hash of every row of the screen. Only the rows that changed are hashed again, and the hash of the screen is computed
+// from these.
+static MACHINE_LOCAL uint64_t *row_hashes, screen_hash;
+static MACHINE_LOCAL int hashing, frames;
+
+#ifdef SIGUSR1
+// Counted like the counter dump requests in instrument.c, so that every machine in the process takes a screenshot
+static volatile sig_atomic_t screenshot_requests;
+static MACHINE_LOCAL sig_atomic_t screenshot_requests_seen;
+static void display_screenshot_signal(int sig)
+{
+    UNUSED(sig);
+    screenshot_requests++;
+}
+#endif
+
+void* display_get_pixels(void)
+{
+    return pixels;
+}
+
+static uint64_t display_hash_row(int y)
+{
+    // 64-bit FNV-1a on pixels instead of bytes
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int x = 0; x < w; x++)
+        hash = (hash ^ (pixels[y * w + x] & 0xFFFFFF)) * 0x100000001B3ULL;
+    return hash;
+}
+
+static void display_rehash(struct display_rect* rects, int count)
+{
+    for (int i = 0; i < count; i++)
+        for (int y = rects[i].y; y < rects[i].y + rects[i].height; y++)
+            row_hashes[y] = display_hash_row(y);
+
+    uint64_t hash = 0xCBF29CE484222325ULL ^ ((uint64_t)w << 32 | h);
+    for (int y = 0; y < h; y++)
+        hash = (hash ^ row_hashes[y]) * 0x100000001B3ULL;
+    screen_hash = hash;
+}
+
+static void display_screenshot(void)
+{
+    char path[1000];
+    snprintf(path, sizeof(path), "%s-%06d.ppm", settings->screenshot_path ? settings->screenshot_path : "screenshot", frames);
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Unable to write screenshot %s\n", path);
+        return;
+    }
+    uint8_t* row = halloc(w * 3);
+    fprintf(f, "P6\n%d %d\n255\n", w, h);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            uint32_t pixel = pixels[y * w + x];
+            row[x * 3] = pixel >> 16;
+            row[x * 3 + 1] = pixel >> 8;
+            row[x * 3 + 2] = pixel;
+        }
+        fwrite(row, w * 3, 1, f);
+    }
+    free(row);
+    fclose(f);
+}
+
+void display_set_resolution(int width, int height)
+{
+    if (!width && !height) {
+        display_set_resolution(640, 480);
+        return;
+    }
+    DISPLAY_LOG("Changed resolution to w=%d h=%d\n", width, height);
+    free(pixels);
+    free(row_hashes);
+    pixels = halloc(width * height * 4);
+    memset(pixels, 0, width * height * 4);
+    w = width;
+    h = height;
+
+    if (hashing) {
+        struct display_rect all = { 0, 0, w, h };
+        row_hashes = halloc(h * sizeof(uint64_t));
+        display_rehash(&all, 1);
+    } else
+        row_hashes = NULL;
+}
+
+void display_update(struct display_rect* rects, int count)
+{
+    frames++;
+
+    if (hashing && count) {
+        uint64_t old_hash = screen_hash;
+        display_rehash(rects, count);
+        if (settings->print_hash && screen_hash != old_hash)
+            printf("Frame %d: screen hash %016llx\n", frames, (unsigned long long)screen_hash);
+    }
+
+    int screenshot = settings->screenshot_interval && frames % settings->screenshot_interval == 0;
+#ifdef SIGUSR1
+    screenshot |= screenshot_requests != screenshot_requests_seen;
+    screenshot_requests_seen = screenshot_requests;
+#endif
+    if (screenshot)
+        display_screenshot();
+
+    if (settings->wait_enabled) {
+        if (screen_hash == settings->wait_hash) {
+            printf("Screen hash %016llx matched after %d frames\n", (unsigned long long)screen_hash, frames);
+            exit(0);
+        }
+        if (settings->wait_frames && frames >= settings->wait_frames) {
+            printf("Screen hash %016llx did not match after %d frames\n", (unsigned long long)screen_hash, frames);
+            exit(1);
+        }
+    }
+}
+
+void display_handle_events(void)
+{
+}
+
+void display_update_cycles(int cycles_elapsed, int us)
+{
+    UNUSED(cycles_elapsed);
+    UNUSED(us);
+}
+
+void display_sleep(int ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+void display_release_mouse(void)
+{
+}
+
+void display_init(struct display_settings* s)
+{
+    settings = s;
+    hashing = s->print_hash || s->wait_enabled;
+#ifdef SIGUSR1
+    screenshot_requests_seen = screenshot_requests;
+    signal(SIGUSR1, display_screenshot_signal);
+#endif
+    display_set_resolution(640, 480);
+}
+
+#endif // HEADLESS
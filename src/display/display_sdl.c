@@ -1,4 +1,5 @@
 // Simple display driver
+#ifndef HEADLESS
 
 // For Emscripten, we use a faster method by simply slicing the buffers instead of copying them dword by dword
 // We still need SDL for events and the window title, but the blitting can be done independently.
@@ -102,31 +103,30 @@ void display_set_resolution(int width, int height)
 #endif
 }
 
-void display_update(int scanline_start, int scanlines)
+void display_update(struct display_rect* rects, int count)
 {
     if (!resized)
         return;
-    if ((w == 0) || (h == 0))
+    if ((w == 0) || (h == 0) || !count)
         return;
-    if ((scanline_start + scanlines) > h) {
-        printf("%d x %d [%d %d]\n", w, h, scanline_start, scanlines);
-        ABORT();
-    } else {
-//printf("Updating %d scanlines starting from %d\n", scanlines, scanline_start);
 #ifndef EMSCRIPTEN
-        SDL_Rect rect;
-        rect.x = 0;
-        rect.y = 0;
-        rect.w = w;
-        rect.h = h;
-        //__asm__("int3");
-        SDL_BlitSurface(surface, &rect, screen, &rect);
-        SDL_Flip(screen);
+    SDL_Rect sdl_rects[count];
+    for (int i = 0; i < count; i++) {
+        if (rects[i].x + rects[i].width > w || rects[i].y + rects[i].height > h) {
+            printf("%d x %d [%d %d %d %d]\n", w, h, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+            ABORT();
+        }
+        sdl_rects[i].x = rects[i].x;
+        sdl_rects[i].y = rects[i].y;
+        sdl_rects[i].w = rects[i].width;
+        sdl_rects[i].h = rects[i].height;
+        SDL_BlitSurface(surface, &sdl_rects[i], screen, &sdl_rects[i]);
+    }
+    SDL_UpdateRects(screen, count, sdl_rects);
 #else
-        emscripten_flip();
+    UNUSED(rects);
+    emscripten_flip();
 #endif
-        //SDL_UpdateRect(surface, 0, scanline_start, w, scanlines);
-    }
 }
 
 static int input_captured = 0;
@@ -366,8 +366,9 @@ void display_send_scancode(int key)
     display_kbd_send_key(key);
 }
 
-void display_init(void)
+void display_init(struct display_settings* settings)
 {
+    UNUSED(settings);
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_NOPARACHUTE))
         DISPLAY_FATAL("Unable to initialize SDL");
 
@@ -390,3 +391,5 @@ void display_sleep(int ms)
 {
     SDL_Delay(ms);
 }
+
+#endif // HEADLESS
@@ -2,15 +2,18 @@
 
 #include <profan/syscall.h>
 #include <stdlib.h>
+#include <string.h>
 #include "devices.h"
+#include "display.h"
 
 // display_update
 // display_handle_events
 
-int x, y;
+int x, y, border;
 uint32_t *screen;
 
-void display_init(void) {
+void display_init(struct display_settings *settings) {
+    (void)settings;
     screen = NULL;
     x = y = 0;
 }
@@ -25,6 +28,7 @@ void display_set_resolution(int width, int height) {
     screen = malloc(width * height * sizeof(uint32_t));
     x = width;
     y = height;
+    border = 1;
 }
 
 void display_sleep(int ms) {
@@ -42,17 +46,22 @@ void display_handle_events(void) {
     kbd_add_key(k & 0xFF);
 }
 
-void display_update(void) {
+void display_update(struct display_rect *rects, int count) {
     uint32_t *fb = syscall_vesa_fb();
     uint32_t pitch = syscall_vesa_pitch();
 
-    for (int i = 0; i <= x; i++) {
-        for (int j = 0; j <= y; j++) {
-            if (i == x || j == y)
-                fb[i + j * pitch] = 0xFFFFFF;
-            else
-                fb[i + j * pitch] = screen[i + j * x];
-        }
+    // The border only has to be drawn again after the resolution changes
+    if (border) {
+        for (int i = 0; i <= x; i++)
+            fb[i + y * pitch] = 0xFFFFFF;
+        for (int j = 0; j < y; j++)
+            fb[x + j * pitch] = 0xFFFFFF;
+        border = 0;
+    }
+
+    for (int r = 0; r < count; r++) {
+        for (int j = rects[r].y; j < rects[r].y + rects[r].height; j++)
+            memcpy(&fb[rects[r].x + j * pitch], &screen[rects[r].x + j * x], rects[r].width * sizeof(uint32_t));
     }
 }
 
@@ -4,7 +4,9 @@
 #define DISABLE_ZLIB
 
 #include "drive.h"
+#include "cpu/instrument.h"
 #include "platform.h"
+#include "replay.h"
 #include "state.h"
 #include "util.h"
 #include <stdlib.h>
@@ -27,10 +29,10 @@
 #endif
 #define SIMULATE_ASYNC_ACCESS
 #if !defined(EMSCRIPTEN) && defined(SIMULATE_ASYNC_ACCESS)
-static void (*global_cb)(void*, int);
-static void* global_cb_arg1;
+static MACHINE_LOCAL void (*global_cb)(void*, int);
+static MACHINE_LOCAL void* global_cb_arg1;
 #endif
-static int transfer_in_progress = 0;
+static MACHINE_LOCAL int transfer_in_progress = 0;
 
 void drive_cancel_transfers(void)
 {
@@ -47,6 +49,7 @@ void drive_cancel_transfers(void)
 
 int drive_read(struct drive_info* info, void* a, void* b, uint32_t c, drv_offset_t d, drive_cb e)
 {
+    INSTRUMENT_COUNT_N(disk_bytes_read, c);
     return info->read(info->data, a, b, c, d, e);
 }
 int drive_prefetch(struct drive_info* info, void* a, uint32_t b, drv_offset_t c, drive_cb d)
@@ -55,6 +58,7 @@ int drive_prefetch(struct drive_info* info, void* a, uint32_t b, drv_offset_t c,
 }
 int drive_write(struct drive_info* info, void* a, void* b, uint32_t c, drv_offset_t d, drive_cb e)
 {
+    INSTRUMENT_COUNT_N(disk_bytes_written, c);
     return info->write(info->data, a, b, c, d, e);
 }
 
@@ -725,6 +729,8 @@ void drive_check_complete(void)
 {
 #if !defined(EMSCRIPTEN) && defined(SIMULATE_ASYNC_ACCESS)
     if (transfer_in_progress) {
+        if (replay_event(REPLAY_DRIVE_COMPLETE, 0, 0, 0, 0))
+            return;
         global_cb(global_cb_arg1, 0);
         transfer_in_progress = 0;
     }
@@ -785,6 +791,9 @@ int drive_init(struct drive_info* info, char* filename)
 #endif
 void drive_state(struct drive_info* info, char* filename)
 {
+    // Disk contents are not part of the in-memory snapshot
+    if (state_is_snapshot())
+        return;
     info->state(info->data, filename);
 }
 
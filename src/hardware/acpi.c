@@ -11,7 +11,7 @@
 
 #define ACPI_CLOCK_SPEED 3579545
 
-struct acpi_state {
+MACHINE_LOCAL struct acpi_state {
     // <<< BEGIN STRUCT "struct" >>>
     int enabled;
 
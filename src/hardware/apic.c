@@ -26,6 +26,12 @@
 
 #define LVT_DISABLED (1 << 16)
 
+enum {
+    TIMER_MODE_ONE_SHOT = 0,
+    TIMER_MODE_PERIODIC = 1,
+    TIMER_MODE_TSC_DEADLINE = 2
+};
+
 #define EDGE_TRIGGERED 0
 #define LEVEL_TRIGGERED 1
 
@@ -46,10 +52,11 @@ enum {
     LVT_DELIVERY_LOWEST_PRIORITY = 3,
     LVT_DELIVERY_NMI = 4,
     LVT_DELIVERY_INIT = 5,
+    LVT_DELIVERY_STARTUP = 6,
     LVT_DELIVERY_EXT_INT = 7
 };
 
-static struct apic_info {
+static MACHINE_LOCAL struct apic_info {
     // <<< BEGIN STRUCT "struct" >>>
     uint32_t base;
 
@@ -71,6 +78,9 @@ static struct apic_info {
     uint32_t timer_divide, timer_initial_count;
     itick_t timer_reload_time, timer_next;
 
+    // Value of IA32_TSC_DEADLINE, in TSC units. Zero if disarmed.
+    uint64_t tsc_deadline;
+
     uint32_t destination_format, logical_destination;
     int dest_format_physical;
 
@@ -82,36 +92,54 @@ static struct apic_info {
 
     uint32_t temp_data;
     // <<< END STRUCT "struct" >>>
-} apic;
+} apics[MAX_CPUS];
 
-static void apic_state(void)
+// There is one APIC per processor. "apic" is the one that the code below works on, which is the running processor's
+// except while a message is being delivered to another one.
+static MACHINE_LOCAL struct apic_info *apic, *running_apic;
+static MACHINE_LOCAL int apic_count;
+
+static void apic_state_one(char* name)
 {
     // <<< BEGIN AUTOGENERATE "state" >>>
-    struct bjson_object* obj = state_obj("apic", 22 + 0);
-    state_field(obj, 4, "apic.base", &apic.base);
-    state_field(obj, 4, "apic.spurious_interrupt_vector", &apic.spurious_interrupt_vector);
-    state_field(obj, 28, "apic.lvt", &apic.lvt);
-    state_field(obj, 32, "apic.isr", &apic.isr);
-    state_field(obj, 32, "apic.tmr", &apic.tmr);
-    state_field(obj, 32, "apic.irr", &apic.irr);
-    state_field(obj, 8, "apic.icr", &apic.icr);
-    state_field(obj, 4, "apic.id", &apic.id);
-    state_field(obj, 4, "apic.error", &apic.error);
-    state_field(obj, 4, "apic.cached_error", &apic.cached_error);
-    state_field(obj, 4, "apic.timer_divide", &apic.timer_divide);
-    state_field(obj, 4, "apic.timer_initial_count", &apic.timer_initial_count);
-    state_field(obj, 8, "apic.timer_reload_time", &apic.timer_reload_time);
-    state_field(obj, 8, "apic.timer_next", &apic.timer_next);
-    state_field(obj, 4, "apic.destination_format", &apic.destination_format);
-    state_field(obj, 4, "apic.logical_destination", &apic.logical_destination);
-    state_field(obj, 4, "apic.dest_format_physical", &apic.dest_format_physical);
-    state_field(obj, 4, "apic.intr_line_state", &apic.intr_line_state);
-    state_field(obj, 4, "apic.task_priority", &apic.task_priority);
-    state_field(obj, 4, "apic.processor_priority", &apic.processor_priority);
-    state_field(obj, 4, "apic.enabled", &apic.enabled);
-    state_field(obj, 4, "apic.temp_data", &apic.temp_data);
+    struct bjson_object* obj = state_obj(name, 23 + 0);
+    state_field(obj, 4, "apic.base", &apic->base);
+    state_field(obj, 4, "apic.spurious_interrupt_vector", &apic->spurious_interrupt_vector);
+    state_field(obj, 28, "apic.lvt", &apic->lvt);
+    state_field(obj, 32, "apic.isr", &apic->isr);
+    state_field(obj, 32, "apic.tmr", &apic->tmr);
+    state_field(obj, 32, "apic.irr", &apic->irr);
+    state_field(obj, 8, "apic.icr", &apic->icr);
+    state_field(obj, 4, "apic.id", &apic->id);
+    state_field(obj, 4, "apic.error", &apic->error);
+    state_field(obj, 4, "apic.cached_error", &apic->cached_error);
+    state_field(obj, 4, "apic.timer_divide", &apic->timer_divide);
+    state_field(obj, 4, "apic.timer_initial_count", &apic->timer_initial_count);
+    state_field(obj, 8, "apic.timer_reload_time", &apic->timer_reload_time);
+    state_field(obj, 8, "apic.timer_next", &apic->timer_next);
+    state_field(obj, 8, "apic.tsc_deadline", &apic->tsc_deadline);
+    state_field(obj, 4, "apic.destination_format", &apic->destination_format);
+    state_field(obj, 4, "apic.logical_destination", &apic->logical_destination);
+    state_field(obj, 4, "apic.dest_format_physical", &apic->dest_format_physical);
+    state_field(obj, 4, "apic.intr_line_state", &apic->intr_line_state);
+    state_field(obj, 4, "apic.task_priority", &apic->task_priority);
+    state_field(obj, 4, "apic.processor_priority", &apic->processor_priority);
+    state_field(obj, 4, "apic.enabled", &apic->enabled);
+    state_field(obj, 4, "apic.temp_data", &apic->temp_data);
 // <<< END AUTOGENERATE "state" >>>
 }
+static void apic_state(void)
+{
+    // The BSP's APIC keeps the name it had before there were several
+    apic_state_one("apic");
+    for (int i = 1; i < apic_count; i++) {
+        char name[16];
+        sprintf(name, "apic%d", i);
+        apic = &apics[i];
+        apic_state_one(name);
+    }
+    apic = running_apic;
+}
 
 static inline void set_bit(uint32_t* ptr, int bitpos, int bit)
 {
@@ -153,11 +181,11 @@ static void apic_send_highest_priority_interrupt(void)
     // See section 10.8 of Intel SDM
 
     // Ignore if INTR is already high -- this means that we've signalled the CPU but it doesn't want to respond. In that case, it's the CPU's fault!
-    if (apic.intr_line_state == 1)
+    if (apic->intr_line_state == 1)
         return;
 
     // Send the highest priority interrupt
-    int highest_interrupt_requested = highest_set_bit(apic.irr), highest_interrupt_in_service = highest_set_bit(apic.isr);
+    int highest_interrupt_requested = highest_set_bit(apic->irr), highest_interrupt_in_service = highest_set_bit(apic->isr);
     if (highest_interrupt_requested == -1)
         return; // No interrupts were requested, so don't send any!
 
@@ -165,16 +193,17 @@ static void apic_send_highest_priority_interrupt(void)
     // If the interrupt requested has a greater priority, then send another one.
     if (highest_interrupt_in_service < highest_interrupt_requested) {
         // "The processor will deliver only those interrupts that have an interrupt-priority class higher than the processor-priority class in the PPR." (page 391)
-        if ((highest_interrupt_requested & 0xF0) > (apic.task_priority & 0xF0)) {
+        if ((highest_interrupt_requested & 0xF0) > (apic->task_priority & 0xF0)) {
             // At this point, the interrupt will be serviced, so set all approriate fields
-            apic.processor_priority = highest_interrupt_requested & 0xF0; // "PPR[7:4] (the processor-priority class) the maximum of TPR[7:4] (the task- priority class) and ISRV[7:4] (the priority of the highest priority interrupt in service)."
+            apic->processor_priority = highest_interrupt_requested & 0xF0; // "PPR[7:4] (the processor-priority class) the maximum of TPR[7:4] (the task- priority class) and ISRV[7:4] (the priority of the highest priority interrupt in service)."
 
             //if(highest_interrupt_requested != 0xD1) {printf("Sending interrupt: %02x\n", highest_interrupt_requested); __asm__("int3"); }
             // At this point, we simply need to kick the CPU out from its loop and wait for it to acknowledge the interrupt.
             // The next function that will be called is apic_get_interrupt()
-            apic.intr_line_state = 1;
-            cpu_raise_intr_line();
-            cpu_request_fast_return(EXIT_STATUS_IRQ);
+            apic->intr_line_state = 1;
+            cpu_raise_intr_line_of(apic - apics);
+            if (apic == running_apic)
+                cpu_request_fast_return(EXIT_STATUS_IRQ);
         } else // Task priority is too high -- refrain from sending interrupt
             return;
     } else // Nothing changes -- wait for completion
@@ -185,16 +214,16 @@ int apic_get_interrupt(void)
 {
     // Acknowledges the interrupt, lowers the INTR line, modifies appropriate bits, and sends interrupt vector back to cpu->
 
-    int highest_irr = highest_set_bit(apic.irr);
+    int highest_irr = highest_set_bit(apic->irr);
     if (highest_irr == -1) {
         APIC_FATAL("TODO: spurious interrupts\n");
     }
     // TODO: check PPR for spurious interrupt
 
-    set_bit(apic.irr, highest_irr, 0);
-    set_bit(apic.isr, highest_irr, 1);
+    set_bit(apic->irr, highest_irr, 0);
+    set_bit(apic->isr, highest_irr, 1);
 
-    apic.intr_line_state = 0;
+    apic->intr_line_state = 0;
     cpu_lower_intr_line();
 
     APIC_LOG("Sending interrupt %x\n", highest_irr);
@@ -204,17 +233,25 @@ int apic_get_interrupt(void)
 
 int apic_has_interrupt(void)
 {
-    return apic.intr_line_state;
+    return apic->intr_line_state;
 }
 
-void apic_receive_bus_message(int vector, int type, int trigger_mode)
+static void apic_reset_registers(void);
+
+static void apic_accept_message(int vector, int type, int trigger_mode)
 {
     APIC_LOG("Received bus message: vector=%02x type=%d trigger=%d\n", vector, type, trigger_mode);
     // Section 10.8
     switch (type) {
     case LVT_DELIVERY_INIT:
-        APIC_FATAL("TODO: INIT delivery\n");
-        //io_trigger_reset();
+        // Only application processors can be reset on their own
+        if (apic == apics)
+            APIC_FATAL("TODO: INIT delivery\n");
+        apic_reset_registers();
+        cpu_send_init(apic - apics);
+        break;
+    case LVT_DELIVERY_STARTUP:
+        cpu_send_startup(apic - apics, vector);
         break;
     case LVT_DELIVERY_NMI:
         APIC_FATAL("TODO: NMI delivery\n");
@@ -224,66 +261,96 @@ void apic_receive_bus_message(int vector, int type, int trigger_mode)
         break;
     case LVT_DELIVERY_EXT_INT:
         // Set IRR -- no further action required
-        set_bit(apic.irr, vector, 1);
+        set_bit(apic->irr, vector, 1);
         apic_send_highest_priority_interrupt();
         break;
     case LVT_DELIVERY_FIXED:
     case LVT_DELIVERY_LOWEST_PRIORITY:
         // Check if vector is invalid
         if (vector_invalid(vector)) {
-            apic.error |= APIC_RECV_INVALID_VECTOR;
+            apic->error |= APIC_RECV_INVALID_VECTOR;
             apic_error();
         }
         // Check if interrupt has already been sent
-        if (get_bit(apic.irr, vector))
+        if (get_bit(apic->irr, vector))
             return;
-        set_bit(apic.irr, vector, 1);
-        set_bit(apic.tmr, vector, trigger_mode);
+        set_bit(apic->irr, vector, 1);
+        set_bit(apic->tmr, vector, trigger_mode);
         apic_send_highest_priority_interrupt();
         break;
     }
 }
 
-// Send an inter processor interrupt to a CPU with APIC ID "destination"
-static void apic_send_ipi2(uint32_t vector, int mode, int trigger, uint32_t destination)
+// Returns a mask of the APICs that "destination" refers to. In logical mode, only the flat model is supported.
+static int apic_match_destination(uint32_t destination, int logical)
 {
-    if (vector_invalid(vector)) {
-        apic.error |= APIC_SEND_INVALID_VECTOR; // Is this right?
-        apic_error();
+    int targets = 0;
+    for (int i = 0; i < apic_count; i++) {
+        if (logical ? (apics[i].logical_destination >> 24 & destination) != 0 : destination == 0xFF || destination == apics[i].id >> 24)
+            targets |= 1 << i;
     }
+    return targets;
+}
 
-    // Only supports a single processor system at the moment
-    if (destination == apic.id) {
-        apic_receive_bus_message(vector, mode, trigger);
+// Delivers a message to every APIC in "targets"
+static void apic_deliver(int targets, int vector, int type, int trigger_mode)
+{
+    // Lowest priority messages go to only one of them
+    if (type == LVT_DELIVERY_LOWEST_PRIORITY && targets & (targets - 1)) {
+        int lowest = -1;
+        for (int i = 0; i < apic_count; i++)
+            if (targets >> i & 1 && (lowest < 0 || apics[i].task_priority < apics[lowest].task_priority))
+                lowest = i;
+        targets = 1 << lowest;
     }
+
+    struct apic_info* self = apic;
+    for (int i = 0; i < apic_count; i++) {
+        if (!(targets >> i & 1))
+            continue;
+        apic = &apics[i];
+        apic_accept_message(vector, type, trigger_mode);
+    }
+    apic = self;
+
+    // End the time slice so that the other processors see the message soon. The sender is often waiting for an answer.
+    if (targets & ~(1 << (running_apic - apics)))
+        cpu_cancel_execution_cycle(EXIT_STATUS_NORMAL);
 }
 
-static void apic_send_ipi(uint32_t vector, int mode, int trigger)
+// Messages from the I/O APIC. Without other processors, everything goes to the BSP, wherever it was sent.
+void apic_receive_bus_message(int vector, int type, int trigger_mode, uint32_t destination, int logical)
 {
-    if (vector_invalid(vector)) {
-        apic.error |= APIC_SEND_INVALID_VECTOR; // Is this right?
+    apic_deliver(apic_count == 1 ? 1 : apic_match_destination(destination, logical), vector, type, trigger_mode);
+}
+
+// Send an inter processor interrupt to the APICs in "targets"
+static void apic_send_ipi(uint32_t vector, int mode, int trigger, int targets)
+{
+    if (vector_invalid(vector) && (mode == LVT_DELIVERY_FIXED || mode == LVT_DELIVERY_LOWEST_PRIORITY)) {
+        apic->error |= APIC_SEND_INVALID_VECTOR; // Is this right?
         apic_error();
     }
-    apic_receive_bus_message(vector, mode, trigger);
+    apic_deliver(targets, vector, mode, trigger);
 }
 
 static uint32_t* get_lvt_ptr(int idx)
 {
     switch (idx) {
     case 0x2F:
-        return &apic.lvt[LVT_INDEX_CMCI];
+        return &apic->lvt[LVT_INDEX_CMCI];
     case 0x32:
-        return &apic.lvt[LVT_INDEX_TIMER];
+        return &apic->lvt[LVT_INDEX_TIMER];
     case 0x33:
-        return &apic.lvt[LVT_INDEX_THERMAL];
+        return &apic->lvt[LVT_INDEX_THERMAL];
     case 0x34:
-        return &apic.lvt[LVT_INDEX_PERFORMANCE_COUNTER];
+        return &apic->lvt[LVT_INDEX_PERFORMANCE_COUNTER];
     case 0x35:
-        return &apic.lvt[LVT_LINT0];
+        return &apic->lvt[LVT_LINT0];
     case 0x36:
-        return &apic.lvt[LVT_LINT1];
+        return &apic->lvt[LVT_LINT1];
     case 0x37:
-        return &apic.lvt[LVT_ERROR];
+        return &apic->lvt[LVT_ERROR];
     }
     // Should not reach here
     return NULL;
@@ -291,58 +358,63 @@ static uint32_t* get_lvt_ptr(int idx)
 
 static int apic_get_clock_divide(void)
 {
-    return ((((apic.timer_divide >> 1 & 4) | (apic.timer_divide & 3)) + 1) & 7);
+    return ((((apic->timer_divide >> 1 & 4) | (apic->timer_divide & 3)) + 1) & 7);
 }
 
 static uint32_t apic_get_count(void)
 {
-    return apic.timer_initial_count - ((uint32_t)(cpu_get_cycles() - apic.timer_reload_time) >> apic_get_clock_divide()) % apic.timer_initial_count;
+    return apic->timer_initial_count - ((uint32_t)(cpu_get_cycles() - apic->timer_reload_time) >> apic_get_clock_divide()) % apic->timer_initial_count;
+}
+static int apic_get_timer_mode(void)
+{
+    return apic->lvt[LVT_INDEX_TIMER] >> 17 & 3;
 }
+
 // In terms of CPU ticks, independent of ticks_per_second because APIC timer isn't tied to realtime
 static itick_t apic_get_period(void)
 {
-    return (itick_t)apic.timer_initial_count << apic_get_clock_divide();
+    return (itick_t)apic->timer_initial_count << apic_get_clock_divide();
 }
 
 static uint32_t apic_read(uint32_t addr)
 {
-    addr -= apic.base;
+    addr -= apic->base;
     addr >>= 4;
     switch (addr) {
     case 0x02:
-        return apic.id;
+        return apic->id;
     case 0x03:
         return 0x14 | (5 << 16) | (0 << 24); // Version 14h, 6 LVT entries supported, EOI something something unsupported
     case 0x08:
-        return apic.task_priority;
+        return apic->task_priority;
     case 0x0A: {
-        int tpr = apic.task_priority >> 4;
+        int tpr = apic->task_priority >> 4;
         int isrv = apic_get_interrupt();
         if (isrv < 0)
             isrv = 0;
         isrv >>= 4;
         if (tpr >= isrv)
-            return apic.task_priority;
+            return apic->task_priority;
         else
             return isrv << 4;
     }
     case 0x0B: // Note: no error when reading from EOI
         return 0;
     case 0x0D:
-        return apic.logical_destination;
+        return apic->logical_destination;
     case 0x0E:
-        return apic.destination_format;
+        return apic->destination_format;
     case 0x0F: // Spurious interrupt vector register
-        return apic.spurious_interrupt_vector;
+        return apic->spurious_interrupt_vector;
     case 0x10 ... 0x17:
-        return apic.isr[addr & 7];
+        return apic->isr[addr & 7];
     case 0x18 ... 0x1F:
-        return apic.tmr[addr & 7];
+        return apic->tmr[addr & 7];
     case 0x20 ... 0x27:
-        return apic.irr[addr & 7];
+        return apic->irr[addr & 7];
     case 0x28: {
         // XXX -- we are supposed to clear it when we write
-        return apic.cached_error;
+        return apic->cached_error;
     }
     case 0x2F:
     case 0x32:
@@ -353,14 +425,17 @@ static uint32_t apic_read(uint32_t addr)
     case 0x37:
         return *get_lvt_ptr(addr);
     case 0x30 ... 0x31:
-        return apic.icr[addr & 1];
+        return apic->icr[addr & 1];
     case 0x38:
-        return apic.timer_initial_count;
+        return apic->timer_initial_count;
     case 0x39:
+        // "In TSC-deadline mode, the current-count register always reads 0"
+        if (apic_get_timer_mode() == TIMER_MODE_TSC_DEADLINE || !apic->timer_initial_count)
+            return 0;
         return apic_get_count();
-    //return apic.timer_initial_count - ((uint32_t)(cpu_get_cycles() - apic.timer_reload_time) >> apic_get_clock_divide());
+    //return apic->timer_initial_count - ((uint32_t)(cpu_get_cycles() - apic->timer_reload_time) >> apic_get_clock_divide());
     case 0x3E:
-        return apic.timer_divide;
+        return apic->timer_divide;
     default:
         APIC_FATAL("TODO: APIC read %08x\n", addr);
         return 0;
@@ -368,80 +443,80 @@ static uint32_t apic_read(uint32_t addr)
 }
 static void apic_write(uint32_t addr, uint32_t data)
 {
-    addr -= apic.base;
+    addr -= apic->base;
     addr >>= 4; // Must be 128-bit aligned
     switch (addr) {
 #if 0
     default: // Reserved or read-only
         APIC_LOG("Invalid write to %08x\n", data);
-        apic.error |= APIC_ILLEGAL_REGISTER_ACCESS;
+        apic->error |= APIC_ILLEGAL_REGISTER_ACCESS;
         break;
 #endif
 
     case 0x03:
-        apic.error |= APIC_ILLEGAL_REGISTER_ACCESS;
+        apic->error |= APIC_ILLEGAL_REGISTER_ACCESS;
         break;
     case 2:
         APIC_LOG("Setting APIC ID to %08x\n", data);
-        apic.id = data;
+        apic->id = data;
         break;
     case 0x08: { // Task Priority Register
-        apic.task_priority = data & 0xFF;
+        apic->task_priority = data & 0xFF;
 
         // Update PPR as needed
-        int highest_isr = highest_set_bit(apic.isr);
+        int highest_isr = highest_set_bit(apic->isr);
         if (highest_isr == -1)
-            apic.processor_priority = apic.task_priority;
+            apic->processor_priority = apic->task_priority;
         else {
-            int ndiff = (apic.task_priority & 0xF0) - (highest_isr & 0xF0);
+            int ndiff = (apic->task_priority & 0xF0) - (highest_isr & 0xF0);
             if (ndiff > 0) // TPR[7:4] > ISRV[7:4]
-                apic.processor_priority = apic.task_priority;
+                apic->processor_priority = apic->task_priority;
             else
-                apic.processor_priority = highest_isr & 0xF0;
+                apic->processor_priority = highest_isr & 0xF0;
         }
 
         apic_send_highest_priority_interrupt();
         break;
     }
     case 0x0B: { // EOI register
-        int current_isr = highest_set_bit(apic.isr);
+        int current_isr = highest_set_bit(apic->isr);
         if (current_isr != -1) {
-            set_bit(apic.isr, current_isr, 0);
-            if (get_bit(apic.tmr, current_isr)) {
+            set_bit(apic->isr, current_isr, 0);
+            if (get_bit(apic->tmr, current_isr)) {
                 // Level-triggered interrupt, EOI-broadcast supression unsupported.
                 ioapic_remote_eoi(current_isr);
             }
-            APIC_LOG("EOI'ed: %02x Next highest: %02x\n", current_isr, highest_set_bit(apic.irr));
+            APIC_LOG("EOI'ed: %02x Next highest: %02x\n", current_isr, highest_set_bit(apic->irr));
             apic_send_highest_priority_interrupt();
         }
         break;
     }
     case 0x0D: // Logical Destination Register
-        apic.logical_destination = data & 0xFF000000;
+        apic->logical_destination = data & 0xFF000000;
         break;
     case 0x0E: // Destination Format
-        apic.destination_format &= ~0xF0000000;
-        apic.destination_format |= data & 0xF0000000;
-        apic.dest_format_physical = apic.destination_format == 0xFFFFFFFF;
-        if (!apic.dest_format_physical)
+        apic->destination_format &= ~0xF0000000;
+        apic->destination_format |= data & 0xF0000000;
+        apic->dest_format_physical = apic->destination_format == 0xFFFFFFFF;
+        if (!apic->dest_format_physical)
             APIC_LOG("Logical destination unsupported\n");
         break;
     case 0x0F: // Spurious interrupt vector register
-        apic.spurious_interrupt_vector = data;
+        apic->spurious_interrupt_vector = data;
         if (data & 0x100) {
             // Software disabled
             for (int i = 0; i < 7; i++)
-                apic.lvt[i] |= LVT_DISABLED;
+                apic->lvt[i] |= LVT_DISABLED;
         }
         break;
     case 0x10 ... 0x17:
-        apic.isr[addr & 7] = data;
+        apic->isr[addr & 7] = data;
         break;
     case 0x18 ... 0x1F:
-        apic.tmr[addr & 7] = data;
+        apic->tmr[addr & 7] = data;
         break;
     case 0x20 ... 0x27:
-        apic.irr[addr & 7] = data;
+        apic->irr[addr & 7] = data;
         break;
     case 0x28: // error register
         // From the manual:
@@ -449,11 +524,23 @@ static void apic_write(uint32_t addr, uint32_t data)
         //  (The value written does not affect the values read subsequently; only zero may be written in x2APIC mode.) 
         //  This write clears any previously logged errors and updates the ESR with any errors detected since the last write to the ESR. 
         //  This write also rearms the APIC error interrupt triggering mechanism.
-        apic.cached_error = apic.error;
-        apic.error = 0;
+        apic->cached_error = apic->error;
+        apic->error = 0;
+        break;
+    case 0x32: { // LVT timer
+        int old_mode = apic_get_timer_mode();
+        apic->lvt[LVT_INDEX_TIMER] = data;
+        if (old_mode != apic_get_timer_mode()) {
+            // Switching to or from TSC-deadline mode disarms the timer
+            if (old_mode == TIMER_MODE_TSC_DEADLINE || apic_get_timer_mode() == TIMER_MODE_TSC_DEADLINE) {
+                apic->tsc_deadline = 0;
+                apic->timer_next = -1;
+            }
+            cpu_cancel_execution_cycle(EXIT_STATUS_NORMAL);
+        }
         break;
+    }
     case 0x2F:
-    case 0x32:
     case 0x33:
     case 0x34:
     case 0x35:
@@ -462,15 +549,15 @@ static void apic_write(uint32_t addr, uint32_t data)
         *get_lvt_ptr(addr) = data;
         break;
     case 0x30: { // Write to lower 32 bits of ICR. This is how you send interrupts to other processors
-        apic.icr[0] = data;
+        apic->icr[0] = data;
 
         int vector = data & 0xFF,
             delivery_mode = data >> 8 & 7,
-            //destination_mode = data >> 11 & 1,
+            destination_mode = data >> 11 & 1,
             level = data >> 14 & 1,
             trigger = data >> 15 & 1,
             destination_shorthand = data >> 18 & 3,
-            apic_destination = apic.icr[1] >> (56 - 32);
+            apic_destination = apic->icr[1] >> (56 - 32);
 
         if (delivery_mode == 5 && level == 0 && trigger == 1) {
             // INIT level de-assert: not actually an INIT signal
@@ -478,34 +565,39 @@ static void apic_write(uint32_t addr, uint32_t data)
             return;
         }
 
+        int all = (1 << apic_count) - 1, self = 1 << (apic - apics);
         switch (destination_shorthand) {
         case 0: // Route interrupt to processor with specified APIC ID
-            apic_send_ipi2(vector, delivery_mode, trigger, apic_destination);
+            apic_send_ipi(vector, delivery_mode, trigger, apic_match_destination(apic_destination, destination_mode));
             break;
         case 1: // Send interrupt to self, only
-            apic_send_ipi(vector, LVT_DELIVERY_FIXED, trigger);
+            apic_send_ipi(vector, LVT_DELIVERY_FIXED, trigger, self);
             break;
         case 2: // Send interrupt to all processors
-            apic_send_ipi(vector, delivery_mode, trigger);
+            apic_send_ipi(vector, delivery_mode, trigger, all);
             break;
         case 3: // Send interrupt to all processors but self
+            apic_send_ipi(vector, delivery_mode, trigger, all & ~self);
             break;
         }
         break;
     }
     case 0x31: // ICR, upper 32 bits
-        apic.icr[1] = data;
+        apic->icr[1] = data;
         break;
     case 0x38:
-        apic.timer_initial_count = data;
-        apic.timer_reload_time = get_now();
-        apic.timer_next = apic.timer_reload_time + apic_get_period();
+        // Writes to the initial count register are ignored in TSC-deadline mode
+        if (apic_get_timer_mode() == TIMER_MODE_TSC_DEADLINE)
+            break;
+        apic->timer_initial_count = data;
+        apic->timer_reload_time = get_now();
+        apic->timer_next = apic->timer_reload_time + apic_get_period();
         cpu_cancel_execution_cycle(EXIT_STATUS_NORMAL);
         break;
     case 0x39:
         break;
     case 0x3E:
-        apic.timer_divide = data;
+        apic->timer_divide = data;
         APIC_LOG("Timer divide=%d\n", 1 << apic_get_clock_divide());
         cpu_cancel_execution_cycle(EXIT_STATUS_NORMAL);
         break;
@@ -516,7 +608,7 @@ static void apic_write(uint32_t addr, uint32_t data)
 
 // Due to how access.c splits up mmio reads/writes, we need to allow 8-bit APIC accesses.
 // However, since accesses that are less than 32-bits in size are undefined, we can do whatever we want here.
-// We should not be doing this, but this is the simplest way to do things without adding a ton of logic in apic.c
+// We should not be doing this, but this is the simplest way to do things without adding a ton of logic in apic->c
 
 static uint32_t apic_readb(uint32_t addr)
 {
@@ -527,65 +619,128 @@ static void apic_writeb(uint32_t addr, uint32_t data)
 {
     // Technically, we should not be doing this
     int offset = addr & 3, byte_offset = offset << 3;
-    apic.temp_data &= ~(0xFF << byte_offset);
-    apic.temp_data |= data << byte_offset;
+    apic->temp_data &= ~(0xFF << byte_offset);
+    apic->temp_data |= data << byte_offset;
     if (offset == 3) {
-        apic_write(addr & ~3, apic.temp_data);
+        apic_write(addr & ~3, apic->temp_data);
     }
     //APIC_FATAL("8-bit write to %08x with data %02x\n", addr, data);
 }
 
-static void apic_reset(void)
+// Also what an INIT IPI does to an application processor's APIC
+static void apic_reset_registers(void)
 {
-    apic.spurious_interrupt_vector = 0xFF;
-    apic.base = 0xFEE00000;
-    apic.id = 0;
-    apic.error = 0;
+    apic->spurious_interrupt_vector = 0xFF;
+    apic->base = 0xFEE00000;
+    apic->id = (apic - apics) << 24;
+    apic->error = 0;
+
+    apic->tsc_deadline = 0;
+    apic->timer_next = -1;
 
-    apic.destination_format = -1;
-    apic.dest_format_physical = 1;
+    apic->destination_format = -1;
+    apic->dest_format_physical = 1;
 
     for (int i = 0; i < LVT_END; i++)
-        apic.lvt[i] = LVT_DISABLED; // Disabled
+        apic->lvt[i] = LVT_DISABLED; // Disabled
+}
+
+static void apic_reset(void)
+{
+    for (int i = 0; i < apic_count; i++) {
+        apic = &apics[i];
+        apic_reset_registers();
+    }
+    apic = running_apic;
 
-    // Map one page of MMIO at the specified address.
-    io_register_mmio_read(apic.base, 4096, apic_readb, NULL, apic_read);
-    io_register_mmio_write(apic.base, 4096, apic_writeb, NULL, apic_write);
+    // Map one page of MMIO at the specified address. Every processor sees its own APIC there.
+    io_register_mmio_read(apic->base, 4096, apic_readb, NULL, apic_read);
+    io_register_mmio_write(apic->base, 4096, apic_writeb, NULL, apic_write);
 }
 
-// Find out how many ticks until next interrupt
-int apic_next(itick_t now)
+// TSC-deadline mode timer. The guest arms it by writing an absolute TSC value to IA32_TSC_DEADLINE.
+// The deadline is converted into get_now() units when it is written, so that it can be scheduled like the other timer modes.
+void apic_set_tsc_deadline(uint64_t deadline)
 {
-    // TODO: TSC Deadline mode
-    if (!apic.enabled)
+    if (!apic->enabled)
+        return;
+    // "In other timer modes (LVT bits 18:17 != 10b), writes to IA32_TSC_DEADLINE are ignored"
+    if (apic_get_timer_mode() != TIMER_MODE_TSC_DEADLINE)
+        return;
+
+    apic->tsc_deadline = deadline;
+    if (deadline == 0) {
+        // Writing zero disarms the timer
+        apic->timer_next = -1;
+        return;
+    }
+
+    uint64_t tsc = cpu_get_tsc();
+    itick_t now = get_now();
+    apic->timer_next = deadline > tsc ? now + (deadline - tsc) : now;
+
+    // Make the PC re-evaluate device timers with the new deadline
+    cpu_cancel_execution_cycle(EXIT_STATUS_NORMAL);
+}
+
+uint64_t apic_get_tsc_deadline(void)
+{
+    if (apic_get_timer_mode() != TIMER_MODE_TSC_DEADLINE)
+        return 0;
+    return apic->tsc_deadline;
+}
+
+static int apic_tsc_deadline_next(itick_t now)
+{
+    if (!apic->tsc_deadline)
+        return -1;
+
+    if (apic->timer_next <= now) {
+        if (!(apic->lvt[LVT_INDEX_TIMER] & LVT_DISABLED))
+            apic_accept_message(apic->lvt[LVT_INDEX_TIMER] & 0xFF, LVT_DELIVERY_FIXED, 0);
+        // The timer fires only once per write, and the MSR reads back as zero afterwards
+        apic->tsc_deadline = 0;
+        apic->timer_next = -1;
         return -1;
+    }
+
+    itick_t next = apic->timer_next - now;
+    if (next > 0xFFFFFFFF)
+        return -1;
+    return (uint32_t)next;
+}
+
+// Find out how many ticks until next interrupt of this APIC's timer
+static int apic_timer_next(itick_t now)
+{
+    // TSC-deadline mode doesn't use the initial-count register at all
+    if (apic_get_timer_mode() == TIMER_MODE_TSC_DEADLINE)
+        return apic_tsc_deadline_next(now);
+
     // "A write of 0 to the initial-count register effectively stops the local APIC timer, in both one-shot and periodic mode."
-    if (apic.timer_initial_count == 0)
+    if (apic->timer_initial_count == 0)
         return -1;
 
     // We want to keep the APIC timer running in the background, but not sending any interrupts
     int apic_timer_enabled = 1;
     
     // Information regarding lvt
-    int info = apic.lvt[LVT_INDEX_TIMER] >> 16;
+    int info = apic->lvt[LVT_INDEX_TIMER] >> 16;
 
-    if (apic.timer_next <= now) {
+    if (apic->timer_next <= now) {
         // Raise interrupt
         if(!(info & 1)) {// LVT_DISABLED set to 0
-            APIC_LOG(" timer period %lu cur=%lu next=%lu\n", apic_get_period(), now, apic.timer_next);
-            apic_receive_bus_message(apic.lvt[LVT_INDEX_TIMER] & 0xFF, LVT_DELIVERY_FIXED, 0);
+            APIC_LOG(" timer period %lu cur=%lu next=%lu\n", apic_get_period(), now, apic->timer_next);
+            apic_accept_message(apic->lvt[LVT_INDEX_TIMER] & 0xFF, LVT_DELIVERY_FIXED, 0);
         }
         else apic_timer_enabled = 0;
         
         switch (info >> 1 & 3) {
-        case 2:
-            APIC_FATAL("TODO: TSC Deadline\n");
+        case TIMER_MODE_PERIODIC:
+            apic->timer_next += apic_get_period();
             break;
-        case 1: // Periodic
-            apic.timer_next += apic_get_period();
-            break;
-        case 0: // One shot
-            apic.timer_next = -1; // Disable timer
+        case TIMER_MODE_ONE_SHOT:
+            apic->timer_next = -1; // Disable timer
             return -1; // no more interrupts
         case 3:
             APIC_LOG("Invalid timer mode set, ignoring\n");
@@ -596,15 +751,40 @@ int apic_next(itick_t now)
         if(apic_timer_enabled) return -1;
     }
 
-    itick_t next = apic.timer_next - now;
+    itick_t next = apic->timer_next - now;
     if(next > 0xFFFFFFFF) return -1; // Don't allow wrap-around of large integers
     return (uint32_t)next;
 }
 
+int apic_next(itick_t now)
+{
+    if (!apic->enabled)
+        return -1;
+
+    uint32_t min = -1;
+    for (int i = 0; i < apic_count; i++) {
+        apic = &apics[i];
+        uint32_t next = apic_timer_next(now);
+        if (next < min)
+            min = next;
+    }
+    apic = running_apic;
+    return min;
+}
+
+// Called when the CPU switches to processor "id"
+void apic_select(int id)
+{
+    apic = running_apic = &apics[id];
+}
+
 void apic_init(struct pc_settings* pc)
 {
-    apic.enabled = pc->apic_enabled;
-    if (!apic.enabled)
+    apic = running_apic = apics;
+    apic_count = pc->cpus;
+    for (int i = 0; i < apic_count; i++)
+        apics[i].enabled = pc->apic_enabled;
+    if (!apic->enabled)
         return;
     io_register_reset(apic_reset);
     state_register(apic_state);
@@ -612,5 +792,5 @@ void apic_init(struct pc_settings* pc)
 
 int apic_is_enabled(void)
 {
-    return apic.enabled;
+    return apic->enabled;
 }
\ No newline at end of file
@@ -33,7 +33,7 @@ struct cmos {
     // <<< END STRUCT "struct" >>>
 };
 
-static struct cmos cmos;
+static MACHINE_LOCAL struct cmos cmos;
 static void cmos_state(void)
 {
     // <<< BEGIN AUTOGENERATE "state" >>>
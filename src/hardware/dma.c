@@ -50,7 +50,7 @@ struct dma_controller {
     //dma_transfer transfer[8];
     // <<< END STRUCT "struct" >>>
 };
-static struct dma_controller dma;
+static MACHINE_LOCAL struct dma_controller dma;
 
 static void dma_state(void)
 {
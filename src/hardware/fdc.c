@@ -58,7 +58,7 @@
 #define MSR_ACTB 0x02
 #define MSR_ACTA 0x01
 
-struct fdc {
+MACHINE_LOCAL struct fdc {
     // <<< BEGIN STRUCT "struct" >>>
     /// ignore: dmabuf, drives
     uint8_t status[2]; // 3F0/3F1
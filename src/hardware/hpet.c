@@ -0,0 +1,370 @@
+// High Precision Event Timer emulation
+//  Can be simulated optionally by setting pc_settings.hpet_enabled to 1. Requires the I/O APIC.
+//  There is no HPET table in the Bochs BIOS, but SeaBIOS probes 0xFED00000 and adds an HPET table if it finds one.
+// https://www.intel.com/content/dam/www/public/us/en/documents/technical-specifications/software-developers-hpet-spec-1-0a.pdf
+// TODO:
+//  - Legacy replacement route (we don't advertise it, so guests route comparators through the I/O APIC)
+//  - FSB interrupt delivery
+
+#include "cpuapi.h"
+#include "devices.h"
+#include "io.h"
+#include "pc.h"
+
+#define HPET_LOG(x, ...) LOG("HPET", x, ##__VA_ARGS__)
+
+#define HPET_BASE 0xFED00000
+#define HPET_TIMERS 3
+
+// The main counter must run at 10 MHz or faster
+#define HPET_MIN_FREQUENCY 10000000
+
+// General configuration register
+#define HPET_CFG_ENABLE 1
+
+// Timer N configuration and capability register
+#define TN_INT_TYPE_LEVEL (1 << 1)
+#define TN_INT_ENB (1 << 2)
+#define TN_TYPE_PERIODIC (1 << 3)
+#define TN_PER_INT_CAP (1 << 4)
+#define TN_SIZE_CAP (1 << 5)
+#define TN_VAL_SET (1 << 6)
+#define TN_32MODE (1 << 8)
+#define TN_INT_ROUTE(x) ((x) >> 9 & 31)
+#define TN_WRITABLE (TN_INT_TYPE_LEVEL | TN_INT_ENB | TN_TYPE_PERIODIC | TN_VAL_SET | TN_32MODE | (31 << 9))
+
+// I/O APIC pins 20-23 are not used by anything else
+#define TN_INT_ROUTE_CAP 0x00F00000
+
+struct hpet_timer {
+    uint64_t config, comparator, period;
+    // When the comparator will match the main counter, in get_now() ticks. -1 if the timer will never fire.
+    itick_t fire_time;
+};
+
+static MACHINE_LOCAL struct hpet {
+    // <<< BEGIN STRUCT "struct" >>>
+    int enabled;
+
+    uint64_t config, isr;
+
+    // Value of the main counter at the time it was last enabled or written
+    uint64_t counter_base;
+    itick_t counter_start;
+
+    struct hpet_timer timers[HPET_TIMERS];
+
+    uint32_t temp_data;
+    // <<< END STRUCT "struct" >>>
+
+    // Main counter ticks per get_now() tick. Not saved since it depends on ticks_per_second
+    uint32_t multiplier;
+} hpet;
+
+static void hpet_state(void)
+{
+    // <<< BEGIN AUTOGENERATE "state" >>>
+    struct bjson_object* obj = state_obj("hpet", 6 + 4 * 3);
+    state_field(obj, 4, "hpet.enabled", &hpet.enabled);
+    state_field(obj, 8, "hpet.config", &hpet.config);
+    state_field(obj, 8, "hpet.isr", &hpet.isr);
+    state_field(obj, 8, "hpet.counter_base", &hpet.counter_base);
+    state_field(obj, 8, "hpet.counter_start", &hpet.counter_start);
+    state_field(obj, 4, "hpet.temp_data", &hpet.temp_data);
+    state_field(obj, 8, "hpet.timers[0].config", &hpet.timers[0].config);
+    state_field(obj, 8, "hpet.timers[1].config", &hpet.timers[1].config);
+    state_field(obj, 8, "hpet.timers[2].config", &hpet.timers[2].config);
+    state_field(obj, 8, "hpet.timers[0].comparator", &hpet.timers[0].comparator);
+    state_field(obj, 8, "hpet.timers[1].comparator", &hpet.timers[1].comparator);
+    state_field(obj, 8, "hpet.timers[2].comparator", &hpet.timers[2].comparator);
+    state_field(obj, 8, "hpet.timers[0].period", &hpet.timers[0].period);
+    state_field(obj, 8, "hpet.timers[1].period", &hpet.timers[1].period);
+    state_field(obj, 8, "hpet.timers[2].period", &hpet.timers[2].period);
+    state_field(obj, 8, "hpet.timers[0].fire_time", &hpet.timers[0].fire_time);
+    state_field(obj, 8, "hpet.timers[1].fire_time", &hpet.timers[1].fire_time);
+    state_field(obj, 8, "hpet.timers[2].fire_time", &hpet.timers[2].fire_time);
+// <<< END AUTOGENERATE "state" >>>
+}
+
+static inline uint64_t hpet_get_counter(itick_t now)
+{
+    if (!(hpet.config & HPET_CFG_ENABLE))
+        return hpet.counter_base;
+    return hpet.counter_base + (now - hpet.counter_start) * hpet.multiplier;
+}
+
+static inline int hpet_timer_is_32bit(struct hpet_timer* timer)
+{
+    return (timer->config & TN_32MODE) != 0;
+}
+
+// Compute when the comparator next matches the main counter
+static void hpet_update_timer(struct hpet_timer* timer, itick_t now)
+{
+    if (!(hpet.config & HPET_CFG_ENABLE)) {
+        timer->fire_time = -1;
+        return;
+    }
+
+    uint64_t counter = hpet_get_counter(now), diff = timer->comparator - counter;
+    if (hpet_timer_is_32bit(timer))
+        diff &= 0xFFFFFFFF;
+    // Round up so that the counter has definitely reached the comparator when the timer fires.
+    uint64_t ticks = diff / hpet.multiplier + (diff % hpet.multiplier != 0);
+    if (ticks >= (itick_t)-1 - now)
+        timer->fire_time = -1; // Only matches after the 64-bit counter wraps around
+    else
+        timer->fire_time = now + ticks;
+}
+
+static void hpet_update_timers(void)
+{
+    itick_t now = get_now();
+    for (int i = 0; i < HPET_TIMERS; i++)
+        hpet_update_timer(&hpet.timers[i], now);
+
+    // Make the PC re-evaluate device timers
+    cpu_cancel_execution_cycle(EXIT_STATUS_NORMAL);
+}
+
+static void hpet_raise_irq(int n)
+{
+    struct hpet_timer* timer = &hpet.timers[n];
+    if (!(timer->config & TN_INT_ENB))
+        return;
+
+    int route = TN_INT_ROUTE(timer->config);
+    if (timer->config & TN_INT_TYPE_LEVEL) {
+        // Stays high until the guest clears the bit in the status register
+        hpet.isr |= 1 << n;
+        ioapic_raise_irq(route);
+    } else {
+        ioapic_lower_irq(route);
+        ioapic_raise_irq(route);
+    }
+}
+
+static void hpet_lower_irq(int n)
+{
+    ioapic_lower_irq(TN_INT_ROUTE(hpet.timers[n].config));
+}
+
+static uint64_t hpet_read64(uint32_t offset)
+{
+    switch (offset) {
+    case 0x000: // General capabilities and ID register
+        return (uint64_t)(1000000000000000ULL / ((uint64_t)ticks_per_second * hpet.multiplier)) << 32 | // Counter tick period, in femtoseconds
+            0x8086U << 16 | // Vendor ID
+            1 << 13 | // 64-bit main counter
+            (HPET_TIMERS - 1) << 8 | // Number of timers, minus one
+            0x01; // Revision ID
+    case 0x010:
+        return hpet.config;
+    case 0x020:
+        return hpet.isr;
+    case 0x0F0:
+        return hpet_get_counter(get_now());
+    case 0x100 ... 0x100 + (HPET_TIMERS * 0x20) - 1: {
+        struct hpet_timer* timer = &hpet.timers[(offset - 0x100) >> 5];
+        switch (offset & 0x1F) {
+        case 0x00:
+            return timer->config | (uint64_t)TN_INT_ROUTE_CAP << 32;
+        case 0x08:
+            if (hpet_timer_is_32bit(timer))
+                return timer->comparator & 0xFFFFFFFF;
+            return timer->comparator;
+        case 0x10: // FSB interrupt route, unsupported
+            return 0;
+        }
+        break;
+    }
+    }
+    HPET_LOG("Unknown read from offset %03x\n", offset);
+    return 0;
+}
+
+static void hpet_write64(uint32_t offset, uint64_t data, uint64_t mask)
+{
+    switch (offset) {
+    case 0x000: // Read only
+        break;
+    case 0x010: {
+        uint64_t old_config = hpet.config;
+        itick_t now = get_now();
+        hpet.config = (hpet.config & ~mask) | (data & mask & HPET_CFG_ENABLE);
+        if ((old_config ^ hpet.config) & HPET_CFG_ENABLE) {
+            if (hpet.config & HPET_CFG_ENABLE) // Start counting from where we stopped
+                hpet.counter_start = now;
+            else // Freeze the main counter
+                hpet.counter_base += (now - hpet.counter_start) * hpet.multiplier;
+        }
+        hpet_update_timers();
+        break;
+    }
+    case 0x020: {
+        // Writing a 1 clears the interrupt status bit of a level-triggered timer
+        uint64_t cleared = hpet.isr & data & mask;
+        hpet.isr &= ~cleared;
+        for (int i = 0; i < HPET_TIMERS; i++)
+            if (cleared >> i & 1)
+                hpet_lower_irq(i);
+        break;
+    }
+    case 0x0F0:
+        // "Software must halt the main counter before writing to it"
+        if (hpet.config & HPET_CFG_ENABLE) {
+            HPET_LOG("Writing to main counter while it is running\n");
+            break;
+        }
+        hpet.counter_base = (hpet.counter_base & ~mask) | (data & mask);
+        break;
+    case 0x100 ... 0x100 + (HPET_TIMERS * 0x20) - 1: {
+        int n = (offset - 0x100) >> 5;
+        struct hpet_timer* timer = &hpet.timers[n];
+        switch (offset & 0x1F) {
+        case 0x00: {
+            uint64_t writable = TN_WRITABLE;
+            if (!(timer->config & TN_PER_INT_CAP))
+                writable &= ~TN_TYPE_PERIODIC;
+            uint64_t new_config = (timer->config & ~(mask & writable)) | (data & mask & writable);
+
+            // Only accept interrupt routes that we advertise
+            if (!(TN_INT_ROUTE_CAP >> TN_INT_ROUTE(new_config) & 1))
+                new_config = (new_config & ~(31 << 9)) | (timer->config & (31 << 9));
+
+            if ((timer->config ^ new_config) & (TN_INT_TYPE_LEVEL | (31 << 9))) {
+                // Deassert the old line before switching away from it
+                if (hpet.isr >> n & 1) {
+                    hpet.isr &= ~(1 << n);
+                    hpet_lower_irq(n);
+                }
+            }
+            timer->config = new_config;
+            hpet_update_timers();
+            break;
+        }
+        case 0x08:
+            // In periodic mode, the comparator is only set directly if TN_VAL_SET is set. Otherwise, only the period is updated.
+            if (!(timer->config & TN_TYPE_PERIODIC) || (timer->config & TN_VAL_SET))
+                timer->comparator = (timer->comparator & ~mask) | (data & mask);
+            timer->period = (timer->period & ~mask) | (data & mask);
+            timer->config &= ~TN_VAL_SET;
+            if (hpet_timer_is_32bit(timer)) {
+                timer->comparator &= 0xFFFFFFFF;
+                timer->period &= 0xFFFFFFFF;
+            }
+            hpet_update_timers();
+            break;
+        case 0x10:
+            break;
+        }
+        break;
+    }
+    default:
+        HPET_LOG("Unknown write to offset %03x, data=%08x%08x\n", offset, (uint32_t)(data >> 32), (uint32_t)data);
+    }
+}
+
+// All registers are 64 bits wide, but 32-bit guests access them one half at a time.
+static uint32_t hpet_read(uint32_t addr)
+{
+    uint32_t offset = addr & 0x3FF;
+    return hpet_read64(offset & ~7) >> ((offset & 4) * 8);
+}
+static void hpet_write(uint32_t addr, uint32_t data)
+{
+    uint32_t offset = addr & 0x3FF;
+    int shift = (offset & 4) * 8;
+    hpet_write64(offset & ~7, (uint64_t)data << shift, (uint64_t)0xFFFFFFFF << shift);
+}
+
+// See corresponding comments in apic.c for details
+static uint32_t hpet_readb(uint32_t addr)
+{
+    return hpet_read(addr & ~3) >> ((addr & 3) * 8) & 0xFF;
+}
+static void hpet_writeb(uint32_t addr, uint32_t data)
+{
+    int offset = addr & 3, byte_offset = offset << 3;
+    hpet.temp_data &= ~(0xFF << byte_offset);
+    hpet.temp_data |= data << byte_offset;
+    if (offset == 3) {
+        hpet_write(addr & ~3, hpet.temp_data);
+    }
+}
+
+static void hpet_reset(void)
+{
+    for (int i = 0; i < HPET_TIMERS; i++) {
+        if (hpet.isr >> i & 1)
+            hpet_lower_irq(i);
+        hpet.timers[i].config = TN_SIZE_CAP | (i == 0 ? TN_PER_INT_CAP : 0);
+        hpet.timers[i].comparator = -1;
+        hpet.timers[i].period = 0;
+        hpet.timers[i].fire_time = -1;
+    }
+    hpet.config = 0;
+    hpet.isr = 0;
+    hpet.counter_base = 0;
+    hpet.counter_start = 0;
+}
+
+// Find out how many ticks until next interrupt
+int hpet_next(itick_t now)
+{
+    if (!hpet.enabled || !(hpet.config & HPET_CFG_ENABLE))
+        return -1;
+
+    itick_t min = -1;
+    for (int i = 0; i < HPET_TIMERS; i++) {
+        struct hpet_timer* timer = &hpet.timers[i];
+        if (timer->fire_time <= now) {
+            hpet_raise_irq(i);
+            if ((timer->config & TN_TYPE_PERIODIC) && timer->period) {
+                // Devices aren't checked on every tick, so the counter may be several periods past the comparator by
+                // now. Skip the periods that were missed, otherwise the comparator stays behind the counter.
+                uint64_t behind = hpet_get_counter(now) - timer->comparator;
+                if (hpet_timer_is_32bit(timer))
+                    behind &= 0xFFFFFFFF;
+                timer->comparator += (behind / timer->period + 1) * timer->period;
+                if (hpet_timer_is_32bit(timer))
+                    timer->comparator &= 0xFFFFFFFF;
+                hpet_update_timer(timer, now);
+            } else if (hpet_timer_is_32bit(timer)) // Matches again once the counter wraps around
+                timer->fire_time += ((uint64_t)1 << 32) / hpet.multiplier;
+            else
+                timer->fire_time = -1;
+        }
+        if (timer->fire_time < min)
+            min = timer->fire_time;
+    }
+
+    if (min == (itick_t)-1)
+        return -1;
+    if (min <= now)
+        return 0;
+    itick_t next = min - now;
+    if (next > 0xFFFFFFFF)
+        return -1;
+    return (uint32_t)next;
+}
+
+void hpet_init(struct pc_settings* pc)
+{
+    if (!pc->hpet_enabled)
+        return;
+    if (!pc->apic_enabled) {
+        HPET_LOG("Disabling HPET because the I/O APIC is disabled\n");
+        return;
+    }
+    hpet.enabled = 1;
+
+    // Run the main counter at an integer multiple of our tick rate, so that a counter read is just a multiply
+    hpet.multiplier = (HPET_MIN_FREQUENCY + ticks_per_second - 1) / ticks_per_second;
+
+    io_register_reset(hpet_reset);
+    state_register(hpet_state);
+
+    io_register_mmio_read(HPET_BASE, 4096, hpet_readb, NULL, hpet_read);
+    io_register_mmio_write(HPET_BASE, 4096, hpet_writeb, NULL, hpet_write);
+}
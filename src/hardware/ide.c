@@ -68,7 +68,7 @@
 #endif
 
 // We keep all fields inside one big struct to make it easy for the autogen savestate
-static struct ide_controller {
+static MACHINE_LOCAL struct ide_controller {
     // <<< BEGIN STRUCT "struct" >>>
 
     /// ignore: canary_below, canary_above
@@ -36,7 +36,7 @@ enum {
     DELIVERY_EXTINT = 7
 };
 
-static struct ioapic_info {
+static MACHINE_LOCAL struct ioapic_info {
     // <<< BEGIN STRUCT "struct" >>>
     uint32_t base;
     uint32_t register_selected;
@@ -93,9 +93,8 @@ static void ioapic_update(void)
                 irq_number = pic_get_interrupt(); // Is this right? IDK
             // INTENTIONAL FALLTHROUGH
             default:
-                UNUSED(hi);
             done:
-                apic_receive_bus_message(irq_number, type, (lo & TRIGGER_MODE) != 0);
+                apic_receive_bus_message(irq_number, type, (lo & TRIGGER_MODE) != 0, hi >> 24, (lo & DESTINATION_MODE) != 0);
             }
         }
 
@@ -1,6 +1,7 @@
 #include "cpuapi.h"
 #include "devices.h"
 #include "pc.h"
+#include "replay.h"
 #include "state.h"
 #include <string.h>
 
@@ -51,6 +52,7 @@ enum {
 };
 
 static void mouse_move(int clicked);
+static void mouse_buttons(int left, int center, int right);
 
 static void kbd_queue_add(struct kbd_queue* this, uint8_t data)
 {
@@ -76,7 +78,7 @@ static void kbd_queue_clear(struct kbd_queue* this)
 #define KBD_QUEUE 0
 #define AUX_QUEUE 1
 #define NUMBER_OF_QUEUES 2
-struct
+MACHINE_LOCAL struct
 {
     struct kbd_queue queues[2]; // TODO: Should there be a separate controller queue or can it be merged into the keyboard queue?
 
@@ -124,7 +126,7 @@ static void kbd_queue_state(struct bjson_object* obj, struct kbd_queue* y, int z
 static void kbd_state(void)
 {
     // <<< BEGIN AUTOGENERATE "state" >>>
-    struct bjson_object* obj = state_obj("kbd", 15 + 6);
+    struct bjson_object* obj = state_obj("kbd", 17 + 6);
     state_field(obj, 128, "kbd.ram", &kbd.ram);
     state_field(obj, 1, "kbd.data", &kbd.data);
     state_field(obj, 4, "kbd.data_has_been_read", &kbd.data_has_been_read);
@@ -145,7 +147,7 @@ static void kbd_state(void)
     // <<< END AUTOGENERATE "state" >>>
     kbd_queue_state(obj, &kbd.queues[0], 0);
     kbd_queue_state(obj, &kbd.queues[1], 1);
-    kbd_mouse_down(0, 0, 0); // Release all the mouse buttons
+    mouse_buttons(0, 0, 0); // Release all the mouse buttons
 }
 
 // returns 1 if there are items in the keyboard queue
@@ -565,6 +567,8 @@ void kbd_init(void)
 // Adds a key to the keyboard buffer.
 void kbd_add_key(uint8_t data)
 {
+    if (replay_event(REPLAY_KEY, data, 0, 0, 0))
+        return;
     if (!kbd.keyboard_disable_scanning) {
         kbd_add(KBD_QUEUE, data);
     }
@@ -622,7 +626,7 @@ static void mouse_move(int clicked)
     }
 }
 
-void kbd_mouse_down(int left, int center, int right)
+static void mouse_buttons(int left, int center, int right)
 {
     uint8_t mbs = kbd.mouse_button_state;
     if (left != MOUSE_STATUS_NOCHANGE) {
@@ -642,9 +646,18 @@ void kbd_mouse_down(int left, int center, int right)
     }
 }
 
+void kbd_mouse_down(int left, int center, int right)
+{
+    if (replay_event(REPLAY_MOUSE_BUTTONS, left, center, right, 0))
+        return;
+    mouse_buttons(left, center, right);
+}
+
 void display_release_mouse(void);
 void kbd_send_mouse_move(int xrel, int yrel, int wxrel, int wyrel)
 {
+    if (replay_event(REPLAY_MOUSE_MOVE, xrel, yrel, wxrel, wyrel))
+        return;
     if (kbd.mouse_stream_mode && !kbd.mouse_stream_inactive) {
         kbd.xrel += xrel;
         kbd.yrel -= yrel;
@@ -22,7 +22,7 @@
 #define ROM_READ 1
 #define ROM_WRITE 2
 
-static struct pci_state {
+static MACHINE_LOCAL struct pci_state {
     // <<< BEGIN STRUCT "struct" >>>
     /// ignore: configuration_address_spaces
     uint32_t configuration_address_register;
@@ -328,7 +328,7 @@ static int pci_82441fx_write(uint8_t* ptr, uint8_t addr, uint8_t data)
     return retval;
 }
 
-static uint8_t* ram; // Doesn't need to be saved since it will be different on each run.
+static MACHINE_LOCAL uint8_t* ram; // Doesn't need to be saved since it will be different on each run.
 
 static uint32_t mmio_readb(uint32_t addr)
 {
@@ -337,8 +337,10 @@ static uint32_t mmio_readb(uint32_t addr)
 static void mmio_writeb(uint32_t addr, uint32_t data)
 {
     int map = pci.rom_area_memory_mapping[(addr - 0xC0000) >> 14];
-    if (map & 2)
-        ram[addr] = data;
+    if (map & 2) {
+        uint8_t byte = data;
+        cpu_write_mem(addr, &byte, 1); // Shadow RAM writes have to show up in incremental savestates
+    }
     else {
         PCI_LOG("Invalid write addr=%08x data=%02x\n", addr, data);
     }
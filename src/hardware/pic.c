@@ -51,7 +51,7 @@ struct pic_controller {
     // <<< END STRUCT "struct" >>>
 };
 
-struct
+MACHINE_LOCAL struct
 {
     int irq_bus_value; // irq value to send to CPU
     struct pic_controller ctrl[2];
@@ -173,7 +173,7 @@ static void pic_internal_update(struct pic_controller* this)
                 this->highest_priority_irq_to_send = (this->priority_base + 1 + i) & 7;
 
                 if(is_master(this)){
-                cpu_raise_intr_line();
+                cpu_raise_intr_line_of(0); // Only the BSP is wired to the PIC
                 cpu_request_fast_return(EXIT_STATUS_IRQ);
                 }else{
                     // Pulse INT line so that the slave PIC gets our message
@@ -194,7 +194,7 @@ static void pic_internal_update(struct pic_controller* this)
                 this->highest_priority_irq_to_send = (this->priority_base + 1 + i) & 7;
 
                 if(is_master(this)){
-                cpu_raise_intr_line();
+                cpu_raise_intr_line_of(0);
                 cpu_request_fast_return(EXIT_STATUS_IRQ);
                 }else{
                     pic_lower_irq(2);
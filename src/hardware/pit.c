@@ -56,7 +56,7 @@ struct pit {
     struct pit_channel chan[3];
 };
 
-static struct pit pit;
+static MACHINE_LOCAL struct pit pit;
 static void pit_state(void)
 {
     // <<< BEGIN AUTOGENERATE "state" >>>
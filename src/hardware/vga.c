@@ -14,6 +14,20 @@
 #include "io.h"
 #include "state.h"
 #include <string.h>
+#ifdef VGA_USE_THREADS
+#include <pthread.h>
+#endif
+
+// The scanline converters in vga_update have SSE2 versions when the compiler targets it, and AVX2 versions that are
+// selected at startup if the host supports them.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && !defined(EMSCRIPTEN)
+#define VGA_USE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && !defined(PROFAN)
+#define VGA_USE_AVX2
+#include <immintrin.h>
+#endif
+#endif
 
 #define VGA_LOG(x, ...) LOG("VGA", x, ##__VA_ARGS__)
 #define VGA_FATAL(x, ...)          \
@@ -24,7 +38,15 @@
 
 #define VBE_LFB_BASE 0xE0000000
 
-static struct vga_info {
+// Horizontal range of a scanline that has been drawn since the display was last updated. Empty if start == end.
+struct vga_span {
+    uint16_t start, end;
+};
+
+// Scanline spans are merged into at most this many rectangles per display update
+#define VGA_MAX_DAMAGE_RECTS 64
+
+static MACHINE_LOCAL struct vga_info {
     // <<< BEGIN STRUCT "struct" >>>
 
     /// ignore: framebuffer, vram, scanlines_modified, scanlines_to_update, mem, rom, rom_size
@@ -91,6 +113,24 @@ static struct vga_info {
 
     // These fields should not be saved in the VRAM savestate since they have to do with rendering.
     uint8_t* vbe_scanlines_modified;
+    // Parts of each scanline of the framebuffer that have changed since the display was last updated
+    struct vga_span* scanlines_drawn;
+
+    // One bit per page of VRAM, set on any write. Used to copy VRAM to the render thread.
+    uint32_t* vram_dirty;
+    int vram_all_dirty;
+
+    // One bit per page of VRAM, set when the page has been written through the linear framebuffer since the last vga_update
+    uint32_t* lfb_dirty;
+
+    // One bit per page of VRAM, set on any write since the in-memory snapshot was last taken or restored
+    uint32_t* vram_state_dirty;
+
+    // Text mode cells, indexed by character address. A cell is only redrawn while its counter is nonzero. Counters are set
+    // to 2 and decremented after every frame, so a cell changed halfway through a frame is still drawn in full on the next.
+    uint8_t text_cells_modified[0x8000];
+    int text_cells_pending, text_redraw;
+    uint32_t text_cursor_state;
 
     // Screen data cannot change if memory_modified is zero.
     int memory_modified;
@@ -109,12 +149,34 @@ static void vga_alloc_mem(void)
 {
     if (vga.vram)
         afree(vga.vram);
-    vga.vram = aalloc(vga.vram_size, 8);
+    vga.vram = aalloc(vga.vram_size, 4096); // Page aligned so that savestates can map it in directly
     memset(vga.vram, 0, vga.vram_size);
+
+    if (vga.lfb_dirty)
+        free(vga.lfb_dirty);
+    vga.lfb_dirty = calloc((vga.vram_size + 0x1FFFF) >> 17, 4);
+    if (vga.vram_dirty)
+        free(vga.vram_dirty);
+    vga.vram_dirty = calloc((vga.vram_size + 0x1FFFF) >> 17, 4);
+    vga.vram_all_dirty = 1;
+    if (vga.vram_state_dirty)
+        free(vga.vram_state_dirty);
+    vga.vram_state_dirty = malloc(((vga.vram_size + 0x1FFFF) >> 17) * 4);
+    memset(vga.vram_state_dirty, 0xFF, ((vga.vram_size + 0x1FFFF) >> 17) * 4);
+}
+
+// While the linear framebuffer is enabled, the CPU maps it directly and only tells us about the first write to each page.
+static void vga_update_lfb_mapping(void)
+{
+    if ((vga.vbe_enable & VBE_DISPI_ENABLED) && (vga.vbe_enable & VBE_DISPI_LFB_ENABLED))
+        cpu_set_direct_mmio(VBE_LFB_BASE, vga.vram_size, vga.vram, vga.lfb_dirty);
+    else
+        cpu_set_direct_mmio(0, 0, NULL, NULL);
 }
 
 static void vga_state(void)
 {
+    int vram_size = vga.vram_size;
     // <<< BEGIN AUTOGENERATE "state" >>>
     struct bjson_object* obj = state_obj("vga", 42);
     state_field(obj, 256, "vga.crt", &vga.crt);
@@ -162,12 +224,30 @@ static void vga_state(void)
 // <<< END AUTOGENERATE "state" >>>
     if (state_is_reading()) {
         vga_update_size();
-        vga_alloc_mem();
+        // The in-memory snapshot copies VRAM back into the buffer we already have
+        if (!state_is_snapshot() || vga.vram_size != vram_size)
+            vga_alloc_mem();
     }
-    state_file(vga.vram_size, "vram", vga.vram);
+    if (state_is_snapshot()) {
+        // Only the pages written since the last take or restore are copied. Pages written through the linear framebuffer
+        // since the last update have not made it into vram_state_dirty yet.
+        int words = (vga.vram_size + 0x1FFFF) >> 17;
+        for (int i = 0; i < words; i++)
+            vga.vram_state_dirty[i] |= vga.lfb_dirty[i];
+        state_file_paged(vga.vram_size, "vram", vga.vram, vga.vram_state_dirty);
+        if (state_is_reading()) {
+            for (int i = 0; i < words; i++)
+                vga.vram_dirty[i] |= vga.vram_state_dirty[i];
+            memset(vga.vram_state_dirty, 0, words * 4);
+        }
+    } else
+        state_section(vga.vram_size, "vram", vga.vram);
+    if (state_is_reading())
+        vga_update_lfb_mapping(); // vga.vram has moved
 
     // Force a redraw.
     vga.memory_modified = 3;
+    vga.text_redraw = 2;
 }
 
 enum {
@@ -212,19 +292,30 @@ static void vga_update_mem_access(void)
     vga.write_mode = vga.gfx[5] & 3;
     VGA_LOG("Updating Memory Access Constants: write=%d [mode=%d], read=%d\n", vga.write_access, vga.write_mode, vga.read_access);
 }
+// Moves the drawing state of "v" back to the top of the screen
+static void vga_restart_frame(struct vga_info* v)
+{
+    v->current_scanline = 0;
+    v->character_scanline = v->crt[8] & 0x1F;
+    v->current_pixel_panning = v->pixel_panning;
+    v->vram_addr = ((v->crt[0x0C] << 8) | v->crt[0x0D]) << 2; // Video Address Start is done by planar offset
+    v->framebuffer_offset = 0;
+}
 // despite its name, it only resets drawing state
 static void vga_complete_redraw(void)
 {
-    vga.current_scanline = 0;
-    vga.character_scanline = vga.crt[8] & 0x1F;
-    vga.current_pixel_panning = vga.pixel_panning;
-    vga.vram_addr = ((vga.crt[0x0C] << 8) | vga.crt[0x0D]) << 2; // Video Address Start is done by planar offset
-    vga.framebuffer_offset = 0;
+    vga_restart_frame(&vga);
 
     // Force a complete redraw of the screen, and to do that, pretend that memory has been written.
     vga.memory_modified = 3;
 }
 
+static inline void vga_text_cell_modified(uint32_t cell)
+{
+    vga.text_cells_modified[cell & 0x7FFF] = 2;
+    vga.text_cells_pending = 1;
+}
+
 static void vga_change_renderer(void)
 {
 
@@ -318,6 +409,9 @@ static void vga_update_size(void)
     else
         vga.vbe_scanlines_modified = halloc(vga.total_height);
     memset(vga.vbe_scanlines_modified, 1, vga.total_height);
+    vga.scanlines_drawn = realloc(vga.scanlines_drawn, vga.total_height * sizeof(struct vga_span));
+    memset(vga.scanlines_drawn, 0, vga.total_height * sizeof(struct vga_span));
+    vga.text_redraw = 2;
 
     vga.scanlines_to_update = height >> 1;
 }
@@ -369,6 +463,26 @@ static
         return;
     }
     uint8_t diffxor;
+
+    // Text mode only redraws changed cells, so anything other than an index register or the cursor (which vga_update
+    // keeps track of itself) has to repaint the whole screen.
+    switch (port) {
+    case 0x3B4:
+    case 0x3D4:
+    case 0x3C4:
+    case 0x3C7:
+    case 0x3C8:
+    case 0x3CE:
+        break;
+    case 0x3B5:
+    case 0x3D5:
+        if (vga.crt_index == 0x0A || vga.crt_index == 0x0B || vga.crt_index == 0x0E || vga.crt_index == 0x0F)
+            break;
+        // fallthrough
+    default:
+        vga.text_redraw = 2;
+    }
+
     switch (port) {
     case 0x1CE: // Bochs VBE index
         vga.vbe_index = data;
@@ -402,6 +516,7 @@ static
                 }
                 VGA_LOG(" Set VBE enable=%04x bpp=%d diffxor=%04x current=%04x\n", data, vga.vbe_regs[3], diffxor, vga.vbe_enable);
                 vga.vbe_enable = data;
+                vga_update_lfb_mapping();
                 if (vga.vbe_regs[3] == 4)
                     VGA_FATAL("TODO: support VBE 4-bit modes\n");
 
@@ -416,8 +531,11 @@ static
                 if (diffxor & VBE_DISPI_ENABLED) {
                     vga_change_renderer();
                     if (vga.vbe_enable & VBE_DISPI_ENABLED)
-                        if (!(data & VBE_DISPI_NOCLEARMEM)) // should i use diffxor or data?
+                        if (!(data & VBE_DISPI_NOCLEARMEM)) { // should i use diffxor or data?
                             memset(vga.vram, 0, vga.vram_size);
+                            vga.vram_all_dirty = 1;
+                            memset(vga.vram_state_dirty, 0xFF, ((vga.vram_size + 0x1FFFF) >> 17) * 4);
+                        }
                 }
 
                 if (diffxor & VBE_DISPI_8BIT_DAC) {
@@ -747,7 +865,7 @@ bit   0  If set Color Emulation. Base Address=3Dxh else Mono Emulation. Base
         break;
     case 0x3D5:
     case 0x3B5: { // CRT data
-        static uint8_t mask[64] = {
+        static MACHINE_LOCAL uint8_t mask[64] = {
             // 0-7 are changed based on CR11 bit 7
             MASK(0b00000000), // 0
             MASK(0b00000000), // 1
@@ -920,64 +1038,296 @@ static
     }
 }
 
-static inline uint8_t bpp4_to_offset(uint8_t i, uint8_t j, uint8_t k)
+// Convert the framebuffer pages that the CPU has written to since the last call into modified scanlines
+static void vga_sync_lfb(void)
 {
-    return ((i & (0x80 >> j)) != 0) ? 1 << k : 0;
+    if (!(vga.vbe_enable & VBE_DISPI_ENABLED) || !(vga.vbe_enable & VBE_DISPI_LFB_ENABLED))
+        return;
+    uint32_t bytes_per_line = vga.total_width * ((vga.vbe_regs[3] + 7) >> 3), found = 0;
+    if (!bytes_per_line)
+        return;
+    for (int i = 0; i < (vga.vram_size + 0x1FFFF) >> 17; i++) {
+        uint32_t bits = vga.lfb_dirty[i];
+        if (!bits)
+            continue;
+        vga.lfb_dirty[i] = 0;
+        vga.vram_dirty[i] |= bits;
+        vga.vram_state_dirty[i] |= bits;
+        found = 1;
+        while (bits) {
+            uint32_t page = i << 5 | __builtin_ctz(bits);
+            bits &= bits - 1;
+            uint32_t first = (page << 12) / bytes_per_line, last = ((page << 12) | 0xFFF) / bytes_per_line;
+            if (first >= vga.total_height)
+                continue;
+            if (last >= vga.total_height)
+                last = vga.total_height - 1;
+            memset(vga.vbe_scanlines_modified + first, 1, last - first + 1);
+        }
+    }
+    if (found) {
+        vga.memory_modified |= 1;
+        cpu_protect_direct_mmio();
+    }
 }
 
-static int framectr = 0;
-void vga_update(void)
+static uint32_t glyph_masks[256][8];
+static void vga_init_glyph_masks(void)
 {
-    // Note: This function should NOT modify any VGA registers or memory!
+    for (int i = 0; i < 256; i++)
+        for (int j = 0; j < 8; j++)
+            glyph_masks[i][j] = -(i >> (7 - j) & 1);
+}
 
-    framectr = (framectr + 1) & 0x3F;
-    int scanlines_to_update = vga.scanlines_to_update; // XXX
+// Scanline converters. Every version of a converter must produce exactly the same pixels as the plain C one.
+
+// Byte k of planar_lut[x] is bit 7-k of x, so that ORing together the shifted entries for all four planes transposes
+// eight planar pixels into eight chunky ones.
+static uint64_t planar_lut[256];
+static void vga_init_planar_lut(void)
+{
+    for (int i = 0; i < 256; i++) {
+        uint64_t v = 0;
+        for (int j = 0; j < 8; j++)
+            v |= (uint64_t)(i >> (7 - j) & 1) << (j * 8);
+        planar_lut[i] = v;
+    }
+}
+static inline uint64_t vga_planar_to_chunky(uint8_t* planes)
+{
+    return planar_lut[planes[0]] | planar_lut[planes[1]] << 1 | planar_lut[planes[2]] << 2 | planar_lut[planes[3]] << 3;
+}
+
+// 8-bit palettized pixels, four at a time. Each group of four is "stride" bytes after the previous one.
+static void vga_convert_8bpp_c(uint32_t* dest, uint8_t* src, int groups, int stride, uint32_t* palette, uint8_t mask)
+{
+    for (int i = 0; i < groups; i++, src += stride, dest += 4) {
+        for (int j = 0; j < 4; j++)
+            dest[j] = palette[src[j] & mask];
+    }
+}
+static void vga_convert_16bpp_c(uint32_t* dest, uint8_t* src, int width)
+{
+    for (int i = 0; i < width; i++, src += 2) {
+        uint16_t word = *((uint16_t*)src);
+        int red = word >> 11 << 3,
+            green = (word >> 5 & 63) << 2, // Note: 6 bits for green
+            blue = (word & 31) << 3;
+        dest[i] = red << 16 | green << 8 | blue << 0 | 0xFF000000;
+    }
+}
+static void vga_convert_24bpp_c(uint32_t* dest, uint8_t* src, int width)
+{
+    for (int i = 0; i < width; i++, src += 3)
+        dest[i] = src[0] | src[1] << 8 | src[2] << 16 | 0xFF000000;
+}
+
+#ifdef VGA_USE_SSE2
+static inline __m128i vga_rgb565_sse2(__m128i words)
+{
+    const __m128i mask5 = _mm_set1_epi32(31), mask6 = _mm_set1_epi32(63);
+    __m128i red = _mm_slli_epi32(_mm_srli_epi32(words, 11), 19),
+            green = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(words, 5), mask6), 10),
+            blue = _mm_slli_epi32(_mm_and_si128(words, mask5), 3);
+    return _mm_or_si128(_mm_or_si128(red, green), _mm_or_si128(blue, _mm_set1_epi32(0xFF000000)));
+}
+static void vga_convert_16bpp_sse2(uint32_t* dest, uint8_t* src, int width)
+{
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m128i words = _mm_loadu_si128((__m128i*)(src + i * 2));
+        _mm_storeu_si128((__m128i*)(dest + i), vga_rgb565_sse2(_mm_unpacklo_epi16(words, _mm_setzero_si128())));
+        _mm_storeu_si128((__m128i*)(dest + i + 4), vga_rgb565_sse2(_mm_unpackhi_epi16(words, _mm_setzero_si128())));
+    }
+    vga_convert_16bpp_c(dest + i, src + i * 2, width - i);
+}
+static void vga_convert_24bpp_sse2(uint32_t* dest, uint8_t* src, int width)
+{
+    // Four pixels per 16-byte load, so stop early enough that the load doesn't run past the end of the line
+    int i = 0;
+    for (; i + 6 <= width; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i*)(src + i * 3)),
+                p01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3)),
+                p23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9)),
+                result = _mm_and_si128(_mm_unpacklo_epi64(p01, p23), _mm_set1_epi32(0xFFFFFF));
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_or_si128(result, _mm_set1_epi32(0xFF000000)));
+    }
+    vga_convert_24bpp_c(dest + i, src + i * 3, width - i);
+}
+#endif
+
+#ifdef VGA_USE_AVX2
+__attribute__((target("avx2"))) static void vga_convert_8bpp_avx2(uint32_t* dest, uint8_t* src, int groups, int stride, uint32_t* palette, uint8_t mask)
+{
+    // Gather eight groups of four pixels, look each byte up in the palette, and then transpose them back into order
+    const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride)),
+                  byte_mask = _mm256_set1_epi32(mask);
+    int i = 0;
+    for (; i + 8 <= groups; i += 8, src += stride * 8, dest += 32) {
+        __m256i v = _mm256_i32gather_epi32((const int*)src, offsets, 1), r[4];
+        for (int j = 0; j < 4; j++)
+            r[j] = _mm256_i32gather_epi32((const int*)palette, _mm256_and_si256(_mm256_srli_epi32(v, j * 8), byte_mask), 4);
+        __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpacklo_epi32(r[2], r[3]),
+                t2 = _mm256_unpackhi_epi32(r[0], r[1]), t3 = _mm256_unpackhi_epi32(r[2], r[3]),
+                g04 = _mm256_unpacklo_epi64(t0, t1), g15 = _mm256_unpackhi_epi64(t0, t1),
+                g26 = _mm256_unpacklo_epi64(t2, t3), g37 = _mm256_unpackhi_epi64(t2, t3);
+        _mm256_storeu_si256((__m256i*)(dest + 0), _mm256_permute2x128_si256(g04, g15, 0x20));
+        _mm256_storeu_si256((__m256i*)(dest + 8), _mm256_permute2x128_si256(g26, g37, 0x20));
+        _mm256_storeu_si256((__m256i*)(dest + 16), _mm256_permute2x128_si256(g04, g15, 0x31));
+        _mm256_storeu_si256((__m256i*)(dest + 24), _mm256_permute2x128_si256(g26, g37, 0x31));
+    }
+    vga_convert_8bpp_c(dest, src, groups - i, stride, palette, mask);
+}
+__attribute__((target("avx2"))) static void vga_convert_16bpp_avx2(uint32_t* dest, uint8_t* src, int width)
+{
+    const __m256i mask5 = _mm256_set1_epi32(31), mask6 = _mm256_set1_epi32(63), alpha = _mm256_set1_epi32(0xFF000000);
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m256i words = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i*)(src + i * 2))),
+                red = _mm256_slli_epi32(_mm256_srli_epi32(words, 11), 19),
+                green = _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(words, 5), mask6), 10),
+                blue = _mm256_slli_epi32(_mm256_and_si256(words, mask5), 3);
+        _mm256_storeu_si256((__m256i*)(dest + i), _mm256_or_si256(_mm256_or_si256(red, green), _mm256_or_si256(blue, alpha)));
+    }
+    vga_convert_16bpp_c(dest + i, src + i * 2, width - i);
+}
+__attribute__((target("avx2"))) static void vga_convert_24bpp_avx2(uint32_t* dest, uint8_t* src, int width)
+{
+    // Move bytes 0-11 into the low lane and 12-23 into the high lane, then spread each lane's four pixels out
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0),
+                  spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                      0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1),
+                  alpha = _mm256_set1_epi32(0xFF000000);
+    int i = 0;
+    for (; i + 11 <= width; i += 8) {
+        __m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((__m256i*)(src + i * 3)), lanes);
+        _mm256_storeu_si256((__m256i*)(dest + i), _mm256_or_si256(_mm256_shuffle_epi8(v, spread), alpha));
+    }
+    vga_convert_24bpp_c(dest + i, src + i * 3, width - i);
+}
+#endif
+
+static void (*vga_convert_8bpp)(uint32_t* dest, uint8_t* src, int groups, int stride, uint32_t* palette, uint8_t mask) = vga_convert_8bpp_c;
+static void (*vga_convert_16bpp)(uint32_t* dest, uint8_t* src, int width) = vga_convert_16bpp_c;
+static void (*vga_convert_24bpp)(uint32_t* dest, uint8_t* src, int width) = vga_convert_24bpp_c;
+
+static void vga_init_converters(void)
+{
+    vga_init_glyph_masks();
+    vga_init_planar_lut();
+#ifdef VGA_USE_SSE2
+    vga_convert_16bpp = vga_convert_16bpp_sse2;
+    vga_convert_24bpp = vga_convert_24bpp_sse2;
+#endif
+#ifdef VGA_USE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        VGA_LOG("Using AVX2 scanline converters\n");
+        vga_convert_8bpp = vga_convert_8bpp_avx2;
+        vga_convert_16bpp = vga_convert_16bpp_avx2;
+        vga_convert_24bpp = vga_convert_24bpp_avx2;
+    }
+#endif
+}
+
+// Adds [start, end) to the drawn part of a scanline
+static inline void vga_mark_drawn(struct vga_info* v, unsigned int line, unsigned int start, unsigned int end)
+{
+    struct vga_span* span = &v->scanlines_drawn[line];
+    if (start >= end)
+        return;
+    if (span->start == span->end) {
+        span->start = start;
+        span->end = end;
+    } else {
+        if (start < span->start)
+            span->start = start;
+        if (end > span->end)
+            span->end = end;
+    }
+}
+
+// Merges the drawn scanline spans into rectangles: runs of consecutive drawn scanlines become one rectangle covering
+// all of their spans. Returns the number of rectangles.
+static int vga_collect_damage(struct vga_info* v, struct display_rect* rects)
+{
+    int count = 0, open = 0;
+    for (unsigned int y = 0; y < v->total_height; y++) {
+        struct vga_span* span = &v->scanlines_drawn[y];
+        if (span->start == span->end) {
+            open = 0;
+            continue;
+        }
+        // Once we run out of rectangles, the last one grows to cover everything else
+        if (!open && count < VGA_MAX_DAMAGE_RECTS) {
+            struct display_rect* r = &rects[count++];
+            r->x = span->start;
+            r->y = y;
+            r->width = span->end - span->start;
+            r->height = 1;
+            open = 1;
+            continue;
+        }
+        struct display_rect* r = &rects[count - 1];
+        int x0 = r->x < span->start ? r->x : span->start, x1 = r->x + r->width > span->end ? r->x + r->width : span->end;
+        r->x = x0;
+        r->width = x1 - x0;
+        r->height = y + 1 - r->y;
+    }
+    return count;
+}
+
+// Draws up to "scanlines_to_update" scanlines of "v" into v->framebuffer and marks the parts that changed in
+// v->scanlines_drawn. Returns 1 once the last scanline of the frame has been drawn.
+static int vga_render(struct vga_info* v, int scanlines_to_update, int framectr)
+{
+    // Note: This function should NOT modify any VGA registers or memory!
 
     // Text Mode state
     unsigned int cursor_scanline_start = 0, cursor_scanline_end = 0, cursor_enabled = 0, cursor_address = 0,
                  underline_location = 0, line_graphics = 0;
     // 4BPP renderer
-    unsigned int enableMask = 0, address_bit_mapping = 0;
+    unsigned int address_bit_mapping = 0;
+    uint32_t colors_4bpp[16];
 
     // All non-VBE renderers
-    unsigned int offset_between_lines = (((!vga.crt[0x13]) << 8 | vga.crt[0x13]) * 2) << 2;
-    switch (vga.renderer & ~1) {
+    unsigned int offset_between_lines = (((!v->crt[0x13]) << 8 | v->crt[0x13]) * 2) << 2;
+    switch (v->renderer & ~1) {
     case BLANK_RENDERER:
         break;
     case ALPHANUMERIC_RENDERER:
-        cursor_scanline_start = vga.crt[0x0A] & 0x1F;
-        cursor_scanline_end = vga.crt[0x0B] & 0x1F;
-        cursor_enabled = (vga.crt[0x0B] & 0x20) || (framectr >= 0x20);
-        cursor_address = (vga.crt[0x0E] << 8 | vga.crt[0x0F]) << 2;
-        underline_location = vga.crt[0x14] & 0x1F;
-        line_graphics = vga.char_width == 9 ? ((vga.attr[0x10] & 4) ? 0xE0 : 0) : 0;
+        cursor_scanline_start = v->crt[0x0A] & 0x1F;
+        cursor_scanline_end = v->crt[0x0B] & 0x1F;
+        cursor_enabled = (v->crt[0x0B] & 0x20) || (framectr >= 0x20);
+        cursor_address = (v->crt[0x0E] << 8 | v->crt[0x0F]) << 2;
+        underline_location = v->crt[0x14] & 0x1F;
+        line_graphics = v->char_width == 9 ? ((v->attr[0x10] & 4) ? 0xE0 : 0) : 0;
         break;
     case RENDER_4BPP:
-        enableMask = vga.attr[0x12] & 15;
-        address_bit_mapping = vga.crt[0x17] & 1;
+        address_bit_mapping = v->crt[0x17] & 1;
+        // Resolve the color plane enable, attribute palette and DAC once instead of for every pixel
+        for (int i = 0; i < 16; i++)
+            colors_4bpp[i] = v->dac_palette[v->dac_mask & v->attr_palette[i & v->attr[0x12] & 15]];
         break;
     case RENDER_16BPP: // VBE 16-bit BPP mode
-        offset_between_lines = vga.total_width * 2;
+        offset_between_lines = v->total_width * 2;
         break;
     case RENDER_24BPP: // VBE 24-bit BPP mode
-        offset_between_lines = vga.total_width * 3;
+        offset_between_lines = v->total_width * 3;
         break;
     case RENDER_32BPP: // VBE 32-bit BPP mode
-        offset_between_lines = vga.total_width * 4;
+        offset_between_lines = v->total_width * 4;
         break;
     }
-    if (!vga.memory_modified)
-        return;
-    vga.memory_modified &= ~(1 << (vga.current_scanline != 0));
-
-#ifdef ALLEGRO_BUILD
-    vga.framebuffer = display_get_pixels();
-#endif
+    if (!v->memory_modified)
+        return 0;
+    v->memory_modified &= ~(1 << (v->current_scanline != 0));
 
     uint32_t
-        //current = vga.current_scanline,
+        //current = v->current_scanline,
         total_scanlines_drawn
         = 0;
+    int frame_complete = 0;
     while (scanlines_to_update--) {
         total_scanlines_drawn++;
         // Things to account for here
@@ -1003,35 +1353,47 @@ void vga_update(void)
         //  6: ...
         //  7: (same as #6)
         // Therefore, we can come to the conclusion that if scanline doubling is enabled, then all odd scanlines are simply copies of the one preceding them
-        if ((vga.current_scanline & 1) && (vga.crt[9] & 0x80)) {
+        if ((v->current_scanline & 1) && (v->crt[9] & 0x80)) {
             // See above for
-            memcpy(&vga.framebuffer[vga.framebuffer_offset], &vga.framebuffer[vga.framebuffer_offset - vga.total_width], vga.total_width);
+            memcpy(&v->framebuffer[v->framebuffer_offset], &v->framebuffer[v->framebuffer_offset - v->total_width], v->total_width);
+            if (v->current_scanline < v->total_height)
+                vga_mark_drawn(v, v->current_scanline, v->scanlines_drawn[v->current_scanline - 1].start, v->scanlines_drawn[v->current_scanline - 1].end);
         } else {
-            if (vga.current_scanline < vga.total_height) {
-                uint32_t fboffset = vga.framebuffer_offset;
-                uint32_t vram_addr = vga.vram_addr;
-                switch (vga.renderer) {
+            if (v->current_scanline < v->total_height) {
+                uint32_t fboffset = v->framebuffer_offset;
+                uint32_t vram_addr = v->vram_addr;
+                unsigned int drawn_start = 0, drawn_end = v->total_width;
+                switch (v->renderer) {
                 case BLANK_RENDERER:
                 case BLANK_RENDERER | 1:
-                    for (unsigned int i = 0; i < vga.total_width; i++) {
-                        vga.framebuffer[fboffset + i] = 255 << 24;
+                    for (unsigned int i = 0; i < v->total_width; i++) {
+                        v->framebuffer[fboffset + i] = 255 << 24;
                     }
                     break;
                 case ALPHANUMERIC_RENDERER: {
+                    drawn_start = v->total_width;
+                    drawn_end = 0;
                     // Text Mode Memory Layout (physical)
                     // Plane 0: CC XX CC XX
                     // Plane 1: AA XX AA XX
                     // Plane 2: FF XX FF XX
                     // Plane 3: XX XX XX XX
                     // In a row: CC AA FF XX XX XX XX XX CC AA FF XX XX XX XX XX
-                    for (unsigned int i = 0; i < vga.total_width; i += vga.char_width, vram_addr += 4) {
-                        uint8_t character = vga.vram[vram_addr << 1];
-                        uint8_t attribute = vga.vram[(vram_addr << 1) + 1];
-                        uint8_t font = vga.vram[( //
+                    for (unsigned int i = 0; i < v->total_width; i += v->char_width, vram_addr += 4) {
+                        if (!v->text_redraw && !v->text_cells_modified[vram_addr >> 2 & 0x7FFF]) {
+                            fboffset += v->char_width;
+                            continue;
+                        }
+                        if (drawn_start > i)
+                            drawn_start = i;
+                        drawn_end = i + v->char_width;
+                        uint8_t character = v->vram[vram_addr << 1];
+                        uint8_t attribute = v->vram[(vram_addr << 1) + 1];
+                        uint8_t font = v->vram[( //
                                                     ( //
-                                                        vga.character_scanline // Current character scanline
+                                                        v->character_scanline // Current character scanline
                                                         + character * 32 // Each character holds 32 bytes of font data in plane 2
-                                                        + vga.character_map[~attribute >> 3 & 1]) // Offset in plane to, decided by attribute byte
+                                                        + v->character_map[~attribute >> 3 & 1]) // Offset in plane to, decided by attribute byte
                                                     << 2)
                             + 2 // Select Plane 2
                         ];
@@ -1043,49 +1405,47 @@ void vga_update(void)
                         //  - Blinking
                         //  - Underline
                         if (cursor_enabled && vram_addr == cursor_address) {
-                            if ((vga.character_scanline >= cursor_scanline_start) && (vga.character_scanline <= cursor_scanline_end)) {
+                            if ((v->character_scanline >= cursor_scanline_start) && (v->character_scanline <= cursor_scanline_end)) {
                                 // cursor is enabled
                                 bg = fg;
                             }
                         }
 
                         // TODO: I've noticed that blinking is twice as slow as cursor blinks
-                        if ((vga.attr[0x10] & 8) && (framectr >= 32)) {
+                        if ((v->attr[0x10] & 8) && (framectr >= 32)) {
                             bg &= 7; // last bit is not interpreted
                             if (attribute & 0x80)
                                 fg = bg;
                         }
                         // Underline is simple
                         if ((attribute & 0b01110111) == 1) {
-                            if (vga.character_scanline == underline_location)
+                            if (v->character_scanline == underline_location)
                                 bg = fg;
                         }
 
                         // To draw the character quickly, use a method similar to do_mask
-                        fg = vga.dac_palette[vga.dac_mask & vga.attr_palette[fg]];
-                        bg = vga.dac_palette[vga.dac_mask & vga.attr_palette[bg]];
+                        fg = v->dac_palette[v->dac_mask & v->attr_palette[fg]];
+                        bg = v->dac_palette[v->dac_mask & v->attr_palette[bg]];
                         uint32_t xorvec = fg ^ bg;
                         // The following is equivalent to the following:
-                        //  if(font & bit) vga.framebuffer[fboffset] = fg; else vga.framebuffer[fboffset] = bg;
-                        vga.framebuffer[fboffset + 0] = ((xorvec & -(font >> 7))) ^ bg;
-                        vga.framebuffer[fboffset + 1] = ((xorvec & -(font >> 6 & 1))) ^ bg;
-                        vga.framebuffer[fboffset + 2] = ((xorvec & -(font >> 5 & 1))) ^ bg;
-                        vga.framebuffer[fboffset + 3] = ((xorvec & -(font >> 4 & 1))) ^ bg;
-                        vga.framebuffer[fboffset + 4] = ((xorvec & -(font >> 3 & 1))) ^ bg;
-                        vga.framebuffer[fboffset + 5] = ((xorvec & -(font >> 2 & 1))) ^ bg;
-                        vga.framebuffer[fboffset + 6] = ((xorvec & -(font >> 1 & 1))) ^ bg;
-                        vga.framebuffer[fboffset + 7] = ((xorvec & -(font >> 0 & 1))) ^ bg;
+                        //  if(font & bit) v->framebuffer[fboffset] = fg; else v->framebuffer[fboffset] = bg;
+                        // glyph_masks holds each font row already expanded to one mask per pixel, which lets the
+                        // compiler turn this loop into a few vector stores.
+                        const uint32_t* mask = glyph_masks[font];
+                        uint32_t* dest = &v->framebuffer[fboffset];
+                        for (int k = 0; k < 8; k++)
+                            dest[k] = (xorvec & mask[k]) ^ bg;
 
                         if ((character & line_graphics) == 0xC0) {
-                            vga.framebuffer[fboffset + 8] = ((xorvec & -(font >> 0 & 1))) ^ bg;
-                        } else if (vga.char_width == 9)
-                            vga.framebuffer[fboffset + 8] = bg;
-                        fboffset += vga.char_width;
+                            v->framebuffer[fboffset + 8] = ((xorvec & -(font >> 0 & 1))) ^ bg;
+                        } else if (v->char_width == 9)
+                            v->framebuffer[fboffset + 8] = bg;
+                        fboffset += v->char_width;
                     }
                     break;
                 }
                 case MODE_13H_RENDERER: {
-                    //if(!vga.vbe_scanlines_modified[vga.current_scanline]) break;
+                    //if(!v->vbe_scanlines_modified[v->current_scanline]) break;
                     // CHAIN4 Memory Layout:
                     //  Plane 0: AA 00 00 00 AA 00 00 00
                     //  Plane 1: BB 00 00 00 BB 00 00 00
@@ -1093,150 +1453,147 @@ void vga_update(void)
                     //  Plane 3: DD 00 00 00 DD 00 00 00
                     // Draw four clumps of pixels together
                     // XXX: What if screen isn't a multiple of four pixels wide?
-                    for (unsigned int i = 0; i < vga.total_width; i += 4, vram_addr += 16) {
-                        for (int j = 0; j < 4; j++) { // hopefully, compiler unrolls loop
-                            vga.framebuffer[fboffset + j] = vga.dac_palette[vga.vram[vram_addr | j] & vga.dac_mask];
-                        }
-                        fboffset += 4;
-                    }
-                    //vga.vbe_scanlines_modified[vga.current_scanline] = 0;
+                    vga_convert_8bpp(&v->framebuffer[fboffset], &v->vram[vram_addr], (v->total_width + 3) >> 2, 16, v->dac_palette, v->dac_mask);
+                    //v->vbe_scanlines_modified[v->current_scanline] = 0;
                     break;
                 }
                 case MODE_13H_RENDERER | 1:
-                    //if(!vga.vbe_scanlines_modified[vga.current_scanline]) break;
-                    for (unsigned int i = 0; i < vga.total_width; i += 8, vram_addr += 4) {
+                    //if(!v->vbe_scanlines_modified[v->current_scanline]) break;
+                    for (unsigned int i = 0; i < v->total_width; i += 8, vram_addr += 4) {
                         for (int j = 0, k = 0; j < 4; j++, k += 2) {
-                            vga.framebuffer[fboffset + k] = vga.framebuffer[fboffset + k + 1] = vga.dac_palette[vga.vram[vram_addr | j] & vga.dac_mask];
+                            v->framebuffer[fboffset + k] = v->framebuffer[fboffset + k + 1] = v->dac_palette[v->vram[vram_addr | j] & v->dac_mask];
                         }
                         fboffset += 8;
                     }
-                    //vga.vbe_scanlines_modified[vga.current_scanline] = 0;
+                    //v->vbe_scanlines_modified[v->current_scanline] = 0;
                     break;
                 case RENDER_4BPP: {
-                    //if(!vga.vbe_scanlines_modified[vga.current_scanline]) break;
+                    //if(!v->vbe_scanlines_modified[v->current_scanline]) break;
                     uint32_t addr = vram_addr;
-                    if (vga.character_scanline & address_bit_mapping)
+                    if (v->character_scanline & address_bit_mapping)
                         addr |= 0x8000;
-                    uint8_t p0 = vga.vram[addr | 0];
-                    uint8_t p1 = vga.vram[addr | 1];
-                    uint8_t p2 = vga.vram[addr | 2];
-                    uint8_t p3 = vga.vram[addr | 3];
+                    uint64_t pixels = vga_planar_to_chunky(&v->vram[addr]);
 
-                    for (unsigned int x = 0, px = vga.current_pixel_panning; x < vga.total_width; x++, fboffset++, px++) {
+                    for (unsigned int x = 0, px = v->current_pixel_panning; x < v->total_width; x++, fboffset++, px++) {
                         if (px > 7) {
                             px = 0;
                             addr += 4;
-                            p0 = vga.vram[addr | 0];
-                            p1 = vga.vram[addr | 1];
-                            p2 = vga.vram[addr | 2];
-                            p3 = vga.vram[addr | 3];
+                            pixels = vga_planar_to_chunky(&v->vram[addr]);
                         }
-                        int pixel = bpp4_to_offset(p0, px, 0) | bpp4_to_offset(p1, px, 1) | bpp4_to_offset(p2, px, 2) | bpp4_to_offset(p3, px, 3);
-                        pixel &= enableMask;
-                        vga.framebuffer[fboffset] = vga.dac_palette[vga.dac_mask & vga.attr_palette[pixel]];
+                        v->framebuffer[fboffset] = colors_4bpp[pixels >> (px * 8) & 15];
                     }
-                    //vga.vbe_scanlines_modified[vga.current_scanline] = 0;
+                    //v->vbe_scanlines_modified[v->current_scanline] = 0;
                     break;
                 }
                 case RENDER_4BPP | 1: {
                     // 4BPP rendering mode, but lower resolution
-                    //if(!vga.vbe_scanlines_modified[vga.current_scanline]) break;
+                    //if(!v->vbe_scanlines_modified[v->current_scanline]) break;
                     uint32_t addr = vram_addr;
-                    uint8_t p0 = vga.vram[addr | 0];
-                    uint8_t p1 = vga.vram[addr | 1];
-                    uint8_t p2 = vga.vram[addr | 2];
-                    uint8_t p3 = vga.vram[addr | 3];
-                    for (unsigned int x = 0, px = vga.current_pixel_panning; x < vga.total_width; x += 2, fboffset += 2, px++) {
+                    uint64_t pixels = vga_planar_to_chunky(&v->vram[addr]);
+                    for (unsigned int x = 0, px = v->current_pixel_panning; x < v->total_width; x += 2, fboffset += 2, px++) {
                         if (px > 7) {
                             px = 0;
                             addr += 4;
-                            p0 = vga.vram[addr | 0];
-                            p1 = vga.vram[addr | 1];
-                            p2 = vga.vram[addr | 2];
-                            p3 = vga.vram[addr | 3];
+                            pixels = vga_planar_to_chunky(&v->vram[addr]);
                         }
-                        int pixel = bpp4_to_offset(p0, px, 0) | bpp4_to_offset(p1, px, 1) | bpp4_to_offset(p2, px, 2) | bpp4_to_offset(p3, px, 3);
-                        pixel &= enableMask;
-                        uint32_t result = vga.dac_palette[vga.dac_mask & vga.attr_palette[pixel]];
-                        vga.framebuffer[fboffset] = result;
-                        vga.framebuffer[fboffset + 1] = result;
+                        uint32_t result = colors_4bpp[pixels >> (px * 8) & 15];
+                        v->framebuffer[fboffset] = result;
+                        v->framebuffer[fboffset + 1] = result;
                     }
-                    //vga.vbe_scanlines_modified[vga.current_scanline] = 0;
+                    //v->vbe_scanlines_modified[v->current_scanline] = 0;
                     break;
                 }
                 case RENDER_32BPP:
-                    if (!vga.vbe_scanlines_modified[vga.current_scanline])
+                    if (!v->vbe_scanlines_modified[v->current_scanline]) {
+                        drawn_end = 0;
                         break;
-                    for (unsigned int i = 0; i < vga.total_width; i++, vram_addr += 4) {
+                    }
+                    for (unsigned int i = 0; i < v->total_width; i++, vram_addr += 4) {
 #ifndef EMSCRIPTEN
-                        vga.framebuffer[fboffset++] = *((uint32_t*)&vga.vram[vram_addr]) | 0xFF000000;
+                        v->framebuffer[fboffset++] = *((uint32_t*)&v->vram[vram_addr]) | 0xFF000000;
 #else
-                        uint32_t num = *((uint32_t*)&vga.vram[vram_addr]);
+                        uint32_t num = *((uint32_t*)&v->vram[vram_addr]);
                         // Byte-swap framebuffer for easy ImageData blitting
-                        vga.framebuffer[fboffset++] = (num >> 16 & 0xFF) | (num << 16 & 0xFF0000) | (num & 0xFF00) | 0xFF000000;
+                        v->framebuffer[fboffset++] = (num >> 16 & 0xFF) | (num << 16 & 0xFF0000) | (num & 0xFF00) | 0xFF000000;
 #endif
                     }
-                    vga.vbe_scanlines_modified[vga.current_scanline] = 0;
+                    v->vbe_scanlines_modified[v->current_scanline] = 0;
                     break;
                 case RENDER_8BPP:
-                    if (!vga.vbe_scanlines_modified[vga.current_scanline])
+                    if (!v->vbe_scanlines_modified[v->current_scanline]) {
+                        drawn_end = 0;
                         break;
-                    for (unsigned int i = 0; i < vga.total_width; i++, vram_addr++)
-                        vga.framebuffer[fboffset++] = vga.dac_palette[vga.vram[vram_addr]];
+                    }
+                    vga_convert_8bpp(&v->framebuffer[fboffset], &v->vram[vram_addr], v->total_width >> 2, 4, v->dac_palette, 0xFF);
+                    for (unsigned int i = v->total_width & ~3; i < v->total_width; i++)
+                        v->framebuffer[fboffset + i] = v->dac_palette[v->vram[vram_addr + i]];
 
-                    vga.vbe_scanlines_modified[vga.current_scanline] = 0;
+                    v->vbe_scanlines_modified[v->current_scanline] = 0;
                     break;
                 case RENDER_16BPP:
-                    if (!vga.vbe_scanlines_modified[vga.current_scanline])
+                    if (!v->vbe_scanlines_modified[v->current_scanline]) {
+                        drawn_end = 0;
                         break;
-                    for (unsigned int i = 0; i < vga.total_width; i++, vram_addr += 2) {
-                        uint16_t word = *((uint16_t*)&vga.vram[vram_addr]);
+                    }
+#ifndef EMSCRIPTEN
+                    vga_convert_16bpp(&v->framebuffer[fboffset], &v->vram[vram_addr], v->total_width);
+#else
+                    for (unsigned int i = 0; i < v->total_width; i++, vram_addr += 2) {
+                        uint16_t word = *((uint16_t*)&v->vram[vram_addr]);
                         int red = word >> 11 << 3,
                             green = (word >> 5 & 63) << 2, // Note: 6 bits for green
                             blue = (word & 31) << 3;
-#ifndef EMSCRIPTEN
-                        vga.framebuffer[fboffset++] = red << 16 | green << 8 | blue << 0 | 0xFF000000;
-#else
-                        vga.framebuffer[fboffset++] = red << 0 | green << 8 | blue << 16 | 0xFF000000;
-#endif
+                        v->framebuffer[fboffset++] = red << 0 | green << 8 | blue << 16 | 0xFF000000;
                     }
+#endif
 
-                    vga.vbe_scanlines_modified[vga.current_scanline] = 0;
+                    v->vbe_scanlines_modified[v->current_scanline] = 0;
                     break;
                 case RENDER_24BPP:
-                    if (!vga.vbe_scanlines_modified[vga.current_scanline])
+                    if (!v->vbe_scanlines_modified[v->current_scanline]) {
+                        drawn_end = 0;
                         break;
-                    for (unsigned int i = 0; i < vga.total_width; i++, vram_addr += 3) {
-                        uint8_t blue = vga.vram[vram_addr],
-                                green = vga.vram[vram_addr + 1],
-                                red = vga.vram[vram_addr + 2];
+                    }
 #ifndef EMSCRIPTEN
-                        vga.framebuffer[fboffset++] = (blue) | (green << 8) | (red << 16) | 0xFF000000;
+                    vga_convert_24bpp(&v->framebuffer[fboffset], &v->vram[vram_addr], v->total_width);
 #else
-                        vga.framebuffer[fboffset++] = (blue << 16) | (green << 8) | (red) | 0xFF000000;
-#endif
+                    for (unsigned int i = 0; i < v->total_width; i++, vram_addr += 3) {
+                        uint8_t blue = v->vram[vram_addr],
+                                green = v->vram[vram_addr + 1],
+                                red = v->vram[vram_addr + 2];
+                        v->framebuffer[fboffset++] = (blue << 16) | (green << 8) | (red) | 0xFF000000;
                     }
-                    vga.vbe_scanlines_modified[vga.current_scanline] = 0;
+#endif
+                    v->vbe_scanlines_modified[v->current_scanline] = 0;
                     break;
                 }
-                if ((vga.crt[9] & 0x1F) == vga.character_scanline) {
-                    vga.character_scanline = 0;
-                    vga.vram_addr += offset_between_lines; // TODO: Dword Mode
+                vga_mark_drawn(v, v->current_scanline, drawn_start, drawn_end);
+                if ((v->crt[9] & 0x1F) == v->character_scanline) {
+                    v->character_scanline = 0;
+                    v->vram_addr += offset_between_lines; // TODO: Dword Mode
                 } else
-                    vga.character_scanline++;
+                    v->character_scanline++;
             }
         }
-        vga.current_scanline = (vga.current_scanline + 1) & 0x0FFF; // Increment current scan line
-        vga.framebuffer_offset += vga.total_width;
-        if (vga.current_scanline >= vga.total_height) {
+        v->current_scanline = (v->current_scanline + 1) & 0x0FFF; // Increment current scan line
+        v->framebuffer_offset += v->total_width;
+        if (v->current_scanline >= v->total_height) {
             // Technically, we should draw output to the value specified by the CRT Vertical Total Register, but why bother?
 
-            // Update the display when all the scanlines have been drawn
-            //display_update(current, total_scanlines_drawn);
-            display_update(0, vga.total_height);
-
-            vga_complete_redraw(); // contrary to its name, it only resets drawing state
-            //current = 0;
+            // The caller updates the display once all the scanlines have been drawn
+            vga_restart_frame(v);
+            v->memory_modified = 3;
+            frame_complete = 1;
+
+            // Text mode cells that changed during this frame get drawn once more in full
+            if (v->text_redraw)
+                v->text_redraw--;
+            if (v->text_cells_pending) {
+                v->text_cells_pending = 0;
+                for (int i = 0; i < 0x8000; i++)
+                    if (v->text_cells_modified[i])
+                        v->text_cells_pending |= --v->text_cells_modified[i];
+            }
 
             total_scanlines_drawn = 0;
 
@@ -1244,6 +1601,189 @@ void vga_update(void)
             //framectr = (framectr + 1) & 0x3F;
         }
     }
+    return frame_complete;
+}
+
+// One out of every "frameskip" frames is drawn, or none at all if zero
+static MACHINE_LOCAL int frameskip = 1;
+
+#ifdef VGA_USE_THREADS
+// When enabled, a copy of the VGA state is handed to a separate thread once per frame. The thread draws it into its own
+// buffer, and vga_update copies the scanlines that changed to the display.
+static MACHINE_LOCAL struct vga_renderer {
+    int enabled, busy, frame_ready;
+    int scanlines, framectr;
+    struct vga_info state;
+    uint32_t* pixels;
+    uint32_t width, height;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} render;
+
+// "render" is local to the emulator thread, so the render thread is handed a pointer to it
+static void* vga_render_thread(void* arg)
+{
+    struct vga_renderer* r = arg;
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->busy)
+            pthread_cond_wait(&r->cond, &r->lock);
+        pthread_mutex_unlock(&r->lock);
+
+        vga_render(&r->state, r->state.total_height, r->framectr);
+
+        pthread_mutex_lock(&r->lock);
+        r->busy = 0;
+        r->frame_ready = 1;
+    }
+    return NULL;
+}
+
+// Copies everything the render thread needs to draw the current frame. Must be called while it is idle.
+static void vga_render_snapshot(int framectr)
+{
+    struct vga_info* r = &render.state;
+    uint8_t *vram = r->vram, *modified = r->vbe_scanlines_modified;
+    struct vga_span* drawn = r->scanlines_drawn;
+    int resized = render.width != vga.total_width || render.height != vga.total_height;
+
+    if (r->vram_size != vga.vram_size) {
+        free(vram);
+        vram = malloc(vga.vram_size);
+        vga.vram_all_dirty = 1;
+    }
+    if (resized) {
+        render.width = vga.total_width;
+        render.height = vga.total_height;
+        render.pixels = realloc(render.pixels, render.width * render.height * 4);
+        modified = realloc(modified, render.height);
+        drawn = realloc(drawn, render.height * sizeof(struct vga_span));
+    }
+
+    // Only the pages of VRAM that were written since the last snapshot need to be copied
+    int words = (vga.vram_size + 0x1FFFF) >> 17;
+    if (vga.vram_all_dirty)
+        memcpy(vram, vga.vram, vga.vram_size);
+    else {
+        for (int i = 0; i < words; i++) {
+            uint32_t bits = vga.vram_dirty[i];
+            while (bits) {
+                uint32_t offset = (i << 5 | __builtin_ctz(bits)) << 12;
+                bits &= bits - 1;
+                memcpy(vram + offset, vga.vram + offset, 4096);
+            }
+        }
+    }
+    memset(vga.vram_dirty, 0, words * 4);
+    vga.vram_all_dirty = 0;
+
+    *r = vga;
+    r->vram = vram;
+    r->framebuffer = render.pixels;
+    r->vbe_scanlines_modified = modified;
+    r->scanlines_drawn = drawn;
+    r->lfb_dirty = r->vram_dirty = r->vram_state_dirty = NULL;
+
+    // Whatever is marked as modified now will be drawn in full by the render thread
+    memcpy(modified, vga.vbe_scanlines_modified, render.height);
+    memset(vga.vbe_scanlines_modified, 0, render.height);
+    if (vga.text_cells_pending)
+        memset(vga.text_cells_modified, 0, sizeof(vga.text_cells_modified));
+    vga.text_cells_pending = 0;
+    vga.text_redraw = 0;
+    if (resized) {
+        memset(modified, 1, render.height);
+        r->text_redraw = 1;
+    }
+    memset(drawn, 0, render.height * sizeof(struct vga_span));
+
+    vga_restart_frame(r);
+    r->memory_modified = 3;
+    render.framectr = framectr;
+}
+
+static void vga_update_threaded(int framectr)
+{
+    pthread_mutex_lock(&render.lock);
+    if (render.frame_ready) {
+        if (render.width == vga.total_width && render.height == vga.total_height) {
+            struct display_rect rects[VGA_MAX_DAMAGE_RECTS];
+            int count = vga_collect_damage(&render.state, rects);
+            for (int i = 0; i < count; i++)
+                for (int y = rects[i].y; y < rects[i].y + rects[i].height; y++) {
+                    uint32_t offset = y * render.width + rects[i].x;
+                    memcpy(&vga.framebuffer[offset], &render.pixels[offset], rects[i].width * 4);
+                }
+            display_update(rects, count);
+        }
+        render.frame_ready = 0;
+    }
+
+    // Hand over a new frame as often as vga_render would have finished one
+    render.scanlines += vga.scanlines_to_update;
+    if (!render.busy && render.scanlines >= (int)vga.total_height * frameskip) {
+        render.scanlines = 0;
+        vga_render_snapshot(framectr);
+        render.busy = 1;
+        pthread_cond_signal(&render.cond);
+    }
+    pthread_mutex_unlock(&render.lock);
+}
+#endif
+
+static MACHINE_LOCAL int framectr = 0, skipped_scanlines = 0;
+void vga_update(void)
+{
+    if (!frameskip)
+        return;
+    framectr = (framectr + 1) & 0x3F;
+
+    if ((vga.renderer & ~1) == ALPHANUMERIC_RENDERER) {
+        // Only the cells under the old and new cursor need to be redrawn when it moves or blinks, but blinking text can
+        // be anywhere on the screen.
+        unsigned int cursor_address = (vga.crt[0x0E] << 8 | vga.crt[0x0F]) << 2,
+                     cursor_enabled = (vga.crt[0x0B] & 0x20) || (framectr >= 0x20),
+                     text_cursor_state = cursor_address | (vga.crt[0x0A] & 0x1F) << 18 | (vga.crt[0x0B] & 0x1F) << 23 | cursor_enabled << 28
+            | ((vga.attr[0x10] & 8) && (framectr >= 32)) << 29;
+        if (text_cursor_state != vga.text_cursor_state) {
+            vga_text_cell_modified(vga.text_cursor_state >> 2);
+            vga_text_cell_modified(cursor_address >> 2);
+            if ((text_cursor_state ^ vga.text_cursor_state) >> 29)
+                vga.text_redraw = 2;
+            vga.text_cursor_state = text_cursor_state;
+        }
+    }
+
+#ifdef VGA_USE_THREADS
+    if (render.enabled) {
+        vga_sync_lfb();
+        vga_update_threaded(framectr);
+        return;
+    }
+#endif
+
+    // Skipped frames are not drawn a few scanlines at a time, but all at once when the next frame is due. This way, drawing
+    // always starts at the top of the frame.
+    int scanlines_to_update = vga.scanlines_to_update;
+    if (frameskip > 1) {
+        skipped_scanlines += scanlines_to_update;
+        if (skipped_scanlines < (int)vga.total_height * frameskip)
+            return;
+        skipped_scanlines = 0;
+        scanlines_to_update = vga.total_height;
+    }
+    vga_sync_lfb();
+
+#ifdef ALLEGRO_BUILD
+    vga.framebuffer = display_get_pixels();
+#endif
+    if (vga_render(&vga, scanlines_to_update, framectr)) {
+        // Update the display when all the scanlines have been drawn
+        struct display_rect rects[VGA_MAX_DAMAGE_RECTS];
+        display_update(rects, vga_collect_damage(&vga, rects));
+        memset(vga.scanlines_drawn, 0, vga.total_height * sizeof(struct vga_span));
+    }
 }
 
 static void vga_reset(void)
@@ -1253,6 +1793,7 @@ static void vga_reset(void)
     vga.seq_index = 0;
     vga.char_width = 9; // default size of SR01 bit 0 is 0
     vga.character_map[0] = vga.character_map[1] = 0;
+    vga.text_redraw = 2;
     vga_complete_redraw();
 }
 
@@ -1264,13 +1805,14 @@ static void expand32_alt(uint8_t* ptr, int v4)
     ptr[3] = v4 & 8 ? 0xFF : 0;
 }
 
-static uint32_t expand32(int v4)
+// Expands each of the lower four bits to a byte
+static inline uint32_t expand32(int v4)
 {
-    uint32_t r = v4 & 1 ? 0xFF : 0;
-    r |= v4 & 2 ? 0xFF00 : 0;
-    r |= v4 & 4 ? 0xFF0000 : 0;
-    r |= v4 & 8 ? 0xFF000000 : 0;
-    return r;
+    static const uint32_t lut[16] = {
+        0x00000000, 0x000000FF, 0x0000FF00, 0x0000FFFF, 0x00FF0000, 0x00FF00FF, 0x00FFFF00, 0x00FFFFFF, //
+        0xFF000000, 0xFF0000FF, 0xFF00FF00, 0xFF00FFFF, 0xFFFF0000, 0xFFFF00FF, 0xFFFFFF00, 0xFFFFFFFF
+    };
+    return lut[v4 & 15];
 }
 static uint32_t b8to32(uint8_t x)
 {
@@ -1341,26 +1883,17 @@ static uint8_t alu_rotate(uint8_t value)
     return ((value >> rotate_count) | (value << (8 - rotate_count))) & 0xFF;
 }
 
-#define DO_MASK(n) xor ^= mask_enabled& n ? value& lut32[n] : mask& lut32[n]
-// If a bit in "mask_enabled" is set, then replace value with the data in "mask," otherwise keep the same
-// Example: value=0x12345678 mask=0x9ABCDEF0 mask_enabled=0b1010 result=0x9A34DE78
-static inline uint32_t do_mask(uint32_t value, uint32_t mask, int mask_enabled)
+// Marks the VRAM pages containing "first" and "last" as written. Stores are never larger than a page.
+static inline void vga_mark_pages(uint32_t* bitmap, uint32_t first, uint32_t last)
 {
-    static uint32_t lut32[9] = { 0, 0xFF, 0xFF00, 0, 0xFF0000, 0, 0, 0, 0xFF000000 };
-    // Uses XOR for fast bit replacement
-    uint32_t xor = value ^ mask;
-    DO_MASK(1);
-    DO_MASK(2);
-    DO_MASK(4);
-    DO_MASK(8);
-    return xor;
+    bitmap[first >> 17] |= 1 << (first >> 12 & 31);
+    bitmap[last >> 17] |= 1 << (last >> 12 & 31);
 }
 
-#ifndef VGA_LIBRARY
-static
-#endif
-    void
-    vga_mem_writeb(uint32_t addr, uint32_t data)
+// Writes "bytes" (1, 2, or 4) bytes of "data" to consecutive addresses. Everything that does not depend on the data itself
+// -- the write mode, set/reset, ALU and bit mask registers -- is decoded once, and VRAM pages and scanlines are marked as
+// modified once per store instead of once per byte.
+static inline void vga_mem_write(uint32_t addr, uint32_t data, int bytes)
 {
     if (vga.vbe_enable & VBE_DISPI_ENABLED) {
         // The following four scenarios can occur:
@@ -1371,123 +1904,165 @@ static
         uint32_t vram_offset;
         if (addr & 0x80000000) {
             vram_offset = addr - VBE_LFB_BASE;
-            if (vga.vbe_enable & VBE_DISPI_LFB_ENABLED)
-                vga.vram[vram_offset] = data;
-            else
+            if (vga.vbe_enable & VBE_DISPI_LFB_ENABLED) {
+                for (int i = 0; i < bytes; i++)
+                    vga.vram[vram_offset + i] = data >> (i * 8);
+                vga_mark_pages(vga.lfb_dirty, vram_offset, vram_offset + bytes - 1);
+            } else
                 return;
         } else {
             vram_offset = vga.vbe_regs[5] + (addr & 0x1FFFF);
             if (vga.vbe_enable & VBE_DISPI_LFB_ENABLED)
                 return;
-            else
-                vga.vram[vram_offset] = data;
+            else if ((addr & 0x1FFFF) + bytes > 0x20000) {
+                // Wraps around the end of the bank
+                for (int i = 0; i < bytes; i++)
+                    vga_mem_write(addr + i, data >> (i * 8), 1);
+                return;
+            } else
+                for (int i = 0; i < bytes; i++)
+                    vga.vram[vram_offset + i] = data >> (i * 8);
         }
-        // Determine the scanline that was modified
-        uint32_t scanline = vram_offset / (vga.total_width * ((vga.vbe_regs[3] + 7) >> 3));
+        vga_mark_pages(vga.vram_dirty, vram_offset, vram_offset + bytes - 1);
+        vga_mark_pages(vga.vram_state_dirty, vram_offset, vram_offset + bytes - 1);
+        // Determine the scanline that was modified, and the one after it if the store crosses over
+        uint32_t line_size = vga.total_width * ((vga.vbe_regs[3] + 7) >> 3), scanline = vram_offset / line_size;
         if (scanline < vga.total_height)
             vga.vbe_scanlines_modified[scanline] = 1;
+        if (vram_offset - scanline * line_size + bytes > line_size && scanline + 1 < vga.total_height)
+            vga.vbe_scanlines_modified[scanline + 1] = 1;
         vga.memory_modified = 1;
         return;
     }
 
     addr -= vga.vram_window_base;
-    if (addr > vga.vram_window_size) { // Note: will catch the case where addr < vram_window_base as well
+    if (addr > vga.vram_window_size - (bytes - 1)) { // Note: will catch the case where addr < vram_window_base as well
         //VGA_LOG("Out Of Bounds VRAM write: addr=%08x data=%02x\n", addr, data);
+        if (bytes > 1) {
+            // Some of the bytes may still be in the window
+            for (int i = 0; i < bytes; i++)
+                vga_mem_write(addr + vga.vram_window_base + i, data >> (i * 8), 1);
+        }
         return;
     }
-    int plane = 0, plane_addr = -1;
-    switch (vga.write_access) {
-    case CHAIN4:
-        plane = 1 << (addr & 3);
-        plane_addr = addr >> 2;
-        break;
-    case ODDEVEN:
-        plane = 5 << (addr & 1);
-        plane_addr = addr & ~1;
-        break;
-    case NORMAL:
-        plane = 15; // This will be masked out by SR02 later
-        plane_addr = addr;
-        break;
-    }
-    uint32_t data32 = data, and_value = 0xFFFFFFFF; // this will be expanded to 32 bits later, but for now keep it as 8 bits to keep things simple
-    int run_alu = 1;
-    switch (vga.write_mode) {
-    case 0:
-        data32 = b8to32(alu_rotate(data));
-        data32 = do_mask(data32, expand32(vga.gfx[0]), vga.gfx[1]);
-        break;
-    case 1:
-        data32 = vga.latch32; // TODO: endianness
-        run_alu = 0;
-        break;
-    case 2:
-        data32 = expand32(data);
-        break;
-    case 3:
-        and_value = b8to32(alu_rotate(data));
-        data32 = expand32(vga.gfx[0]);
-        break;
-    }
-    if (run_alu) {
-        uint32_t mask = b8to32(vga.gfx[8]) & and_value;
-        switch (vga.gfx[3] & 0x18) {
-        case 0: // MOV (Unmodified)
-            data32 = (data32 & mask) | (vga.latch32 & ~mask);
-            break;
 
-        // TODO: Simplify the rest using Boolean Algebra
-        case 0x08: // AND
-            // ABC + B~C
-            // B(AC + ~C)
-            // (A + ~C)B
-            data32 = ((data32 & vga.latch32) & mask) | (vga.latch32 & ~mask);
+    uint32_t latch = vga.latch32, // TODO: endianness
+        bit_mask = b8to32(vga.gfx[8]), set_reset = expand32(vga.gfx[0]), set_reset_enable = expand32(vga.gfx[1]);
+    int first_plane_addr = -1, plane_addr = -1, planes_written = 0;
+    for (int i = 0; i < bytes; i++, addr++) {
+        uint8_t value = data >> (i * 8);
+        int plane = 0;
+        switch (vga.write_access) {
+        case CHAIN4:
+            plane = 1 << (addr & 3);
+            plane_addr = addr >> 2;
             break;
-        case 0x10: // OR
-            data32 = ((data32 | vga.latch32) & mask) | (vga.latch32 & ~mask);
+        case ODDEVEN:
+            plane = 5 << (addr & 1);
+            plane_addr = addr & ~1;
             break;
-        case 0x18: // XOR
-            data32 = ((data32 ^ vga.latch32) & mask) | (vga.latch32 & ~mask);
+        case NORMAL:
+            plane = 15; // This will be masked out by SR02 later
+            plane_addr = addr;
             break;
         }
+        uint32_t data32 = latch, mask = bit_mask;
+        switch (vga.write_mode) {
+        case 0:
+            data32 = b8to32(alu_rotate(value));
+            data32 = (data32 & ~set_reset_enable) | (set_reset & set_reset_enable);
+            break;
+        case 1:
+            break;
+        case 2:
+            data32 = expand32(value);
+            break;
+        case 3:
+            mask &= b8to32(alu_rotate(value));
+            data32 = set_reset;
+            break;
+        }
+        if (vga.write_mode != 1) {
+            switch (vga.gfx[3] & 0x18) {
+            case 0x08: // AND
+                data32 &= latch;
+                break;
+            case 0x10: // OR
+                data32 |= latch;
+                break;
+            case 0x18: // XOR
+                data32 ^= latch;
+                break;
+            }
+            data32 = (data32 & mask) | (latch & ~mask);
+        }
+        if (plane_addr > 65536)
+            VGA_FATAL("Writing outside plane bounds\n");
+
+        // Actually write to memory
+        plane &= vga.seq[2];
+        uint32_t *vram_ptr = (uint32_t*)&vga.vram[plane_addr << 2], plane_mask = expand32(plane);
+        *vram_ptr = (*vram_ptr & ~plane_mask) | (data32 & plane_mask);
+
+        // Characters and attributes live in planes 0 and 1, and the font in plane 2
+        if (plane & 3)
+            vga_text_cell_modified(plane_addr >> 1);
+        planes_written |= plane;
+        if (!i)
+            first_plane_addr = plane_addr;
     }
-    if (plane_addr > 65536)
-        VGA_FATAL("Writing outside plane bounds\n");
-
-    // Actually write to memory
-    plane &= vga.seq[2];
-    uint32_t* vram_ptr = (uint32_t*)&vga.vram[plane_addr << 2];
-    *vram_ptr = do_mask(*vram_ptr, data32, plane);
+    vga_mark_pages(vga.vram_dirty, first_plane_addr << 2, plane_addr << 2);
+    vga_mark_pages(vga.vram_state_dirty, first_plane_addr << 2, plane_addr << 2);
+    if (planes_written & 4)
+        vga.text_redraw = 2;
 
     // Update scanline
-    uint32_t offs = (plane_addr << 2) - (((vga.crt[0x0C] << 8) | vga.crt[0x0D]) << 2),
-             offset_between_lines = (((!vga.crt[0x13]) << 8 | vga.crt[0x13]) * 2) << 2;
-
-    unsigned int scanline = offs / offset_between_lines;
-    if (vga.total_height > scanline) {
-        switch (vga.renderer >> 1) {
-        case MODE_13H_RENDERER >> 1:
-            // Determine the scanline that it has been written to.
+    switch (vga.renderer >> 1) {
+    case MODE_13H_RENDERER >> 1:
+    case RENDER_4BPP >> 1: { // todo: what about bit13 replacement?
+        uint32_t start = ((vga.crt[0x0C] << 8) | vga.crt[0x0D]) << 2,
+                 offset_between_lines = (((!vga.crt[0x13]) << 8 | vga.crt[0x13]) * 2) << 2;
+        unsigned int scanline = ((first_plane_addr << 2) - start) / offset_between_lines;
+        if (vga.total_height > scanline)
             vga.vbe_scanlines_modified[scanline] = 1;
-            break;
-        case RENDER_4BPP >> 1:
-            // todo: what about bit13 replacement?
-            vga.vbe_scanlines_modified[scanline] = 1;
-            break;
+        if (plane_addr != first_plane_addr) {
+            scanline = ((plane_addr << 2) - start) / offset_between_lines;
+            if (vga.total_height > scanline)
+                vga.vbe_scanlines_modified[scanline] = 1;
         }
+        break;
+    }
     }
 
     vga.memory_modified = 3;
+}
 
-#if 0
-    VGA_LOG("Writing %02x to vram=0x%08x, phys=%08x [%c%c%c%c, offset: 0x%x] d32: %08x vram: %08x latch: %08x wmode: %d\n", data, addr, vga.vram_window_base + addr,
-        plane & 1 ? '0' : ' ',
-        plane & 2 ? '1' : ' ',
-        plane & 4 ? '2' : ' ',
-        plane & 8 ? '3' : ' ',
-        plane_addr,
-        data32, *vram_ptr, vga.latch32, vga.write_mode);
+#ifndef VGA_LIBRARY
+static
 #endif
+    void
+    vga_mem_writeb(uint32_t addr, uint32_t data)
+{
+    vga_mem_write(addr, data, 1);
+}
+static void vga_mem_writew(uint32_t addr, uint32_t data)
+{
+    vga_mem_write(addr, data, 2);
+}
+static void vga_mem_writed(uint32_t addr, uint32_t data)
+{
+    vga_mem_write(addr, data, 4);
+}
+
+// Word and dword reads don't have to go through the generic MMIO code to be split up. Every byte loads the latches, so
+// they are left holding the last one, as if the bytes had been read one by one.
+static uint32_t vga_mem_readw(uint32_t addr)
+{
+    return (vga_mem_readb(addr) & 0xFF) | (vga_mem_readb(addr + 1) & 0xFF) << 8;
+}
+static uint32_t vga_mem_readd(uint32_t addr)
+{
+    return vga_mem_readw(addr) | vga_mem_readw(addr + 2) << 16;
 }
 
 static const uint8_t pci_config_space[16] = { 0x34, 0x12, 0x11, 0x11, 0, 0, 0, 0, 0, 0, 0, 3, 0, 0, 0, 0 };
@@ -1558,6 +2133,7 @@ static void vga_pci_init(struct loaded_file* vgabios)
 
 void vga_init(struct pc_settings* pc)
 {
+    vga_init_converters();
     io_register_reset(vga_reset);
     io_register_read(0x3B0, 48, vga_read, NULL, NULL);
     io_register_write(0x3B0, 48, vga_write, NULL, NULL);
@@ -1568,12 +2144,12 @@ void vga_init(struct pc_settings* pc)
 
     state_register(vga_state);
 
-    io_register_mmio_read(0xA0000, 0x20000 - 1, vga_mem_readb, NULL, NULL);
-    io_register_mmio_write(0xA0000, 0x20000 - 1, vga_mem_writeb, NULL, NULL);
+    io_register_mmio_read(0xA0000, 0x20000 - 1, vga_mem_readb, vga_mem_readw, vga_mem_readd);
+    io_register_mmio_write(0xA0000, 0x20000 - 1, vga_mem_writeb, vga_mem_writew, vga_mem_writed);
 
     int memory_size = pc->vga_memory_size < (256 << 10) ? 256 << 10 : pc->vga_memory_size;
-    io_register_mmio_read(VBE_LFB_BASE, memory_size, vga_mem_readb, NULL, NULL);
-    io_register_mmio_write(VBE_LFB_BASE, memory_size, vga_mem_writeb, NULL, NULL);
+    io_register_mmio_read(VBE_LFB_BASE, memory_size, vga_mem_readb, vga_mem_readw, vga_mem_readd);
+    io_register_mmio_write(VBE_LFB_BASE, memory_size, vga_mem_writeb, vga_mem_writew, vga_mem_writed);
 
     vga.vram_size = memory_size;
     vga_alloc_mem();
@@ -1581,6 +2157,20 @@ void vga_init(struct pc_settings* pc)
     if (pc->pci_vga_enabled) {
         vga_pci_init(&pc->vgabios);
     }
+
+    frameskip = pc->display.frameskip;
+    if (pc->vga_render_thread) {
+#ifdef VGA_USE_THREADS
+        pthread_mutex_init(&render.lock, NULL);
+        pthread_cond_init(&render.cond, NULL);
+        if (pthread_create(&render.thread, NULL, vga_render_thread, &render) == 0)
+            render.enabled = 1;
+        else
+            VGA_LOG("Unable to create render thread\n");
+#else
+        VGA_LOG("Render thread not supported on this platform\n");
+#endif
+    }
 }
 
 void* vga_get_raw_vram(void)
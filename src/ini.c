@@ -371,6 +371,8 @@ int parse_cfg(struct pc_settings* pc, char* data)
     pc->memory_size = get_field_int(global, "memory", 32 * 1024 * 1024);
     pc->vga_memory_size = get_field_int(global, "vgamemory", 4 * 1024 * 1024);
 
+    pc->cpus = get_field_int(global, "cpus", 1);
+
     // Set emulator time
     pc->current_time = get_field_long(global, "now", 0);
 
@@ -381,7 +383,12 @@ int parse_cfg(struct pc_settings* pc, char* data)
     pc->floppy_enabled = get_field_int(global, "floppy", 1);
     pc->vbe_enabled = get_field_int(global, "vbe", 1);
     pc->pci_vga_enabled = get_field_int(global, "pcivga", 0);
+    pc->hpet_enabled = get_field_int(global, "hpet", pc->apic_enabled);
+    pc->vga_render_thread = get_field_int(global, "renderthread", 0);
+    pc->free_pages = get_field_int(global, "freepages", 1);
     pc->boot_kernel = get_field_int(global, "kernel", 0);
+    pc->stats_file = dupstr(get_field_string(global, "statsfile"));
+    pc->stats_interval = get_field_int(global, "statsinterval", 0);
 
     // Now figure out disk image information
     int res = parse_disk(&pc->drives[0], get_section(global, "ata0-master"), 0);
@@ -458,6 +465,21 @@ int parse_cfg(struct pc_settings* pc, char* data)
         pc->kernel_img = NULL;
     }
 
+    struct ini_section* display = get_section(global, "display");
+    if (display) {
+        char* hash = get_field_string(display, "waithash");
+        pc->display.frameskip = get_field_int(display, "frameskip", 1);
+        pc->display.print_hash = get_field_int(display, "hash", 0);
+        pc->display.wait_enabled = hash != NULL;
+        pc->display.wait_hash = hash ? strtoull(hash, NULL, 16) : 0;
+        pc->display.wait_frames = get_field_int(display, "waitframes", 0);
+        pc->display.screenshot_path = dupstr(get_field_string(display, "screenshot"));
+        pc->display.screenshot_interval = get_field_int(display, "screenshotinterval", 0);
+    } else {
+        memset(&pc->display, 0, sizeof(struct display_settings));
+        pc->display.frameskip = 1;
+    }
+
     char sid[50];
     for (int i = 0; i < MAX_VIRTIO_DEVICES; i++) {
         sprintf(sid, "virtio%d", i);
@@ -501,6 +523,36 @@ int parse_cfg(struct pc_settings* pc, char* data)
         pc->cpu.cpuid_limit_winnt = get_field_int(cpu, "cpuid_limit_winnt", 0);
     }
 
+    struct ini_section* profiler = get_section(global, "profiler");
+    if (profiler) {
+        pc->profiler.interval = get_field_int(profiler, "interval", 0);
+        pc->profiler.depth = get_field_int(profiler, "depth", 16);
+        pc->profiler.report = dupstr(get_field_string(profiler, "report"));
+        pc->profiler.stacks = dupstr(get_field_string(profiler, "stacks"));
+    } else
+        memset(&pc->profiler, 0, sizeof(pc->profiler));
+
+    struct ini_section* benchmark = get_section(global, "benchmark");
+    if (benchmark) {
+        char *instructions = get_field_string(benchmark, "instructions"), *port = get_field_string(benchmark, "port");
+        pc->benchmark.enabled = get_field_int(benchmark, "enabled", 0);
+        pc->benchmark.instructions = instructions ? strtoull(instructions, NULL, 0) : 0;
+        pc->benchmark.port = port ? (int)strtol(port, NULL, 0) : -1;
+        pc->benchmark.savestate = dupstr(get_field_string(benchmark, "savestate"));
+        pc->benchmark.report = dupstr(get_field_string(benchmark, "report"));
+    } else {
+        memset(&pc->benchmark, 0, sizeof(pc->benchmark));
+        pc->benchmark.port = -1;
+    }
+
+    struct ini_section* snapshot = get_section(global, "snapshot");
+    char* snapshot_port = snapshot ? get_field_string(snapshot, "port") : NULL;
+    pc->snapshot_port = snapshot_port ? (int)strtol(snapshot_port, NULL, 0) : -1;
+
+    struct ini_section* replay = get_section(global, "replay");
+    pc->replay.record = replay ? dupstr(get_field_string(replay, "record")) : NULL;
+    pc->replay.replay = replay ? dupstr(get_field_string(replay, "replay")) : NULL;
+
     UNUSED(get_section);
 
     free_ini(global);
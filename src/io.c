@@ -13,8 +13,11 @@ uint32_t ioport_in;
 
 #define IO_LOG(x, ...) LOG("I/O", x, ##__VA_ARGS__)
 
-static io_read **read;
-static io_write **write;
+static MACHINE_LOCAL io_read **read;
+static MACHINE_LOCAL io_write **write;
+
+// Number of accesses to every port, counted for instrument_counters_dump
+static MACHINE_LOCAL uint64_t *port_reads, *port_writes;
 
 // Default I/O handlers
 uint32_t io_default_readb(uint32_t port)
@@ -98,8 +101,8 @@ void io_unregister_write(int port, int length){
 }
 
 #define MAX_RESETS 15
-static io_reset resets[MAX_RESETS];
-static int io_reset_ptr = 0;
+static MACHINE_LOCAL io_reset resets[MAX_RESETS];
+static MACHINE_LOCAL int io_reset_ptr = 0;
 void io_register_reset(io_reset cb)
 {
     if (io_reset_ptr == MAX_RESETS) {
@@ -120,6 +123,7 @@ uint8_t io_readb(uint32_t port)
 #ifdef SO_BUILD
     ioport_in = port;
 #endif
+    port_reads[port & 0xFFFF]++;
     uint8_t data = read[port & 0xFFFF][0](port);
     //cpu_io_read(port, data, 1);
 #ifndef LOG_ALL_IO
@@ -133,6 +137,7 @@ uint16_t io_readw(uint32_t port)
 #ifdef SO_BUILD
     ioport_in = port;
 #endif
+    port_reads[port & 0xFFFF]++;
     uint16_t data = read[port & 0xFFFF][1](port);
     //cpu_io_read(port, data, 2);
 #ifndef LOG_ALL_IO
@@ -146,6 +151,7 @@ uint32_t io_readd(uint32_t port)
 #ifdef SO_BUILD
     ioport_in = port;
 #endif
+    port_reads[port & 0xFFFF]++;
     uint32_t data = read[port & 0xFFFF][2](port);
     //cpu_io_read(port, data, 4);
 #ifndef LOG_ALL_IO
@@ -161,6 +167,7 @@ void io_writeb(uint32_t port, uint8_t data)
 #endif
         IO_LOG("writeb: port=0x%04x data=0x%02x\n", port, data);
     //cpu_io_write(port, 1);
+    port_writes[port & 0xFFFF]++;
     write[port & 0xFFFF][0](port, data);
 }
 void io_writew(uint32_t port, uint16_t data)
@@ -168,6 +175,7 @@ void io_writew(uint32_t port, uint16_t data)
     if(port != 0x1F0)
     IO_LOG("writew: port=0x%04x data=0x%04x\n", port, data);
     //cpu_io_write(port, 2);
+    port_writes[port & 0xFFFF]++;
     write[port & 0xFFFF][1](port, data);
 }
 void io_writed(uint32_t port, uint32_t data)
@@ -177,6 +185,7 @@ void io_writed(uint32_t port, uint32_t data)
     if(port != 0x1F0)
     IO_LOG("writed: port=0x%04x data=0x%08x\n", port, data);
 #endif
+    port_writes[port & 0xFFFF]++;
     write[port & 0xFFFF][2](port, data);
 }
 
@@ -231,9 +240,25 @@ struct mmio {
     uint32_t begin, end;
 };
 
-static struct mmio mmio[MAX_MMIO + 1];
-static int mmio_pos[2] = { 0, 0 },
+static MACHINE_LOCAL struct mmio mmio[MAX_MMIO + 1];
+static MACHINE_LOCAL uint64_t mmio_reads[MAX_MMIO + 1], mmio_writes[MAX_MMIO + 1];
+static MACHINE_LOCAL int mmio_pos[2] = { 0, 0 },
            tf = 0; // Ugly hack, but necessary
+
+// The last area hit by a read and a write, or -1. Devices like the HPET are polled in tight loops, so check these before scanning the table.
+static MACHINE_LOCAL int mmio_last[2] = { -1, -1 };
+
+// Only remember areas that cannot be shadowed by an earlier entry in the table
+static int io_mmio_cacheable(int i)
+{
+    if (mmio[i].begin == 0)
+        return 0;
+    for (int j = 0; j < i; j++) {
+        if (mmio[j].begin <= mmio[i].end && mmio[i].begin <= mmio[j].end)
+            return 0;
+    }
+    return 1;
+}
 void io_register_mmio_read(uint32_t start, uint32_t length, io_read b, io_read w, io_read d)
 {
     if (tf && mmio_pos[0] == MAX_MMIO) {
@@ -247,6 +272,7 @@ void io_register_mmio_read(uint32_t start, uint32_t length, io_read b, io_read w
     mmio[mmio_pos[0]].r[2] = d ? d : io_default_mmio_readd;
 
     mmio_pos[0]++;
+    mmio_last[0] = mmio_last[1] = -1;
 }
 void io_register_mmio_write(uint32_t start, uint32_t length, io_write b, io_write w, io_write d)
 {
@@ -262,12 +288,14 @@ void io_register_mmio_write(uint32_t start, uint32_t length, io_write b, io_writ
     mmio[mmio_pos[1]].w[2] = d ? d : io_default_mmio_writed;
 
     mmio_pos[1]++;
+    mmio_last[0] = mmio_last[1] = -1;
 }
 void io_remap_mmio_read(uint32_t oldstart, uint32_t newstart){
     for(int i=0;i<MAX_MMIO;i++){
         if(mmio[i].begin == oldstart){
             mmio[i].begin = newstart;
             mmio[i].end = (mmio[i].end - oldstart) + newstart;
+            mmio_last[0] = mmio_last[1] = -1;
             return;
         }
     }
@@ -277,9 +305,18 @@ void io_remap_mmio_read(uint32_t oldstart, uint32_t newstart){
 void io_handle_mmio_write(uint32_t addr, uint32_t data, int size)
 {
     //if(addr == 0x004abc95) __asm__("int3");
+    int last = mmio_last[1];
+    if (last >= 0 && addr >= mmio[last].begin && mmio[last].end >= addr) {
+        mmio_writes[last]++;
+        mmio[last].w[size](addr, data);
+        return;
+    }
     for (int i = 0; i <= MAX_MMIO; i++) {
         if (addr >= mmio[i].begin && mmio[i].end >= addr) {
             //printf("'%c' %08x %08x %08x %d %d size: %d\n", data, mmio[i].begin, addr, mmio[i].end, addr >= mmio[i].begin, addr < mmio[i].end, size);
+            if (io_mmio_cacheable(i))
+                mmio_last[1] = i;
+            mmio_writes[i]++;
             mmio[i].w[size](addr, data);
             return;
         }
@@ -288,8 +325,16 @@ void io_handle_mmio_write(uint32_t addr, uint32_t data, int size)
 }
 uint32_t io_handle_mmio_read(uint32_t addr, int size)
 {
+    int last = mmio_last[0];
+    if (last >= 0 && addr >= mmio[last].begin && mmio[last].end >= addr) {
+        mmio_reads[last]++;
+        return mmio[last].r[size](addr);
+    }
     for (int i = 0; i <= MAX_MMIO; i++) {
         if (addr >= mmio[i].begin && mmio[i].end >= addr) {
+            if (io_mmio_cacheable(i))
+                mmio_last[0] = i;
+            mmio_reads[i]++;
             uint32_t res = mmio[i].r[size](addr); 
             //printf("%08x\n", res);
             return res;
@@ -309,10 +354,42 @@ int io_addr_mmio_read(uint32_t addr){
     return 0;
 }
 
+void io_dump_counters(FILE* f)
+{
+    // Ports are grouped into runs handled by the same functions, which usually means the same device
+    int first = 1;
+    fprintf(f, "\"ports\":[");
+    for (int start = 0, port = 0; port < 0x10000; start = port) {
+        uint64_t reads = 0, writes = 0;
+        do {
+            reads += port_reads[port];
+            writes += port_writes[port];
+            port++;
+        } while (port < 0x10000 && read[port][0] == read[start][0] && write[port][0] == write[start][0]);
+        if (!reads && !writes)
+            continue;
+        fprintf(f, "%s{\"first\":%d,\"last\":%d,\"reads\":%llu,\"writes\":%llu}", first ? "" : ",", start, port - 1,
+            (unsigned long long)reads, (unsigned long long)writes);
+        first = 0;
+    }
+    first = 1;
+    fprintf(f, "],\"mmio\":[");
+    for (int i = 0; i <= MAX_MMIO; i++) {
+        if (!mmio_reads[i] && !mmio_writes[i])
+            continue;
+        fprintf(f, "%s{\"begin\":%u,\"end\":%u,\"reads\":%llu,\"writes\":%llu}", first ? "" : ",", mmio[i].begin, mmio[i].end,
+            (unsigned long long)mmio_reads[i], (unsigned long long)mmio_writes[i]);
+        first = 0;
+    }
+    fprintf(f, "]");
+}
+
 void io_init(void)
 {
     read = malloc((0x10000 * sizeof(io_read*)) + (0x10000 * 3 * sizeof(io_read)));
     write = malloc((0x10000 * sizeof(io_write*)) + (0x10000 * 3 * sizeof(io_write)));
+    port_reads = calloc(0x10000, sizeof(uint64_t));
+    port_writes = calloc(0x10000, sizeof(uint64_t));
 
     for (int i = 0; i < 0x10000; i++) {
         read[i] = (io_read*)(((void *) read + 0x10000 * sizeof(io_read*)) + (i * 3 * sizeof(io_read)));
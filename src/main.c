@@ -1,4 +1,5 @@
 #include "cpuapi.h"
+#include "cpu/instrument.h"
 #include "devices.h"
 #include "display.h"
 #include "drive.h"
@@ -29,13 +30,15 @@ struct option {
 enum {
     OPTION_HELP,
     OPTION_CONFIG,
-    OPTION_REALTIME
+    OPTION_REALTIME,
+    OPTION_BENCHMARK
 };
 
 static const struct option options[] = {
     { "h", "help", 0, OPTION_HELP, "Show available options" },
     { "c", "config", HASARG, OPTION_CONFIG, "Use custom config file [arg]" },
     { "r", "realtime", 0, OPTION_REALTIME, "Try to sync internal emulator clock with wall clock" },
+    { "b", "benchmark", 0, OPTION_BENCHMARK, "Run the [benchmark] section of the config file and exit" },
     { NULL, NULL, 0, 0, NULL }
 };
 
@@ -66,7 +69,7 @@ static void generic_help(const struct option* options)
 int main(int argc, char** argv)
 {
     char* configfile = "/zada/halfix/default.cfg";
-    int filesz, realtime = 0;
+    int filesz, realtime = 0, benchmark = 0;
     FILE* f;
     char* buf;
 
@@ -101,6 +104,9 @@ int main(int argc, char** argv)
                 case OPTION_REALTIME:
                     realtime = -1;
                     continue;
+                case OPTION_BENCHMARK:
+                    benchmark = 1;
+                    continue;
                 }
                 break;
             }
@@ -139,10 +145,17 @@ parse_config:
         fprintf(stderr, "VGA memory size (0x%x) too small\n", pc.vga_memory_size);
         return -1;
     }
+    pc.benchmark.enabled |= benchmark;
+    // Otherwise, the CMOS clock starts at the current time and the guest may behave differently on every run
+    if (pc.benchmark.enabled && !pc.current_time)
+        pc.current_time = 946684800; // 2000-01-01
+
     if (pc_init(&pc) == -1) {
         fprintf(stderr, "Unable to initialize PC\n");
         return -1;
     }
+    if (pc.benchmark.enabled)
+        return benchmark_run(&pc);
 #if 0
     // Good for debugging
     while(1){
@@ -155,6 +168,7 @@ parse_config:
         // Update our screen/devices here
         vga_update();
         display_handle_events();
+        instrument_counters_poll();
         ms_to_sleep &= realtime;
         if (ms_to_sleep)
             display_sleep(ms_to_sleep * 5);
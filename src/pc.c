@@ -1,16 +1,21 @@
 #include "pc.h"
 #include "cpuapi.h"
+#include "cpu/instrument.h"
 #include "devices.h"
 #include "display.h"
 #include "io.h"
+#include "replay.h"
 #include "state.h"
 #include "util.h"
+#include <string.h>
 
 // Comment below line to disable automatic loading of savestate
 //#define SAVESTATE
 #define DISABLE_RESTORE
 // Comment below line to disable automatic saving.
 #define DISABLE_CONSTANT_SAVING
+// Automatic saving stores one full snapshot followed by this many incremental snapshots chained onto it
+#define SAVESTATE_CHAIN_LENGTH 15
 
 static inline void pc_cmos_lowhi(int idx, int data)
 {
@@ -38,9 +43,9 @@ static inline void pc_cmos_lowhi(int idx, int data)
 #define FW_CFG_BOOT_MENU 0x0e
 #define FW_CFG_MAX_CPUS 0x0f
 #define FW_CFG_MAX_ENTRY 0x10
-static uint32_t bios_firmware_data, firmware_memory_size;
+static MACHINE_LOCAL uint32_t bios_firmware_data, firmware_memory_size;
 
-static uint8_t cmos12v = 0;
+static MACHINE_LOCAL uint8_t cmos12v = 0;
 static void pc_init_cmos_disk(struct drive_info* drv, int id)
 {
     if (drv->type == DRIVE_TYPE_DISK) {
@@ -117,9 +122,9 @@ static inline void pc_init_cmos(struct pc_settings* pc)
 }
 
 // Some BIOS-specific stuff
-static int a20 = 2;
-static char bios_data[2][101];
-static int bios_ptr[2];
+static MACHINE_LOCAL int a20 = 2;
+static MACHINE_LOCAL char bios_data[2][101];
+static MACHINE_LOCAL int bios_ptr[2];
 
 static void bios_writeb(uint32_t port, uint32_t data)
 {
@@ -135,13 +140,13 @@ static void bios_writeb(uint32_t port, uint32_t data)
             bios_firmware_data = firmware_memory_size;
             break;
         case FW_CFG_NB_CPUS:
-            bios_firmware_data = 1;
+            bios_firmware_data = cpu_get_count();
             break;
         }
         break;
     case 0x8900: {
         static const unsigned char shutdown[8] = "Shutdown";
-        static int idx = 0;
+        static MACHINE_LOCAL int idx = 0;
         if (data == shutdown[idx++]) {
             if (idx == 8) {
                 LOG("PC", "Shutdown requested\n");
@@ -179,7 +184,7 @@ void pc_set_a20(int state)
 {
     a20 = state << 1;
 }
-uint8_t p61_data;
+MACHINE_LOCAL uint8_t p61_data;
 static uint32_t bios_readb(uint32_t port)
 {
     switch (port) {
@@ -217,14 +222,59 @@ static uint32_t default_mmio_readb(uint32_t a)
 // XXX Very very bad hack to make timing work (see util.c)
 void util_state(void);
 
+// Lets the guest run a test case over and over without any help from the host. It writes SNAPSHOT_TAKE to the snapshot port
+// once the test is set up, and SNAPSHOT_RESTORE whenever a run is over, which resumes it right after the OUT instruction
+// that took the snapshot. Reading the port returns the number of restores so far, which the guest can use to tell runs
+// apart. Both requests are carried out by pc_execute after the OUT instruction has completed.
+#define SNAPSHOT_TAKE 0
+#define SNAPSHOT_RESTORE 1
+static MACHINE_LOCAL int snapshot_request = -1;
+static MACHINE_LOCAL uint32_t snapshot_restores;
+
+static uint32_t pc_snapshot_read(uint32_t port)
+{
+    UNUSED(port);
+    return snapshot_restores;
+}
+static void pc_snapshot_write(uint32_t port, uint32_t data)
+{
+    UNUSED(port);
+    snapshot_request = data;
+    cpu_cancel_execution_cycle(EXIT_STATUS_NORMAL);
+}
+
+static void pc_snapshot_service(void)
+{
+    int request = snapshot_request;
+    snapshot_request = -1;
+    if (request == SNAPSHOT_TAKE)
+        state_snapshot_take();
+    else if (request == SNAPSHOT_RESTORE) {
+        if (state_snapshot_restore() == -1)
+            fprintf(stderr, "Guest asked for a snapshot to be restored before taking one\n");
+        else {
+            snapshot_restores++;
+            INSTRUMENT_COUNT(snapshot_restores);
+        }
+    } else
+        fprintf(stderr, "Unknown snapshot request %d\n", request);
+}
+
 int pc_init(struct pc_settings* pc)
 {
+    if (pc->cpus < 1 || pc->cpus > MAX_CPUS || (pc->cpus > 1 && !pc->apic_enabled)) {
+        fprintf(stderr, "Unsupported number of processors: %d (1 to %d, and only 1 without an APIC)\n", pc->cpus, MAX_CPUS);
+        return -1;
+    }
     if (cpu_init() == -1)
         return -1;
     cpu_set_cpuid(&pc->cpu);
     io_init();
     dma_init();
-    cmos_init(pc->current_time);
+    uint64_t current_time = pc->current_time;
+    if (replay_init(pc->replay.record, pc->replay.replay, &current_time) == -1)
+        return -1;
+    cmos_init(current_time);
     pc_init_cmos(pc); // must come before floppy initalization b/c reg 0x14
     fdc_init(pc);
     pit_init();
@@ -238,13 +288,21 @@ int pc_init(struct pc_settings* pc)
     apic_init(pc);
     ioapic_init(pc);
     acpi_init(pc);
+    hpet_init(pc);
 
     //cpu_set_a20(0); // causes code to be prefetched from 0xFFEFxxxx at boot
     cpu_set_a20(1);
 
     io_trigger_reset();
 
-    display_init();
+    if (pc->snapshot_port >= 0) {
+        io_register_read(pc->snapshot_port, 1, pc_snapshot_read, pc_snapshot_read, pc_snapshot_read);
+        io_register_write(pc->snapshot_port, 1, pc_snapshot_write, pc_snapshot_write, pc_snapshot_write);
+    }
+
+    display_init(&pc->display);
+    instrument_counters_init(pc->stats_file, pc->stats_interval);
+    cpu_profiler_init(pc->profiler.interval, pc->profiler.depth, pc->profiler.report, pc->profiler.stacks);
 
     //io_register_read(0x61, 1, bios_readb, NULL, NULL);
     io_register_read(0xB3, 1, bios_readb, NULL, NULL);
@@ -325,6 +383,9 @@ int pc_init(struct pc_settings* pc)
     firmware_memory_size = pc->memory_size;
     if (cpu_init_mem(pc->memory_size) == -1)
         return -1;
+    cpu_set_free_zeroed_pages(pc->free_pages);
+    if (cpu_init_smp(pc->cpus, !pc->replay.record && !pc->replay.replay) == -1)
+        return -1;
     if (pc->pci_enabled)
         pci_init_mem(cpu_get_ram_ptr());
 
@@ -357,12 +418,13 @@ int pc_init(struct pc_settings* pc)
 }
 static uint32_t devices_get_next_raw(itick_t now)
 {
-    uint32_t next[4], min = -1;
+    uint32_t next[5], min = -1;
     next[0] = cmos_next(now);
     next[1] = pit_next(now);
     next[2] = apic_next(now);
     next[3] = acpi_next(now);
-    for (int i = 0; i < 4; i++) {
+    next[4] = hpet_next(now);
+    for (int i = 0; i < 5; i++) {
         if (next[i] < min)
             min = next[i];
     }
@@ -393,12 +455,15 @@ void pc_hlt_if_0(void)
 
 //#define INSNS_PER_FRAME 100000000 // Windows 7, Vista
 #define INSNS_PER_FRAME 50000000
-static int sync = 0;
-static uint64_t last = 0;
+static MACHINE_LOCAL int sync = 0;
+static MACHINE_LOCAL uint64_t last = 0;
+
+MACHINE_LOCAL int pc_measure_time;
+MACHINE_LOCAL uint64_t pc_cpu_time_ns;
 
 #ifdef EMSCRIPTEN
 // Don't feel like wasting your time while waiting for HLT loops to complete? solution is below
-static int fast = 0;
+static MACHINE_LOCAL int fast = 0;
 
 void pc_set_fast(int yes){
     fast = yes;
@@ -418,14 +483,29 @@ int pc_execute(void)
 
     // Call the callback if needed, for async drive cases
     drive_check_complete();
+    // Recorded events are delivered here, after any disk transfer has completed, like during the recording
+    replay_poll();
 
     sync++;
     if (!drive_async_event_in_progress() && (cpu_get_cycles() - last) > INSNS_PER_FRAME) {
 // Verify that timing is identical
 #ifndef DISABLE_CONSTANT_SAVING
-        state_store_to_file("savestates/halfix_state");
+        static MACHINE_LOCAL int chain_position = 0;
+        static MACHINE_LOCAL char parent[64];
+        char path[64];
+        if (chain_position == 0)
+            strcpy(path, "savestates/halfix_state");
+        else
+            sprintf(path, "savestates/halfix_state.%d", chain_position);
+        state_mkdir(path);
+        if (chain_position == 0)
+            state_store_to_file_background(path);
+        else
+            state_store_incremental_to_file(path, parent);
+        strcpy(parent, path);
+        chain_position = (chain_position + 1) % (SAVESTATE_CHAIN_LENGTH + 1);
 #ifndef DISABLE_RESTORE
-        state_read_from_file("savestates/halfix_state");
+        state_read_from_file(path);
 #endif
 #endif
         sync = 0;
@@ -439,7 +519,15 @@ int pc_execute(void)
 #if 0
         uint64_t before = get_now();
 #endif
+        uint64_t cpu_begin = pc_measure_time ? get_host_time_ns() : 0;
         cycles_run = cpu_run(cycles_to_run);
+        if (pc_measure_time)
+            pc_cpu_time_ns += get_host_time_ns() - cpu_begin;
+        if (snapshot_request != -1) {
+            // The machine may have been replaced under our feet, so start over
+            pc_snapshot_service();
+            return 0;
+        }
 //LOG("PC", "Exited from loop (cycles to run: %d, extra: %d)\n", cycles_to_run, devices_need_servicing);
 #if 0
         if ((before + cycles_run) != get_now()) {
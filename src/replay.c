@@ -0,0 +1,235 @@
+// Record and replay of the machine's inputs
+// Guest time is derived from the instruction count (see get_now), so the timers, RDTSC and the CMOS clock tick the same way
+// on every run. What is left are the inputs from the host: keys, mouse events, and the point at which disk transfers
+// complete. Recording writes these to a log, along with where they were delivered. Replaying ignores the host and delivers
+// the events from the log at the same points instead, so that the guest does exactly the same thing again. The CMOS start
+// time is stored in the log too. Once the log runs out, the host takes over again.
+//
+// All events are delivered with the CPU stopped, between two calls to cpu_run. pc_execute calls replay_poll once before it
+// runs the CPU, so the number of replay_poll calls so far tells exactly where an event belongs. get_now() is stored as
+// well, to notice when a replay has gone off track (e.g. the configuration or the disk images are not the same).
+//
+// Log format: "HFXR", a version, and the CMOS start time, followed by one record per event:
+//  - the number of replay_poll calls since the previous event
+//  - the event type (one byte)
+//  - get_now() relative to the previous event
+//  - the arguments of the event, zigzag encoded
+// All numbers except the type are LEB128 varints, and those in the header are 32 and 64-bit little endian.
+
+#include "replay.h"
+#include "devices.h"
+#include "drive.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define REPLAY_LOG(x, ...) LOG("REPLAY", x, ##__VA_ARGS__)
+
+#define REPLAY_MAGIC 0x52584648 // "HFXR"
+#define REPLAY_VERSION 1
+
+enum {
+    REPLAY_OFF,
+    REPLAY_RECORDING,
+    REPLAY_REPLAYING
+};
+
+static const int replay_arg_count[] = { 1, 3, 4, 0 };
+
+struct replay_record {
+    uint64_t poll, now;
+    int type, args[4];
+};
+
+static MACHINE_LOCAL struct {
+    int mode;
+    FILE* f;
+    // Number of replay_poll calls so far
+    uint64_t polls;
+    // The last record written or read, which the next one is relative to
+    struct replay_record last;
+
+    // Recording: set when there is something to flush
+    int unflushed;
+
+    // Replaying: the next record to be delivered, if has_next is set
+    struct replay_record next;
+    int has_next, delivering, diverged;
+} replay;
+
+static void replay_write_varint(uint64_t value)
+{
+    while (value >= 0x80) {
+        fputc((value & 0x7F) | 0x80, replay.f);
+        value >>= 7;
+    }
+    fputc(value, replay.f);
+}
+
+static int replay_read_varint(uint64_t* value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(replay.f);
+        if (c == EOF)
+            return -1;
+        result |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void replay_write_header(uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        fputc(value >> (i * 8), replay.f);
+}
+
+static int replay_read_header(uint64_t* value, int bytes)
+{
+    *value = 0;
+    for (int i = 0; i < bytes; i++) {
+        int c = fgetc(replay.f);
+        if (c == EOF)
+            return -1;
+        *value |= (uint64_t)c << (i * 8);
+    }
+    return 0;
+}
+
+// Reads the next record into replay.next, or clears has_next at the end of the log
+static void replay_read_next(void)
+{
+    struct replay_record* r = &replay.next;
+    uint64_t poll, now, arg;
+    int type;
+    replay.has_next = 0;
+    if (replay_read_varint(&poll) || (type = fgetc(replay.f)) == EOF || type > REPLAY_DRIVE_COMPLETE || replay_read_varint(&now))
+        return;
+    r->poll = replay.last.poll + poll;
+    r->now = replay.last.now + now;
+    r->type = type;
+    for (int i = 0; i < replay_arg_count[type]; i++) {
+        if (replay_read_varint(&arg))
+            return;
+        r->args[i] = (int)(arg >> 1) ^ -(int)(arg & 1);
+    }
+    replay.last = *r;
+    replay.has_next = 1;
+}
+
+static void replay_deliver(struct replay_record* r)
+{
+    switch (r->type) {
+    case REPLAY_KEY:
+        kbd_add_key(r->args[0]);
+        break;
+    case REPLAY_MOUSE_BUTTONS:
+        kbd_mouse_down(r->args[0], r->args[1], r->args[2]);
+        break;
+    case REPLAY_MOUSE_MOVE:
+        kbd_send_mouse_move(r->args[0], r->args[1], r->args[2], r->args[3]);
+        break;
+    case REPLAY_DRIVE_COMPLETE:
+        drive_check_complete();
+        break;
+    }
+}
+
+int replay_event(int type, int a, int b, int c, int d)
+{
+    if (replay.mode == REPLAY_REPLAYING)
+        return !replay.delivering;
+    if (replay.mode != REPLAY_RECORDING)
+        return 0;
+
+    int args[4] = { a, b, c, d };
+    itick_t now = get_now();
+    replay_write_varint(replay.polls - replay.last.poll);
+    fputc(type, replay.f);
+    replay_write_varint(now - replay.last.now);
+    for (int i = 0; i < replay_arg_count[type]; i++)
+        replay_write_varint((uint32_t)args[i] << 1 ^ (uint32_t)(args[i] >> 31));
+    replay.last.poll = replay.polls;
+    replay.last.now = now;
+    replay.unflushed = 1;
+    return 0;
+}
+
+void replay_poll(void)
+{
+    if (replay.mode == REPLAY_RECORDING && replay.unflushed) {
+        // Keep the log on disk up to date, so that it is complete even if the emulator is killed while the guest is hung
+        fflush(replay.f);
+        replay.unflushed = 0;
+    } else if (replay.mode == REPLAY_REPLAYING) {
+        while (replay.has_next && replay.next.poll == replay.polls) {
+            if (!replay.diverged && replay.next.now != get_now()) {
+                fprintf(stderr, "Replay has diverged: event recorded at tick %llu is being delivered at tick %llu\n",
+                    (unsigned long long)replay.next.now, (unsigned long long)get_now());
+                replay.diverged = 1;
+            }
+            replay.delivering = 1;
+            replay_deliver(&replay.next);
+            replay.delivering = 0;
+            replay_read_next();
+        }
+        if (!replay.has_next) {
+            fprintf(stderr, "Replay finished at tick %llu\n", (unsigned long long)get_now());
+            fclose(replay.f);
+            replay.mode = REPLAY_OFF;
+        }
+    }
+    replay.polls++;
+}
+
+int replay_init(char* record_path, char* replay_path, uint64_t* current_time)
+{
+    if (!record_path && !replay_path)
+        return 0;
+#ifdef REALTIME_TIMING
+    fprintf(stderr, "Record and replay need guest time to follow the instruction count\n");
+    return -1;
+#endif
+    if (record_path && replay_path) {
+        fprintf(stderr, "Cannot record and replay at the same time\n");
+        return -1;
+    }
+
+    replay.f = fopen(record_path ? record_path : replay_path, record_path ? "wb" : "rb");
+    if (!replay.f) {
+        fprintf(stderr, "Unable to open replay log %s\n", record_path ? record_path : replay_path);
+        return -1;
+    }
+    replay.last.poll = 0;
+    replay.last.now = get_now();
+
+    if (record_path) {
+        // The CMOS clock would otherwise start at a different time on every run
+        if (!*current_time)
+            *current_time = time(NULL);
+        replay_write_header(REPLAY_MAGIC, 4);
+        replay_write_header(REPLAY_VERSION, 4);
+        replay_write_header(*current_time, 4);
+        replay_write_header(*current_time >> 32, 4);
+        replay.mode = REPLAY_RECORDING;
+        REPLAY_LOG("Recording to %s\n", record_path);
+        return 0;
+    }
+
+    uint64_t magic, version;
+    if (replay_read_header(&magic, 4) || replay_read_header(&version, 4) || replay_read_header(current_time, 8)
+        || magic != REPLAY_MAGIC || version != REPLAY_VERSION) {
+        fprintf(stderr, "%s is not a replay log\n", replay_path);
+        fclose(replay.f);
+        return -1;
+    }
+    replay.mode = REPLAY_REPLAYING;
+    replay_read_next();
+    REPLAY_LOG("Replaying %s\n", replay_path);
+    return 0;
+}
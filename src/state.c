@@ -12,6 +12,13 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef STATE_USE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef STATE_USE_THREADS
+#include <pthread.h>
+#endif
 
 #ifdef EMSCRIPTEN
 #include <emscripten.h>
@@ -162,9 +169,9 @@ static void writemem(struct wstream* w, void* mem, int len)
     FATAL("STATE", x, ##__VA_ARGS__);
 
 #define MAX_STATE_HANDLERS 16
-static state_handler state_handlers[MAX_STATE_HANDLERS];
-static int state_handler_count = 0;
-static int is_reading = 0;
+static MACHINE_LOCAL state_handler state_handlers[MAX_STATE_HANDLERS];
+static MACHINE_LOCAL int state_handler_count = 0;
+static MACHINE_LOCAL int is_reading = 0;
 void state_register(state_handler s)
 {
     if (state_handler_count == MAX_STATE_HANDLERS)
@@ -260,7 +267,65 @@ void state_init_bjson_mem(struct bjson_data* arr, int length)
 }
 
 // Public API
-static struct bjson_object* global_obj;
+static MACHINE_LOCAL struct bjson_object* global_obj;
+
+// The in-memory snapshot (see state_snapshot_take). state.bin is kept as it would have been written to disk, and the areas
+// that would have gone to files of their own are copied into blobs, looked up by name.
+struct snapshot_blob {
+    char* name;
+    uint32_t size;
+    uint8_t* data;
+    // Only for areas with a dirty bitmap: pages written while the caller's bitmap was being used for other savestates
+    uint32_t* dirty;
+};
+static MACHINE_LOCAL struct {
+    int active; // Set while the handlers are saving or restoring the in-memory snapshot
+    uint8_t* state_bin;
+    struct snapshot_blob* blobs;
+    int blob_count;
+} snapshot;
+
+static struct snapshot_blob* state_snapshot_find(char* name)
+{
+    for (int i = 0; i < snapshot.blob_count; i++)
+        if (!strcmp(snapshot.blobs[i].name, name))
+            return &snapshot.blobs[i];
+    return NULL;
+}
+
+// Returns the blob that "name" is restored from, or that it is about to be saved to
+static struct snapshot_blob* state_snapshot_blob(char* name, uint32_t size)
+{
+    struct snapshot_blob* b = state_snapshot_find(name);
+    if (is_reading) {
+        if (!b || b->size != size)
+            STATE_FATAL("Snapshot does not have %s with size %d\n", name, size);
+        return b;
+    }
+    if (!b) {
+        snapshot.blobs = realloc(snapshot.blobs, (snapshot.blob_count + 1) * sizeof(struct snapshot_blob));
+        b = &snapshot.blobs[snapshot.blob_count++];
+        b->name = dupstr(name);
+        b->size = 0;
+        b->data = NULL;
+        b->dirty = NULL;
+    }
+    if (b->size != size) {
+        free(b->data);
+        b->data = halloc(size);
+        b->size = size;
+    }
+    return b;
+}
+
+static void state_snapshot_copy(char* name, void* ptr, uint32_t size)
+{
+    struct snapshot_blob* b = state_snapshot_blob(name, size);
+    if (is_reading)
+        memcpy(ptr, b->data, size);
+    else
+        memcpy(b->data, ptr, size);
+}
 struct bjson_object* state_obj(char* name, int keyvalues)
 {
     if (is_reading)
@@ -387,10 +452,14 @@ static void bjson_destroy_object(struct bjson_object* obj)
     free(obj);
 }
 
-static char* global_file_base;
+static MACHINE_LOCAL char* global_file_base;
 void state_file(int size, char* name, void* ptr)
 {
     char temp[1000];
+    if (snapshot.active) {
+        state_snapshot_copy(name, ptr, size);
+        return;
+    }
     sprintf(temp, "%s" PATHSEP_STR "%s", global_file_base, name);
     if (is_reading) {
 #ifndef EMSCRIPTEN
@@ -454,9 +523,662 @@ static char* normalize(char* a)
     return res;
 }
 
+// Large areas of guest memory (RAM, VRAM) are stored as sections of a single file, memory.bin:
+//  - A 4 KB header: uint32_t magic, uint32_t version, uint32_t section count, uint32_t reserved, and then for each section
+//    a 40-byte NUL-padded name, uint32_t offset (in pages), uint32_t size (in bytes), uint32_t stored size, and uint32_t codec
+//  - The sections themselves, each starting on a page boundary
+// Uncompressed sections can be mapped copy-on-write on top of the destination buffer when restoring, provided that the
+// buffer is page aligned too. Otherwise, we fall back to reading them.
+// Compressed sections are split into chunks that are compressed independently: uint32_t chunk size, uint32_t chunk count,
+// uint32_t compressed size of each chunk, and then the compressed chunks one after another.
+#define SECTION_MAGIC 0xC8C70FF2
+#define SECTION_VERSION 2
+#define SECTION_PAGE_SIZE 4096
+#define SECTION_NAME_LENGTH 40
+#define SECTION_V1_NAME_LENGTH 48 // Version 1 had longer names, and no stored size or codec
+#define SECTION_HEADER_SIZE 16
+#define SECTION_ENTRY_SIZE (SECTION_NAME_LENGTH + 16)
+#define MAX_SECTIONS ((SECTION_PAGE_SIZE - SECTION_HEADER_SIZE) / SECTION_ENTRY_SIZE)
+
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+#define CHUNK_SIZE (1 << 20)
+
+// Number of threads compressing a background savestate
+#define COMPRESSION_THREADS 4
+
+// Copy-on-write state of each page of the live section while it is being saved in the background
+#define PAGE_PENDING 0 // Not saved yet
+#define PAGE_READING 1 // The writer is copying the page
+#define PAGE_SAVED 2 // The writer is done with the page
+#define PAGE_COPYING 3 // The emulator is about to modify the page and is making a copy for the writer
+#define PAGE_PRESERVED 4 // The copy is in preserved[]
+
+struct section {
+    char name[SECTION_NAME_LENGTH];
+    uint8_t* ptr;
+    uint32_t size;
+    uint32_t chunk_count;
+    uint8_t** chunks;
+    uint32_t* chunk_sizes;
+};
+
+struct section_file {
+    char* base;
+    int compress;
+    uint32_t count;
+    struct section sections[MAX_SECTIONS];
+
+    // The section that still points to live guest memory, or -1. Writes to it go through state_protect_page.
+    int live;
+    uint8_t* page_state;
+    uint8_t** preserved;
+
+    // Contents of state.bin, written after memory.bin is complete
+    struct wstream state_bin;
+    int has_state_bin;
+
+    uint32_t next_chunk, total_chunks;
+#ifdef STATE_USE_THREADS
+    pthread_mutex_t lock;
+    pthread_t thread;
+#endif
+};
+
+// The file that the current state_store is filling in
+static MACHINE_LOCAL struct section_file* current_sections;
+#ifdef STATE_USE_THREADS
+// The file that is being written in the background, if any
+static MACHINE_LOCAL struct section_file* background_sections;
+// Set once state_wait_background has been registered to run at exit
+static MACHINE_LOCAL int background_wait_at_exit;
+#endif
+
+#ifndef EMSCRIPTEN
+static void state_write_section(char* name, void* ptr, uint32_t size, int live)
+{
+    struct section_file* f = current_sections;
+    if (f->count == MAX_SECTIONS)
+        STATE_FATAL("Too many memory sections\n");
+    if (strlen(name) >= SECTION_NAME_LENGTH)
+        STATE_FATAL("Section name %s too long\n", name);
+
+    struct section* s = &f->sections[f->count];
+    strcpy(s->name, name);
+    s->size = size;
+    s->ptr = ptr;
+    if (f->compress) {
+        // The emulator keeps running while the section is written, so either protect the memory or take a copy now.
+        if (live && f->live == -1) {
+            f->live = f->count;
+            f->page_state = halloc((size + SECTION_PAGE_SIZE - 1) / SECTION_PAGE_SIZE);
+            f->preserved = halloc(((size + SECTION_PAGE_SIZE - 1) / SECTION_PAGE_SIZE) * sizeof(uint8_t*));
+        } else {
+            s->ptr = malloc(size);
+            memcpy(s->ptr, ptr, size);
+        }
+    }
+    f->count++;
+}
+
+// Copies a page of the live section for the writer, or picks up the copy the emulator made before modifying it.
+static void state_read_live_page(struct section_file* f, uint32_t page, uint8_t* dest, uint32_t length)
+{
+#ifdef STATE_USE_THREADS
+    uint8_t expected = PAGE_PENDING;
+    if (__atomic_compare_exchange_n(&f->page_state[page], &expected, PAGE_READING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        memcpy(dest, f->sections[f->live].ptr + page * SECTION_PAGE_SIZE, length);
+        __atomic_store_n(&f->page_state[page], PAGE_SAVED, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&f->page_state[page], __ATOMIC_ACQUIRE) != PAGE_PRESERVED)
+        ;
+    memcpy(dest, f->preserved[page], length);
+    free(f->preserved[page]);
+    f->preserved[page] = NULL;
+#else
+    memcpy(dest, f->sections[f->live].ptr + page * SECTION_PAGE_SIZE, length);
+#endif
+}
+
+void state_protect_page(void* ptr)
+{
+#ifdef STATE_USE_THREADS
+    struct section_file* f = background_sections;
+    if (!f || f->live == -1)
+        return;
+    struct section* s = &f->sections[f->live];
+    if ((uint8_t*)ptr < s->ptr || (uint8_t*)ptr >= s->ptr + s->size)
+        return;
+    uint32_t page = ((uint8_t*)ptr - s->ptr) / SECTION_PAGE_SIZE, offset = page * SECTION_PAGE_SIZE,
+             length = s->size - offset < SECTION_PAGE_SIZE ? s->size - offset : SECTION_PAGE_SIZE;
+
+    uint8_t expected = PAGE_PENDING;
+    if (__atomic_compare_exchange_n(&f->page_state[page], &expected, PAGE_COPYING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        f->preserved[page] = malloc(length);
+        memcpy(f->preserved[page], s->ptr + offset, length);
+        __atomic_store_n(&f->page_state[page], PAGE_PRESERVED, __ATOMIC_RELEASE);
+        return;
+    }
+    // The writer is in the middle of copying this page; it won't take long
+    while (__atomic_load_n(&f->page_state[page], __ATOMIC_ACQUIRE) == PAGE_READING)
+        ;
+#else
+    UNUSED(ptr);
+#endif
+}
+
+static void state_compress_chunk(struct section_file* f, uint8_t* buf, uint32_t index)
+{
+    struct section* s = f->sections;
+    while (index >= s->chunk_count)
+        index -= (s++)->chunk_count;
+    uint32_t offset = index * CHUNK_SIZE, length = s->size - offset < CHUNK_SIZE ? s->size - offset : CHUNK_SIZE;
+
+    uint8_t* src = s->ptr + offset;
+    if (s == &f->sections[f->live]) {
+        for (uint32_t i = 0; i < length; i += SECTION_PAGE_SIZE)
+            state_read_live_page(f, (offset + i) / SECTION_PAGE_SIZE, buf + i, length - i < SECTION_PAGE_SIZE ? length - i : SECTION_PAGE_SIZE);
+        src = buf;
+    }
+
+    uLongf dest_length = compressBound(length);
+    s->chunks[index] = malloc(dest_length);
+    if (compress2(s->chunks[index], &dest_length, src, length, Z_BEST_SPEED) != Z_OK)
+        STATE_FATAL("Unable to compress section %s\n", s->name);
+    s->chunk_sizes[index] = dest_length;
+}
+
+static void* state_compress_worker(void* arg)
+{
+    struct section_file* f = arg;
+    uint8_t* buf = malloc(CHUNK_SIZE);
+    while (1) {
+        uint32_t index;
+#ifdef STATE_USE_THREADS
+        pthread_mutex_lock(&f->lock);
+#endif
+        index = f->next_chunk++;
+#ifdef STATE_USE_THREADS
+        pthread_mutex_unlock(&f->lock);
+#endif
+        if (index >= f->total_chunks)
+            break;
+        state_compress_chunk(f, buf, index);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void state_write_file(char* base, char* name, void* data, uint32_t length)
+{
+    char temp[1000];
+    sprintf(temp, "%s" PATHSEP_STR "%s", base, name);
+    int fh = open(temp, O_WRONLY | O_CREAT | O_BINARY | O_TRUNC, 0666);
+    if (fh == -1)
+        STATE_FATAL("Unable to create file %s\n", temp);
+    if (write(fh, data, length) != (ssize_t)length)
+        STATE_FATAL("Could not write to %s\n", temp);
+    close(fh);
+}
+
+// Writes out memory.bin (compressing it first if requested), and then state.bin if it is attached.
+static void* state_write_sections(void* arg)
+{
+    struct section_file* f = arg;
+    char temp[1000], temp2[1000];
+
+    if (f->compress) {
+        f->total_chunks = 0;
+        for (uint32_t i = 0; i < f->count; i++) {
+            struct section* s = &f->sections[i];
+            s->chunk_count = (s->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+            s->chunks = halloc(s->chunk_count * sizeof(uint8_t*));
+            s->chunk_sizes = halloc(s->chunk_count * sizeof(uint32_t));
+            f->total_chunks += s->chunk_count;
+        }
+        f->next_chunk = 0;
+#ifdef STATE_USE_THREADS
+        pthread_t workers[COMPRESSION_THREADS - 1];
+        for (int i = 0; i < COMPRESSION_THREADS - 1; i++)
+            if (pthread_create(&workers[i], NULL, state_compress_worker, f))
+                STATE_FATAL("Unable to create compression thread\n");
+        state_compress_worker(f);
+        for (int i = 0; i < COMPRESSION_THREADS - 1; i++)
+            pthread_join(workers[i], NULL);
+#else
+        state_compress_worker(f);
+#endif
+    }
+
+    // Write to a temporary file first: memory.bin may currently be mapped into guest memory, and truncating it
+    // would pull the rug out from under us.
+    sprintf(temp, "%s" PATHSEP_STR "memory.bin.tmp", f->base);
+    int fh = open(temp, O_WRONLY | O_CREAT | O_BINARY | O_TRUNC, 0666);
+    if (fh == -1)
+        STATE_FATAL("Unable to create file %s\n", temp);
+
+    struct wstream header;
+    wstream_init(&header, SECTION_PAGE_SIZE + 1);
+    write32(&header, SECTION_MAGIC);
+    write32(&header, SECTION_VERSION);
+    write32(&header, f->count);
+    write32(&header, 0);
+
+    uint32_t next_page = 1;
+    for (uint32_t i = 0; i < f->count; i++) {
+        struct section* s = &f->sections[i];
+        uint32_t stored = s->size;
+        if (lseek(fh, (off_t)next_page * SECTION_PAGE_SIZE, SEEK_SET) == -1)
+            STATE_FATAL("Could not seek\n");
+        if (f->compress) {
+            struct wstream table;
+            wstream_init(&table, 8 + s->chunk_count * 4 + 1);
+            write32(&table, CHUNK_SIZE);
+            write32(&table, s->chunk_count);
+            stored = table.pos + s->chunk_count * 4;
+            for (uint32_t j = 0; j < s->chunk_count; j++) {
+                write32(&table, s->chunk_sizes[j]);
+                stored += s->chunk_sizes[j];
+            }
+            if (write(fh, table.buf, table.pos) != (ssize_t)table.pos)
+                STATE_FATAL("Could not write\n");
+            wstream_destroy(&table);
+            for (uint32_t j = 0; j < s->chunk_count; j++) {
+                if (write(fh, s->chunks[j], s->chunk_sizes[j]) != (ssize_t)s->chunk_sizes[j])
+                    STATE_FATAL("Could not write\n");
+                free(s->chunks[j]);
+            }
+            free(s->chunks);
+            free(s->chunk_sizes);
+        } else if (write(fh, s->ptr, s->size) != (ssize_t)s->size)
+            STATE_FATAL("Could not write\n");
+
+        writemem(&header, s->name, SECTION_NAME_LENGTH);
+        write32(&header, next_page);
+        write32(&header, s->size);
+        write32(&header, stored);
+        write32(&header, f->compress ? CODEC_ZLIB : CODEC_NONE);
+        next_page += (stored + SECTION_PAGE_SIZE - 1) / SECTION_PAGE_SIZE;
+    }
+
+    // Pad the file so that the last section ends on a page boundary and can be mapped in full
+    if (ftruncate(fh, (off_t)next_page * SECTION_PAGE_SIZE) == -1)
+        STATE_FATAL("Could not resize memory sections\n");
+    if (lseek(fh, 0, SEEK_SET) == -1 || write(fh, header.buf, header.pos) != (ssize_t)header.pos)
+        STATE_FATAL("Could not write\n");
+    close(fh);
+    wstream_destroy(&header);
+
+    sprintf(temp2, "%s" PATHSEP_STR "memory.bin", f->base);
+    if (rename(temp, temp2) == -1)
+        STATE_FATAL("Unable to rename %s to %s\n", temp, temp2);
+
+    if (f->has_state_bin)
+        state_write_file(f->base, "state.bin", f->state_bin.buf, f->state_bin.pos);
+    return NULL;
+}
+
+static void state_free_sections(struct section_file* f)
+{
+    for (uint32_t i = 0; i < f->count; i++)
+        if (f->compress && (int)i != f->live)
+            free(f->sections[i].ptr);
+    if (f->preserved) {
+        uint32_t pages = (f->sections[f->live].size + SECTION_PAGE_SIZE - 1) / SECTION_PAGE_SIZE;
+        for (uint32_t i = 0; i < pages; i++)
+            free(f->preserved[i]);
+    }
+    free(f->preserved);
+    free(f->page_state);
+    if (f->has_state_bin)
+        wstream_destroy(&f->state_bin);
+    free(f->base);
+    free(f);
+}
+
+static void state_open_sections(int compress)
+{
+    current_sections = halloc(sizeof(struct section_file));
+    current_sections->base = normalize(global_file_base);
+    current_sections->compress = compress;
+    current_sections->live = -1;
+}
+
+// Writes out the sections collected during state_store. If "state_bin" is given, the whole job (including state.bin)
+// is handed over to a background thread.
+static void state_close_sections(struct wstream* state_bin)
+{
+    struct section_file* f = current_sections;
+    current_sections = NULL;
+    if (!state_bin) {
+        if (f->count)
+            state_write_sections(f);
+        state_free_sections(f);
+        return;
+    }
+
+    f->state_bin = *state_bin;
+    f->has_state_bin = 1;
+#ifdef STATE_USE_THREADS
+    pthread_mutex_init(&f->lock, NULL);
+    background_sections = f;
+    if (pthread_create(&f->thread, NULL, state_write_sections, f))
+        STATE_FATAL("Unable to create savestate thread\n");
+    // Quitting while the thread is still writing would leave a truncated savestate behind
+    if (!background_wait_at_exit) {
+        atexit(state_wait_background);
+        background_wait_at_exit = 1;
+    }
+#else
+    state_write_sections(f);
+    state_free_sections(f);
+#endif
+}
+
+void state_wait_background(void)
+{
+#ifdef STATE_USE_THREADS
+    struct section_file* f = background_sections;
+    if (!f)
+        return;
+    pthread_join(f->thread, NULL);
+    pthread_mutex_destroy(&f->lock);
+    background_sections = NULL;
+    state_free_sections(f);
+#endif
+}
+
+// Loads a section from base/memory.bin. Returns -1 if the section (or the file) does not exist.
+static int state_read_section(char* base, char* name, void* ptr, uint32_t size)
+{
+    char temp[1000];
+    uint8_t header[SECTION_PAGE_SIZE];
+    sprintf(temp, "%s" PATHSEP_STR "memory.bin", base);
+    int fh = open(temp, O_RDONLY | O_BINARY);
+    if (fh == -1)
+        return -1;
+    if (read(fh, header, SECTION_PAGE_SIZE) != SECTION_PAGE_SIZE)
+        STATE_FATAL("Could not read header of %s\n", temp);
+
+    struct rstream r;
+    rstream_init(&r, header);
+    if (read32(&r) != SECTION_MAGIC)
+        STATE_FATAL("%s is not a memory section file\n", temp);
+    uint32_t version = read32(&r);
+    if (version != 1 && version != SECTION_VERSION)
+        STATE_FATAL("%s has an unsupported version\n", temp);
+    uint32_t count = read32(&r);
+    read32(&r);
+    if (count > MAX_SECTIONS)
+        STATE_FATAL("%s is corrupted\n", temp);
+
+    for (uint32_t i = 0; i < count; i++) {
+        int name_length = version == 1 ? SECTION_V1_NAME_LENGTH : SECTION_NAME_LENGTH;
+        char* section_name = skipptr(&r, name_length);
+        uint32_t page = read32(&r), section_size = read32(&r), stored = section_size, codec = CODEC_NONE;
+        if (version != 1) {
+            stored = read32(&r);
+            codec = read32(&r);
+        }
+        if (strncmp(section_name, name, name_length))
+            continue;
+        if (section_size != size)
+            STATE_FATAL("Section %s has size %d, expected %d\n", name, section_size, size);
+        off_t offset = (off_t)page * SECTION_PAGE_SIZE;
+
+        if (codec == CODEC_ZLIB) {
+            uint8_t* buf = halloc(stored);
+            if (lseek(fh, offset, SEEK_SET) == -1 || read(fh, buf, stored) != (ssize_t)stored)
+                STATE_FATAL("Could not read section %s\n", name);
+            struct rstream chunks;
+            rstream_init(&chunks, buf);
+            uint32_t chunk_size = read32(&chunks), chunk_count = read32(&chunks), data = chunks.pos + chunk_count * 4;
+            for (uint32_t j = 0; j < chunk_count; j++) {
+                uint32_t compressed = read32(&chunks);
+                uLongf length = size - j * chunk_size < chunk_size ? size - j * chunk_size : chunk_size;
+                if (uncompress(ptr + j * chunk_size, &length, buf + data, compressed) != Z_OK)
+                    STATE_FATAL("Unable to decompress section %s\n", name);
+                data += compressed;
+            }
+            free(buf);
+            close(fh);
+            return 0;
+        } else if (codec != CODEC_NONE)
+            STATE_FATAL("Section %s uses unknown codec %d\n", name, codec);
+
+        uint32_t mapped = 0;
+#ifdef STATE_USE_MMAP
+        // Only whole pages that belong to the buffer can be replaced.
+        if (((uintptr_t)ptr & (SECTION_PAGE_SIZE - 1)) == 0) {
+            mapped = size & ~(SECTION_PAGE_SIZE - 1);
+            if (mapped && mmap(ptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fh, offset) == MAP_FAILED)
+                mapped = 0;
+        }
+#endif
+        if (mapped != size) {
+            if (lseek(fh, offset + mapped, SEEK_SET) == -1 || read(fh, ptr + mapped, size - mapped) != (ssize_t)(size - mapped))
+                STATE_FATAL("Could not read section %s\n", name);
+        }
+        close(fh);
+        return 0;
+    }
+    close(fh);
+    return -1;
+}
+#else
+void state_protect_page(void* ptr)
+{
+    UNUSED(ptr);
+}
+void state_wait_background(void) {}
+#endif
+
+// Like state_file, but the data goes into memory.bin so that it can be mapped back in on restore.
+// Snapshots taken before memory.bin existed are still read from standalone files.
+void state_section(uint32_t size, char* name, void* ptr)
+{
+    if (snapshot.active) {
+        state_snapshot_copy(name, ptr, size);
+        return;
+    }
+#ifndef EMSCRIPTEN
+    if (!is_reading)
+        state_write_section(name, ptr, size, 0);
+    else if (state_read_section(global_file_base, name, ptr, size) == -1)
+        state_file(size, name, ptr);
+#else
+    state_file(size, name, ptr);
+#endif
+}
+
+// Incremental RAM snapshots. Instead of a full copy of "name", a snapshot in a chain stores "name.delta", which contains
+// only the pages that were written since its parent snapshot was taken:
+//  - uint32_t magic, uint32_t total size, uint32_t number of runs
+//  - NUL-terminated path of the parent snapshot
+//  - For each run, uint32_t first page and uint32_t page count
+//  - The contents of every run, one after another
+// Restoring a delta restores its parent first (which may itself be a delta) and then copies the runs on top.
+#define DELTA_MAGIC 0xC8C70FF1
+#define DELTA_PAGE_SIZE 4096
+#define DELTA_PAGE_DIRTY(dirty, page) (dirty[(page) >> 5] & (1 << ((page)&31)))
+
+static MACHINE_LOCAL char* global_parent_base;
+
+#ifndef EMSCRIPTEN
+static void state_read_paged(char* base, char* name, uint8_t* ptr, uint32_t size)
+{
+    char temp[1000];
+    sprintf(temp, "%s" PATHSEP_STR "%s.delta", base, name);
+    int fh = open(temp, O_RDONLY | O_BINARY);
+    if (fh == -1) {
+        // End of the chain: a full copy of the area
+        if (state_read_section(base, name, ptr, size) == 0)
+            return;
+        sprintf(temp, "%s" PATHSEP_STR "%s", base, name);
+        fh = open(temp, O_RDONLY | O_BINARY);
+        if (fh == -1)
+            STATE_FATAL("Unable to open file %s\n", temp);
+        if (read(fh, ptr, size) != (ssize_t)size)
+            STATE_FATAL("Could not read\n");
+        close(fh);
+        return;
+    }
+
+    int filesize = lseek(fh, 0, SEEK_END);
+    lseek(fh, 0, SEEK_SET);
+    uint8_t* buf = halloc(filesize);
+    if (read(fh, buf, filesize) != filesize)
+        STATE_FATAL("Could not read\n");
+    close(fh);
+
+    struct rstream r;
+    rstream_init(&r, buf);
+    if (read32(&r) != DELTA_MAGIC)
+        STATE_FATAL("%s is not a delta snapshot\n", temp);
+    if (read32(&r) != size)
+        STATE_FATAL("%s has the wrong size\n", temp);
+    uint32_t runs = read32(&r);
+    char* parent = readstr(&r);
+    state_read_paged(parent, name, ptr, size);
+    free(parent);
+
+    uint32_t data = r.pos + runs * 8;
+    for (uint32_t i = 0; i < runs; i++) {
+        uint32_t offset = read32(&r) * DELTA_PAGE_SIZE, length = read32(&r) * DELTA_PAGE_SIZE;
+        if (offset + length > size)
+            length = size - offset;
+        memcpy(ptr + offset, buf + data, length);
+        data += length;
+    }
+    free(buf);
+}
+
+static void state_write_paged(char* name, uint8_t* ptr, uint32_t size, uint32_t* dirty)
+{
+    char temp[1000];
+    uint32_t pages = (size + DELTA_PAGE_SIZE - 1) / DELTA_PAGE_SIZE, runs = 0;
+    struct wstream w;
+    wstream_init(&w, 65536);
+    write32(&w, DELTA_MAGIC);
+    write32(&w, size);
+    write32(&w, 0); // Patched below
+    writestr(&w, global_parent_base);
+
+    // Coalesce consecutive dirty pages into runs so that they can be written with a single call
+    for (uint32_t i = 0; i < pages;) {
+        if (!dirty[i >> 5]) {
+            i = (i | 31) + 1;
+            continue;
+        }
+        if (!DELTA_PAGE_DIRTY(dirty, i)) {
+            i++;
+            continue;
+        }
+        uint32_t start = i;
+        while (i < pages && DELTA_PAGE_DIRTY(dirty, i))
+            i++;
+        write32(&w, start);
+        write32(&w, i - start);
+        runs++;
+    }
+    w.buf[8] = runs;
+    w.buf[9] = runs >> 8;
+    w.buf[10] = runs >> 16;
+    w.buf[11] = runs >> 24;
+
+    sprintf(temp, "%s" PATHSEP_STR "%s.delta", global_file_base, name);
+    int fh = open(temp, O_WRONLY | O_CREAT | O_BINARY | O_TRUNC, 0666);
+    if (fh == -1)
+        STATE_FATAL("Unable to create file %s\n", temp);
+    if (write(fh, w.buf, w.pos) != (ssize_t)w.pos)
+        STATE_FATAL("Could not write\n");
+
+    struct rstream r;
+    rstream_init(&r, w.buf);
+    r.pos = w.pos - runs * 8;
+    for (uint32_t i = 0; i < runs; i++) {
+        uint32_t offset = read32(&r) * DELTA_PAGE_SIZE, length = read32(&r) * DELTA_PAGE_SIZE;
+        if (offset + length > size)
+            length = size - offset;
+        if (write(fh, ptr + offset, length) != (ssize_t)length)
+            STATE_FATAL("Could not write\n");
+    }
+    close(fh);
+    wstream_destroy(&w);
+
+    // A stale full copy would otherwise take precedence over the chain on systems that reuse the directory
+    sprintf(temp, "%s" PATHSEP_STR "%s", global_file_base, name);
+    unlink(temp);
+}
+#endif
+
+// Taking the in-memory snapshot copies all of the area. Restoring it only copies back the pages that were written since.
+static void state_snapshot_paged(char* name, uint8_t* ptr, uint32_t size, uint32_t* dirty)
+{
+    uint32_t words = (size + DELTA_PAGE_SIZE * 32 - 1) / (DELTA_PAGE_SIZE * 32);
+    struct snapshot_blob* b = state_snapshot_blob(name, size);
+    if (!is_reading) {
+        memcpy(b->data, ptr, size);
+        free(b->dirty);
+        b->dirty = calloc(words, 4);
+        return;
+    }
+    for (uint32_t i = 0; i < words; i++) {
+        uint32_t bits = dirty[i] | b->dirty[i];
+        dirty[i] = bits;
+        b->dirty[i] = 0;
+        for (uint32_t j = 0; bits; j++, bits >>= 1) {
+            if (!(bits & 1))
+                continue;
+            uint32_t offset = (i * 32 + j) * DELTA_PAGE_SIZE, length = DELTA_PAGE_SIZE;
+            if (offset + length > size)
+                length = size - offset;
+            memcpy(ptr + offset, b->data + offset, length);
+        }
+    }
+}
+
+void state_file_paged(uint32_t size, char* name, void* ptr, uint32_t* dirty)
+{
+    uint32_t words = (size + DELTA_PAGE_SIZE * 32 - 1) / (DELTA_PAGE_SIZE * 32);
+    if (snapshot.active) {
+        state_snapshot_paged(name, ptr, size, dirty);
+        // After a restore, the caller gets to see which pages were copied back, and clears the bitmap itself
+        if (!is_reading)
+            memset(dirty, 0, words * 4);
+        return;
+    }
+
+    // Whatever happens to the area now, the in-memory snapshot will have to restore it
+    struct snapshot_blob* b = state_snapshot_find(name);
+    if (b && b->dirty) {
+        for (uint32_t i = 0; i < words; i++)
+            b->dirty[i] = is_reading ? (uint32_t)-1 : b->dirty[i] | dirty[i];
+    }
+
+#ifndef EMSCRIPTEN
+    if (is_reading)
+        state_read_paged(global_file_base, name, ptr, size);
+    else if (global_parent_base)
+        state_write_paged(name, ptr, size, dirty);
+    else {
+        char temp[1000];
+        state_write_section(name, ptr, size, 1);
+        sprintf(temp, "%s" PATHSEP_STR "%s.delta", global_file_base, name);
+        unlink(temp);
+    }
+#else
+    state_file(size, name, ptr);
+#endif
+    // Whatever we just saved or restored becomes the parent of the next snapshot in the chain
+    memset(dirty, 0, words * 4);
+}
+
 void state_read_from_file(char* fn)
 {
     char path[1000];
+    state_wait_background();
     global_file_base = normalize(fn);
     sprintf(path, "%s" PATHSEP_STR "state.bin", fn);
 
@@ -500,20 +1222,40 @@ void state_read_from_file(char* fn)
     free(buf);
 }
 
-void state_store_to_file(char* fn)
+static void state_store(char* fn, char* parent, int background)
 {
     char path[1000];
     struct wstream w;
+    // Only one snapshot can be in flight at a time
+    state_wait_background();
     wstream_init(&w, 65536);
     write32(&w, MAGIC);
     write32(&w, VERSION);
 
     is_reading = 0;
     global_file_base = normalize(fn);
+    global_parent_base = parent ? normalize(parent) : NULL;
     global_obj = state_create_bjson_object(64);
+#ifndef EMSCRIPTEN
+    state_open_sections(background);
+#else
+    UNUSED(background);
+#endif
     for (int i = 0; i < state_handler_count; i++)
         state_handlers[i]();
     bjson_serialize(&w, global_obj);
+#ifndef EMSCRIPTEN
+    if (background) {
+        // The background thread writes state.bin once memory.bin is complete
+        state_close_sections(&w);
+        bjson_destroy_object(global_obj);
+        free(global_file_base);
+        free(global_parent_base);
+        global_parent_base = NULL;
+        return;
+    }
+    state_close_sections(NULL);
+#endif
 
     sprintf(path, "%s" PATHSEP_STR "state.bin", fn);
 
@@ -535,6 +1277,23 @@ void state_store_to_file(char* fn)
     wstream_destroy(&w);
     bjson_destroy_object(global_obj);
     free(global_file_base);
+    free(global_parent_base);
+    global_parent_base = NULL;
+}
+
+void state_store_to_file(char* fn)
+{
+    state_store(fn, NULL, 0);
+}
+
+void state_store_incremental_to_file(char* fn, char* parent)
+{
+    state_store(fn, parent, 0);
+}
+
+void state_store_to_file_background(char* fn)
+{
+    state_store(fn, NULL, 1);
 }
 
 #ifdef EMSCRIPTEN
@@ -567,6 +1326,50 @@ void state_get_buffer(void)
 }
 #endif
 
+void state_snapshot_take(void)
+{
+    struct wstream w;
+    state_wait_background();
+    wstream_init(&w, 65536);
+    write32(&w, MAGIC);
+    write32(&w, VERSION);
+
+    is_reading = 0;
+    snapshot.active = 1;
+    global_obj = state_create_bjson_object(64);
+    for (int i = 0; i < state_handler_count; i++)
+        state_handlers[i]();
+    bjson_serialize(&w, global_obj);
+    bjson_destroy_object(global_obj);
+    snapshot.active = 0;
+
+    free(snapshot.state_bin);
+    snapshot.state_bin = w.buf;
+}
+
+int state_snapshot_restore(void)
+{
+    if (!snapshot.state_bin)
+        return -1;
+    state_wait_background();
+
+    struct rstream r;
+    rstream_init(&r, snapshot.state_bin);
+    global_obj = parse_bjson(&r);
+    is_reading = 1;
+    snapshot.active = 1;
+    for (int i = 0; i < state_handler_count; i++)
+        state_handlers[i]();
+    snapshot.active = 0;
+    bjson_destroy_object(global_obj);
+    return 0;
+}
+
+int state_is_snapshot(void)
+{
+    return snapshot.active;
+}
+
 char* state_get_path_base(void)
 {
     return global_file_base;
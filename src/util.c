@@ -11,14 +11,19 @@
 #ifdef REALTIME_TIMING
 #include <sys/time.h>
 #endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 #define QMALLOC_SIZE 1 << 20
 
-static void* qmalloc_data;
-static int qmalloc_usage, qmalloc_size;
+static MACHINE_LOCAL void* qmalloc_data;
+static MACHINE_LOCAL int qmalloc_usage, qmalloc_size;
 
-static void** qmalloc_slabs = NULL;
-static int qmalloc_slabs_size = 0;
+static MACHINE_LOCAL void** qmalloc_slabs = NULL;
+static MACHINE_LOCAL int qmalloc_slabs_size = 0;
 static void qmalloc_slabs_resize(void)
 {
     qmalloc_slabs = realloc(qmalloc_slabs, qmalloc_slabs_size * sizeof(void*));
@@ -175,10 +180,10 @@ void afree(void* ptr)
 
 // TODO: Make this configurable
 #ifndef REALTIME_TIMING
-uint32_t ticks_per_second = 50000000;
+MACHINE_LOCAL uint32_t ticks_per_second = 50000000;
 #else
-uint32_t ticks_per_second = 1000000;
-itick_t base;
+MACHINE_LOCAL uint32_t ticks_per_second = 1000000;
+MACHINE_LOCAL itick_t base;
 #endif
 
 void set_ticks_per_second(uint32_t value)
@@ -186,7 +191,7 @@ void set_ticks_per_second(uint32_t value)
     ticks_per_second = value;
 }
 
-static itick_t tick_base;
+static MACHINE_LOCAL itick_t tick_base;
 
 void util_state(void)
 {
@@ -216,6 +221,23 @@ void add_now(itick_t a)
     tick_base += a;
 }
 
+// Host wall clock time in nanoseconds, for measuring the emulator itself. Has nothing to do with get_now.
+uint64_t get_host_time_ns(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / frequency.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return (uint64_t)clock() * (1000000000 / CLOCKS_PER_SEC);
+#endif
+}
+
 void util_debug(void)
 {
     display_release_mouse();